@@ -85,6 +85,7 @@
 
 #include "redis.h"
 #include "bio.h"
+#include "config.h"
 
 // 工作线程，斥互和条件变量
 static pthread_t bio_threads[REDIS_BIO_NUM_OPS];
@@ -103,6 +104,9 @@ static list *bio_jobs[REDIS_BIO_NUM_OPS];
 // 记录每种类型 job 队列里有多少 job 等待执行
 static unsigned long long bio_pending[REDIS_BIO_NUM_OPS];
 
+// 后台线程是否已经创建, 创建之前提交的释放任务在主线程直接执行
+static int bio_initialized = 0;
+
 /* This structure represents a background Job. It is only used locally to this
  * file as the API deos not expose the internals at all.
  *
@@ -121,9 +125,13 @@ struct bio_job {
      * 任务的参数。参数多于三个时，可以传递数组或者结构
      */
     void *arg1, *arg2, *arg3;
+
+    // REDIS_BIO_LAZY_FREE 任务的释放函数, 以 arg1 为参数调用
+    void (*free_fn)(void *);
 };
 
 void *bioProcessBackgroundJobs(void *arg);
+static void bioSubmitJob(int type, struct bio_job *job);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. 
@@ -163,6 +171,9 @@ void bioInit(void) {
     while (stacksize < REDIS_THREAD_STACK_SIZE) stacksize *= 2;
     pthread_attr_setstacksize(&attr, stacksize);
 
+    // 后台线程会释放内存, 内存用量的统计必须先改为线程安全
+    zmalloc_enable_thread_safeness();
+
     /* Ready to spawn our threads. We use the single argument the thread
      * function accepts in order to pass the job ID the thread is
      * responsible of. 
@@ -177,6 +188,16 @@ void bioInit(void) {
         }
         bio_threads[j] = thread;
     }
+    bio_initialized = 1;
+}
+
+/*
+ * 是否可以把释放任务交给后台线程
+ *
+ * 后台线程还没有创建时返回 0 , 调用者应该直接在主线程释放
+ */
+int bioLazyFreeEnabled(void) {
+    return bio_initialized;
 }
 
 /*
@@ -189,7 +210,41 @@ void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3) {
     job->arg1 = arg1;
     job->arg2 = arg2;
     job->arg3 = arg3;
+    job->free_fn = NULL;
+
+    bioSubmitJob(type,job);
+}
+
+/*
+ * 创建一个后台释放任务, 由后台线程调用 free_fn(arg)
+ *
+ * 主线程在提交任务之后不能再访问 arg 指向的任何数据,
+ * 并且这些数据中不能包含与主线程共享的对象 (比如共享整数)。
+ *
+ * 后台线程还没有创建时, 直接在主线程调用 free_fn(arg)
+ */
+void bioCreateLazyFreeJob(void (*free_fn)(void *), void *arg) {
+    struct bio_job *job;
 
+    if (!bio_initialized) {
+        free_fn(arg);
+        return;
+    }
+
+    job = zmalloc(sizeof(*job));
+
+    job->time = time(NULL);
+    job->arg1 = arg;
+    job->arg2 = job->arg3 = NULL;
+    job->free_fn = free_fn;
+
+    bioSubmitJob(REDIS_BIO_LAZY_FREE,job);
+}
+
+/*
+ * 将任务推入 type 类型的队列, 并唤醒对应的线程
+ */
+static void bioSubmitJob(int type, struct bio_job *job) {
     pthread_mutex_lock(&bio_mutex[type]);
 
     // 将新工作推入队列
@@ -251,6 +306,9 @@ void *bioProcessBackgroundJobs(void *arg) {
         } else if (type == REDIS_BIO_AOF_FSYNC) {
             aof_fsync((long)job->arg1);
 
+        } else if (type == REDIS_BIO_LAZY_FREE) {
+            job->free_fn(job->arg1);
+
         } else {
             redisPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
@@ -304,3 +362,142 @@ void bioKillThreads(void) {
         }
     }
 }
+
+/* ----------------------------- 并行任务 ------------------------------ */
+
+/*
+ * 和上面的后台任务不同, 并行任务由主线程发起, 并且主线程会等待它完成:
+ * 任务被分成 nparts 份, 由主线程和一组按需创建的工作线程一起领取执行。
+ *
+ * 主线程在等待期间不处理其他事件, 所以只适合那些本身就要阻塞主线程,
+ * 并且可以安全地分片只读执行的计算 (比如超大集合的集合运算)。
+ */
+
+// 已经创建的并行工作线程
+static pthread_t bio_parallel_threads[REDIS_BIO_MAX_PARALLEL];
+static int bio_parallel_nthreads = 0;
+
+static pthread_mutex_t bio_parallel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bio_parallel_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bio_parallel_done = PTHREAD_COND_INITIALIZER;
+
+// 当前的并行任务
+static void (*bio_parallel_fn)(void *privdata, int part, int nparts);
+static void *bio_parallel_privdata;
+static int bio_parallel_nparts = 0;
+
+// 下一个待领取的分片, 以及尚未完成的分片数量
+static int bio_parallel_next = 0;
+static int bio_parallel_pending = 0;
+
+/*
+ * 并行工作线程: 等待并领取分片执行
+ */
+void *bioProcessParallelJobs(void *arg) {
+    sigset_t sigset;
+
+    REDIS_NOTUSED(arg);
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        redisLog(REDIS_WARNING,
+            "Warning: can't mask SIGALRM in bio.c thread: %s", strerror(errno));
+
+    pthread_mutex_lock(&bio_parallel_mutex);
+    while(1) {
+        int part;
+
+        if (bio_parallel_next >= bio_parallel_nparts) {
+            pthread_cond_wait(&bio_parallel_start,&bio_parallel_mutex);
+            continue;
+        }
+
+        part = bio_parallel_next++;
+        pthread_mutex_unlock(&bio_parallel_mutex);
+
+        bio_parallel_fn(bio_parallel_privdata,part,bio_parallel_nparts);
+
+        pthread_mutex_lock(&bio_parallel_mutex);
+        if (--bio_parallel_pending == 0)
+            pthread_cond_signal(&bio_parallel_done);
+    }
+}
+
+/*
+ * 确保至少有 n 个并行工作线程, 返回实际拥有的线程数量
+ */
+static int bioSpawnParallelThreads(int n) {
+    pthread_attr_t attr;
+    size_t stacksize;
+
+    if (bio_parallel_nthreads >= n) return bio_parallel_nthreads;
+
+    // 工作线程会分配内存, 在创建线程之前切换到线程安全的内存计数
+    zmalloc_enable_thread_safeness();
+
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1; /* The world is full of Solaris Fixes */
+    while (stacksize < REDIS_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+
+    while (bio_parallel_nthreads < n) {
+        if (pthread_create(&bio_parallel_threads[bio_parallel_nthreads],&attr,
+                           bioProcessParallelJobs,NULL) != 0)
+        {
+            // 创建失败时用已有的线程继续, 剩余的分片由主线程执行
+            redisLog(REDIS_WARNING,"Can't create parallel bio thread.");
+            break;
+        }
+        bio_parallel_nthreads++;
+    }
+    pthread_attr_destroy(&attr);
+
+    return bio_parallel_nthreads;
+}
+
+/*
+ * 将任务分成 nparts 份并行执行, 对每一份调用 fn(privdata, part, nparts),
+ * 所有分片执行完毕后才返回
+ *
+ * 只能由主线程调用。返回参与执行的线程数量 (包括主线程)。
+ */
+int bioRunParallel(int nparts, void (*fn)(void *privdata, int part, int nparts), void *privdata) {
+    int threads;
+
+    if (nparts < 1) nparts = 1;
+    if (nparts > REDIS_BIO_MAX_PARALLEL) nparts = REDIS_BIO_MAX_PARALLEL;
+
+    threads = bioSpawnParallelThreads(nparts-1);
+
+    pthread_mutex_lock(&bio_parallel_mutex);
+    bio_parallel_fn = fn;
+    bio_parallel_privdata = privdata;
+    bio_parallel_nparts = nparts;
+    bio_parallel_next = 0;
+    bio_parallel_pending = nparts;
+    pthread_cond_broadcast(&bio_parallel_start);
+
+    // 主线程同样领取分片执行
+    while (bio_parallel_next < bio_parallel_nparts) {
+        int part = bio_parallel_next++;
+
+        pthread_mutex_unlock(&bio_parallel_mutex);
+        fn(privdata,part,nparts);
+        pthread_mutex_lock(&bio_parallel_mutex);
+        bio_parallel_pending--;
+    }
+
+    // 等待工作线程完成已经领取的分片
+    while (bio_parallel_pending > 0)
+        pthread_cond_wait(&bio_parallel_done,&bio_parallel_mutex);
+
+    bio_parallel_nparts = 0;
+    bio_parallel_next = 0;
+    pthread_mutex_unlock(&bio_parallel_mutex);
+
+    return (threads < nparts-1 ? threads : nparts-1) + 1;
+}
@@ -34,8 +34,15 @@ unsigned long long bioPendingJobsOfType(int type);
 void bioWaitPendingJobsLE(int type, unsigned long long num);
 time_t bioOlderJobOfType(int type);
 void bioKillThreads(void);
+void bioCreateLazyFreeJob(void (*free_fn)(void *), void *arg);
+int bioLazyFreeEnabled(void);
+int bioRunParallel(int nparts, void (*fn)(void *privdata, int part, int nparts), void *privdata);
 
 /* Background job opcodes */
 #define REDIS_BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define REDIS_BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
-#define REDIS_BIO_NUM_OPS       2
+#define REDIS_BIO_LAZY_FREE     2 /* Deferred objects freeing. */
+#define REDIS_BIO_NUM_OPS       3
+
+/* Parallel jobs */
+#define REDIS_BIO_MAX_PARALLEL  16 /* Max parts of a bioRunParallel() job. */
@@ -0,0 +1,1086 @@
+/*
+ * 位操作
+ *
+ * 将字符串对象当作位数组使用, 第 0 个字节的最高位为第 0 位:
+ *
+ *   byte 0            byte 1
+ *   +-+-+-+-+-+-+-+-+ +-+-+-+-+-+-+-+-+
+ *   |0|1|2|3|4|5|6|7| |8|9|...        |
+ *   +-+-+-+-+-+-+-+-+ +-+-+-+-+-+-+-+-+
+ *
+ * 命令:
+ *   - SETBIT key offset value, 按需用 0 字节扩展字符串
+ *   - GETBIT key offset
+ *   - BITCOUNT key [start end]
+ *   - BITPOS key bit [start [end]]
+ *   - BITOP AND|OR|XOR|NOT destkey key [key ...]
+ *   - BITFIELD key [GET type offset] [SET type offset value]
+ *                  [INCRBY type offset increment] [OVERFLOW WRAP|SAT|FAIL]
+ *
+ * BITCOUNT, BITPOS 和 BITOP 都以机器字 (unsigned long / uint64_t) 为单位处理,
+ * 只在首尾处理不足一个字的字节。
+ */
+
+#include "redis.h"
+#include "endianconv.h"
+
+// 位偏移量的上限, 字符串最大为 512MB
+#define BITOPS_MAX_BYTES (512*1024*1024)
+
+// BITOP 每次处理的字节数, 使结果缓冲区的当前块在所有源键之间保持在缓存中
+#define BITOP_BLOCK_BYTES (64*1024)
+
+#define BITOP_AND   0
+#define BITOP_OR    1
+#define BITOP_XOR   2
+#define BITOP_NOT   3
+
+// BITFIELD 子命令
+#define BITFIELDOP_GET 0
+#define BITFIELDOP_SET 1
+#define BITFIELDOP_INCRBY 2
+
+// BITFIELD 溢出处理方式
+#define BFOVERFLOW_WRAP 0   /* 回绕 (默认) */
+#define BFOVERFLOW_SAT 1    /* 饱和到最大值或最小值 */
+#define BFOVERFLOW_FAIL 2   /* 不修改, 回复 nil */
+
+/*----------------------------------- 辅助函数 --------------------------------*/
+
+/*
+ * 以 SWAR 方式计算 64 位字 x 中每个字节的置位数量,
+ * 结果的每个字节保存对应字节的置位数量 (0 ~ 8)
+ */
+static inline uint64_t bitopsByteCounts(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    return (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+}
+
+/*
+ * 不依赖 CPU 指令的 popcount, 每次处理 32 字节
+ *
+ * 4 个字的字节计数先相加 (每个字节最多为 32), 再扩展为 16 位的槽横向求和,
+ * 总数最多为 256, 直接用字节横向求和会溢出
+ */
+static size_t redisPopcountSWAR(unsigned char *p, long count) {
+    size_t bits = 0;
+    uint64_t w[4], tail;
+
+    while (count >= 32) {
+        uint64_t sum;
+
+        memcpy(w,p,sizeof(w));
+        sum = bitopsByteCounts(w[0]) + bitopsByteCounts(w[1]) +
+              bitopsByteCounts(w[2]) + bitopsByteCounts(w[3]);
+        sum = (sum & 0x00ff00ff00ff00ffULL) + ((sum >> 8) & 0x00ff00ff00ff00ffULL);
+        bits += (sum * 0x0001000100010001ULL) >> 48;
+
+        p += 32;
+        count -= 32;
+    }
+
+    while (count >= 8) {
+        memcpy(w,p,sizeof(uint64_t));
+        bits += (bitopsByteCounts(w[0]) * 0x0101010101010101ULL) >> 56;
+        p += 8;
+        count -= 8;
+    }
+
+    // 剩余不足 8 字节, 放进一个高位补 0 的字中处理
+    if (count > 0) {
+        tail = 0;
+        memcpy(&tail,p,count);
+        bits += (bitopsByteCounts(tail) * 0x0101010101010101ULL) >> 56;
+    }
+
+    return bits;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/*
+ * 使用 POPCNT 指令的 popcount, 每次处理 32 字节
+ *
+ * 4 个独立的累加器避免 POPCNT 之间的数据依赖, 使指令可以并行执行,
+ * 这时的瓶颈是内存带宽而不是计算
+ */
+__attribute__((target("popcnt")))
+static size_t redisPopcountHW(unsigned char *p, long count) {
+    size_t bits0 = 0, bits1 = 0, bits2 = 0, bits3 = 0;
+    uint64_t w[4], tail;
+
+    while (count >= 32) {
+        memcpy(w,p,sizeof(w));
+        bits0 += __builtin_popcountll(w[0]);
+        bits1 += __builtin_popcountll(w[1]);
+        bits2 += __builtin_popcountll(w[2]);
+        bits3 += __builtin_popcountll(w[3]);
+        p += 32;
+        count -= 32;
+    }
+
+    while (count >= 8) {
+        memcpy(w,p,sizeof(uint64_t));
+        bits0 += __builtin_popcountll(w[0]);
+        p += 8;
+        count -= 8;
+    }
+
+    if (count > 0) {
+        tail = 0;
+        memcpy(&tail,p,count);
+        bits0 += __builtin_popcountll(tail);
+    }
+
+    return bits0 + bits1 + bits2 + bits3;
+}
+#endif
+
+/*
+ * 计算 s 开始的 count 个字节中, 值为 1 的位的数量
+ *
+ * CPU 支持 POPCNT 指令时使用该指令, 否则使用 SWAR 方法
+ *
+ * T = O(N)
+ */
+size_t redisPopcount(void *s, long count) {
+#if defined(__GNUC__) && defined(__x86_64__)
+    static int has_popcnt = -1;
+
+    if (has_popcnt == -1) has_popcnt = __builtin_cpu_supports("popcnt") != 0;
+    if (has_popcnt) return redisPopcountHW(s,count);
+#endif
+    return redisPopcountSWAR(s,count);
+}
+
+/*
+ * 返回 s 开始的 count 个字节中, 第一个值为 bit 的位的位置
+ *
+ * 查找 1 时, 没有找到返回 -1
+ * 查找 0 时, 字符串被当作右侧补充了无限个 0 位,
+ * 所以全为 1 时返回 count*8, 由调用者决定如何处理
+ *
+ * 先逐字节处理到字对齐, 再逐字跳过全 0 (或全 1) 的字,
+ * 最后在找到的字中用前导 0 计数定位
+ *
+ * T = O(N)
+ */
+long redisBitpos(void *s, unsigned long count, int bit) {
+    unsigned long *l;
+    unsigned char *c;
+    unsigned long skipval, word = 0;
+    long pos = 0; /* 已经跳过的位数 */
+    int found;
+    unsigned long j;
+
+    // 要跳过的字节值
+    skipval = bit ? 0 : UCHAR_MAX;
+    c = (unsigned char*) s;
+    found = 0;
+
+    // 逐字节处理到字对齐
+    while((unsigned long)c & (sizeof(*l)-1) && count) {
+        if (*c != skipval) {
+            found = 1;
+            break;
+        }
+        c++;
+        count--;
+        pos += 8;
+    }
+
+    // 逐字跳过
+    l = (unsigned long*) c;
+    if (!found) {
+        skipval = bit ? 0 : ULONG_MAX;
+        while (count >= sizeof(*l)) {
+            if (*l != skipval) break;
+            l++;
+            count -= sizeof(*l);
+            pos += sizeof(*l)*8;
+        }
+    }
+
+    // 按大端序载入一个字, 使字的最高位对应第一个字节的最高位,
+    // 不足一个字时右侧补 0
+    c = (unsigned char*)l;
+    for (j = 0; j < sizeof(*l); j++) {
+        word <<= 8;
+        if (count) {
+            word |= *c;
+            c++;
+            count--;
+        }
+    }
+
+    // 查找 1 时, 最后一个字全为 0 表示没有找到
+    if (bit == 1 && word == 0) return -1;
+
+    // 查找 0 时取反, 转换为查找第一个 1,
+    // 补充的 0 位保证了查找 0 时总能找到
+    if (bit == 0) word = ~word;
+
+    return pos + __builtin_clzl(word);
+}
+
+/*
+ * 从对象 o 中取出位偏移量, 保存到 *offset
+ *
+ * hash 为真时, 接受 "#N" 形式的偏移量, 表示第 N 个宽度为 bits 的整数,
+ * 也即是 N*bits
+ *
+ * 偏移量必须为非负整数, 且对应的字节不超过 512MB
+ *
+ * 成功返回 REDIS_OK, 否则向客户端回复错误并返回 REDIS_ERR
+ */
+static int getBitOffsetFromArgument(redisClient *c, robj *o, size_t *offset, int hash, int bits) {
+    long long loffset;
+    char *err = "bit offset is not an integer or out of range";
+    char *p = o->ptr;
+    size_t plen = sdslen(p);
+    int usehash = 0;
+
+    if (hash && sdsEncodedObject(o) && plen > 1 && p[0] == '#') usehash = 1;
+
+    if (usehash) {
+        if (string2ll(p+1,plen-1,&loffset) == 0 ||
+            loffset < 0 || loffset > LLONG_MAX/bits)
+        {
+            addReplyError(c,err);
+            return REDIS_ERR;
+        }
+        loffset *= bits;
+    } else {
+        if (getLongLongFromObjectOrReply(c,o,&loffset,err) != REDIS_OK)
+            return REDIS_ERR;
+    }
+
+    if ((loffset < 0) || ((unsigned long long)loffset >> 3) >= BITOPS_MAX_BYTES) {
+        addReplyError(c,err);
+        return REDIS_ERR;
+    }
+
+    *offset = (size_t)loffset;
+    return REDIS_OK;
+}
+
+/*
+ * 从对象 o 中取出 BITFIELD 的整数类型, i1 ~ i64 或者 u1 ~ u63
+ *
+ * 无符号整数最多 63 位, 保证结果可以用有符号 64 位整数回复
+ *
+ * 成功返回 REDIS_OK, 否则向客户端回复错误并返回 REDIS_ERR
+ */
+static int getBitfieldTypeFromArgument(redisClient *c, robj *o, int *sign, int *bits) {
+    char *p = o->ptr;
+    char *err = "Invalid bitfield type. Use something like i16 u8. Note that u64 is not supported but i64 is.";
+    long long llbits;
+
+    if (!sdsEncodedObject(o)) {
+        addReplyError(c,err);
+        return REDIS_ERR;
+    }
+
+    if (*p == 'i') {
+        *sign = 1;
+    } else if (*p == 'u') {
+        *sign = 0;
+    } else {
+        addReplyError(c,err);
+        return REDIS_ERR;
+    }
+
+    if ((string2ll(p+1,sdslen(p)-1,&llbits)) == 0 ||
+        llbits < 1 ||
+        (*sign == 1 && llbits > 64) ||
+        (*sign == 0 && llbits > 63))
+    {
+        addReplyError(c,err);
+        return REDIS_ERR;
+    }
+
+    *bits = llbits;
+    return REDIS_OK;
+}
+
+/*
+ * 位偏移量为 offset, 宽度不超过 64 位的整数最多跨越 9 个字节,
+ * BITFIELD 总是以 9 字节的窗口读写整数:
+ * 窗口的前 8 个字节按大端序载入为一个字 hi, 第 9 个字节为 lo,
+ * 这样只需要几次移位和掩码操作, 而不必逐位处理
+ *
+ * 窗口超出缓冲区末尾时, 超出的部分按 0 处理
+ */
+static void bitfieldLoadWindow(const unsigned char *p, size_t len, size_t byte,
+                               uint64_t *hi, uint64_t *lo)
+{
+    unsigned char buf[9];
+    const unsigned char *w;
+
+    if (byte + sizeof(buf) <= len) {
+        // 窗口完全在缓冲区内, 直接载入
+        w = p + byte;
+    } else {
+        memset(buf,0,sizeof(buf));
+        if (byte < len) memcpy(buf,p+byte,len-byte);
+        w = buf;
+    }
+
+    memcpy(hi,w,sizeof(*hi));
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+    *hi = __builtin_bswap64(*hi);
+#endif
+    *lo = w[8];
+}
+
+/*
+ * 将窗口写回缓冲区, 只写回缓冲区范围内的字节
+ */
+static void bitfieldStoreWindow(unsigned char *p, size_t len, size_t byte,
+                                uint64_t hi, uint64_t lo)
+{
+    unsigned char buf[9];
+    size_t n = len - byte;
+
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+    hi = __builtin_bswap64(hi);
+#endif
+
+    if (n >= sizeof(buf)) {
+        memcpy(p+byte,&hi,sizeof(hi));
+        p[byte+8] = lo;
+    } else {
+        memcpy(buf,&hi,sizeof(hi));
+        buf[8] = lo;
+        memcpy(p+byte,buf,n);
+    }
+}
+
+/*
+ * 取出 p 中从第 offset 位开始, 宽度为 bits 的无符号整数
+ *
+ * len 为缓冲区长度, 超出缓冲区的位视为 0
+ *
+ * T = O(1)
+ */
+static uint64_t getUnsignedBitfield(const unsigned char *p, size_t len, uint64_t offset, int bits) {
+    uint64_t hi, lo, v;
+    int shift = offset & 7;
+
+    bitfieldLoadWindow(p,len,offset>>3,&hi,&lo);
+
+    // 将整数的最高位移到字的最高位
+    v = hi << shift;
+    if (shift) v |= lo >> (8-shift);
+
+    return v >> (64-bits);
+}
+
+/*
+ * 取出 p 中从第 offset 位开始, 宽度为 bits 的有符号整数 (补码)
+ */
+static int64_t getSignedBitfield(const unsigned char *p, size_t len, uint64_t offset, int bits) {
+    uint64_t v = getUnsignedBitfield(p,len,offset,bits);
+    uint64_t msb;
+
+    if (bits == 64) return (int64_t) v;
+
+    // 符号扩展
+    msb = (uint64_t)1 << (bits-1);
+    return (int64_t) ((v ^ msb) - msb);
+}
+
+/*
+ * 将 p 中从第 offset 位开始, 宽度为 bits 的整数设置为 value 的低 bits 位
+ *
+ * 调用者需要保证缓冲区至少包含 offset+bits 位
+ *
+ * T = O(1)
+ */
+static void setUnsignedBitfield(unsigned char *p, size_t len, uint64_t offset, int bits, uint64_t value) {
+    uint64_t hi, lo, mask;
+    int shift = offset & 7;
+    int lsb; /* 整数最低位在 72 位窗口中的位置 (从低位开始计算) */
+
+    bitfieldLoadWindow(p,len,offset>>3,&hi,&lo);
+
+    mask = (bits == 64) ? UINT64_MAX : (((uint64_t)1 << bits) - 1);
+    value &= mask;
+    lsb = 72 - shift - bits;
+
+    if (lsb >= 8) {
+        // 整数完全在 hi 中
+        hi = (hi & ~(mask << (lsb-8))) | (value << (lsb-8));
+    } else {
+        // 整数的低 8-lsb 位在 lo 中
+        int r = 8 - lsb;
+
+        hi = (hi & ~(mask >> r)) | (value >> r);
+        lo = (lo & ~((mask << lsb) & 0xff)) | ((value << lsb) & 0xff);
+    }
+
+    bitfieldStoreWindow(p,len,offset>>3,hi,lo);
+}
+
+/*
+ * 检查宽度为 bits 的无符号整数 value 加上 incr 后是否溢出
+ *
+ * 没有溢出返回 0, 上溢返回 1, 下溢返回 -1
+ *
+ * 溢出且 limit 不为 NULL 时, 按 owtype 将处理后的结果保存到 *limit:
+ * WRAP 时为回绕后的值, SAT 时为最大值或最小值
+ */
+static int checkUnsignedBitfieldOverflow(uint64_t value, int64_t incr, int bits, int owtype, uint64_t *limit) {
+    uint64_t max = ((uint64_t)1 << bits) - 1; /* bits 最多为 63 */
+    __int128 sum = (__int128)value + incr;
+    int overflow;
+
+    if (sum > (__int128)max) overflow = 1;
+    else if (sum < 0) overflow = -1;
+    else return 0;
+
+    if (limit) {
+        if (owtype == BFOVERFLOW_WRAP)
+            *limit = (value + (uint64_t)incr) & max;
+        else if (owtype == BFOVERFLOW_SAT)
+            *limit = overflow == 1 ? max : 0;
+    }
+    return overflow;
+}
+
+/*
+ * 检查宽度为 bits 的有符号整数 value 加上 incr 后是否溢出
+ *
+ * 返回值和 *limit 同 checkUnsignedBitfieldOverflow()
+ */
+static int checkSignedBitfieldOverflow(int64_t value, int64_t incr, int bits, int owtype, int64_t *limit) {
+    int64_t max = (bits == 64) ? INT64_MAX : (((int64_t)1 << (bits-1)) - 1);
+    int64_t min = (-max) - 1;
+    __int128 sum = (__int128)value + incr;
+    int overflow;
+
+    if (sum > max) overflow = 1;
+    else if (sum < min) overflow = -1;
+    else return 0;
+
+    if (limit) {
+        if (owtype == BFOVERFLOW_WRAP) {
+            uint64_t c = (uint64_t)value + (uint64_t)incr;
+
+            // 截取低 bits 位, 再做符号扩展
+            if (bits < 64) {
+                uint64_t msb = (uint64_t)1 << (bits-1);
+
+                c &= ((uint64_t)1 << bits) - 1;
+                c = (c ^ msb) - msb;
+            }
+            *limit = (int64_t) c;
+        } else if (owtype == BFOVERFLOW_SAT) {
+            *limit = overflow == 1 ? max : min;
+        }
+    }
+    return overflow;
+}
+
+/*
+ * 将 src 的 len 个字节按 op 合并到 dst, 以字为单位处理
+ */
+#define BITOP_WORD_LOOP(_dst,_src,_len,_op) do { \
+    size_t _j = 0; \
+    unsigned long _a, _b; \
+    for (; _j+sizeof(_a) <= (_len); _j += sizeof(_a)) { \
+        memcpy(&_a,(_dst)+_j,sizeof(_a)); \
+        memcpy(&_b,(_src)+_j,sizeof(_b)); \
+        _a _op _b; \
+        memcpy((_dst)+_j,&_a,sizeof(_a)); \
+    } \
+    for (; _j < (_len); _j++) (_dst)[_j] _op (_src)[_j]; \
+} while(0)
+
+static void bitopBuffer(int op, unsigned char *dst, const unsigned char *src, size_t len) {
+    switch(op) {
+    case BITOP_AND: BITOP_WORD_LOOP(dst,src,len,&=); break;
+    case BITOP_OR:  BITOP_WORD_LOOP(dst,src,len,|=); break;
+    case BITOP_XOR: BITOP_WORD_LOOP(dst,src,len,^=); break;
+    }
+}
+
+/*
+ * 将 dst 的 len 个字节按位取反
+ */
+static void bitopNotBuffer(unsigned char *dst, size_t len) {
+    size_t j = 0;
+    unsigned long a;
+
+    for (; j+sizeof(a) <= len; j += sizeof(a)) {
+        memcpy(&a,dst+j,sizeof(a));
+        a = ~a;
+        memcpy(dst+j,&a,sizeof(a));
+    }
+    for (; j < len; j++) dst[j] = ~dst[j];
+}
+
+/*----------------------------------- 命令实现 --------------------------------*/
+
+/*
+ * SETBIT key offset value
+ *
+ * 返回该位原来的值
+ */
+void setbitCommand(redisClient *c) {
+    robj *o;
+    char *err = "bit is not an integer or out of range";
+    size_t bitoffset, byte;
+    int bit, byteval, bitval;
+    long on;
+
+    if (getBitOffsetFromArgument(c,c->argv[2],&bitoffset,0,0) != REDIS_OK)
+        return;
+
+    if (getLongFromObjectOrReply(c,c->argv[3],&on,err) != REDIS_OK)
+        return;
+
+    // 值只能为 0 或 1
+    if (on & ~1) {
+        addReplyError(c,err);
+        return;
+    }
+
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o == NULL) {
+        o = createObject(REDIS_STRING,sdsempty());
+        dbAdd(c->db,c->argv[1],o);
+    } else {
+        if (checkType(c,o,REDIS_STRING)) return;
+        o = dbUnshareStringValue(c->db,c->argv[1],o);
+    }
+
+    // 按需扩展字符串, 新增的字节为 0
+    byte = bitoffset >> 3;
+    o->ptr = sdsgrowzero(o->ptr,byte+1);
+
+    // 取出原来的值, 并设置新的值
+    byteval = ((uint8_t*)o->ptr)[byte];
+    bit = 7 - (bitoffset & 0x7);
+    bitval = byteval & (1 << bit);
+
+    byteval &= ~(1 << bit);
+    byteval |= ((on & 0x1) << bit);
+    ((uint8_t*)o->ptr)[byte] = byteval;
+
+    signalModifiedKey(c->db,c->argv[1]);
+    notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
+    server.dirty++;
+    addReply(c, bitval ? shared.cone : shared.czero);
+}
+
+/*
+ * GETBIT key offset
+ *
+ * 偏移量超出字符串长度时返回 0
+ */
+void getbitCommand(redisClient *c) {
+    robj *o;
+    char llbuf[32];
+    size_t bitoffset;
+    size_t byte, bit;
+    size_t bitval = 0;
+
+    if (getBitOffsetFromArgument(c,c->argv[2],&bitoffset,0,0) != REDIS_OK)
+        return;
+
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
+        checkType(c,o,REDIS_STRING)) return;
+
+    byte = bitoffset >> 3;
+    bit = 7 - (bitoffset & 0x7);
+    if (sdsEncodedObject(o)) {
+        if (byte < sdslen(o->ptr))
+            bitval = ((uint8_t*)o->ptr)[byte] & (1 << bit);
+    } else {
+        // 整数编码, 按字符串形式处理
+        if (byte < (size_t)ll2string(llbuf,sizeof(llbuf),(long)o->ptr))
+            bitval = llbuf[byte] & (1 << bit);
+    }
+
+    addReply(c, bitval ? shared.cone : shared.czero);
+}
+
+/*
+ * BITOP op destkey srckey1 srckey2 ... srckeyN
+ *
+ * 较短的字符串右侧补 0, 结果的长度等于最长的源字符串,
+ * 结果为空时删除 destkey
+ *
+ * 按 BITOP_BLOCK_BYTES 分块, 每块先复制第一个源键, 再逐个合并其余的源键,
+ * 合并以字为单位进行
+ *
+ * T = O(N), N 为所有源字符串的长度之和
+ */
+void bitopCommand(redisClient *c) {
+    char *opname = c->argv[1]->ptr;
+    robj *o, *targetkey = c->argv[2];
+    unsigned long op, j, numkeys;
+    robj **objects;      /* 源键的值 (已解码) */
+    unsigned char **src; /* 源字符串 */
+    unsigned long *len, maxlen = 0;
+    unsigned char *res = NULL;
+    size_t off, blen, avail;
+
+    // 解析操作
+    if ((opname[0] == 'a' || opname[0] == 'A') && !strcasecmp(opname,"and"))
+        op = BITOP_AND;
+    else if((opname[0] == 'o' || opname[0] == 'O') && !strcasecmp(opname,"or"))
+        op = BITOP_OR;
+    else if((opname[0] == 'x' || opname[0] == 'X') && !strcasecmp(opname,"xor"))
+        op = BITOP_XOR;
+    else if((opname[0] == 'n' || opname[0] == 'N') && !strcasecmp(opname,"not"))
+        op = BITOP_NOT;
+    else {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    // NOT 只接受一个源键
+    if (op == BITOP_NOT && c->argc != 4) {
+        addReplyError(c,"BITOP NOT must be called with a single source key.");
+        return;
+    }
+
+    // 取出所有源字符串
+    numkeys = c->argc - 3;
+    src = zmalloc(sizeof(unsigned char*) * numkeys);
+    len = zmalloc(sizeof(long) * numkeys);
+    objects = zmalloc(sizeof(robj*) * numkeys);
+    for (j = 0; j < numkeys; j++) {
+        o = lookupKeyRead(c->db,c->argv[j+3]);
+
+        // 不存在的键视为空字符串
+        if (o == NULL) {
+            objects[j] = NULL;
+            src[j] = NULL;
+            len[j] = 0;
+            continue;
+        }
+
+        if (checkType(c,o,REDIS_STRING)) {
+            unsigned long i;
+
+            for (i = 0; i < j; i++) {
+                if (objects[i]) decrRefCount(objects[i]);
+            }
+            zfree(src);
+            zfree(len);
+            zfree(objects);
+            return;
+        }
+
+        objects[j] = getDecodedObject(o);
+        src[j] = objects[j]->ptr;
+        len[j] = sdslen(objects[j]->ptr);
+        if (len[j] > maxlen) maxlen = len[j];
+    }
+
+    // 计算结果
+    if (maxlen) {
+        res = (unsigned char*) sdsnewlen(NULL,maxlen);
+
+        for (off = 0; off < maxlen; off += BITOP_BLOCK_BYTES) {
+            blen = maxlen - off;
+            if (blen > BITOP_BLOCK_BYTES) blen = BITOP_BLOCK_BYTES;
+
+            // 复制第一个源键的当前块, 不足的部分补 0
+            avail = len[0] > off ? len[0] - off : 0;
+            if (avail > blen) avail = blen;
+            if (avail) memcpy(res+off,src[0]+off,avail);
+            memset(res+off+avail,0,blen-avail);
+
+            if (op == BITOP_NOT) {
+                bitopNotBuffer(res+off,blen);
+                continue;
+            }
+
+            // 合并其余的源键
+            for (j = 1; j < numkeys; j++) {
+                avail = len[j] > off ? len[j] - off : 0;
+                if (avail > blen) avail = blen;
+
+                if (avail) bitopBuffer(op,res+off,src[j]+off,avail);
+
+                // 与补充的 0 做 AND 结果为 0, 做 OR/XOR 结果不变
+                if (op == BITOP_AND) memset(res+off+avail,0,blen-avail);
+            }
+        }
+    }
+
+    // 释放源字符串
+    for (j = 0; j < numkeys; j++) {
+        if (objects[j]) decrRefCount(objects[j]);
+    }
+    zfree(src);
+    zfree(len);
+    zfree(objects);
+
+    // 保存结果
+    if (maxlen) {
+        o = createObject(REDIS_STRING,res);
+        setKey(c->db,targetkey,o);
+        notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"set",targetkey,c->db->id);
+        decrRefCount(o);
+    } else if (dbDelete(c->db,targetkey)) {
+        signalModifiedKey(c->db,targetkey);
+        notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",targetkey,c->db->id);
+    }
+    server.dirty++;
+    addReplyLongLong(c,maxlen); /* 返回结果的长度 */
+}
+
+/*
+ * 取出字符串对象 o 的内容, 整数编码时转换为字符串保存到 llbuf
+ */
+static unsigned char *bitopsGetString(robj *o, char *llbuf, size_t buflen, long *strlen) {
+    if (o->encoding == REDIS_ENCODING_INT) {
+        *strlen = ll2string(llbuf,buflen,(long)o->ptr);
+        return (unsigned char*) llbuf;
+    } else {
+        *strlen = sdslen(o->ptr);
+        return (unsigned char*) o->ptr;
+    }
+}
+
+/*
+ * BITCOUNT key [start end]
+ *
+ * start 和 end 是字节索引, 支持负数索引
+ */
+void bitcountCommand(redisClient *c) {
+    robj *o;
+    long start, end, strlen;
+    unsigned char *p;
+    char llbuf[32];
+
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
+        checkType(c,o,REDIS_STRING)) return;
+
+    p = bitopsGetString(o,llbuf,sizeof(llbuf),&strlen);
+
+    if (c->argc == 4) {
+        if (getLongFromObjectOrReply(c,c->argv[2],&start,NULL) != REDIS_OK)
+            return;
+        if (getLongFromObjectOrReply(c,c->argv[3],&end,NULL) != REDIS_OK)
+            return;
+
+        // 转换负数索引
+        if (start < 0) start = strlen+start;
+        if (end < 0) end = strlen+end;
+        if (start < 0) start = 0;
+        if (end < 0) end = 0;
+        if (end >= strlen) end = strlen-1;
+    } else if (c->argc == 2) {
+        start = 0;
+        end = strlen-1;
+    } else {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    if (start > end) {
+        addReply(c,shared.czero);
+    } else {
+        long bytes = end-start+1;
+
+        addReplyLongLong(c,redisPopcount(p+start,bytes));
+    }
+}
+
+/*
+ * BITPOS key bit [start [end]]
+ *
+ * 没有给定 end 时, 查找 0 的结果可以超出字符串末尾 (字符串全为 1 时),
+ * 给定 end 时只在范围内查找, 没有找到返回 -1
+ */
+void bitposCommand(redisClient *c) {
+    robj *o;
+    long bit, start, end, strlen;
+    unsigned char *p;
+    char llbuf[32];
+    int end_given = 0;
+
+    if (getLongFromObjectOrReply(c,c->argv[2],&bit,NULL) != REDIS_OK)
+        return;
+    if (bit != 0 && bit != 1) {
+        addReplyError(c, "The bit argument must be 1 or 0.");
+        return;
+    }
+
+    // 键不存在时视为空字符串 (全为 0)
+    if ((o = lookupKeyRead(c->db,c->argv[1])) == NULL) {
+        addReplyLongLong(c, bit ? -1 : 0);
+        return;
+    }
+    if (checkType(c,o,REDIS_STRING)) return;
+
+    p = bitopsGetString(o,llbuf,sizeof(llbuf),&strlen);
+
+    if (c->argc == 4 || c->argc == 5) {
+        if (getLongFromObjectOrReply(c,c->argv[3],&start,NULL) != REDIS_OK)
+            return;
+        if (c->argc == 5) {
+            if (getLongFromObjectOrReply(c,c->argv[4],&end,NULL) != REDIS_OK)
+                return;
+            end_given = 1;
+        } else {
+            end = strlen-1;
+        }
+
+        if (start < 0) start = strlen+start;
+        if (end < 0) end = strlen+end;
+        if (start < 0) start = 0;
+        if (end < 0) end = 0;
+        if (end >= strlen) end = strlen-1;
+    } else if (c->argc == 3) {
+        start = 0;
+        end = strlen-1;
+    } else {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    if (start > end) {
+        addReplyLongLong(c, -1);
+    } else {
+        long bytes = end-start+1;
+        long pos = redisBitpos(p+start,bytes,bit);
+
+        // 给定了范围时, 范围之外补充的 0 位不算找到
+        if (end_given && bit == 0 && pos == bytes*8) {
+            addReplyLongLong(c,-1);
+            return;
+        }
+        if (pos != -1) pos += start*8;
+        addReplyLongLong(c,pos);
+    }
+}
+
+/*
+ * BITFIELD 的一个子命令
+ */
+struct bitfieldOp {
+    uint64_t offset;    /* 位偏移量 */
+    int64_t i64;        /* SET 的值或者 INCRBY 的增量 */
+    int opcode;         /* BITFIELDOP_* */
+    int owtype;         /* BFOVERFLOW_* */
+    int bits;           /* 整数宽度 */
+    int sign;           /* 是否为有符号整数 */
+};
+
+/*
+ * BITFIELD key [GET type offset] [SET type offset value]
+ *              [INCRBY type offset increment] [OVERFLOW WRAP|SAT|FAIL]
+ *
+ * 将字符串当作一组任意宽度、任意偏移量的整数处理,
+ * 按顺序执行所有子命令, 每个 GET/SET/INCRBY 对应一个回复:
+ *   - GET 返回当前值
+ *   - SET 返回旧值
+ *   - INCRBY 返回新值
+ *   - OVERFLOW FAIL 时溢出的 SET/INCRBY 不执行, 返回 nil
+ *
+ * OVERFLOW 只影响它之后的子命令
+ *
+ * 先解析所有子命令, 再一次性将字符串扩展到最大的写入位置
+ */
+void bitfieldCommand(redisClient *c) {
+    robj *o;
+    size_t bitoffset, len = 0;
+    int j, numops = 0, changes = 0;
+    struct bitfieldOp *ops = NULL;
+    int owtype = BFOVERFLOW_WRAP;
+    int readonly = 1;
+    size_t highest_write_offset = 0;
+    unsigned char *p = NULL;
+    char llbuf[32];
+
+    /* 1. 解析子命令 */
+
+    for (j = 2; j < c->argc; j++) {
+        int remargs = c->argc-j-1; /* 剩余参数数量 */
+        char *subcmd = c->argv[j]->ptr;
+        long long i64 = 0;
+        int sign = 0, bits = 0;
+        int opcode;
+
+        if (!strcasecmp(subcmd,"get") && remargs >= 2)
+            opcode = BITFIELDOP_GET;
+        else if (!strcasecmp(subcmd,"set") && remargs >= 3)
+            opcode = BITFIELDOP_SET;
+        else if (!strcasecmp(subcmd,"incrby") && remargs >= 3)
+            opcode = BITFIELDOP_INCRBY;
+        else if (!strcasecmp(subcmd,"overflow") && remargs >= 1) {
+            char *owtypename = c->argv[j+1]->ptr;
+
+            j++;
+            if (!strcasecmp(owtypename,"wrap"))
+                owtype = BFOVERFLOW_WRAP;
+            else if (!strcasecmp(owtypename,"sat"))
+                owtype = BFOVERFLOW_SAT;
+            else if (!strcasecmp(owtypename,"fail"))
+                owtype = BFOVERFLOW_FAIL;
+            else {
+                addReplyError(c,"Invalid OVERFLOW type specified");
+                zfree(ops);
+                return;
+            }
+            continue;
+        } else {
+            addReply(c,shared.syntaxerr);
+            zfree(ops);
+            return;
+        }
+
+        // 类型和偏移量
+        if (getBitfieldTypeFromArgument(c,c->argv[j+1],&sign,&bits) != REDIS_OK) {
+            zfree(ops);
+            return;
+        }
+        if (getBitOffsetFromArgument(c,c->argv[j+2],&bitoffset,1,bits) != REDIS_OK) {
+            zfree(ops);
+            return;
+        }
+
+        // SET 的值, INCRBY 的增量
+        if (opcode != BITFIELDOP_GET) {
+            readonly = 0;
+            if (highest_write_offset < bitoffset + bits - 1)
+                highest_write_offset = bitoffset + bits - 1;
+            if (getLongLongFromObjectOrReply(c,c->argv[j+3],&i64,NULL) != REDIS_OK) {
+                zfree(ops);
+                return;
+            }
+        }
+
+        ops = zrealloc(ops,sizeof(*ops)*(numops+1));
+        ops[numops].offset = bitoffset;
+        ops[numops].i64 = i64;
+        ops[numops].opcode = opcode;
+        ops[numops].owtype = owtype;
+        ops[numops].bits = bits;
+        ops[numops].sign = sign;
+        numops++;
+
+        j += 3 - (opcode == BITFIELDOP_GET);
+    }
+
+    /* 2. 取出字符串 */
+
+    if (readonly) {
+        // 只有 GET 时不创建键
+        o = lookupKeyRead(c->db,c->argv[1]);
+        if (o != NULL) {
+            if (checkType(c,o,REDIS_STRING)) {
+                zfree(ops);
+                return;
+            }
+            if (o->encoding == REDIS_ENCODING_INT) {
+                len = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+                p = (unsigned char*) llbuf;
+            } else {
+                len = sdslen(o->ptr);
+                p = o->ptr;
+            }
+        }
+    } else {
+        o = lookupKeyWrite(c->db,c->argv[1]);
+        if (o == NULL) {
+            o = createObject(REDIS_STRING,sdsempty());
+            dbAdd(c->db,c->argv[1],o);
+        } else {
+            if (checkType(c,o,REDIS_STRING)) {
+                zfree(ops);
+                return;
+            }
+            o = dbUnshareStringValue(c->db,c->argv[1],o);
+        }
+
+        // 一次扩展到所有写入都能容纳的长度
+        o->ptr = sdsgrowzero(o->ptr,(highest_write_offset>>3)+1);
+        len = sdslen(o->ptr);
+        p = o->ptr;
+    }
+
+    /* 3. 执行子命令 */
+
+    addReplyMultiBulkLen(c,numops);
+    for (j = 0; j < numops; j++) {
+        struct bitfieldOp *thisop = ops+j;
+
+        if (thisop->opcode == BITFIELDOP_GET) {
+            // 键不存在时 p 为 NULL, len 为 0, 读出的值为 0
+            if (thisop->sign)
+                addReplyLongLong(c,getSignedBitfield(p,len,thisop->offset,thisop->bits));
+            else
+                addReplyLongLong(c,getUnsignedBitfield(p,len,thisop->offset,thisop->bits));
+            continue;
+        }
+
+        if (thisop->sign) {
+            int64_t oldval, newval, wrapped, retval;
+            int overflow;
+
+            oldval = getSignedBitfield(p,len,thisop->offset,thisop->bits);
+
+            if (thisop->opcode == BITFIELDOP_INCRBY) {
+                overflow = checkSignedBitfieldOverflow(oldval,thisop->i64,
+                               thisop->bits,thisop->owtype,&wrapped);
+                newval = overflow ? wrapped : oldval + thisop->i64;
+                retval = newval;
+            } else {
+                newval = thisop->i64;
+                overflow = checkSignedBitfieldOverflow(newval,0,
+                               thisop->bits,thisop->owtype,&wrapped);
+                if (overflow) newval = wrapped;
+                retval = oldval;
+            }
+
+            if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
+                setUnsignedBitfield(p,len,thisop->offset,thisop->bits,(uint64_t)newval);
+                addReplyLongLong(c,retval);
+                changes++;
+            } else {
+                addReply(c,shared.nullbulk);
+            }
+        } else {
+            uint64_t oldval, newval, wrapped, retval;
+            int overflow;
+
+            oldval = getUnsignedBitfield(p,len,thisop->offset,thisop->bits);
+
+            if (thisop->opcode == BITFIELDOP_INCRBY) {
+                overflow = checkUnsignedBitfieldOverflow(oldval,thisop->i64,
+                               thisop->bits,thisop->owtype,&wrapped);
+                newval = overflow ? wrapped : oldval + thisop->i64;
+                retval = newval;
+            } else {
+                newval = thisop->i64;
+                overflow = checkUnsignedBitfieldOverflow(0,thisop->i64,
+                               thisop->bits,thisop->owtype,&wrapped);
+                if (overflow) newval = wrapped;
+                retval = oldval;
+            }
+
+            if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
+                setUnsignedBitfield(p,len,thisop->offset,thisop->bits,newval);
+                addReplyLongLong(c,retval);
+                changes++;
+            } else {
+                addReply(c,shared.nullbulk);
+            }
+        }
+    }
+
+    if (changes) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
+        server.dirty += changes;
+    }
+    zfree(ops);
+}
@@ -1,5 +1,301 @@
+/**
+ * 阻塞操作的通用部分
+ *
+ * 客户端因为 BLPOP 等命令阻塞时, 调用 blockClient 设置阻塞状态,
+ * 条件满足或超时后调用 unblockClient 解除阻塞,
+ * 具体阻塞类型的数据 (例如等待的键) 由各自的模块维护, 见 t_list.c
+ *
+ * 阻塞超时使用分层时间轮管理:
+ * 第 L 层的每个槽覆盖 2^(8L) 毫秒, 超时时间与当前时间的差距越大, 所在的层越高,
+ * 时间轮每前进一毫秒只处理第 0 层的一个槽,
+ * 低位进位时才把高一层对应槽中的客户端重新分配到更低的层
+ *
+ * 所以加入、删除超时都是 O(1) , 处理超时只和到期的客户端数量有关,
+ * 不需要像周期性扫描那样检查所有被阻塞的客户端
+ */
+
 #include "redis.h"
 
+#define BLOCK_WHEEL_MASK (REDIS_BLOCK_WHEEL_SLOTS-1)
+
+// 距离上次处理超过这个毫秒数时 (例如服务器长时间阻塞或系统时钟跳变),
+// 不再逐毫秒前进, 而是直接重建时间轮
+#define BLOCK_WHEEL_REBUILD_GAP (REDIS_BLOCK_WHEEL_SLOTS*REDIS_BLOCK_WHEEL_SLOTS)
+
+/**
+ * 从对象中取出阻塞时限, 并转换为毫秒格式的 UNIX 时间
+ * 时限为 0 表示永远阻塞
+ *
+ * 取出成功返回 REDIS_OK , 否则向客户端回复错误并返回 REDIS_ERR
+ */
+int getTimeoutFromObjectOrReply(redisClient *c, robj *object, mstime_t *timeout, int unit) {
+    long long tval;
+
+    if (getLongLongFromObjectOrReply(c, object, &tval,
+        "timeout is not an integer or out of range") != REDIS_OK)
+        return REDIS_ERR;
+
+    if (tval < 0) {
+        addReplyError(c, "timeout is negative");
+        return REDIS_ERR;
+    }
+
+    // 转换为绝对时间
+    if (tval > 0) {
+        if (unit == UNIT_SECONDS) tval *= 1000;
+        tval += mstime();
+    }
+    *timeout = tval;
+
+    return REDIS_OK;
+}
+
+/**
+ * 根据客户端的超时时间, 将它链接到时间轮中合适的槽
+ *
+ * 选择超时时间与时间轮当前时间的高位开始相同的最低一层,
+ * 这样客户端所在的槽一定在这一层尚未处理的部分
+ * 超出时间轮范围的客户端放在 overflow 中, 时间轮转完一圈时重新分配
+ *
+ * T = O(1)
+ */
+static void blockTimerLink(blockTimerWheel *tw, redisClient *c) {
+    unsigned long long expire = c->bpop.timeout, now = tw->now;
+    redisClient **slot;
+    int level;
+
+    // 已经过期的客户端在下一次处理时超时
+    if (expire < now) expire = now;
+
+    if ((expire >> (REDIS_BLOCK_WHEEL_BITS*REDIS_BLOCK_WHEEL_LEVELS)) !=
+        (now >> (REDIS_BLOCK_WHEEL_BITS*REDIS_BLOCK_WHEEL_LEVELS)))
+    {
+        slot = &tw->overflow;
+    } else {
+        for (level = 0; level < REDIS_BLOCK_WHEEL_LEVELS-1; level++) {
+            int shift = REDIS_BLOCK_WHEEL_BITS*(level+1);
+            if ((expire >> shift) == (now >> shift)) break;
+        }
+        slot = &tw->slots[level][(expire >> (REDIS_BLOCK_WHEEL_BITS*level)) & BLOCK_WHEEL_MASK];
+    }
+
+    // 添加到槽的表头
+    c->bpop.tw_prev = NULL;
+    c->bpop.tw_next = *slot;
+    if (*slot) (*slot)->bpop.tw_prev = c;
+    *slot = c;
+    c->bpop.tw_slot = slot;
+}
+
+/**
+ * 将客户端从所在的槽中删除
+ *
+ * T = O(1)
+ */
+static void blockTimerUnlink(redisClient *c) {
+    if (c->bpop.tw_prev) {
+        c->bpop.tw_prev->bpop.tw_next = c->bpop.tw_next;
+    } else {
+        *c->bpop.tw_slot = c->bpop.tw_next;
+    }
+    if (c->bpop.tw_next) c->bpop.tw_next->bpop.tw_prev = c->bpop.tw_prev;
+
+    c->bpop.tw_prev = c->bpop.tw_next = NULL;
+    c->bpop.tw_slot = NULL;
+}
+
+/**
+ * 将槽中的所有客户端重新分配到时间轮中, 用于高层的槽进位到低层
+ *
+ * T = O(N), N 为槽中的客户端数量
+ */
+static void blockTimerCascade(blockTimerWheel *tw, redisClient **slot) {
+    redisClient *c = *slot, *next;
+
+    *slot = NULL;
+    while (c) {
+        next = c->bpop.tw_next;
+        blockTimerLink(tw, c);
+        c = next;
+    }
+}
+
+/**
+ * 将客户端加入超时时间轮, 没有时限的客户端不加入
+ *
+ * T = O(1)
+ */
+static void blockTimerAdd(redisClient *c) {
+    blockTimerWheel *tw = &server.bpop_timer_wheel;
+
+    if (c->bpop.timeout == 0) return;
+
+    // 时间轮为空时, 直接将当前时间拨到现在, 不需要逐毫秒追赶
+    if (tw->count == 0) tw->now = mstime();
+
+    blockTimerLink(tw, c);
+    tw->count++;
+}
+
+/**
+ * 将客户端从超时时间轮中删除
+ *
+ * T = O(1)
+ */
+static void blockTimerDel(redisClient *c) {
+    if (c->bpop.tw_slot == NULL) return;
+
+    blockTimerUnlink(c);
+    server.bpop_timer_wheel.count--;
+}
+
+/**
+ * 对给定的客户端进行阻塞, btype 为阻塞类型
+ * 调用前需要设置好 c->bpop 中对应阻塞类型的数据和超时时间
+ */
 void blockClient(redisClient *c, int btype) {
-    
-}
\ No newline at end of file
+    c->flags |= REDIS_BLOCKED;
+    c->btype = btype;
+    server.bpop_blocked_clients++;
+
+    blockTimerAdd(c);
+}
+
+/**
+ * 解除客户端的阻塞状态, 不会向客户端发送回复
+ */
+void unblockClient(redisClient *c) {
+    if (c->btype == REDIS_BLOCKED_LIST) {
+        unblockClientWaitingData(c);
+    } else {
+        redisPanic("Unknown btype in unblockClient().");
+    }
+
+    blockTimerDel(c);
+
+    c->flags &= ~REDIS_BLOCKED;
+    c->btype = REDIS_BLOCKED_NONE;
+    server.bpop_blocked_clients--;
+}
+
+/**
+ * 向阻塞超时的客户端发送回复
+ */
+void replyToBlockedClientTimedOut(redisClient *c) {
+    if (c->btype == REDIS_BLOCKED_LIST) {
+        addReply(c, shared.nullmultibulk);
+    } else {
+        redisPanic("Unknown btype in replyToBlockedClientTimedOut().");
+    }
+}
+
+/**
+ * 客户端阻塞超时: 回复空值并解除阻塞
+ * 调用前客户端已经从时间轮中删除
+ */
+static void blockTimerFire(blockTimerWheel *tw, redisClient *c) {
+    c->bpop.tw_prev = c->bpop.tw_next = NULL;
+    c->bpop.tw_slot = NULL;
+    tw->count--;
+
+    replyToBlockedClientTimedOut(c);
+    unblockClient(c);
+}
+
+/**
+ * 将槽中的客户端取出, 用 tw_next 串到 all 的前面, 返回新的 all
+ */
+static redisClient *blockTimerCollect(redisClient **slot, redisClient *all) {
+    redisClient *c, *next;
+
+    for (c = *slot; c; c = next) {
+        next = c->bpop.tw_next;
+        c->bpop.tw_next = all;
+        all = c;
+    }
+    *slot = NULL;
+
+    return all;
+}
+
+/**
+ * 取出时间轮中的所有客户端, 处理已经超时的客户端,
+ * 然后以 now 之后的一毫秒为起点重新加入其余的客户端
+ *
+ * T = O(N), N 为时间轮中的客户端数量
+ */
+static void blockTimerRebuild(blockTimerWheel *tw, mstime_t now) {
+    redisClient *all = NULL, *c, *next;
+    int level, i;
+
+    for (level = 0; level < REDIS_BLOCK_WHEEL_LEVELS; level++) {
+        for (i = 0; i < REDIS_BLOCK_WHEEL_SLOTS; i++)
+            all = blockTimerCollect(&tw->slots[level][i], all);
+    }
+    all = blockTimerCollect(&tw->overflow, all);
+
+    tw->now = now + 1;
+    for (c = all; c; c = next) {
+        next = c->bpop.tw_next;
+        if (c->bpop.timeout <= now) {
+            blockTimerFire(tw, c);
+        } else {
+            blockTimerLink(tw, c);
+        }
+    }
+}
+
+/**
+ * 处理阻塞超时的客户端: 回复空值并解除阻塞
+ * 应该在每次事件循环中调用一次 (或者在 serverCron 中调用)
+ *
+ * 时间轮从上次处理的时间前进到当前时间, 每一毫秒处理第 0 层的一个槽,
+ * 相隔太久时改为重建时间轮
+ *
+ * T = O(M + K), M 为距离上次处理的毫秒数 (不超过 BLOCK_WHEEL_REBUILD_GAP),
+ *     K 为到期和需要进位的客户端数量
+ */
+void handleBlockedClientsTimeout(void) {
+    blockTimerWheel *tw = &server.bpop_timer_wheel;
+    mstime_t now = mstime();
+
+    if (tw->count && now - tw->now >= BLOCK_WHEEL_REBUILD_GAP) {
+        blockTimerRebuild(tw, now);
+        return;
+    }
+
+    while (tw->count && tw->now <= now) {
+        unsigned long long t = tw->now;
+        redisClient *c, *next;
+
+        // 低位进位时, 从高到低把对应槽中的客户端重新分配,
+        // 时间轮转完一圈时还要重新分配 overflow 中的客户端
+        if ((t & BLOCK_WHEEL_MASK) == 0) {
+            int level = 1;
+
+            while (level < REDIS_BLOCK_WHEEL_LEVELS &&
+                   ((t >> (REDIS_BLOCK_WHEEL_BITS*level)) & BLOCK_WHEEL_MASK) == 0)
+                level++;
+
+            if (level == REDIS_BLOCK_WHEEL_LEVELS) {
+                blockTimerCascade(tw, &tw->overflow);
+                level--;
+            }
+            for (; level >= 1; level--) {
+                blockTimerCascade(tw, &tw->slots[level]
+                    [(t >> (REDIS_BLOCK_WHEEL_BITS*level)) & BLOCK_WHEEL_MASK]);
+            }
+        }
+
+        // 第 0 层当前槽中的客户端全部到期
+        c = tw->slots[0][t & BLOCK_WHEEL_MASK];
+        tw->slots[0][t & BLOCK_WHEEL_MASK] = NULL;
+        while (c) {
+            next = c->bpop.tw_next;
+            blockTimerFire(tw, c);
+            c = next;
+        }
+
+        tw->now++;
+    }
+}
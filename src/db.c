@@ -22,6 +22,9 @@
  */
 robj *lookupKey(redisDb *db, robj *key) {
 
+    // 之后访问值时建立的索引和指纹缓存属于这个数据库, 见 ptrcache.c
+    ptrCacheSetCurrentDb(db->id);
+
     // 从 db 查找 key 的值对象
     dictEntry *de = dictFind(db->dict,key->ptr);
 
@@ -115,6 +118,16 @@ robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply) {
 }
 
 
+/*
+ * 值对象 val 被关联到数据库 db 的键 key 时 (添加、覆盖、RENAME、MOVE、载入),
+ * 更新它在以地址为键的缓存中所属的数据库, 见 ptrcache.c
+ */
+static void dbBindValue(redisDb *db, robj *key, robj *val) {
+    if (val->type == REDIS_ZSET && val->encoding == REDIS_ENCODING_ZIPLIST)
+        zzlIndexSetDb(val->ptr,db->id);
+    else if (val->type == REDIS_HASH)
+        hashTypeSetDb(db,key,val);
+}
 
 /**
  * 向数据库添加键值对
@@ -134,6 +147,8 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
 
     // 如果开启了集群模式, 那么将键保存在槽里面
     if (server.cluster_enabled) slotToKeyAdd(key);
+
+    dbBindValue(db,key,val);
 }
 
 /**
@@ -152,6 +167,8 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
 
     // 修改值对象
     dictReplace(db->dict,key->ptr,val);
+
+    dbBindValue(db,key,val);
 }
 
 /**
@@ -232,7 +249,7 @@ robj *dbRandomKey(redisDb *db) {
  * 从数据库删除 键值对, 并删除其过期时间
  * 删除成功返回 1, 否则返回 0
  */
-int dbDelete(redisDb *db, robj *key) {
+int dbSyncDelete(redisDb *db, robj *key) {
 
     // 删除过期时间
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
@@ -250,6 +267,15 @@ int dbDelete(redisDb *db, robj *key) {
     }
 }
 
+/**
+ * 服务器内部删除键时使用的函数
+ * 开启 lazyfree_lazy_server_del 时, 大的值对象交给后台线程释放
+ */
+int dbDelete(redisDb *db, robj *key) {
+    return server.lazyfree_lazy_server_del ? dbAsyncDelete(db,key) :
+                                             dbSyncDelete(db,key);
+}
+
 /**
  * 将字符串键非 RAW 编码的值对象转换成 RAW 编码后存入数据库
  */
@@ -269,8 +295,11 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
 /**
  * 清空服务器的所有数据库数据
  * 返回删除的节点数量
+ *
+ * flags 带有 REDIS_EMPTYDB_ASYNC 时, 数据库由后台线程释放,
+ * 此时不会调用 callback
  */
-long long emptyDb(void(callback)(void*)) {
+long long emptyDb(int flags, void(callback)(void*)) {
     int j;
     long long removed = 0;
 
@@ -280,11 +309,16 @@ long long emptyDb(void(callback)(void*)) {
         // 统计删除节点数
         removed += dictSize(server.db[j].dict);
 
-        // 删除 kv 数据库
-        dictEmpty(server.db[j].dict,callback);
+        if (flags & REDIS_EMPTYDB_ASYNC) {
+            // 交给后台线程释放
+            emptyDbAsync(&server.db[j]);
+        } else {
+            // 删除 kv 数据库
+            dictEmpty(server.db[j].dict,callback);
 
-        // 删除 expire 数据库
-        dictEmpty(server.db[j].expires,callback);
+            // 删除 expire 数据库
+            dictEmpty(server.db[j].expires,callback);
+        }
     }
 
     // 如果开启集群模式, 那么移除槽记录
@@ -328,10 +362,35 @@ void signalFlushDb(int dbid) {
 
 /*------------------------- 数据库命令(与类型无关) --------------------------*/
 
+/**
+ * 解析 FLUSHDB 和 FLUSHALL 的 ASYNC 参数
+ * 参数正确返回 REDIS_OK, 否则向客户端回复错误并返回 REDIS_ERR
+ */
+int getFlushCommandFlags(redisClient *c, int *flags) {
+
+    if (c->argc > 1) {
+        // 只接受一个 ASYNC 参数
+        if (c->argc > 2 || strcasecmp(c->argv[1]->ptr,"async")) {
+            addReply(c,shared.syntaxerr);
+            return REDIS_ERR;
+        }
+        *flags = REDIS_EMPTYDB_ASYNC;
+    } else {
+        *flags = REDIS_EMPTYDB_NO_FLAGS;
+    }
+
+    return REDIS_OK;
+}
+
 /**
  * 清空客户端指定的数据库
  */
+// FLUSHDB [ASYNC]
 void flushdbCommand(redisClient *c) {
+    int flags;
+
+    if (getFlushCommandFlags(c,&flags) == REDIS_ERR) return;
+
     // 更新键改次数
     server.dirty += dictSize(c->db->dict);
 
@@ -339,8 +398,12 @@ void flushdbCommand(redisClient *c) {
     signalFlushDb(c->db->id);
 
     // 清空指定数据库
-    dictEmpty(c->db->dict,NULL);
-    dictEmpty(c->db->expires,NULL);
+    if (flags & REDIS_EMPTYDB_ASYNC) {
+        emptyDbAsync(c->db);
+    } else {
+        dictEmpty(c->db->dict,NULL);
+        dictEmpty(c->db->expires,NULL);
+    }
 
     // 如果开启了集群模式, 要移除槽记录
     if (server.cluster_enabled) slotToKeyFlush();
@@ -352,13 +415,18 @@ void flushdbCommand(redisClient *c) {
 /**
  * 清空服务器中的所有数据库
  */
+// FLUSHALL [ASYNC]
 void flushallCommand(redisClient *c) {
+    int flags;
+
+    if (getFlushCommandFlags(c,&flags) == REDIS_ERR) return;
+
     // 发送通知
     signalFlushDb(-1);
 
     // 清空所有数据库, 更新键改次数
     // 回复客户端
-    server.dirty += emptyDb(NULL);
+    server.dirty += emptyDb(flags,NULL);
     addReply(c,shared.ok);
 
     // 如果正在保存新的 RDB, 那么取消保存操作
@@ -382,8 +450,11 @@ void flushallCommand(redisClient *c) {
     server.dirty++;
 }
 
-// DEL key [key ...]
-void delCommand(redisClient *c) {
+/**
+ * DEL 和 UNLINK 命令的实现
+ * lazy 为真时, 大的值对象交给后台线程释放
+ */
+void delGenericCommand(redisClient *c, int lazy) {
     int deleted = 0, j;
 
     // 遍历所有输入键
@@ -393,8 +464,9 @@ void delCommand(redisClient *c) {
         expireIfNeeded(c->db,c->argv[j]);
 
         // 尝试删除键
-        if (dbDelete(c->db,c->argv[j])) {
-
+        if (lazy ? dbAsyncDelete(c->db,c->argv[j]) :
+                   dbSyncDelete(c->db,c->argv[j]))
+        {
             // 删除成功, 发送通知
             signalModifiedKey(c->db,c->argv[j]);
             notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,
@@ -411,6 +483,16 @@ void delCommand(redisClient *c) {
     addReplyLongLong(c,deleted);
 }
 
+// DEL key [key ...]
+void delCommand(redisClient *c) {
+    delGenericCommand(c,0);
+}
+
+// UNLINK key [key ...]
+void unlinkCommand(redisClient *c) {
+    delGenericCommand(c,1);
+}
+
 // EXISTS key [key ...]
 void existsCommand(redisClient *c) {
 
@@ -600,6 +682,18 @@ long long getExpire(redisDb *db, robj *key) {
     dictGetSignedIntegerVal(de);
 }
 
+/**
+ * 将删除命令 argv 传播到附属节点和 AOF 文件
+ *
+ * 这里是 AOF 和复制的写入口 (feedAppendOnlyFile, replicationFeedSlaves),
+ * 这个版本还没有实现 AOF 和复制, 所以不执行任何操作
+ */
+static void propagateDeletion(redisDb *db, robj **argv, int argc) {
+    REDIS_NOTUSED(db);
+    REDIS_NOTUSED(argv);
+    REDIS_NOTUSED(argc);
+}
+
 /**
  * 将过期时间传播到附属节点和 AOF 文件
  * 
@@ -610,13 +704,37 @@ long long getExpire(redisDb *db, robj *key) {
  * 所以即使有写操作对过期键执行, 所有数据都还是一致的
  */
 void propagateExpire(redisDb *db, robj *key) {
+    robj *argv[2];
+
+    argv[0] = shared.del;
+    argv[1] = key;
+
+    propagateDeletion(db,argv,2);
+}
 
+/**
+ * 将哈希域的过期传播到附属节点和 AOF 文件
+ *
+ * 和键一样, 主节点删除哈希 key 中到期的域 fields 时,
+ * 传播一个显式的 HDEL key field [field ...] 命令,
+ * 附属节点自己不删除到期的域, 只等待这个命令
+ */
+void propagateHashFieldsExpire(redisDb *db, robj *key, robj **fields, int numfields) {
+    robj **argv = zmalloc(sizeof(robj*)*(numfields+2));
+    int j;
+
+    argv[0] = shared.hdel;
+    argv[1] = key;
+    for (j = 0; j < numfields; j++) argv[j+2] = fields[j];
+
+    propagateDeletion(db,argv,numfields+2);
+    zfree(argv);
 }
 
 /**
  * 检查 key 是否过期, 如果过期, 将它从数据库中删除
  * 返回 0, 表示键不存在过期时间 或 未过期
- * 返回 1, 表示键已过期并删除
+ * 返回 1, 表示键已过期并删除 (包括最后一个域也已到期的哈希键)
  */
 int expireIfNeeded(redisDb *db, robj *key) {
 
@@ -624,6 +742,9 @@ int expireIfNeeded(redisDb *db, robj *key) {
     mstime_t when = getExpire(db,key);
     mstime_t now;
 
+    // 删除哈希中到期的域, 最后一个域也到期时键被删除
+    if (hashTypeExpireFieldsIfNeeded(db,key)) return 1;
+
     // 没有过期时间
     if (when < 0) return 0;
 
@@ -15,6 +15,7 @@
 
 #include <assert.h>
 #include "dictType.h"
+#include "rand.h"
 
 extern dictType initDictType;
 
@@ -402,16 +403,6 @@ dictEntry *dictFind(dict *d,const void *key){
     return NULL;
 }
 
-/**
- * 自定义随机函数 (非 redis 函数)
- * 因为 C99编译器没有 random 函数
- */ 
-int customRandom()
-{
-    srand(time(NULL));
-    return rand();
-}
-
 /**
  * 从字典中随机返回一个节点
  * 
@@ -436,7 +427,7 @@ dictEntry *dictGetRandomKey(dict *d)
         // 随机获取非空节点链表
         do {
             // 随机索引值,根据主副哈希表的长度计算随机值
-            h = customRandom() % (d->ht[0].size+d->ht[1].size);
+            h = redisRandomBelow(d->ht[0].size+d->ht[1].size);
             // 取出节点链表首地址
             he = (h >= d->ht[0].size) ? d->ht[1].table[h - d->ht[0].size] :
                                         d->ht[0].table[h];
@@ -447,8 +438,8 @@ dictEntry *dictGetRandomKey(dict *d)
     else {
         // 随机获取非空节点链表
         do {
-            // 随机索引值 (gcc 没有random)
-            h = customRandom() & d->ht[0].sizemask;
+            // 随机索引值
+            h = redisRandom64() & d->ht[0].sizemask;
             // 取出节点链表首地址
             he = d->ht[0].table[h];
         }while(he == NULL);
@@ -462,7 +453,7 @@ dictEntry *dictGetRandomKey(dict *d)
         listlen++;
     }
     // 根据链表长度获取随机值
-    listele = customRandom() % listlen;
+    listele = redisRandomBelow(listlen);
 
     // 获取随机值指向的节点
     he = origHe;
@@ -491,7 +482,7 @@ int dictGetRandomKeys(dict *d,dictEntry **des,int count){
         for(j=0; j<2; j++){
 
             // 获取随机数并确定哈希表索引值
-            unsigned int i = customRandom() & d->ht[j].sizemask;
+            unsigned int i = redisRandom64() & d->ht[j].sizemask;
             int size = d->ht[j].size;
 
             // 遍历随机节点链表后的所有节点链表
@@ -961,7 +952,7 @@ void dictPrintAllEntry(dict *d)
 }
 
 
-// gcc -g zmalloc.c dictType.c dict.c
+// gcc -g zmalloc.c rand.c dictType.c dict.c -D DICT_TEST_MAIN
 void main(void)
 {
     int ret;
@@ -25,6 +25,7 @@ typedef struct dictEntry {
         void *val;
         uint64_t u64;
         int64_t s64;
+        double d;
     } v;
 
     // 指向下一个哈希表节点，形成链表
@@ -149,6 +150,10 @@ typedef struct dictIterator {
 #define dictSetUnsignedIntegerVal(entry, _val_) \
     do { entry->v.u64 = _val_; } while(0)
 
+// 将一个浮点数设为节点的值
+#define dictSetDoubleVal(entry, _val_) \
+    do { entry->v.d = _val_; } while(0)
+
 // 释放给定字典节点的键
 #define dictFreeKey(d, entry) \
     if ((d)->type->keyDestructor) \
@@ -178,6 +183,8 @@ typedef struct dictIterator {
 #define dictGetSignedIntegerVal(he) ((he)->v.s64)
 // 返回给定节点的无符号整数值
 #define dictGetUnsignedIntegerVal(he) ((he)->v.u64)
+// 返回给定节点的浮点数值
+#define dictGetDoubleVal(he) ((he)->v.d)
 // 返回字典已用的节点数
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 // 查看字典是否正在 rehash
@@ -0,0 +1,1070 @@
+/*
+ * HyperLogLog
+ *
+ * 用 12k 字节的固定空间估算集合的基数 (不同元素的数量), 标准误差 0.81%
+ *
+ * 1. 算法
+ *    对元素计算 64 位哈希值, 低 HLL_P 位用于选择寄存器,
+ *    剩余的 HLL_Q 位中从低位开始第一个 1 出现的位置 (从 1 开始) 即为该元素的计数,
+ *    每个寄存器只保存落到该寄存器的元素的最大计数。
+ *    估算时使用寄存器值的直方图计算调和平均数 (Ertl 的改进估算方法),
+ *    无需对大基数和小基数分别修正。
+ *
+ * 2. 编码
+ *    HLL 以字符串对象保存, 所以 RDB 和 AOF 不需要特殊处理:
+ *
+ *    +------+---+-----+----------+
+ *    | HYLL | E | N/U | Cardin.  |
+ *    +------+---+-----+----------+
+ *
+ *    - 4 字节的魔数 "HYLL"
+ *    - 1 字节的编码, HLL_DENSE 或 HLL_SPARSE
+ *    - 3 字节未使用
+ *    - 8 字节的基数缓存 (小端序), 最高字节的最高位为 1 时表示缓存失效
+ *
+ *    之后是寄存器:
+ *
+ *    稠密 (dense) 编码: 16384 个 6 位寄存器, 从低位开始紧密排列,
+ *    共 12288 字节。
+ *
+ *    稀疏 (sparse) 编码: 对寄存器进行游程编码, 有三种操作码:
+ *
+ *    - ZERO  : 00xxxxxx, 表示 xxxxxx+1 (1 ~ 64) 个值为 0 的寄存器
+ *    - XZERO : 01xxxxxx yyyyyyyy, 表示 xxxxxxyyyyyyyy+1 (1 ~ 16384) 个值为 0 的寄存器
+ *    - VAL   : 1vvvvvxx, 表示 xx+1 (1 ~ 4) 个值为 vvvvv+1 (1 ~ 32) 的寄存器
+ *
+ *    新建的 HLL 是稀疏编码, 只占 4 个字节的寄存器空间。
+ *    寄存器的值超过 32, 或者稀疏表示的长度超过 server.hll_sparse_max_bytes 时,
+ *    转换为稠密编码, 转换是单向的。
+ *
+ *    合并多个 HLL 时 (PFCOUNT 多个键, PFMERGE), 内部使用每个寄存器一个字节的
+ *    HLL_RAW 编码, 这种编码不会被保存到数据库中。
+ *
+ * 3. 批量处理寄存器
+ *    6 位寄存器的边界每 3 个字节对齐一次, 所以稠密编码每次处理 12 字节 (16 个寄存器):
+ *    先解码到字节数组, 再对字节数组做逐字节的 max 或者直方图计数。
+ *    逐字节的 max 循环没有分支和跨元素依赖, 编译器可以将它向量化。
+ */
+
+#include "redis.h"
+#include "endianconv.h"
+#include <stdint.h>
+#include <math.h>
+
+/*---------------------------------- 结构 -------------------------------------*/
+
+struct hllhdr {
+    // 魔数 "HYLL"
+    char magic[4];
+    // HLL_DENSE 或 HLL_SPARSE
+    uint8_t encoding;
+    // 保留, 必须为 0
+    uint8_t notused[3];
+    // 基数缓存, 小端序
+    uint8_t card[8];
+    // 寄存器
+    uint8_t registers[];
+};
+
+// 基数缓存是否有效
+#define HLL_INVALIDATE_CACHE(hdr) (hdr)->card[7] |= (1<<7)
+#define HLL_VALID_CACHE(hdr) (((hdr)->card[7] & (1<<7)) == 0)
+
+#define HLL_P 14 /* 用于选择寄存器的哈希位数 */
+#define HLL_Q (64-HLL_P) /* 用于计算计数的哈希位数 */
+#define HLL_REGISTERS (1<<HLL_P) /* 寄存器数量, 16384 */
+#define HLL_P_MASK (HLL_REGISTERS-1)
+#define HLL_BITS 6 /* 寄存器位数, 最大计数 HLL_Q+1 需要 6 位 */
+#define HLL_REGISTER_MAX ((1<<HLL_BITS)-1)
+#define HLL_HDR_SIZE sizeof(struct hllhdr)
+#define HLL_DENSE_SIZE (HLL_HDR_SIZE+((HLL_REGISTERS*HLL_BITS+7)/8))
+#define HLL_DENSE 0 /* 稠密编码 */
+#define HLL_SPARSE 1 /* 稀疏编码 */
+#define HLL_RAW 255 /* 每个寄存器一个字节, 只在内部使用 */
+#define HLL_MAX_ENCODING 1
+
+// 0.5/ln(2), 寄存器数量趋于无穷时的修正常数
+#define HLL_ALPHA_INF 0.721347520444481703680
+
+// 每批处理的寄存器数量, 以及它们在稠密编码中占用的字节数
+#define HLL_DENSE_BATCH 16
+#define HLL_DENSE_BATCH_BYTES (HLL_DENSE_BATCH*HLL_BITS/8)
+
+static char *invalid_hll_err = "-INVALIDOBJ Corrupted HLL object detected\r\n";
+static char *wrongtype_hll_err = "-WRONGTYPE Key is not a valid HyperLogLog string value.\r\n";
+
+/*--------------------------------- 稠密编码 -----------------------------------*/
+
+/*
+ * 取出 p 中第 regnum 个寄存器的值, 保存到 target
+ *
+ * 寄存器可能跨越两个字节:
+ *
+ *   +--------+--------+
+ *   |11000000|22221111|
+ *   +--------+--------+
+ *
+ * 读取最后一个寄存器时会多读一个字节, 这个字节是 sds 末尾的 '\0'
+ */
+#define HLL_DENSE_GET_REGISTER(target,p,regnum) do { \
+    uint8_t *_p = (uint8_t*) p; \
+    unsigned long _byte = regnum*HLL_BITS/8; \
+    unsigned long _fb = regnum*HLL_BITS&7; \
+    unsigned long _fb8 = 8 - _fb; \
+    unsigned long b0 = _p[_byte]; \
+    unsigned long b1 = _p[_byte+1]; \
+    target = ((b0 >> _fb) | (b1 << _fb8)) & HLL_REGISTER_MAX; \
+} while(0)
+
+/*
+ * 将 p 中第 regnum 个寄存器设置为 val
+ */
+#define HLL_DENSE_SET_REGISTER(p,regnum,val) do { \
+    uint8_t *_p = (uint8_t*) p; \
+    unsigned long _byte = regnum*HLL_BITS/8; \
+    unsigned long _fb = regnum*HLL_BITS&7; \
+    unsigned long _fb8 = 8 - _fb; \
+    unsigned long _v = val; \
+    _p[_byte] &= ~(HLL_REGISTER_MAX << _fb); \
+    _p[_byte] |= _v << _fb; \
+    _p[_byte+1] &= ~(HLL_REGISTER_MAX >> _fb8); \
+    _p[_byte+1] |= _v >> _fb8; \
+} while(0)
+
+/*
+ * 将稠密编码中 r 开始的 12 个字节解码为 16 个寄存器, 保存到 regs
+ *
+ * T = O(1)
+ */
+static inline void hllDenseDecodeBatch(const uint8_t *r, uint8_t *regs) {
+    int j;
+
+    // 每 3 个字节保存 4 个寄存器
+    for (j = 0; j < HLL_DENSE_BATCH/4; j++) {
+        unsigned long b0 = r[0], b1 = r[1], b2 = r[2];
+
+        regs[0] = b0 & 63;
+        regs[1] = ((b0 >> 6) | (b1 << 2)) & 63;
+        regs[2] = ((b1 >> 4) | (b2 << 4)) & 63;
+        regs[3] = (b2 >> 2) & 63;
+
+        r += 3;
+        regs += 4;
+    }
+}
+
+/*
+ * 将 regs 中的 16 个寄存器编码为稠密编码, 写入 r 开始的 12 个字节
+ *
+ * T = O(1)
+ */
+static inline void hllDenseEncodeBatch(uint8_t *r, const uint8_t *regs) {
+    int j;
+
+    for (j = 0; j < HLL_DENSE_BATCH/4; j++) {
+        r[0] = regs[0] | (regs[1] << 6);
+        r[1] = (regs[1] >> 2) | (regs[2] << 4);
+        r[2] = (regs[2] >> 4) | (regs[3] << 2);
+
+        r += 3;
+        regs += 4;
+    }
+}
+
+/*---------------------------------- 哈希 -------------------------------------*/
+
+/*
+ * MurmurHash2, 64 位版本, 由 Austin Appleby 编写
+ *
+ * 按小端序读取输入, 保证大端机器上得到相同的结果
+ */
+uint64_t MurmurHash64A(const void *key, int len, unsigned int seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    const uint8_t *data = (const uint8_t *)key;
+    const uint8_t *end = data + (len-(len&7));
+
+    while(data != end) {
+        uint64_t k;
+
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+        memcpy(&k,data,sizeof(k));
+#else
+        k = (uint64_t) data[0];
+        k |= (uint64_t) data[1] << 8;
+        k |= (uint64_t) data[2] << 16;
+        k |= (uint64_t) data[3] << 24;
+        k |= (uint64_t) data[4] << 32;
+        k |= (uint64_t) data[5] << 40;
+        k |= (uint64_t) data[6] << 48;
+        k |= (uint64_t) data[7] << 56;
+#endif
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+        data += 8;
+    }
+
+    switch(len & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48; /* fall through */
+    case 6: h ^= (uint64_t)data[5] << 40; /* fall through */
+    case 5: h ^= (uint64_t)data[4] << 32; /* fall through */
+    case 4: h ^= (uint64_t)data[3] << 24; /* fall through */
+    case 3: h ^= (uint64_t)data[2] << 16; /* fall through */
+    case 2: h ^= (uint64_t)data[1] << 8; /* fall through */
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
+    };
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+/*
+ * 计算元素 ele 对应的寄存器索引 (保存到 *regp) 和计数
+ *
+ * 计数为哈希值高 HLL_Q 位中, 从低位开始第一个 1 的位置,
+ * 第 HLL_Q 位总是设为 1, 所以计数不超过 HLL_Q+1
+ *
+ * T = O(N), N 为元素长度
+ */
+int hllPatLen(unsigned char *ele, size_t elesize, long *regp) {
+    uint64_t hash, index;
+
+    hash = MurmurHash64A(ele,elesize,0xadc83b19ULL);
+    index = hash & HLL_P_MASK;
+    hash >>= HLL_P;
+    hash |= ((uint64_t)1<<HLL_Q);
+
+    *regp = (long) index;
+    return __builtin_ctzll(hash) + 1;
+}
+
+/*------------------------------- 稠密编码操作 ---------------------------------*/
+
+/*
+ * 如果 count 大于第 index 个寄存器的值, 那么更新寄存器
+ *
+ * 寄存器被更新返回 1, 否则返回 0
+ *
+ * T = O(1)
+ */
+int hllDenseSet(uint8_t *registers, long index, uint8_t count) {
+    uint8_t oldcount;
+
+    HLL_DENSE_GET_REGISTER(oldcount,registers,index);
+    if (count > oldcount) {
+        HLL_DENSE_SET_REGISTER(registers,index,count);
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/*
+ * 将元素 ele 添加到稠密编码的 HLL 中
+ *
+ * 寄存器被更新返回 1, 否则返回 0
+ */
+int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
+    long index;
+    uint8_t count = hllPatLen(ele,elesize,&index);
+
+    return hllDenseSet(registers,index,count);
+}
+
+/*
+ * 统计稠密编码的寄存器值的直方图, 累加到 reghisto
+ *
+ * T = O(M), M 为寄存器数量
+ */
+void hllDenseRegHisto(uint8_t *registers, int *reghisto) {
+    uint8_t regs[HLL_DENSE_BATCH];
+    uint8_t *r = registers;
+    int j, k;
+
+    for (j = 0; j < HLL_REGISTERS/HLL_DENSE_BATCH; j++) {
+        hllDenseDecodeBatch(r,regs);
+        for (k = 0; k < HLL_DENSE_BATCH; k++) reghisto[regs[k]]++;
+        r += HLL_DENSE_BATCH_BYTES;
+    }
+}
+
+/*------------------------------- 稀疏编码操作 ---------------------------------*/
+
+#define HLL_SPARSE_XZERO_BIT 0x40 /* 01xxxxxx */
+#define HLL_SPARSE_VAL_BIT 0x80 /* 1vvvvvxx */
+#define HLL_SPARSE_IS_ZERO(p) (((*(p)) & 0xc0) == 0) /* 00xxxxxx */
+#define HLL_SPARSE_IS_XZERO(p) (((*(p)) & 0xc0) == HLL_SPARSE_XZERO_BIT)
+#define HLL_SPARSE_IS_VAL(p) ((*(p)) & HLL_SPARSE_VAL_BIT)
+#define HLL_SPARSE_ZERO_LEN(p) (((*(p)) & 0x3f)+1)
+#define HLL_SPARSE_XZERO_LEN(p) (((((*(p)) & 0x3f) << 8) | (*((p)+1)))+1)
+#define HLL_SPARSE_VAL_VALUE(p) ((((*(p)) >> 2) & 0x1f)+1)
+#define HLL_SPARSE_VAL_LEN(p) (((*(p)) & 0x3)+1)
+#define HLL_SPARSE_VAL_MAX_VALUE 32
+#define HLL_SPARSE_VAL_MAX_LEN 4
+#define HLL_SPARSE_ZERO_MAX_LEN 64
+#define HLL_SPARSE_XZERO_MAX_LEN 16384
+#define HLL_SPARSE_VAL_SET(p,val,len) do { \
+    *(p) = (((val)-1)<<2|((len)-1))|HLL_SPARSE_VAL_BIT; \
+} while(0)
+#define HLL_SPARSE_ZERO_SET(p,len) do { \
+    *(p) = (len)-1; \
+} while(0)
+#define HLL_SPARSE_XZERO_SET(p,len) do { \
+    int _l = (len)-1; \
+    *(p) = (_l>>8) | HLL_SPARSE_XZERO_BIT; \
+    *((p)+1) = (_l&0xff); \
+} while(0)
+
+/*
+ * 将稀疏编码的 HLL 对象 o 转换为稠密编码
+ *
+ * 对象已经是稠密编码时不做任何事
+ *
+ * 转换成功返回 REDIS_OK, 稀疏表示损坏时返回 REDIS_ERR
+ *
+ * T = O(M), M 为寄存器数量
+ */
+int hllSparseToDense(robj *o) {
+    sds sparse = o->ptr, dense;
+    struct hllhdr *hdr, *oldhdr = (struct hllhdr*)sparse;
+    int idx = 0, runlen, regval;
+    uint8_t *p = (uint8_t*)sparse, *end = p+sdslen(sparse);
+
+    if (oldhdr->encoding == HLL_DENSE) return REDIS_OK;
+
+    // 新的 sds 已经被清零, 只需要设置非 0 的寄存器
+    dense = sdsnewlen(NULL,HLL_DENSE_SIZE);
+    hdr = (struct hllhdr*) dense;
+    // 复制魔数和基数缓存
+    *hdr = *oldhdr;
+    hdr->encoding = HLL_DENSE;
+
+    p += HLL_HDR_SIZE;
+    while(p < end) {
+        if (HLL_SPARSE_IS_ZERO(p)) {
+            runlen = HLL_SPARSE_ZERO_LEN(p);
+            idx += runlen;
+            p++;
+        } else if (HLL_SPARSE_IS_XZERO(p)) {
+            runlen = HLL_SPARSE_XZERO_LEN(p);
+            idx += runlen;
+            p += 2;
+        } else {
+            runlen = HLL_SPARSE_VAL_LEN(p);
+            regval = HLL_SPARSE_VAL_VALUE(p);
+            if ((runlen + idx) > HLL_REGISTERS) break; /* 溢出 */
+            while(runlen--) {
+                HLL_DENSE_SET_REGISTER(hdr->registers,idx,regval);
+                idx++;
+            }
+            p++;
+        }
+    }
+
+    // 操作码覆盖的寄存器数量必须刚好为 HLL_REGISTERS
+    if (idx != HLL_REGISTERS) {
+        sdsfree(dense);
+        return REDIS_ERR;
+    }
+
+    sdsfree(o->ptr);
+    o->ptr = dense;
+    return REDIS_OK;
+}
+
+/*
+ * 如果 count 大于稀疏编码的 HLL 对象 o 中第 index 个寄存器的值, 那么更新寄存器
+ *
+ * count 无法用 VAL 操作码表示, 或者更新后的长度超过 server.hll_sparse_max_bytes 时,
+ * 先将对象转换为稠密编码, 再更新寄存器
+ *
+ * 寄存器被更新返回 1, 没有更新返回 0, 稀疏表示损坏时返回 -1
+ *
+ * T = O(N), N 为稀疏表示的长度
+ */
+int hllSparseSet(robj *o, long index, uint8_t count) {
+    struct hllhdr *hdr;
+    uint8_t oldcount, *sparse, *end, *p, *prev, *next;
+    long first, span;
+    long is_zero = 0, is_xzero = 0, is_val = 0, runlen = 0;
+    uint8_t seq[5], *n;
+    int last, len, seqlen, oldlen, deltalen, scanlen;
+
+    if (count > HLL_SPARSE_VAL_MAX_VALUE) goto promote;
+
+    // 最坏情况下, 一个操作码会被替换为 XZERO-VAL-XZERO, 多出 3 个字节
+    o->ptr = sdsMakeRoomFor(o->ptr,3);
+
+    /* 1. 找到覆盖 index 的操作码 */
+
+    sparse = p = ((uint8_t*)o->ptr) + HLL_HDR_SIZE;
+    end = p + sdslen(o->ptr) - HLL_HDR_SIZE;
+
+    // first 为当前操作码覆盖的第一个寄存器, prev 为前一个操作码
+    first = 0;
+    prev = NULL;
+    next = NULL;
+    span = 0;
+    while(p < end) {
+        long oplen;
+
+        oplen = 1;
+        if (HLL_SPARSE_IS_ZERO(p)) {
+            span = HLL_SPARSE_ZERO_LEN(p);
+        } else if (HLL_SPARSE_IS_VAL(p)) {
+            span = HLL_SPARSE_VAL_LEN(p);
+        } else { /* XZERO */
+            span = HLL_SPARSE_XZERO_LEN(p);
+            oplen = 2;
+        }
+
+        if (index <= first+span-1) break;
+        prev = p;
+        p += oplen;
+        first += span;
+    }
+    if (span == 0 || p >= end) return -1; /* 格式错误 */
+
+    next = HLL_SPARSE_IS_XZERO(p) ? p+2 : p+1;
+    if (next >= end) next = NULL;
+
+    if (HLL_SPARSE_IS_ZERO(p)) {
+        is_zero = 1;
+        runlen = HLL_SPARSE_ZERO_LEN(p);
+    } else if (HLL_SPARSE_IS_XZERO(p)) {
+        is_xzero = 1;
+        runlen = HLL_SPARSE_XZERO_LEN(p);
+    } else {
+        is_val = 1;
+        runlen = HLL_SPARSE_VAL_LEN(p);
+    }
+
+    /* 2. 原地更新 */
+
+    // 情况 A: 寄存器已经有更大的值, 或者 VAL 只覆盖这一个寄存器
+    if (is_val) {
+        oldcount = HLL_SPARSE_VAL_VALUE(p);
+        if (oldcount >= count) return 0;
+
+        if (runlen == 1) {
+            HLL_SPARSE_VAL_SET(p,count,1);
+            goto updated;
+        }
+    }
+
+    // 情况 B: ZERO 只覆盖这一个寄存器
+    if (is_zero && runlen == 1) {
+        HLL_SPARSE_VAL_SET(p,count,1);
+        goto updated;
+    }
+
+    /* 3. 一般情况: 将操作码拆分为最多 3 个操作码 */
+
+    n = seq;
+    last = first+span-1;
+
+    if (is_zero || is_xzero) {
+        // ZERO 或 XZERO 拆分为 [X]ZERO-VAL-[X]ZERO
+        if (index != first) {
+            len = index-first;
+            if (len > HLL_SPARSE_ZERO_MAX_LEN) {
+                HLL_SPARSE_XZERO_SET(n,len);
+                n += 2;
+            } else {
+                HLL_SPARSE_ZERO_SET(n,len);
+                n++;
+            }
+        }
+        HLL_SPARSE_VAL_SET(n,count,1);
+        n++;
+        if (index != last) {
+            len = last-index;
+            if (len > HLL_SPARSE_ZERO_MAX_LEN) {
+                HLL_SPARSE_XZERO_SET(n,len);
+                n += 2;
+            } else {
+                HLL_SPARSE_ZERO_SET(n,len);
+                n++;
+            }
+        }
+    } else {
+        // VAL 拆分为 VAL-VAL-VAL
+        int curval = HLL_SPARSE_VAL_VALUE(p);
+
+        if (index != first) {
+            len = index-first;
+            HLL_SPARSE_VAL_SET(n,curval,len);
+            n++;
+        }
+        HLL_SPARSE_VAL_SET(n,count,1);
+        n++;
+        if (index != last) {
+            len = last-index;
+            HLL_SPARSE_VAL_SET(n,curval,len);
+            n++;
+        }
+    }
+
+    // 用新的操作码序列替换旧的操作码
+    seqlen = n-seq;
+    oldlen = is_xzero ? 2 : 1;
+    deltalen = seqlen-oldlen;
+
+    if (deltalen > 0 &&
+        sdslen(o->ptr)+deltalen > server.hll_sparse_max_bytes) goto promote;
+    if (deltalen && next) memmove(next+deltalen,next,end-next);
+    sdsIncrLen(o->ptr,deltalen);
+    memcpy(p,seq,seqlen);
+    end += deltalen;
+
+updated:
+    /* 4. 合并修改位置附近值相同的相邻 VAL 操作码 */
+
+    p = prev ? prev : sparse;
+    scanlen = 5; /* 最多检查 5 个操作码 */
+    while (p < end && scanlen--) {
+        if (HLL_SPARSE_IS_XZERO(p)) {
+            p += 2;
+            continue;
+        } else if (HLL_SPARSE_IS_ZERO(p)) {
+            p++;
+            continue;
+        }
+
+        if (p+1 < end && HLL_SPARSE_IS_VAL(p+1)) {
+            int v1 = HLL_SPARSE_VAL_VALUE(p);
+            int v2 = HLL_SPARSE_VAL_VALUE(p+1);
+
+            if (v1 == v2) {
+                int len = HLL_SPARSE_VAL_LEN(p)+HLL_SPARSE_VAL_LEN(p+1);
+
+                if (len <= HLL_SPARSE_VAL_MAX_LEN) {
+                    HLL_SPARSE_VAL_SET(p+1,v1,len);
+                    memmove(p,p+1,end-p);
+                    sdsIncrLen(o->ptr,-1);
+                    end--;
+                    // 合并后的操作码可能还能和下一个合并
+                    continue;
+                }
+            }
+        }
+        p++;
+    }
+
+    hdr = o->ptr;
+    HLL_INVALIDATE_CACHE(hdr);
+    return 1;
+
+promote:
+    if (hllSparseToDense(o) == REDIS_ERR) return -1;
+    hdr = o->ptr;
+
+    return hllDenseSet(hdr->registers,index,count);
+}
+
+/*
+ * 将元素 ele 添加到稀疏编码的 HLL 对象 o 中
+ *
+ * 返回值同 hllSparseSet()
+ */
+int hllSparseAdd(robj *o, unsigned char *ele, size_t elesize) {
+    long index;
+    uint8_t count = hllPatLen(ele,elesize,&index);
+
+    return hllSparseSet(o,index,count);
+}
+
+/*
+ * 统计稀疏编码的寄存器值的直方图, 累加到 reghisto
+ *
+ * 操作码覆盖的寄存器数量不为 HLL_REGISTERS 时, 将 *invalid 设为 1
+ *
+ * T = O(N), N 为稀疏表示的长度
+ */
+void hllSparseRegHisto(uint8_t *sparse, int sparselen, int *invalid, int *reghisto) {
+    int idx = 0, runlen, regval;
+    uint8_t *end = sparse+sparselen, *p = sparse;
+
+    while(p < end) {
+        if (HLL_SPARSE_IS_ZERO(p)) {
+            runlen = HLL_SPARSE_ZERO_LEN(p);
+            idx += runlen;
+            reghisto[0] += runlen;
+            p++;
+        } else if (HLL_SPARSE_IS_XZERO(p)) {
+            runlen = HLL_SPARSE_XZERO_LEN(p);
+            idx += runlen;
+            reghisto[0] += runlen;
+            p += 2;
+        } else {
+            runlen = HLL_SPARSE_VAL_LEN(p);
+            regval = HLL_SPARSE_VAL_VALUE(p);
+            idx += runlen;
+            reghisto[regval] += runlen;
+            p++;
+        }
+    }
+    if (idx != HLL_REGISTERS && invalid) *invalid = 1;
+}
+
+/*------------------------------- RAW 编码操作 ---------------------------------*/
+
+/*
+ * 统计 HLL_RAW 编码的寄存器值的直方图, 累加到 reghisto
+ *
+ * 以 8 字节为单位跳过全 0 的寄存器
+ *
+ * T = O(M), M 为寄存器数量
+ */
+void hllRawRegHisto(uint8_t *registers, int *reghisto) {
+    uint8_t *bytes = registers;
+    uint64_t word;
+    int j, k;
+
+    for (j = 0; j < HLL_REGISTERS/8; j++) {
+        memcpy(&word,bytes,sizeof(word));
+        if (word == 0) {
+            reghisto[0] += 8;
+        } else {
+            for (k = 0; k < 8; k++) reghisto[bytes[k]]++;
+        }
+        bytes += 8;
+    }
+}
+
+/*---------------------------------- 估算 -------------------------------------*/
+
+/*
+ * sigma(x) = x + sum(x^(2^k) * 2^(k-1)), k 从 1 到无穷
+ *
+ * 用于修正值为 0 的寄存器
+ */
+double hllSigma(double x) {
+    double zPrime;
+    double y = 1;
+    double z = x;
+
+    if (x == 1.) return INFINITY;
+
+    do {
+        x *= x;
+        zPrime = z;
+        z += x * y;
+        y += y;
+    } while(zPrime != z);
+
+    return z;
+}
+
+/*
+ * tau(x) = (1 - x - sum((1 - x^(2^-k))^2 * 2^-k)) / 3, k 从 1 到无穷
+ *
+ * 用于修正值为 HLL_Q+1 (饱和) 的寄存器
+ */
+double hllTau(double x) {
+    double zPrime;
+    double y = 1.0;
+    double z = 1 - x;
+
+    if (x == 0. || x == 1.) return 0.;
+
+    do {
+        x = sqrt(x);
+        zPrime = z;
+        y *= 0.5;
+        z -= pow(1 - x, 2)*y;
+    } while(zPrime != z);
+
+    return z / 3;
+}
+
+/*
+ * 返回 HLL 的基数估算值
+ *
+ * 先统计寄存器值的直方图, 再按直方图计算调和平均数,
+ * 计算量只和直方图的大小 (HLL_Q+2) 有关, 与寄存器数量无关
+ *
+ * 稀疏表示损坏时将 *invalid 设为 1 (invalid 为 NULL 时不检查)
+ *
+ * T = O(M), M 为寄存器数量
+ */
+uint64_t hllCount(struct hllhdr *hdr, int *invalid) {
+    double m = HLL_REGISTERS;
+    double z;
+    int j;
+    int reghisto[64] = {0};
+
+    // 计算寄存器值的直方图
+    if (hdr->encoding == HLL_DENSE) {
+        hllDenseRegHisto(hdr->registers,reghisto);
+    } else if (hdr->encoding == HLL_SPARSE) {
+        hllSparseRegHisto(hdr->registers,
+            sdslen((sds)hdr)-HLL_HDR_SIZE,invalid,reghisto);
+    } else if (hdr->encoding == HLL_RAW) {
+        hllRawRegHisto(hdr->registers,reghisto);
+    } else {
+        redisPanic("Unknown HyperLogLog encoding in hllCount()");
+    }
+
+    // 按直方图计算 sum(2^-reg), 并修正饱和与为 0 的寄存器
+    z = m * hllTau((m-reghisto[HLL_Q+1])/(double)m);
+    for (j = HLL_Q; j >= 1; --j) {
+        z += reghisto[j];
+        z *= 0.5;
+    }
+    z += m * hllSigma(reghisto[0]/(double)m);
+
+    return (uint64_t) llroundl(HLL_ALPHA_INF*m*m/z);
+}
+
+/*
+ * 将元素 ele 添加到 HLL 对象 o 中
+ *
+ * 寄存器被更新返回 1, 没有更新返回 0, 对象损坏时返回 -1
+ */
+int hllAdd(robj *o, unsigned char *ele, size_t elesize) {
+    struct hllhdr *hdr = o->ptr;
+
+    switch(hdr->encoding) {
+    case HLL_DENSE: return hllDenseAdd(hdr->registers,ele,elesize);
+    case HLL_SPARSE: return hllSparseAdd(o,ele,elesize);
+    default: return -1; /* 编码错误 */
+    }
+}
+
+/*
+ * 将 HLL 对象 hll 的寄存器合并到 max 中,
+ * max 每个字节保存一个寄存器, 合并后每个寄存器为两者的最大值
+ *
+ * 成功返回 REDIS_OK, 稀疏表示损坏时返回 REDIS_ERR
+ *
+ * T = O(M), M 为寄存器数量
+ */
+int hllMerge(uint8_t *max, robj *hll) {
+    struct hllhdr *hdr = hll->ptr;
+    int i, k;
+
+    if (hdr->encoding == HLL_DENSE) {
+        uint8_t regs[HLL_DENSE_BATCH];
+        uint8_t *r = hdr->registers;
+
+        // 每批解码 16 个寄存器, 再逐字节取最大值
+        for (i = 0; i < HLL_REGISTERS; i += HLL_DENSE_BATCH) {
+            hllDenseDecodeBatch(r,regs);
+            for (k = 0; k < HLL_DENSE_BATCH; k++)
+                max[i+k] = max[i+k] > regs[k] ? max[i+k] : regs[k];
+            r += HLL_DENSE_BATCH_BYTES;
+        }
+    } else {
+        uint8_t *p = hll->ptr, *end = p + sdslen(hll->ptr);
+        long runlen, regval;
+
+        p += HLL_HDR_SIZE;
+        i = 0;
+        while(p < end) {
+            if (HLL_SPARSE_IS_ZERO(p)) {
+                runlen = HLL_SPARSE_ZERO_LEN(p);
+                i += runlen;
+                p++;
+            } else if (HLL_SPARSE_IS_XZERO(p)) {
+                runlen = HLL_SPARSE_XZERO_LEN(p);
+                i += runlen;
+                p += 2;
+            } else {
+                runlen = HLL_SPARSE_VAL_LEN(p);
+                regval = HLL_SPARSE_VAL_VALUE(p);
+                if ((runlen + i) > HLL_REGISTERS) break; /* 溢出 */
+                while(runlen--) {
+                    if (regval > max[i]) max[i] = regval;
+                    i++;
+                }
+                p++;
+            }
+        }
+        if (i != HLL_REGISTERS) return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+/*
+ * 用 max 中的寄存器 (每个字节一个) 覆盖稠密编码的寄存器
+ *
+ * T = O(M), M 为寄存器数量
+ */
+static void hllDenseStoreRaw(uint8_t *registers, uint8_t *max) {
+    int i;
+
+    for (i = 0; i < HLL_REGISTERS; i += HLL_DENSE_BATCH) {
+        hllDenseEncodeBatch(registers,max+i);
+        registers += HLL_DENSE_BATCH_BYTES;
+    }
+}
+
+/*--------------------------------- 命令实现 -----------------------------------*/
+
+/*
+ * 创建一个空的 HLL 对象, 使用稀疏编码
+ *
+ * 所有寄存器用 XZERO 操作码表示, 16384 个寄存器只需要 1 个操作码
+ */
+robj *createHLLObject(void) {
+    struct hllhdr *hdr;
+    sds s;
+    uint8_t *p;
+    int sparselen = HLL_HDR_SIZE +
+                    (((HLL_REGISTERS+(HLL_SPARSE_XZERO_MAX_LEN-1)) /
+                     HLL_SPARSE_XZERO_MAX_LEN)*2);
+    int aux;
+
+    // sdsnewlen 会将内容清零, 基数缓存为 0 且有效
+    s = sdsnewlen(NULL,sparselen);
+    p = (uint8_t*)s + HLL_HDR_SIZE;
+    aux = HLL_REGISTERS;
+    while(aux) {
+        int xzero = HLL_SPARSE_XZERO_MAX_LEN;
+
+        if (xzero > aux) xzero = aux;
+        HLL_SPARSE_XZERO_SET(p,xzero);
+        p += 2;
+        aux -= xzero;
+    }
+    redisAssert((p-(uint8_t*)s) == sparselen);
+
+    hdr = (struct hllhdr*) s;
+    memcpy(hdr->magic,"HYLL",4);
+    hdr->encoding = HLL_SPARSE;
+
+    return createObject(REDIS_STRING,s);
+}
+
+/*
+ * 检查对象 o 是否为 HLL,
+ * 是返回 REDIS_OK, 否则向客户端回复错误并返回 REDIS_ERR
+ *
+ * 只检查头部, 不检查稀疏表示是否完整
+ */
+int isHLLObjectOrReply(redisClient *c, robj *o) {
+    struct hllhdr *hdr;
+
+    if (checkType(c,o,REDIS_STRING))
+        return REDIS_ERR;
+
+    if (!sdsEncodedObject(o)) goto invalid;
+    if (stringObjectLen(o) < sizeof(*hdr)) goto invalid;
+    hdr = o->ptr;
+
+    // 魔数
+    if (hdr->magic[0] != 'H' || hdr->magic[1] != 'Y' ||
+        hdr->magic[2] != 'L' || hdr->magic[3] != 'L') goto invalid;
+
+    if (hdr->encoding > HLL_MAX_ENCODING) goto invalid;
+
+    // 稠密编码的长度是固定的
+    if (hdr->encoding == HLL_DENSE &&
+        stringObjectLen(o) != HLL_DENSE_SIZE) goto invalid;
+
+    return REDIS_OK;
+
+invalid:
+    addReplyString(c,wrongtype_hll_err,strlen(wrongtype_hll_err));
+    return REDIS_ERR;
+}
+
+/*
+ * PFADD key element [element ...]
+ *
+ * 至少一个寄存器被更新 (或者新建了键) 时返回 1, 否则返回 0
+ */
+void pfaddCommand(redisClient *c) {
+    robj *o = lookupKeyWrite(c->db,c->argv[1]);
+    struct hllhdr *hdr;
+    int updated = 0, j;
+
+    if (o == NULL) {
+        // 键不存在, 创建一个空的 HLL
+        o = createHLLObject();
+        dbAdd(c->db,c->argv[1],o);
+        updated++;
+    } else {
+        if (isHLLObjectOrReply(c,o) != REDIS_OK) return;
+        o = dbUnshareStringValue(c->db,c->argv[1],o);
+    }
+
+    for (j = 2; j < c->argc; j++) {
+        robj *ele = getDecodedObject(c->argv[j]);
+        int retval = hllAdd(o,(unsigned char*)ele->ptr,sdslen(ele->ptr));
+
+        decrRefCount(ele);
+        switch(retval) {
+        case 1:
+            updated++;
+            break;
+        case -1:
+            addReplyString(c,invalid_hll_err,strlen(invalid_hll_err));
+            return;
+        }
+    }
+
+    hdr = o->ptr;
+    if (updated) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"pfadd",c->argv[1],c->db->id);
+        server.dirty++;
+        HLL_INVALIDATE_CACHE(hdr);
+    }
+    addReply(c, updated ? shared.cone : shared.czero);
+}
+
+/*
+ * PFCOUNT key [key ...]
+ *
+ * 单个键时使用并更新基数缓存,
+ * 多个键时先将所有 HLL 合并到一个 HLL_RAW 编码的临时 HLL, 再估算其基数
+ */
+void pfcountCommand(redisClient *c) {
+    robj *o;
+    struct hllhdr *hdr;
+    uint64_t card;
+
+    if (c->argc > 2) {
+        uint8_t max[HLL_HDR_SIZE+HLL_REGISTERS], *registers;
+        int j;
+
+        memset(max,0,sizeof(max));
+        hdr = (struct hllhdr*) max;
+        hdr->encoding = HLL_RAW;
+        registers = max + HLL_HDR_SIZE;
+
+        for (j = 1; j < c->argc; j++) {
+            o = lookupKeyRead(c->db,c->argv[j]);
+            if (o == NULL) continue; /* 不存在的键视为空 HLL */
+            if (isHLLObjectOrReply(c,o) != REDIS_OK) return;
+
+            if (hllMerge(registers,o) == REDIS_ERR) {
+                addReplyString(c,invalid_hll_err,strlen(invalid_hll_err));
+                return;
+            }
+        }
+
+        addReplyLongLong(c,hllCount(hdr,NULL));
+        return;
+    }
+
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o == NULL) {
+        addReply(c,shared.czero);
+        return;
+    }
+    if (isHLLObjectOrReply(c,o) != REDIS_OK) return;
+    // 需要写入基数缓存
+    o = dbUnshareStringValue(c->db,c->argv[1],o);
+
+    hdr = o->ptr;
+    if (HLL_VALID_CACHE(hdr)) {
+        // 使用缓存的基数
+        card = (uint64_t)hdr->card[0];
+        card |= (uint64_t)hdr->card[1] << 8;
+        card |= (uint64_t)hdr->card[2] << 16;
+        card |= (uint64_t)hdr->card[3] << 24;
+        card |= (uint64_t)hdr->card[4] << 32;
+        card |= (uint64_t)hdr->card[5] << 40;
+        card |= (uint64_t)hdr->card[6] << 48;
+        card |= (uint64_t)hdr->card[7] << 56;
+    } else {
+        int invalid = 0;
+
+        // 重新估算基数并更新缓存
+        card = hllCount(hdr,&invalid);
+        if (invalid) {
+            addReplyString(c,invalid_hll_err,strlen(invalid_hll_err));
+            return;
+        }
+        hdr->card[0] = card & 0xff;
+        hdr->card[1] = (card >> 8) & 0xff;
+        hdr->card[2] = (card >> 16) & 0xff;
+        hdr->card[3] = (card >> 24) & 0xff;
+        hdr->card[4] = (card >> 32) & 0xff;
+        hdr->card[5] = (card >> 40) & 0xff;
+        hdr->card[6] = (card >> 48) & 0xff;
+        hdr->card[7] = (card >> 56) & 0xff;
+
+        // 缓存是值的一部分, 需要传播给从服务器和 AOF
+        signalModifiedKey(c->db,c->argv[1]);
+        server.dirty++;
+    }
+    addReplyLongLong(c,card);
+}
+
+/*
+ * PFMERGE destkey sourcekey [sourcekey ...]
+ *
+ * 将所有 HLL (包括 destkey 本身) 合并后保存到 destkey
+ */
+void pfmergeCommand(redisClient *c) {
+    uint8_t max[HLL_REGISTERS];
+    struct hllhdr *hdr;
+    robj *o;
+    int j;
+    int use_dense = 0; /* 任一输入为稠密编码时, 结果使用稠密编码 */
+
+    memset(max,0,sizeof(max));
+    for (j = 1; j < c->argc; j++) {
+        o = lookupKeyRead(c->db,c->argv[j]);
+        if (o == NULL) continue; /* 不存在的键视为空 HLL */
+        if (isHLLObjectOrReply(c,o) != REDIS_OK) return;
+
+        hdr = o->ptr;
+        if (hdr->encoding == HLL_DENSE) use_dense = 1;
+
+        if (hllMerge(max,o) == REDIS_ERR) {
+            addReplyString(c,invalid_hll_err,strlen(invalid_hll_err));
+            return;
+        }
+    }
+
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o == NULL) {
+        o = createHLLObject();
+        dbAdd(c->db,c->argv[1],o);
+    } else {
+        o = dbUnshareStringValue(c->db,c->argv[1],o);
+    }
+
+    if (use_dense && hllSparseToDense(o) == REDIS_ERR) {
+        addReplyString(c,invalid_hll_err,strlen(invalid_hll_err));
+        return;
+    }
+
+    hdr = o->ptr;
+    if (hdr->encoding == HLL_DENSE) {
+        // 合并结果已经包含 destkey 原有的寄存器, 直接整体覆盖
+        hllDenseStoreRaw(hdr->registers,max);
+    } else {
+        // 稀疏编码只需要设置非 0 的寄存器, 途中可能转换为稠密编码
+        for (j = 0; j < HLL_REGISTERS; j++) {
+            if (max[j] == 0) continue;
+            hdr = o->ptr;
+            if (hdr->encoding == HLL_DENSE)
+                hllDenseSet(hdr->registers,j,max[j]);
+            else
+                hllSparseSet(o,j,max[j]);
+        }
+    }
+
+    hdr = o->ptr;
+    HLL_INVALIDATE_CACHE(hdr);
+
+    signalModifiedKey(c->db,c->argv[1]);
+    notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"pfadd",c->argv[1],c->db->id);
+    server.dirty++;
+    addReply(c,shared.ok);
+}
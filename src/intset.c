@@ -9,6 +9,7 @@
 #include "intset.h"
 #include "zmalloc.h"
 #include "endianconv.h"
+#include "rand.h"
 #include <sys/time.h>
 
 /**
@@ -411,7 +412,7 @@ uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value) {
  * T = O(1)
  */
 int64_t intsetRandom(intset *is) {
-    return _intsetGet(is, rand()%intrev32ifbe(is->length));
+    return _intsetGet(is, redisRandomBelow(intrev32ifbe(is->length)));
 }
 
 /**
@@ -431,6 +432,35 @@ size_t intsetBlobLen(intset *is) {
     return sizeof(intset)+intrev32ifbe(is->length)*intrev32ifbe(is->encoding);
 }
 
+/**
+ * 用从小到大排序并且没有重复元素的 values 数组创建整数集合
+ *
+ * 编码由最小值和最大值一次确定, 内存也只分配一次,
+ * 不需要像 intsetAdd 那样逐个查找、扩容和升级
+ *
+ * T = O(N)
+ */
+intset *intsetNewFromSorted(const int64_t *values, uint32_t len) {
+    intset *is = intsetNew();
+    uint8_t enc, maxenc;
+    uint32_t i;
+
+    if (len == 0) return is;
+
+    // 最小值和最大值中需要的编码较大者, 就是整个集合的编码
+    enc = _intsetValueEncoding(values[0]);
+    maxenc = _intsetValueEncoding(values[len-1]);
+    if (maxenc > enc) enc = maxenc;
+
+    is->encoding = intrev32ifbe(enc);
+    is = intsetResize(is,len);
+    for (i = 0; i < len; i++)
+        _intsetSet(is,i,values[i]);
+    is->length = intrev32ifbe(len);
+
+    return is;
+}
+
 #ifdef INTSET_TEST_MAIN
 
 /*---------------------  --------------------*/
@@ -503,7 +533,7 @@ void checkConsistency(intset *is) {
     }
 }
 
-// gcc -g zmalloc.c intset.c -D INTSET_TEST_MAIN
+// gcc -g zmalloc.c rand.c intset.c -D INTSET_TEST_MAIN
 int main(void) {
 
     uint8_t success;
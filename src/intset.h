@@ -16,6 +16,7 @@ typedef struct intset
 } intset;
 
 intset *intsetNew(void);
+intset *intsetNewFromSorted(const int64_t *values, uint32_t len);
 intset *intsetAdd(intset *is, int64_t value, uint8_t *success);
 intset *intsetRemove(intset *is, int64_t value, int *success);
 uint8_t intsetFind(intset *is, int64_t value);
@@ -0,0 +1,402 @@
+/*
+ * 惰性释放
+ *
+ * 释放一个包含上千万元素的集合、哈希或有序集合需要逐个释放元素,
+ * 会阻塞服务器几百毫秒。
+ *
+ * 这里先估算释放一个值对象的代价 (需要释放的内存块数量),
+ * 代价超过 server.lazyfree_threshold 的值会先从数据库中摘除,
+ * 再交给 bio 的 REDIS_BIO_LAZY_FREE 线程释放, 主线程只需要 O(1) 时间。
+ *
+ * 提交给后台线程的对象必须只被数据库引用:
+ * 后台线程不能修改与主线程共享的对象的引用计数,
+ * 共享对象的引用计数为 REDIS_SHARED_REFCOUNT, 不会被修改。
+ */
+
+#include "redis.h"
+#include "bio.h"
+
+// 等待后台释放的对象数量, 以及这些对象的释放代价之和
+static size_t lazyfree_objects = 0;
+static size_t lazyfree_effort = 0;
+
+// 已经由后台线程释放的对象数量
+static size_t lazyfreed_objects = 0;
+
+static pthread_mutex_t lazyfree_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// 当前线程是否为执行惰性释放的后台线程
+static __thread int lazyfree_in_background = 0;
+
+// 交给后台线程释放的数据库
+typedef struct lazyfreeDb {
+    dict *dict;
+    dict *expires;
+} lazyfreeDb;
+
+/*
+ * 返回释放对象 obj 的代价, 也即是需要释放的内存块的数量
+ *
+ * 使用单块内存的编码 (ziplist, intset, 字符串) 的代价总是 1
+ *
+ * T = O(1)
+ */
+size_t lazyfreeGetFreeEffort(robj *obj) {
+    if (obj->type == REDIS_LIST && obj->encoding == REDIS_ENCODING_QUICKLIST) {
+        return ((quicklist*)obj->ptr)->len;
+
+    } else if (obj->type == REDIS_SET && obj->encoding == REDIS_ENCODING_HT) {
+        return dictSize((dict*)obj->ptr);
+
+    } else if (obj->type == REDIS_ZSET && obj->encoding == REDIS_ENCODING_SKIPLIST) {
+        return ((zset*)obj->ptr)->zsl->length;
+
+    } else if (obj->type == REDIS_ZSET && obj->encoding == REDIS_ENCODING_BTREE) {
+        return ((zset*)obj->ptr)->zbt->length;
+
+    } else if (obj->type == REDIS_HASH && obj->encoding == REDIS_ENCODING_HT) {
+        return dictSize((dict*)obj->ptr);
+
+    } else {
+        return 1;
+    }
+}
+
+/*
+ * 记录一个提交给后台线程的释放任务
+ */
+static void lazyfreeAddPending(size_t effort) {
+    pthread_mutex_lock(&lazyfree_mutex);
+    lazyfree_objects++;
+    lazyfree_effort += effort;
+    pthread_mutex_unlock(&lazyfree_mutex);
+}
+
+/*
+ * 记录一个已经完成的释放任务
+ */
+static void lazyfreeDonePending(size_t effort) {
+    pthread_mutex_lock(&lazyfree_mutex);
+    lazyfree_objects--;
+    lazyfree_effort -= effort;
+    lazyfreed_objects++;
+    pthread_mutex_unlock(&lazyfree_mutex);
+}
+
+/*
+ * 返回等待后台释放的对象数量
+ */
+size_t lazyfreeGetPendingObjectsCount(void) {
+    size_t count;
+
+    pthread_mutex_lock(&lazyfree_mutex);
+    count = lazyfree_objects;
+    pthread_mutex_unlock(&lazyfree_mutex);
+
+    return count;
+}
+
+/*
+ * 返回等待后台释放的对象的释放代价之和
+ */
+size_t lazyfreeGetPendingEffort(void) {
+    size_t effort;
+
+    pthread_mutex_lock(&lazyfree_mutex);
+    effort = lazyfree_effort;
+    pthread_mutex_unlock(&lazyfree_mutex);
+
+    return effort;
+}
+
+/*
+ * 返回已经由后台线程释放的对象数量
+ */
+size_t lazyfreeGetFreedObjectsCount(void) {
+    size_t count;
+
+    pthread_mutex_lock(&lazyfree_mutex);
+    count = lazyfreed_objects;
+    pthread_mutex_unlock(&lazyfree_mutex);
+
+    return count;
+}
+
+/*
+ * 当前线程是否正在执行惰性释放
+ *
+ * 只属于主线程的状态 (比如有序集合的 ziplist 索引缓存)
+ * 在后台线程释放对象时不能访问
+ */
+int lazyfreeInBackground(void) {
+    return lazyfree_in_background;
+}
+
+/*
+ * 后台线程: 释放一个对象
+ */
+static void lazyfreeFreeObject(void *arg) {
+    robj *o = arg;
+    size_t effort = lazyfreeGetFreeEffort(o);
+
+    lazyfree_in_background = 1;
+    decrRefCount(o);
+    lazyfree_in_background = 0;
+
+    lazyfreeDonePending(effort);
+}
+
+/*
+ * 后台线程: 释放一个数据库的键空间和过期字典
+ */
+static void lazyfreeFreeDatabase(void *arg) {
+    lazyfreeDb *ldb = arg;
+    size_t effort = dictSize(ldb->dict);
+
+    lazyfree_in_background = 1;
+    dictRelease(ldb->dict);
+    dictRelease(ldb->expires);
+    lazyfree_in_background = 0;
+
+    zfree(ldb);
+    lazyfreeDonePending(effort);
+}
+
+/*
+ * 从数据库中删除键 key,
+ * 如果值对象的释放代价超过 server.lazyfree_threshold, 那么交给后台线程释放
+ *
+ * 只有引用计数为 1 (只被数据库引用) 的值才能交给后台线程,
+ * 其他值即使很大也在主线程同步释放 (只是减少引用计数)。
+ * 命令创建的列表、集合、哈希和有序集合引用计数都为 1 ,
+ * 所以大的聚合值总是在后台释放; 引用计数大于 1 的通常是
+ * 还被客户端参数 (argv) 引用的字符串值或者共享对象, 它们的释放代价都是 1 。
+ * 见文件末尾 LAZYFREE_TEST_MAIN 的测试
+ *
+ * 删除成功返回 1, 键不存在返回 0
+ *
+ * T = O(1)
+ */
+int dbAsyncDelete(redisDb *db, robj *key) {
+    dictEntry *de;
+    robj *val;
+    void *k;
+    size_t effort;
+
+    // 删除过期时间, 过期字典和键空间共享键, 不会释放键
+    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+
+    if ((de = dictFind(db->dict,key->ptr)) == NULL) return 0;
+
+    val = dictGetVal(de);
+    effort = lazyfreeGetFreeEffort(val);
+
+    // 代价太小, 对象还被其他地方引用, 或者后台线程还没有启动
+    // (zmalloc 尚未切换到线程安全的计数), 直接同步删除
+    if (!server.lazyfree_threshold || effort <= server.lazyfree_threshold ||
+        val->refcount != 1 || !bioLazyFreeEnabled())
+    {
+        dictDelete(db->dict,key->ptr);
+        if (server.cluster_enabled) slotToKeyDel(key);
+        return 1;
+    }
+
+    // 将值对象从键空间中摘除, 只在主线程释放键
+    k = dictGetKey(de);
+    dictDeleteNoFree(db->dict,key->ptr);
+
+    // 后台线程不会访问域的过期索引, 在提交前移除
+    if (val->type == REDIS_HASH) hashTypeClearFieldExpires(val);
+    if (db->dict->type->keyDestructor)
+        db->dict->type->keyDestructor(db->dict->privdata,k);
+
+    if (server.cluster_enabled) slotToKeyDel(key);
+
+    lazyfreeAddPending(effort);
+    bioCreateLazyFreeJob(lazyfreeFreeObject,val);
+
+    return 1;
+}
+
+/*
+ * 用空字典替换数据库 db 的键空间和过期字典,
+ * 旧的字典交给后台线程释放
+ *
+ * T = O(1)
+ */
+void emptyDbAsync(redisDb *db) {
+    lazyfreeDb *ldb = zmalloc(sizeof(*ldb));
+
+    ldb->dict = db->dict;
+    ldb->expires = db->expires;
+
+    db->dict = dictCreate(ldb->dict->type,ldb->dict->privdata);
+    db->expires = dictCreate(ldb->expires->type,ldb->expires->privdata);
+
+    // 后台线程释放 ziplist 编码的有序集合和哈希时不会访问索引和指纹缓存,
+    // 所以需要在提交前删除这个数据库的缓存项, 避免留下指向已释放 ziplist 的索引,
+    // 其他数据库的缓存项不受影响
+    zzlIndexResetDb(db->id);
+    hzlFingerprintResetDb(db->id);
+    hashTypeClearDbFieldExpires(db);
+
+    lazyfreeAddPending(dictSize(ldb->dict));
+    bioCreateLazyFreeJob(lazyfreeFreeDatabase,ldb);
+}
+
+#ifdef LAZYFREE_TEST_MAIN
+/*
+ * dbAsyncDelete 的测试: 小的键同步释放, 大的键交给后台线程释放
+ *
+ * ziplist.c, object.c 和 adlist.c 的 main 没有用宏保护, 先重命名后单独编译:
+ * gcc -g -c -Dmain=ziplist_main ziplist.c
+ * gcc -g -c -Dmain=object_main object.c
+ * gcc -g -c -Dmain=adlist_main adlist.c
+ * gcc -g -DLAZYFREE_TEST_MAIN lazyfree.c bio.c networking.c redis.c quicklist.c sds.c \
+ *     zmalloc.c util.c dict.c intset.c lzf_c.c lzf_d.c rand.c ziplist.o object.o adlist.o \
+ *     -lm -lpthread
+ */
+#include <unistd.h>
+
+/*
+ * 以下是 lazyfree.c, bio.c 和 object.c 引用的服务器函数,
+ * 测试不会调用它们, 只为了链接
+ */
+void _redisAssert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+void redisLog(int level, const char *fmt, ...) { REDIS_NOTUSED(level); REDIS_NOTUSED(fmt); }
+unsigned int dictGenHashFunction(const void *key, int len) {
+    REDIS_NOTUSED(key); REDIS_NOTUSED(len); return 0;
+}
+void dictEnableResize(void) {}
+void dictDisableResize(void) {}
+void slotToKeyDel(robj *key) { REDIS_NOTUSED(key); }
+void hashEntryFree(sds entry) { REDIS_NOTUSED(entry); }
+void hashTypeClearFieldExpires(robj *o) { REDIS_NOTUSED(o); }
+void hashTypeClearDbFieldExpires(redisDb *db) { REDIS_NOTUSED(db); }
+void hzlFingerprintInvalidate(unsigned char *zl) { REDIS_NOTUSED(zl); }
+void hzlFingerprintResetDb(int dbid) { REDIS_NOTUSED(dbid); }
+void zzlIndexInvalidate(unsigned char *zl) { REDIS_NOTUSED(zl); }
+void zzlIndexResetDb(int dbid) { REDIS_NOTUSED(dbid); }
+zskiplist *zslCreate(void) { return NULL; }
+void zslFree(zskiplist *zsl) { REDIS_NOTUSED(zsl); }
+void zbtFree(zbtree *zbt) { REDIS_NOTUSED(zbt); }
+
+/* 测试用的键空间: 键为 sds, 值为对象 */
+static unsigned int lazyfreeTestHash(const void *key) {
+    const unsigned char *p = key;
+    size_t len = sdslen((sds)key);
+    unsigned int h = 5381;
+
+    while (len--) h = h*33 + *p++;
+    return h;
+}
+
+static int lazyfreeTestKeyCompare(void *privdata, const void *key1, const void *key2) {
+    REDIS_NOTUSED(privdata);
+    return sdslen((sds)key1) == sdslen((sds)key2) &&
+           memcmp(key1,key2,sdslen((sds)key1)) == 0;
+}
+
+static void lazyfreeTestKeyDestructor(void *privdata, void *key) {
+    REDIS_NOTUSED(privdata);
+    sdsfree(key);
+}
+
+static void lazyfreeTestValDestructor(void *privdata, void *val) {
+    REDIS_NOTUSED(privdata);
+    decrRefCount(val);
+}
+
+static dictType lazyfreeTestDictType = {
+    lazyfreeTestHash, NULL, NULL, lazyfreeTestKeyCompare,
+    lazyfreeTestKeyDestructor, lazyfreeTestValDestructor
+};
+
+static dictType lazyfreeTestExpiresDictType = {
+    lazyfreeTestHash, NULL, NULL, lazyfreeTestKeyCompare, NULL, NULL
+};
+
+/* 添加一个有 nodes 个节点的列表, 释放代价为 nodes */
+static void lazyfreeTestAddList(redisDb *db, char *key, long nodes) {
+    robj *o = createQuicklistObject();
+    long j;
+
+    for (j = 0; j < nodes; j++) quicklistPushTail(o->ptr,"x",1);
+    dictAdd(db->dict,sdsnew(key),o);
+}
+
+/* 等待后台线程释放完所有对象, 最多等待 10 秒 */
+static int lazyfreeTestWait(void) {
+    int j;
+
+    for (j = 0; j < 10000 && lazyfreeGetPendingObjectsCount() > 0; j++)
+        usleep(1000);
+    return lazyfreeGetPendingObjectsCount() == 0;
+}
+
+int main(void) {
+    redisDb db;
+    robj *key;
+    int failed = 0, ok;
+
+    server.list_quicklist_fill = 1;     // 每个节点一个元素
+    server.list_compress_depth = 0;
+    server.lazyfree_threshold = 64;
+    server.cluster_enabled = 0;
+
+    db.dict = dictCreate(&lazyfreeTestDictType,NULL);
+    db.expires = dictCreate(&lazyfreeTestExpiresDictType,NULL);
+    db.id = 0;
+
+    bioInit();
+
+    printf("Small key is freed synchronously: ");
+    {
+        lazyfreeTestAddList(&db,"small",8);
+        key = createStringObject("small",5);
+        ok = dbAsyncDelete(&db,key) == 1 &&
+             dictFind(db.dict,key->ptr) == NULL &&
+             lazyfreeGetPendingObjectsCount() == 0 &&
+             lazyfreeGetFreedObjectsCount() == 0;
+        decrRefCount(key);
+        printf("%s\n", ok ? "OK" : "FAILED");
+        if (!ok) failed++;
+    }
+
+    printf("Large key is freed in the background: ");
+    {
+        lazyfreeTestAddList(&db,"large",100000);
+        key = createStringObject("large",5);
+        ok = dbAsyncDelete(&db,key) == 1 && dictFind(db.dict,key->ptr) == NULL;
+        ok = lazyfreeTestWait() && ok &&
+             lazyfreeGetFreedObjectsCount() == 1 &&
+             lazyfreeGetPendingEffort() == 0;
+        decrRefCount(key);
+        printf("%s\n", ok ? "OK" : "FAILED");
+        if (!ok) failed++;
+    }
+
+    printf("Large key still referenced elsewhere is freed synchronously: ");
+    {
+        robj *val;
+
+        lazyfreeTestAddList(&db,"shared",100000);
+        key = createStringObject("shared",6);
+        val = dictGetVal(dictFind(db.dict,key->ptr));
+        incrRefCount(val);
+        ok = dbAsyncDelete(&db,key) == 1 &&
+             lazyfreeGetPendingObjectsCount() == 0 &&
+             lazyfreeGetFreedObjectsCount() == 1 &&
+             val->refcount == 1;
+        decrRefCount(val);
+        decrRefCount(key);
+        printf("%s\n", ok ? "OK" : "FAILED");
+        if (!ok) failed++;
+    }
+
+    return failed ? 1 : 0;
+}
+#endif
@@ -11,6 +11,17 @@ void addReplyString(redisClient *c, char *s, size_t len) {
 
 }
 
+/**
+ * 将已经按协议格式拼接好的 sds 作为回复, 并接管 s 的所有权
+ * 调用者之后不能再使用 s
+ */
+void addReplySds(redisClient *c, sds s) {
+    robj *o = createObject(REDIS_STRING, s);
+
+    addReply(c, o);
+    decrRefCount(o);
+}
+
 /**
  * 向客户端回复一个错误
  * 
@@ -36,6 +47,18 @@ void addReplyBulkCBuffer(redisClient *c, void *p, size_t len) {
 
 }
 
+/**
+ * 以批量回复的形式返回一个整数
+ * 格式：$5\r\n10086\r\n
+ */
+void addReplyBulkLongLong(redisClient *c, long long ll) {
+    char buf[64];
+    int len;
+
+    len = ll2string(buf,sizeof(buf),ll);
+    addReplyBulkCBuffer(c,buf,len);
+}
+
 /**
  * 返回一个 C 字符串作为回复
  */
@@ -84,3 +107,15 @@ void rewriteClientCommandVector(redisClient *c, int argc, ...) {
 
 }
 
+// 用 argv 替换客户端的参数数组, argv 的所有权转交给客户端
+void replaceClientCommandVector(redisClient *c, int argc, robj **argv) {
+    int j;
+
+    for (j = 0; j < c->argc; j++)
+        decrRefCount(c->argv[j]);
+    zfree(c->argv);
+
+    c->argv = argv;
+    c->argc = argc;
+}
+
@@ -142,12 +142,13 @@ robj *createStringObjectFromLongLong(long long value) {
 
     robj *o;
 
-    // value 的大小符合 REDIS共享整数的范围
-    // 返回共享对象
-    if (value >= 0 && value < REDIS_SHARED_INTEGERS) {
-        
-        // incrRefCount(shared.integers[value]);
-        // o = shared.integers[value];
+    // value 的大小符合 REDIS共享整数的范围, 并且共享整数已经创建
+    // (见 createSharedObjects), 返回共享对象
+    if (value >= 0 && value < REDIS_SHARED_INTEGERS &&
+        shared.integers[value] != NULL)
+    {
+        incrRefCount(shared.integers[value]);
+        o = shared.integers[value];
     // 不符合共享范围, 创建一个新的整数对象
     } else {
 
@@ -221,18 +222,16 @@ robj *dupStringObject(robj *o) {
 }
 
 /**
- * 创建一个 LINKEDLIST 编码的列表对象
+ * 创建一个 QUICKLIST 编码的列表对象
  */
-robj *createListObject(void) {
+robj *createQuicklistObject(void) {
 
-    // 创建链表
-    list *l = listCreate();
+    // 创建快速列表
+    quicklist *l = quicklistNew(server.list_quicklist_fill, server.list_compress_depth);
     
     robj *o = createObject(REDIS_LIST, l);
 
-    listSetFreeMethod(l,decrRefCountVoid);
-
-    o->encoding = REDIS_ENCODING_LINKEDLIST;
+    o->encoding = REDIS_ENCODING_QUICKLIST;
 
     return o;
 }
@@ -304,6 +303,7 @@ robj *createZsetObject(void) {
 
     zs->dict = dictCreate(&zsetDictType, NULL);
     zs->zsl = zslCreate();
+    zs->zbt = NULL;
 
     o = createObject(REDIS_ZSET, zs);
 
@@ -341,8 +341,8 @@ void freeStringObject(robj *o) {
 void freeListObject(robj *o) {
 
     switch(o->encoding) {
-    case REDIS_ENCODING_LINKEDLIST:
-        listRelease((list*) o->ptr);
+    case REDIS_ENCODING_QUICKLIST:
+        quicklistRelease((quicklist*) o->ptr);
         break;
 
     case REDIS_ENCODING_ZIPLIST:
@@ -386,7 +386,15 @@ void freeZsetObject(robj *o) {
         zfree(zs);
         break;
 
+    case REDIS_ENCODING_BTREE:
+        zs = o->ptr;
+        dictRelease(zs->dict);
+        zbtFree(zs->zbt);
+        zfree(zs);
+        break;
+
     case REDIS_ENCODING_ZIPLIST:
+        zzlIndexInvalidate(o->ptr);
         zfree(o->ptr);
         break;
 
@@ -401,13 +409,17 @@ void freeZsetObject(robj *o) {
  * 释放有序集合对象
  */
 void freeHashObject(robj *o) {
-    
+
+    // 移除域的过期时间
+    hashTypeClearFieldExpires(o);
+
     switch(o->encoding) {
     case REDIS_ENCODING_HT:
         dictRelease((dict*)o->ptr);
         break;
 
     case REDIS_ENCODING_ZIPLIST:
+        hzlFingerprintInvalidate(o->ptr);
         zfree(o->ptr);
         break;
     default:
@@ -421,7 +433,7 @@ void freeHashObject(robj *o) {
  * 对象的引用计数加 1
  */
 void incrRefCount(robj *o) {
-    o->refcount++;
+    if (o->refcount != REDIS_SHARED_REFCOUNT) o->refcount++;
 }
 
 /**
@@ -445,10 +457,22 @@ void decrRefCount(robj *o) {
         }
         zfree(o);
     } else {
-        o->refcount--;
+        // 共享对象的引用计数不会被修改,
+        // 所以后台线程释放数据库时也可以安全地对它调用 decrRefCount
+        if (o->refcount != REDIS_SHARED_REFCOUNT) o->refcount--;
     }
 }
 
+/**
+ * 将对象设置为共享对象 (比如 shared.integers 中的对象),
+ * 共享对象永远不会被释放, 它的引用计数也不会再被修改
+ */
+robj *makeObjectShared(robj *o) {
+    if (o->refcount != 1) redisPanic("Sharing an object that is already referenced");
+    o->refcount = REDIS_SHARED_REFCOUNT;
+    return o;
+}
+
 /**
  * 特定数据结构的释放函数包装
  */
@@ -509,8 +533,10 @@ robj *tryObjectEncoding(robj *o) {
 
         // todo 还没看到 server部分
         // if (server.maxmemory == 0 && 
-        // 共享内存的整数
-        if (value >= 0 && value < REDIS_SHARED_INTEGERS) {
+        // 共享内存的整数 (共享整数已经创建时才使用)
+        if (value >= 0 && value < REDIS_SHARED_INTEGERS &&
+            shared.integers[value] != NULL)
+        {
             decrRefCount(o);
             incrRefCount(shared.integers[value]);
             return shared.integers[value];
@@ -917,6 +943,8 @@ char *strEncoding(int encoding) {
     case REDIS_ENCODING_INTSET: return "intset";
     case REDIS_ENCODING_SKIPLIST: return "skiplist";
     case REDIS_ENCODING_EMBSTR: return "emstr";
+    case REDIS_ENCODING_BTREE: return "btree";
+    case REDIS_ENCODING_QUICKLIST: return "quicklist";
     default: return "unknown";
     }
 }
@@ -1059,12 +1087,37 @@ int main () {
         printf("OK\n");
     }
 
-    // 创建一个 list 编码的空列表对象
-    printf("create and free list list object: ");
+    // 共享整数范围内的值: 共享对象创建之前返回新对象, 之后返回共享对象
+    printf("create small int string objects (0..%d): ", REDIS_SHARED_INTEGERS-1);
+    {
+        long long j;
+        robj *small;
+
+        for (j = 0; j < REDIS_SHARED_INTEGERS; j++) {
+            small = createStringObjectFromLongLong(j);
+            assert(small->encoding == REDIS_ENCODING_INT);
+            assert((long long)small->ptr == j);
+            assert(small->refcount == 1);
+            decrRefCount(small);
+        }
+
+        createSharedObjects();
+        for (j = 0; j < REDIS_SHARED_INTEGERS; j++) {
+            small = createStringObjectFromLongLong(j);
+            assert(small == shared.integers[j]);
+            assert((long long)small->ptr == j);
+            assert(small->refcount == REDIS_SHARED_REFCOUNT);
+            decrRefCount(small);
+        }
+        printf("OK\n");
+    }
+
+    // 创建一个 quicklist 编码的空列表对象
+    printf("create and free quicklist list object: ");
     {
-        o = createListObject();
+        o = createQuicklistObject();
         assert(o->type == REDIS_LIST);
-        assert(o->encoding == REDIS_ENCODING_LINKEDLIST);
+        assert(o->encoding == REDIS_ENCODING_QUICKLIST);
         freeListObject(o);
         printf("OK\n");
     }
@@ -0,0 +1,228 @@
+/*
+ * 以地址为键的缓存
+ *
+ * 有些加速结构不能写入对象本身 (否则会改变 ziplist 和 RDB 的格式),
+ * 比如有序集合 ziplist 的稀疏索引、哈希 ziplist 的域指纹,
+ * 以及哈希对象的域过期索引。它们以对象 (或 ziplist) 的地址为键,
+ * 保存在一个 ptrCache 中, 对象被修改或释放时由调用者删除。
+ *
+ * 每个缓存项记录它所属的数据库号码:
+ * FLUSHDB ASYNC 把整个数据库交给后台线程释放时, 后台线程不会删除缓存项,
+ * 主线程在提交前用 ptrCacheEmptyDb 删除这个数据库的缓存项,
+ * 其他数据库的缓存项不受影响。
+ * 建立缓存项时还不知道所属数据库的, 数据库号码为 -1 ,
+ * 清空任何数据库时都会被删除。
+ *
+ * 缓存可以设置容量上限, 超过上限时随机淘汰一个缓存项。
+ *
+ * 缓存只属于主线程, 后台线程释放对象时不能访问缓存, 见 ptrCacheDelete
+ */
+
+#include "redis.h"
+
+// 一个缓存项
+typedef struct ptrCacheEntry {
+
+    // 缓存的值
+    void *val;
+
+    // 所属的数据库号码, -1 表示未知
+    int dbid;
+
+} ptrCacheEntry;
+
+// 计算校验值时抽查的偏移量数量, 以及每个偏移量处抽查的字节数
+#define PTRCACHE_CHECK_SAMPLES 8
+#define PTRCACHE_CHECK_BYTES 16
+
+// 最近一次查找键的数据库号码, 见 ptrCacheSetCurrentDb
+static int ptrcache_current_db = -1;
+
+/*
+ * 字典的键是地址本身, 按指针计算哈希值
+ */
+static unsigned int ptrCacheHash(const void *key) {
+    return dictGenHashFunction((unsigned char*)&key,sizeof(key));
+}
+
+static void ptrCacheEntryDestructor(void *privdata, void *val) {
+    ptrCache *cache = privdata;
+    ptrCacheEntry *entry = val;
+
+    if (cache->freeval) cache->freeval(entry->val);
+    zfree(entry);
+}
+
+static dictType ptrCacheDictType = {
+    ptrCacheHash,              /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    NULL,                      /* key compare, 比较指针本身 */
+    NULL,                      /* key destructor */
+    ptrCacheEntryDestructor    /* val destructor */
+};
+
+/*
+ * 创建一个缓存, 容量上限为 max_entries (为 0 时不限制),
+ * freeval 用于释放缓存的值, 可以为 NULL
+ */
+ptrCache *ptrCacheCreate(unsigned long max_entries, void (*freeval)(void *val)) {
+    ptrCache *cache = zmalloc(sizeof(*cache));
+
+    cache->max_entries = max_entries;
+    cache->freeval = freeval;
+    cache->entries = dictCreate(&ptrCacheDictType,cache);
+
+    return cache;
+}
+
+/*
+ * 返回缓存项的数量
+ */
+unsigned long ptrCacheSize(ptrCache *cache) {
+    return cache ? dictSize(cache->entries) : 0;
+}
+
+/*
+ * 返回地址 ptr 的缓存值, 没有缓存时返回 NULL
+ *
+ * T = O(1)
+ */
+void *ptrCacheFind(ptrCache *cache, void *ptr) {
+    dictEntry *de;
+
+    if (cache == NULL || dictSize(cache->entries) == 0) return NULL;
+
+    if ((de = dictFind(cache->entries,ptr)) == NULL) return NULL;
+
+    return ((ptrCacheEntry*)dictGetVal(de))->val;
+}
+
+/*
+ * 为地址 ptr 添加缓存值 val, 所属数据库为 dbid, 已有的缓存值会被释放
+ *
+ * 缓存已满时随机淘汰一个缓存项
+ *
+ * T = O(1)
+ */
+void ptrCacheAdd(ptrCache *cache, void *ptr, void *val, int dbid) {
+    ptrCacheEntry *entry;
+    dictEntry *de;
+
+    dictDelete(cache->entries,ptr);
+
+    if (cache->max_entries && dictSize(cache->entries) >= cache->max_entries) {
+        de = dictGetRandomKey(cache->entries);
+        dictDelete(cache->entries,dictGetKey(de));
+    }
+
+    entry = zmalloc(sizeof(*entry));
+    entry->val = val;
+    entry->dbid = dbid;
+    dictAdd(cache->entries,ptr,entry);
+}
+
+/*
+ * 删除并释放地址 ptr 的缓存值
+ *
+ * 对象被修改或释放时调用。
+ * 后台线程释放对象时直接返回: 缓存只属于主线程,
+ * 交给后台线程释放的对象的缓存项已经在提交前删除 (见 emptyDbAsync)
+ *
+ * T = O(1)
+ */
+void ptrCacheDelete(ptrCache *cache, void *ptr) {
+    if (lazyfreeInBackground()) return;
+
+    if (cache == NULL || dictSize(cache->entries) == 0) return;
+
+    dictDelete(cache->entries,ptr);
+}
+
+/*
+ * 地址 ptr 的对象被加入数据库 dbid 时, 更新缓存项所属的数据库
+ *
+ * T = O(1)
+ */
+void ptrCacheSetDb(ptrCache *cache, void *ptr, int dbid) {
+    dictEntry *de;
+
+    if (cache == NULL || dictSize(cache->entries) == 0) return;
+
+    if ((de = dictFind(cache->entries,ptr)) == NULL) return;
+
+    ((ptrCacheEntry*)dictGetVal(de))->dbid = dbid;
+}
+
+/*
+ * 删除属于数据库 dbid 的缓存项, 以及所属数据库未知的缓存项
+ *
+ * 在把整个数据库交给后台线程释放之前调用
+ *
+ * T = O(N), N 为缓存项的数量 (不超过容量上限)
+ */
+void ptrCacheEmptyDb(ptrCache *cache, int dbid) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (cache == NULL || dictSize(cache->entries) == 0) return;
+
+    di = dictGetSafeIterator(cache->entries);
+    while ((de = dictNext(di)) != NULL) {
+        ptrCacheEntry *entry = dictGetVal(de);
+
+        if (entry->dbid == dbid || entry->dbid == -1)
+            dictDelete(cache->entries,dictGetKey(de));
+    }
+    dictReleaseIterator(di);
+}
+
+/*
+ * 计算长度为 len 的 buf 的校验值, 用于检查缓存值是否过期:
+ * buf 的前 header 个字节, 加上 count 个偏移量中均匀抽查的
+ * PTRCACHE_CHECK_SAMPLES 个偏移量处的至多 PTRCACHE_CHECK_BYTES 个字节
+ *
+ * ziplist 被重写成同样的长度时, 只比较长度无法发现缓存过期,
+ * 而表头或者抽查处的内容通常会改变
+ *
+ * 调用者需要保证 header 和所有偏移量都小于 len
+ *
+ * T = O(1)
+ */
+uint64_t ptrCacheChecksum(unsigned char *buf, size_t len, size_t header,
+                          uint32_t *offsets, unsigned int count)
+{
+    unsigned int n, j, k;
+    uint64_t sum;
+    size_t sample;
+
+    sum = dictGenHashFunction(buf,header);
+
+    n = count < PTRCACHE_CHECK_SAMPLES ? count : PTRCACHE_CHECK_SAMPLES;
+    for (j = 0; j < n; j++) {
+        k = (unsigned long)count*j/n;
+        sample = len - offsets[k];
+        if (sample > PTRCACHE_CHECK_BYTES) sample = PTRCACHE_CHECK_BYTES;
+        sum = ((sum << 7) | (sum >> 57)) ^
+              dictGenHashFunction(buf+offsets[k],sample);
+    }
+
+    return sum;
+}
+
+/*
+ * 记录正在访问的数据库, 由 lookupKey 调用
+ *
+ * 命令总是先查找键再访问它的值, 所以访问值时建立的缓存项属于这个数据库。
+ * 值被移动到其他数据库时, 由 dbAdd 调用 ptrCacheSetDb 更新
+ */
+void ptrCacheSetCurrentDb(int dbid) {
+    ptrcache_current_db = dbid;
+}
+
+/*
+ * 返回正在访问的数据库号码, 还没有查找过键时返回 -1
+ */
+int ptrCacheCurrentDb(void) {
+    return ptrcache_current_db;
+}
@@ -0,0 +1,2046 @@
+/**
+ * 快速列表 (quicklist)
+ *
+ * 快速列表是由 ziplist 组成的双端链表, 每个链表节点保存一个容量有限的 ziplist
+ *
+ * 双端链表编码的列表为每个元素分配一个 listNode 和一个 robj,
+ * 每个元素有约 80 字节的额外开销, 而 ziplist 在元素很多时,
+ * 每次修改都需要 realloc 和移动整块内存.
+ * 快速列表兼顾了两者的优点:
+ *   1.元素紧凑地保存在 ziplist 中, 额外开销平摊到节点内的所有元素上
+ *   2.每个 ziplist 的大小有上限, 修改操作只需要移动一个节点的内存
+ *   3.表头表尾的添加和弹出仍然是 O(1)
+ *
+ * 节点的大小由填充因子 fill 控制, 见 quicklistSetFill
+ *
+ * 长列表通常只访问两端, 因此可以用 LZF 压缩中间的节点:
+ * 两端各 compress 个节点保持原样, 其余节点的 ziplist 被压缩,
+ * 访问时临时解压 (recompress 标记), 使用完毕后重新压缩
+ *
+ * 节点之上还有一个按元素数量计数的跳跃表索引 (类似 zskiplist 的 span),
+ * 按索引查找元素只需要 O(log N) 次跳转, 而不是逐个节点遍历
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zmalloc.h"
+#include "ziplist.h"
+#include "util.h"
+#include "lzf.h"
+#include "adlist.h"
+#include "quicklist.h"
+#include "rand.h"
+#include "redisassert.h"
+
+/**
+ * 填充因子为负数时, 单个节点的 ziplist 最大字节数
+ * fill = -1 时为 4KB, fill = -2 时为 8KB, 以此类推
+ */
+static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
+
+/**
+ * 填充因子为正数时, 单个节点的 ziplist 仍然不能超过该字节数,
+ * 避免大元素让一个节点变得过大
+ */
+#define SIZE_SAFETY_LIMIT 8192
+
+/**
+ * 一个节点最多保存的元素数量, 受 count 字段的位数限制
+ */
+#define COUNT_LIMIT ((1 << 16) - 1)
+
+/**
+ * ziplist 头部和末端标识的字节数
+ */
+#define ZIPLIST_OVERHEAD 11
+
+/**
+ * 小于该字节数的 ziplist 不压缩
+ */
+#define MIN_COMPRESS_BYTES 48
+
+/**
+ * 压缩后至少要节省该字节数, 否则保持原样
+ */
+#define MIN_COMPRESS_IMPROVE 8
+
+/*--------------------------- 节点压缩 ---------------------------*/
+
+/**
+ * 使用 LZF 压缩节点的 ziplist
+ * 压缩成功返回 1, ziplist 太小或压缩效果不明显时保持原样, 返回 0
+ *
+ * T = O(N), N 为 ziplist 的字节数
+ */
+static int __quicklistCompressNode(quicklistNode *node) {
+    quicklistLZF *lzf;
+
+    node->recompress = 0;
+    if (node->sz < MIN_COMPRESS_BYTES) return 0;
+
+    // 输出缓冲区与原数据一样大, 放不下说明压缩没有意义
+    // lzf_compress 在输出缓冲区满时可能多写 1 字节, 与 rdbSaveLzfStringObject 一样多分配 1 字节
+    lzf = zmalloc(sizeof(*lzf) + node->sz + 1);
+    lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed, node->sz);
+    if (lzf->sz == 0 || lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
+        zfree(lzf);
+        return 0;
+    }
+
+    // 缩小到实际大小, 替换原 ziplist
+    lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
+    zfree(node->zl);
+    node->zl = (unsigned char *)lzf;
+    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    return 1;
+}
+
+/**
+ * 将节点解压成原来的 ziplist
+ *
+ * T = O(N), N 为 ziplist 的字节数
+ */
+static void __quicklistDecompressNode(quicklistNode *node) {
+    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    unsigned char *zl = zmalloc(node->sz);
+    unsigned int len = lzf_decompress(lzf->compressed, lzf->sz, zl, node->sz);
+
+    assert(len == node->sz);
+    zfree(lzf);
+    node->zl = zl;
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    node->recompress = 0;
+}
+
+// 压缩未压缩的节点
+#define quicklistCompressNode(_node)                                       \
+    do {                                                                   \
+        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_RAW)   \
+            __quicklistCompressNode((_node));                              \
+    } while (0)
+
+// 解压被压缩的节点, 节点从此保持未压缩
+#define quicklistDecompressNode(_node)                                     \
+    do {                                                                   \
+        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF)   \
+            __quicklistDecompressNode((_node));                            \
+    } while (0)
+
+// 临时解压节点以便读写, 使用完毕后需要 quicklistRecompressOnly 或 quicklistCompress
+#define quicklistDecompressNodeForUse(_node)                               \
+    do {                                                                   \
+        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) { \
+            __quicklistDecompressNode((_node));                            \
+            (_node)->recompress = 1;                                       \
+        }                                                                  \
+    } while (0)
+
+// 重新压缩临时解压的节点
+#define quicklistRecompressOnly(_node)                                     \
+    do {                                                                   \
+        if ((_node)->recompress) quicklistCompressNode((_node));           \
+    } while (0)
+
+/**
+ * 维护压缩范围: 解压两端 compress 个节点, 压缩刚刚离开这个范围的节点,
+ * 如果 node 不在两端的范围内, 同时压缩 node
+ *
+ * 插入新节点会把原来在范围内的节点挤出去, 删除节点会让中间的节点进入范围,
+ * 所以在节点数量变化之后调用
+ *
+ * T = O(compress)
+ */
+static void __quicklistCompress(const quicklist *quicklist, quicklistNode *node) {
+    quicklistNode *forward, *reverse;
+    unsigned int depth = 0;
+    int in_depth = 0;
+
+    if (quicklist->compress == 0 || quicklist->len == 0) return;
+
+    forward = quicklist->head;
+    reverse = quicklist->tail;
+    while (depth++ < quicklist->compress) {
+        quicklistDecompressNode(forward);
+        quicklistDecompressNode(reverse);
+
+        if (forward == node || reverse == node) in_depth = 1;
+
+        // 两端相遇, 所有节点都不需要压缩
+        if (forward == reverse || forward->next == reverse) return;
+
+        forward = forward->next;
+        reverse = reverse->prev;
+    }
+
+    // forward 和 reverse 是范围之外的第一个节点
+    if (node && !in_depth) quicklistCompressNode(node);
+    quicklistCompressNode(forward);
+    quicklistCompressNode(reverse);
+}
+
+// 临时解压的节点重新压缩, 否则按节点的位置决定是否压缩
+#define quicklistCompress(_ql, _node)                                      \
+    do {                                                                   \
+        if ((_node)->recompress)                                           \
+            quicklistCompressNode((_node));                                \
+        else                                                               \
+            __quicklistCompress((_ql), (_node));                           \
+    } while (0)
+
+/*--------------------------- 节点索引 ---------------------------*/
+
+/**
+ * 节点索引是建立在节点之上的跳跃表, prev/next 组成第 0 层,
+ * 节点的第 k 层 (k >= 1) 保存在 level[k-1] 中, 表头的各层保存在 quicklist->index 中
+ *
+ * 每一层的 span 记录从当前节点 (包含) 到 forward (不包含) 的元素数量,
+ * 第 0 层的 span 就是节点的 count, 表头本身不包含元素
+ *
+ * 在索引中 NULL 表示表头, 表头每一层的 backward 记录该层最后一个节点,
+ * 所以表头和表尾节点的元素数量变化时, 不需要遍历就能找到覆盖它的各层节点
+ */
+
+// 节点 (NULL 为表头) 的第 k 层
+#define __quicklistLevel(_ql, _node, _k)                                   \
+    ((_node) ? &(_node)->level[(_k)-1] : &(_ql)->index[(_k)-1])
+
+/**
+ * 为新节点生成随机的索引层数, 以 1/4 的概率晋升一层
+ * 与 zslRandomLevel 相同, 随机数末尾每有 2 个 0 就增加一层
+ */
+static int quicklistRandomLevel(void) {
+    int level = __builtin_ctzll(redisRandom64() | (1ULL<<63)) / 2;
+
+    return (level < QUICKLIST_INDEX_MAXLEVEL) ? level : QUICKLIST_INDEX_MAXLEVEL;
+}
+
+/**
+ * 计算覆盖 node 的各层节点:
+ * update[k] 是 node 之前 (包含 node) 第一个层数不少于 k 的节点, NULL 为表头,
+ * dist[k] 是从 update[k] 到 node (都包含) 的元素数量, dist 可以为 NULL
+ *
+ * 从 node 开始, 在第 k-1 层向前走到层数不少于 k 的节点, 就得到第 k 层的覆盖节点
+ * node 为表尾时直接从表头的 backward 得到
+ *
+ * T = O(log N), N 为节点数量
+ */
+static void __quicklistIndexPath(const quicklist *quicklist, quicklistNode *node,
+                                 quicklistNode **update, unsigned long *dist) {
+    quicklistNode *x = node;
+    unsigned long d = node ? node->count : 0;
+    unsigned int k;
+
+    for (k = 1; k <= quicklist->index_level; k++) {
+        if (node != NULL && node == quicklist->tail) {
+            // 表尾: 第 k 层的最后一个节点覆盖到表尾
+            x = quicklist->index[k-1].backward;
+            if (dist) d = __quicklistLevel(quicklist, x, k)->span;
+        } else {
+            while (x && x->levels < k) {
+                quicklistNode *y = (k == 1) ? x->prev : x->level[k-2].backward;
+                if (k == 1) {
+                    d += y ? y->count : 0;
+                } else {
+                    d += __quicklistLevel(quicklist, y, k-1)->span;
+                }
+                x = y;
+            }
+        }
+        update[k] = x;
+        if (dist) dist[k] = d;
+    }
+}
+
+/**
+ * 确保索引至少有 level 层, 新增的表头层直接指向表尾
+ *
+ * 第一次创建时需要遍历节点统计元素数量, 之后从最高层的 span 累加得到
+ *
+ * T = O(N)
+ */
+static void __quicklistIndexGrow(quicklist *quicklist, unsigned int level) {
+    unsigned long total = 0;
+    quicklistNode *x = NULL;
+    unsigned int k;
+
+    if (level <= quicklist->index_level) return;
+
+    if (quicklist->index_level == 0) {
+        for (x = quicklist->head; x; x = x->next) total += x->count;
+    } else {
+        k = quicklist->index_level;
+        do {
+            quicklistLevel *l = __quicklistLevel(quicklist, x, k);
+            total += l->span;
+            x = l->forward;
+        } while (x);
+    }
+
+    quicklist->index = zrealloc(quicklist->index, sizeof(quicklistLevel) * level);
+    for (k = quicklist->index_level + 1; k <= level; k++) {
+        quicklist->index[k-1].forward = NULL;
+        quicklist->index[k-1].backward = NULL;
+        quicklist->index[k-1].span = total;
+    }
+    quicklist->index_level = level;
+}
+
+/**
+ * 将 node 加入索引, 位置在 prev (NULL 为表头) 之后
+ * 调用时 node 还没有链接到第 0 层, node->count 必须已经设置
+ *
+ * T = O(log N)
+ */
+static void __quicklistIndexInsert(quicklist *quicklist, quicklistNode *prev, quicklistNode *node) {
+    quicklistNode *update[QUICKLIST_INDEX_MAXLEVEL+1];
+    unsigned long dist[QUICKLIST_INDEX_MAXLEVEL+1];
+    unsigned int k;
+
+    __quicklistIndexGrow(quicklist, node->levels);
+    if (quicklist->index_level == 0) return;
+
+    if (prev) {
+        __quicklistIndexPath(quicklist, prev, update, dist);
+    } else {
+        for (k = 1; k <= quicklist->index_level; k++) {
+            update[k] = NULL;
+            dist[k] = 0;
+        }
+    }
+
+    for (k = 1; k <= quicklist->index_level; k++) {
+        quicklistLevel *pl = __quicklistLevel(quicklist, update[k], k);
+
+        if (k <= node->levels) {
+            // 在第 k 层把 node 链接到 update[k] 之后, 拆分 update[k] 的 span
+            quicklistLevel *nl = &node->level[k-1];
+
+            nl->forward = pl->forward;
+            nl->backward = update[k];
+            nl->span = pl->span - dist[k] + node->count;
+            pl->forward = node;
+            pl->span = dist[k];
+
+            if (nl->forward) {
+                nl->forward->level[k-1].backward = node;
+            } else {
+                quicklist->index[k-1].backward = node;
+            }
+        } else {
+            // 更高的层只需要计入 node 的元素
+            pl->span += node->count;
+        }
+    }
+}
+
+/**
+ * 将 node 从索引中删除, 调用时 node 仍然链接在第 0 层
+ *
+ * T = O(log N)
+ */
+static void __quicklistIndexDelete(quicklist *quicklist, quicklistNode *node) {
+    quicklistNode *update[QUICKLIST_INDEX_MAXLEVEL+1];
+    unsigned int k;
+
+    if (quicklist->index_level == 0) return;
+
+    __quicklistIndexPath(quicklist, node, update, NULL);
+
+    for (k = 1; k <= quicklist->index_level; k++) {
+        if (k <= node->levels) {
+            // 前置节点接管 node 在第 k 层的链接
+            quicklistLevel *nl = &node->level[k-1];
+            quicklistLevel *pl = __quicklistLevel(quicklist, nl->backward, k);
+
+            pl->span += nl->span - node->count;
+            pl->forward = nl->forward;
+
+            if (nl->forward) {
+                nl->forward->level[k-1].backward = nl->backward;
+            } else {
+                quicklist->index[k-1].backward = nl->backward;
+            }
+        } else {
+            __quicklistLevel(quicklist, update[k], k)->span -= node->count;
+        }
+    }
+}
+
+/**
+ * 将已加入快速列表的节点的元素数量增加 delta (可以为负数), 同时更新索引
+ * 不修改 quicklist->count
+ *
+ * 表头和表尾节点 T = O(log N) 次简单运算, 其他节点 T = O(log N) 次跳转
+ */
+static void __quicklistNodeIncrCount(quicklist *quicklist, quicklistNode *node, long delta) {
+    quicklistNode *update[QUICKLIST_INDEX_MAXLEVEL+1];
+    unsigned int k;
+
+    node->count += delta;
+    if (quicklist->index_level == 0) return;
+
+    __quicklistIndexPath(quicklist, node, update, NULL);
+    for (k = 1; k <= quicklist->index_level; k++) {
+        __quicklistLevel(quicklist, update[k], k)->span += delta;
+    }
+}
+
+/**
+ * 查找包含第 index 个元素 (从 0 开始) 的节点,
+ * *accum 保存该节点之前的元素数量
+ * index 超出范围返回 NULL
+ *
+ * T = O(log N)
+ */
+static quicklistNode *__quicklistIndexFind(const quicklist *quicklist,
+                                           unsigned long index, unsigned long *accum) {
+    quicklistNode *x = NULL;
+    unsigned long traversed = 0;
+    unsigned int k;
+
+    // 从最高层开始, 跳过整段不包含 index 的节点
+    for (k = quicklist->index_level; k >= 1; k--) {
+        quicklistLevel *l = __quicklistLevel(quicklist, x, k);
+        while (l->forward && traversed + l->span <= index) {
+            traversed += l->span;
+            x = l->forward;
+            l = &x->level[k-1];
+        }
+    }
+
+    // 第 0 层
+    if (x == NULL) x = quicklist->head;
+    while (x && traversed + x->count <= index) {
+        traversed += x->count;
+        x = x->next;
+    }
+
+    *accum = traversed;
+    return x;
+}
+
+/*--------------------------- 节点操作 ---------------------------*/
+
+/**
+ * 创建一个空节点
+ *
+ * T = O(1)
+ */
+static quicklistNode *quicklistCreateNode(void) {
+    int levels = quicklistRandomLevel();
+    quicklistNode *node = zmalloc(sizeof(*node) + levels * sizeof(quicklistLevel));
+    node->levels = levels;
+    node->prev = node->next = NULL;
+    node->zl = NULL;
+    node->sz = 0;
+    node->count = 0;
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    node->recompress = 0;
+    return node;
+}
+
+
+/**
+ * 更新节点记录的 ziplist 字节数
+ */
+#define quicklistNodeUpdateSz(node)                                        \
+    do {                                                                   \
+        (node)->sz = ziplistBlobLen((node)->zl);                           \
+    } while (0)
+
+/**
+ * 将 new_node 插入到 old_node 之后 (after 为 1) 或之前 (after 为 0)
+ * old_node 为 NULL 时快速列表必须为空
+ *
+ * T = O(1)
+ */
+static void __quicklistInsertNode(quicklist *quicklist, quicklistNode *old_node,
+                                  quicklistNode *new_node, int after) {
+
+    // 先加入索引, 此时表尾还没有变化
+    __quicklistIndexInsert(quicklist, after ? old_node : (old_node ? old_node->prev : NULL),
+                           new_node);
+
+    if (after) {
+        new_node->prev = old_node;
+        if (old_node) {
+            new_node->next = old_node->next;
+            if (old_node->next) old_node->next->prev = new_node;
+            old_node->next = new_node;
+        }
+        if (quicklist->tail == old_node) quicklist->tail = new_node;
+    } else {
+        new_node->next = old_node;
+        if (old_node) {
+            new_node->prev = old_node->prev;
+            if (old_node->prev) old_node->prev->next = new_node;
+            old_node->prev = new_node;
+        }
+        if (quicklist->head == old_node) quicklist->head = new_node;
+    }
+
+    // 空列表
+    if (quicklist->len == 0) {
+        quicklist->head = quicklist->tail = new_node;
+    }
+
+    quicklist->len++;
+}
+
+/**
+ * 从快速列表中删除并释放节点, 同时更新元素总数
+ *
+ * T = O(1)
+ */
+static void __quicklistDelNode(quicklist *quicklist, quicklistNode *node) {
+    __quicklistIndexDelete(quicklist, node);
+
+    if (node->next) node->next->prev = node->prev;
+    if (node->prev) node->prev->next = node->next;
+
+    if (node == quicklist->tail) quicklist->tail = node->prev;
+    if (node == quicklist->head) quicklist->head = node->next;
+
+    quicklist->len--;
+    quicklist->count -= node->count;
+
+    zfree(node->zl);
+    zfree(node);
+}
+
+/**
+ * 填充因子为负数时, 检查 sz 字节的 ziplist 是否满足大小限制
+ */
+static int _quicklistNodeSizeMeetsOptimizationRequirement(const size_t sz, const int fill) {
+    size_t offset;
+
+    if (fill >= 0) return 0;
+
+    offset = (-fill) - 1;
+    if (offset < sizeof(optimization_level) / sizeof(*optimization_level)) {
+        return sz <= optimization_level[offset];
+    }
+    return 0;
+}
+
+#define sizeMeetsSafetyLimit(sz) ((sz) <= SIZE_SAFETY_LIMIT)
+
+/**
+ * 估算长度为 sz 的值添加到 ziplist 后占用的字节数,
+ * 包括 prevlen 和 encoding
+ */
+static size_t _quicklistEntrySize(const size_t sz) {
+    int ziplist_overhead;
+
+    ziplist_overhead = (sz < 254) ? 1 : 5;
+    if (sz < 64) ziplist_overhead += 1;
+    else if (sz < 16384) ziplist_overhead += 2;
+    else ziplist_overhead += 5;
+
+    return sz + ziplist_overhead;
+}
+
+/**
+ * 检查能否向 node 添加一个长度为 sz 的元素
+ * 可以返回 1, 否则返回 0
+ *
+ * T = O(1)
+ */
+static int _quicklistNodeAllowInsert(const quicklistNode *node, const int fill, const size_t sz) {
+    size_t new_sz;
+
+    if (node == NULL) return 0;
+    if (node->count >= COUNT_LIMIT) return 0;
+
+    new_sz = node->sz + _quicklistEntrySize(sz);
+
+    if (_quicklistNodeSizeMeetsOptimizationRequirement(new_sz, fill)) return 1;
+    if (!sizeMeetsSafetyLimit(new_sz)) return 0;
+    if ((int)node->count < fill) return 1;
+
+    return 0;
+}
+
+/**
+ * 检查能否将节点 a 和 b 合并成一个节点
+ * 可以返回 1, 否则返回 0
+ *
+ * T = O(1)
+ */
+static int _quicklistNodeAllowMerge(const quicklistNode *a, const quicklistNode *b, const int fill) {
+    size_t merge_sz;
+
+    if (!a || !b) return 0;
+    if (a->count + b->count > COUNT_LIMIT) return 0;
+
+    // 合并后只保留一份 ziplist 头部和末端标识
+    merge_sz = a->sz + b->sz - ZIPLIST_OVERHEAD;
+
+    if (_quicklistNodeSizeMeetsOptimizationRequirement(merge_sz, fill)) return 1;
+    if (!sizeMeetsSafetyLimit(merge_sz)) return 0;
+    if ((int)(a->count + b->count) <= fill) return 1;
+
+    return 0;
+}
+
+/**
+ * 将 ziplist 元素 p 的值添加到 zl 的表头或表尾, 返回添加后的 zl
+ */
+static unsigned char *_quicklistZiplistPushEntry(unsigned char *zl, unsigned char *p, int where) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    char buf[32];
+
+    ziplistGet(p, &vstr, &vlen, &vlong);
+    if (vstr == NULL) {
+        vlen = ll2string(buf, sizeof(buf), vlong);
+        vstr = (unsigned char*)buf;
+    }
+    return ziplistPush(zl, vstr, vlen, where);
+}
+
+/**
+ * 将相邻节点 other 的元素并入 keep, 然后删除 other
+ * other 在 keep 之前时元素添加到 keep 的表头, 否则添加到表尾
+ *
+ * keep 必须是未压缩的, 合并后 keep 仍然有效
+ *
+ * T = O(N), N 为 other 的元素数量
+ */
+static void _quicklistMergeNodes(quicklist *quicklist, quicklistNode *keep, quicklistNode *other) {
+    unsigned char *p;
+
+    quicklistDecompressNodeForUse(other);
+
+    if (other == keep->prev) {
+        // 从后往前添加到表头, 保持元素顺序
+        p = ziplistIndex(other->zl, -1);
+        while (p != NULL) {
+            keep->zl = _quicklistZiplistPushEntry(keep->zl, p, ZIPLIST_HEAD);
+            p = ziplistPrev(other->zl, p);
+        }
+    } else {
+        p = ziplistIndex(other->zl, 0);
+        while (p != NULL) {
+            keep->zl = _quicklistZiplistPushEntry(keep->zl, p, ZIPLIST_TAIL);
+            p = ziplistNext(other->zl, p);
+        }
+    }
+    __quicklistNodeIncrCount(quicklist, keep, other->count);
+    quicklistNodeUpdateSz(keep);
+
+    // keep 接收了 other 的元素, 元素总数不变
+    quicklist->count += other->count;
+    __quicklistDelNode(quicklist, other);
+}
+
+/**
+ * 尝试将 center 前后相邻的节点并入 center, 避免插入时的分裂产生过多的小节点
+ * center 不会被释放
+ *
+ * T = O(N)
+ */
+static void _quicklistMergeAround(quicklist *quicklist, quicklistNode *center) {
+    int fill = quicklist->fill;
+
+    if (_quicklistNodeAllowMerge(center->prev, center, fill)) {
+        _quicklistMergeNodes(quicklist, center, center->prev);
+    }
+
+    if (_quicklistNodeAllowMerge(center, center->next, fill)) {
+        _quicklistMergeNodes(quicklist, center, center->next);
+    }
+}
+
+/**
+ * 在 offset 处将节点分裂成两个, 返回新节点, 新节点不会被加入快速列表
+ * node 必须是未压缩的
+ *
+ * after 为 1 时, 原节点保留 [0, offset] 的元素, 新节点保存 offset 之后的元素
+ * after 为 0 时, 原节点保留 [offset, count) 的元素, 新节点保存 offset 之前的元素
+ *
+ * T = O(N)
+ */
+static quicklistNode *_quicklistSplitNode(quicklist *quicklist, quicklistNode *node,
+                                          int offset, int after) {
+    quicklistNode *new_node = quicklistCreateNode();
+    int count = node->count;
+
+    // 复制一份 ziplist, 两个节点各自删除不属于自己的部分
+    new_node->zl = zmalloc(node->sz);
+    memcpy(new_node->zl, node->zl, node->sz);
+
+    if (after) {
+        node->zl = ziplistDeleteRange(node->zl, offset + 1, count - offset - 1);
+        __quicklistNodeIncrCount(quicklist, node, (long)(offset + 1) - count);
+        new_node->zl = ziplistDeleteRange(new_node->zl, 0, offset + 1);
+        new_node->count = count - offset - 1;
+    } else {
+        node->zl = ziplistDeleteRange(node->zl, 0, offset);
+        __quicklistNodeIncrCount(quicklist, node, -(long)offset);
+        new_node->zl = ziplistDeleteRange(new_node->zl, offset, count - offset);
+        new_node->count = offset;
+    }
+    quicklistNodeUpdateSz(node);
+    quicklistNodeUpdateSz(new_node);
+
+    return new_node;
+}
+
+/**
+ * 删除 node 中 *p 指向的元素, 删除后 *p 指向被删除元素的下一个元素
+ * 如果节点因此变空, 那么删除节点
+ *
+ * node 必须是未压缩的
+ *
+ * 删除了节点返回 1, 否则返回 0
+ *
+ * T = O(N), N 为节点的元素数量
+ */
+static int quicklistDelIndex(quicklist *quicklist, quicklistNode *node, unsigned char **p) {
+    node->zl = ziplistDelete(node->zl, p);
+    __quicklistNodeIncrCount(quicklist, node, -1);
+    quicklist->count--;
+
+    if (node->count == 0) {
+        __quicklistDelNode(quicklist, node);
+        // 中间的节点可能进入了两端不压缩的范围
+        __quicklistCompress(quicklist, NULL);
+        return 1;
+    }
+
+    quicklistNodeUpdateSz(node);
+    return 0;
+}
+
+/*--------------------------- 创建和释放 ---------------------------*/
+
+/**
+ * 创建一个新的空快速列表, 使用默认填充因子 (每个节点 8KB), 不压缩节点
+ *
+ * T = O(1)
+ */
+quicklist *quicklistCreate(void) {
+    struct quicklist *quicklist = zmalloc(sizeof(*quicklist));
+
+    quicklist->head = quicklist->tail = NULL;
+    quicklist->len = 0;
+    quicklist->count = 0;
+    quicklist->fill = -2;
+    quicklist->compress = 0;
+    quicklist->index = NULL;
+    quicklist->index_level = 0;
+    return quicklist;
+}
+
+/**
+ * 创建一个使用给定填充因子和压缩深度的空快速列表
+ *
+ * T = O(1)
+ */
+quicklist *quicklistNew(int fill, int compress) {
+    quicklist *quicklist = quicklistCreate();
+    quicklistSetFill(quicklist, fill);
+    quicklistSetCompressDepth(quicklist, compress);
+    return quicklist;
+}
+
+/**
+ * 设置填充因子
+ *  - 正数, 每个节点最多保存 fill 个元素 (节点大小仍受 8KB 的安全上限限制)
+ *  - 负数, -1 到 -5 分别表示每个节点最多 4KB, 8KB, 16KB, 32KB, 64KB
+ *
+ * 超出范围的值会被截断到 [QUICKLIST_FILL_MIN, QUICKLIST_FILL_MAX]
+ */
+void quicklistSetFill(quicklist *quicklist, int fill) {
+    if (fill > QUICKLIST_FILL_MAX) {
+        fill = QUICKLIST_FILL_MAX;
+    } else if (fill < QUICKLIST_FILL_MIN) {
+        fill = QUICKLIST_FILL_MIN;
+    }
+    quicklist->fill = fill;
+}
+
+/**
+ * 设置压缩深度, 表头和表尾各有 depth 个节点不压缩, 为 0 时不压缩
+ *
+ * 只影响之后修改或访问的节点
+ */
+void quicklistSetCompressDepth(quicklist *quicklist, int depth) {
+    if (depth > QUICKLIST_COMPRESS_MAX) {
+        depth = QUICKLIST_COMPRESS_MAX;
+    } else if (depth < 0) {
+        depth = 0;
+    }
+    quicklist->compress = depth;
+}
+
+/**
+ * 释放快速列表及其所有节点
+ *
+ * T = O(N), N 为节点数量
+ */
+void quicklistRelease(quicklist *quicklist) {
+    quicklistNode *current, *next;
+
+    current = quicklist->head;
+    while (current) {
+        next = current->next;
+        zfree(current->zl);
+        zfree(current);
+        current = next;
+    }
+    zfree(quicklist->index);
+    zfree(quicklist);
+}
+
+/*--------------------------- 添加元素 ---------------------------*/
+
+/**
+ * 将值添加到表头
+ * 创建了新的表头节点返回 1, 否则返回 0
+ *
+ * T = O(1)
+ */
+int quicklistPushHead(quicklist *quicklist, void *value, size_t sz) {
+    quicklistNode *orig_head = quicklist->head;
+
+    if (_quicklistNodeAllowInsert(quicklist->head, quicklist->fill, sz)) {
+        quicklistDecompressNode(quicklist->head);
+        quicklist->head->zl = ziplistPush(quicklist->head->zl, value, sz, ZIPLIST_HEAD);
+        quicklistNodeUpdateSz(quicklist->head);
+        __quicklistNodeIncrCount(quicklist, quicklist->head, 1);
+    } else {
+        quicklistNode *node = quicklistCreateNode();
+        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        node->count++;
+        quicklistNodeUpdateSz(node);
+        __quicklistInsertNode(quicklist, quicklist->head, node, 0);
+        // 原表头可能离开了不压缩的范围
+        __quicklistCompress(quicklist, node);
+    }
+    quicklist->count++;
+    return (orig_head != quicklist->head);
+}
+
+/**
+ * 将值添加到表尾
+ * 创建了新的表尾节点返回 1, 否则返回 0
+ *
+ * T = O(1)
+ */
+int quicklistPushTail(quicklist *quicklist, void *value, size_t sz) {
+    quicklistNode *orig_tail = quicklist->tail;
+
+    if (_quicklistNodeAllowInsert(quicklist->tail, quicklist->fill, sz)) {
+        quicklistDecompressNode(quicklist->tail);
+        quicklist->tail->zl = ziplistPush(quicklist->tail->zl, value, sz, ZIPLIST_TAIL);
+        quicklistNodeUpdateSz(quicklist->tail);
+        __quicklistNodeIncrCount(quicklist, quicklist->tail, 1);
+    } else {
+        quicklistNode *node = quicklistCreateNode();
+        node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_TAIL);
+        node->count++;
+        quicklistNodeUpdateSz(node);
+        __quicklistInsertNode(quicklist, quicklist->tail, node, 1);
+        // 原表尾可能离开了不压缩的范围
+        __quicklistCompress(quicklist, node);
+    }
+    quicklist->count++;
+    return (orig_tail != quicklist->tail);
+}
+
+/**
+ * 将值添加到表头 (QUICKLIST_HEAD) 或表尾 (QUICKLIST_TAIL)
+ */
+void quicklistPush(quicklist *quicklist, void *value, const size_t sz, int where) {
+    if (where == QUICKLIST_HEAD) {
+        quicklistPushHead(quicklist, value, sz);
+    } else if (where == QUICKLIST_TAIL) {
+        quicklistPushTail(quicklist, value, sz);
+    }
+}
+
+/**
+ * 按顺序将 num 个值添加到表头 (QUICKLIST_HEAD) 或表尾 (QUICKLIST_TAIL),
+ * 结果与逐个调用 quicklistPush 相同
+ *
+ * 先按填充因子估算端点节点还能容纳多少个值,
+ * 然后通过 ziplistPushMulti 一次性写入, 每个节点只重分配一次内存,
+ * 剩余的值写入新创建的节点
+ *
+ * T = O(N), N 为值的总长度
+ */
+void quicklistPushMulti(quicklist *quicklist, unsigned char **values, unsigned int *sz,
+                        unsigned long num, int where) {
+    int zlwhere = (where == QUICKLIST_HEAD) ? ZIPLIST_HEAD : ZIPLIST_TAIL;
+    unsigned long i = 0, n;
+
+    while (i < num) {
+        quicklistNode *node = (where == QUICKLIST_HEAD) ? quicklist->head : quicklist->tail;
+        quicklistNode probe;
+        int created = 0;
+
+        // 端点节点放不下第一个值, 创建新节点
+        if (!_quicklistNodeAllowInsert(node, quicklist->fill, sz[i])) {
+            node = quicklistCreateNode();
+            node->zl = ziplistNew();
+            quicklistNodeUpdateSz(node);
+            created = 1;
+        }
+
+        // 用 probe 模拟逐个添加, 计算这个节点能容纳多少个值
+        probe.sz = node->sz + _quicklistEntrySize(sz[i]);
+        probe.count = node->count + 1;
+        n = 1;
+        while (i + n < num &&
+               _quicklistNodeAllowInsert(&probe, quicklist->fill, sz[i+n])) {
+            probe.sz += _quicklistEntrySize(sz[i+n]);
+            probe.count++;
+            n++;
+        }
+
+        if (!created) quicklistDecompressNode(node);
+        node->zl = ziplistPushMulti(node->zl, values+i, sz+i, n, zlwhere);
+        if (created) {
+            node->count = n;
+        } else {
+            __quicklistNodeIncrCount(quicklist, node, n);
+        }
+        quicklistNodeUpdateSz(node);
+        quicklist->count += n;
+
+        if (created) {
+            __quicklistInsertNode(quicklist, (where == QUICKLIST_HEAD) ? quicklist->head : quicklist->tail,
+                                  node, where != QUICKLIST_HEAD);
+            // 原端点节点可能离开了不压缩的范围
+            __quicklistCompress(quicklist, node);
+        }
+
+        i += n;
+    }
+}
+
+/**
+ * 将整个 ziplist 作为一个新节点追加到表尾, zl 的所有权转交给快速列表
+ *
+ * RDB 载入时使用, 不检查填充因子
+ *
+ * T = O(1)
+ */
+void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl) {
+    quicklistNode *node = quicklistCreateNode();
+
+    node->zl = zl;
+    node->count = ziplistLen(node->zl);
+    quicklistNodeUpdateSz(node);
+
+    __quicklistInsertNode(quicklist, quicklist->tail, node, 1);
+    quicklist->count += node->count;
+    __quicklistCompress(quicklist, node);
+}
+
+/**
+ * 按顺序将 ziplist 的所有元素添加到一个新的快速列表, 然后释放 zl
+ *
+ * T = O(N)
+ */
+quicklist *quicklistCreateFromZiplist(int fill, int compress, unsigned char *zl) {
+    quicklist *quicklist = quicklistNew(fill, compress);
+    unsigned char *p = ziplistIndex(zl, 0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    char buf[32];
+
+    while (p != NULL) {
+        ziplistGet(p, &vstr, &vlen, &vlong);
+        if (vstr == NULL) {
+            vlen = ll2string(buf, sizeof(buf), vlong);
+            vstr = (unsigned char*)buf;
+        }
+        quicklistPushTail(quicklist, vstr, vlen);
+        p = ziplistNext(zl, p);
+    }
+
+    zfree(zl);
+    return quicklist;
+}
+
+/**
+ * 将值插入到 entry 之后 (after 为 1) 或之前 (after 为 0)
+ *
+ * 节点还有空间时直接插入 ziplist,
+ * 插入位置在节点边缘时, 尝试插入到相邻节点, 或者创建一个新节点,
+ * 否则在插入位置分裂节点, 插入后再尝试与相邻节点合并
+ *
+ * entry 所在的节点必须是未压缩的 (由 quicklistIndex 或迭代器解压),
+ * 插入之后 entry 和迭代器都失效, 但 entry->node 不会被释放
+ *
+ * T = O(N), N 为节点的元素数量
+ */
+static void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
+                             void *value, const size_t sz, int after) {
+    int fill = quicklist->fill;
+    quicklistNode *node = entry->node;
+    quicklistNode *new_node = NULL;
+    int full, at_tail = 0, at_head = 0;
+
+    // 空列表, 创建第一个节点
+    if (node == NULL) {
+        new_node = quicklistCreateNode();
+        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->count++;
+        quicklistNodeUpdateSz(new_node);
+        __quicklistInsertNode(quicklist, NULL, new_node, after);
+        quicklist->count++;
+        return;
+    }
+
+    full = !_quicklistNodeAllowInsert(node, fill, sz);
+    if (after && entry->offset == (int)node->count - 1) at_tail = 1;
+    if (!after && entry->offset == 0) at_head = 1;
+
+    if (!full) {
+        // 节点有空间, 直接插入
+        if (after) {
+            unsigned char *next = ziplistNext(node->zl, entry->zi);
+            if (next == NULL) {
+                node->zl = ziplistPush(node->zl, value, sz, ZIPLIST_TAIL);
+            } else {
+                node->zl = ziplistInsert(node->zl, next, value, sz);
+            }
+        } else {
+            node->zl = ziplistInsert(node->zl, entry->zi, value, sz);
+        }
+        __quicklistNodeIncrCount(quicklist, node, 1);
+        quicklistNodeUpdateSz(node);
+
+    } else if (at_tail && _quicklistNodeAllowInsert(node->next, fill, sz)) {
+        // 插入到后一个节点的表头
+        new_node = node->next;
+        quicklistDecompressNodeForUse(new_node);
+        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD);
+        __quicklistNodeIncrCount(quicklist, new_node, 1);
+        quicklistNodeUpdateSz(new_node);
+        quicklistRecompressOnly(new_node);
+
+    } else if (at_head && _quicklistNodeAllowInsert(node->prev, fill, sz)) {
+        // 插入到前一个节点的表尾
+        new_node = node->prev;
+        quicklistDecompressNodeForUse(new_node);
+        new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL);
+        __quicklistNodeIncrCount(quicklist, new_node, 1);
+        quicklistNodeUpdateSz(new_node);
+        quicklistRecompressOnly(new_node);
+
+    } else if (at_tail || at_head) {
+        // 相邻节点也满了, 为新值创建一个节点
+        new_node = quicklistCreateNode();
+        new_node->zl = ziplistPush(ziplistNew(), value, sz, ZIPLIST_HEAD);
+        new_node->count++;
+        quicklistNodeUpdateSz(new_node);
+        __quicklistInsertNode(quicklist, node, new_node, after);
+        __quicklistCompress(quicklist, new_node);
+
+    } else {
+        // 插入位置在满节点的中间, 分裂节点, 新值放到分出的节点中
+        new_node = _quicklistSplitNode(quicklist, node, entry->offset, after);
+        new_node->zl = ziplistPush(new_node->zl, value, sz,
+                                   after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+        new_node->count++;
+        quicklistNodeUpdateSz(new_node);
+        __quicklistInsertNode(quicklist, node, new_node, after);
+        __quicklistCompress(quicklist, new_node);
+
+        // 合并可能释放相邻节点, 之后重新维护压缩范围
+        _quicklistMergeAround(quicklist, node);
+        __quicklistCompress(quicklist, NULL);
+    }
+
+    // entry 所在的节点如果是被临时解压的, 重新压缩
+    quicklistRecompressOnly(node);
+    quicklist->count++;
+}
+
+/**
+ * 将值插入到 entry 之后
+ */
+void quicklistInsertAfter(quicklist *quicklist, quicklistEntry *entry,
+                          void *value, const size_t sz) {
+    _quicklistInsert(quicklist, entry, value, sz, 1);
+}
+
+/**
+ * 将值插入到 entry 之前
+ */
+void quicklistInsertBefore(quicklist *quicklist, quicklistEntry *entry,
+                           void *value, const size_t sz) {
+    _quicklistInsert(quicklist, entry, value, sz, 0);
+}
+
+/*--------------------------- 删除和替换 ---------------------------*/
+
+/**
+ * 删除迭代器上一次返回的元素 entry, 并调整迭代器,
+ * 使下一次迭代返回被删除元素之后 (按迭代方向) 的元素
+ *
+ * T = O(N), N 为节点的元素数量
+ */
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
+    quicklistNode *prev = entry->node->prev;
+    quicklistNode *next = entry->node->next;
+    int deleted_node = quicklistDelIndex((quicklist *)entry->quicklist,
+                                         entry->node, &entry->zi);
+
+    // ziplist 可能被重新分配了, 下次迭代按 offset 重新定位
+    iter->zi = NULL;
+
+    if (deleted_node) {
+        if (iter->direction == AL_START_HEAD) {
+            iter->current = next;
+            iter->offset = 0;
+        } else {
+            iter->current = prev;
+            iter->offset = prev ? (long)prev->count - 1 : 0;
+        }
+
+    } else if (iter->direction == AL_START_HEAD) {
+        // 后面的元素前移到了被删除元素的位置
+        iter->offset = entry->offset;
+
+    } else {
+        iter->offset = entry->offset - 1;
+        if (iter->offset < 0) {
+            // 离开当前节点, 需要时重新压缩
+            quicklistCompress(entry->quicklist, entry->node);
+            iter->current = prev;
+            iter->offset = prev ? (long)prev->count - 1 : 0;
+        }
+    }
+}
+
+/**
+ * 用 data 替换 index 处的元素
+ * 替换成功返回 1, index 超出范围返回 0
+ *
+ * T = O(N)
+ */
+int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data, int sz) {
+    quicklistEntry entry;
+
+    if (!quicklistIndex(quicklist, index, &entry)) return 0;
+
+    entry.node->zl = ziplistDelete(entry.node->zl, &entry.zi);
+    entry.node->zl = ziplistInsert(entry.node->zl, entry.zi, data, sz);
+    quicklistNodeUpdateSz(entry.node);
+    quicklistCompress(quicklist, entry.node);
+    return 1;
+}
+
+/**
+ * 删除节点中从 offset 开始的 del 个元素, 调用方保证节点不会因此变空
+ *
+ * T = O(N), N 为节点的字节数
+ */
+static void __quicklistNodeDelPart(quicklist *quicklist, quicklistNode *node,
+                                   unsigned long offset, unsigned long del) {
+    quicklistDecompressNodeForUse(node);
+    node->zl = ziplistDeleteRange(node->zl, offset, del);
+    __quicklistNodeIncrCount(quicklist, node, -(long)del);
+    quicklist->count -= del;
+    quicklistNodeUpdateSz(node);
+    quicklistRecompressOnly(node);
+}
+
+/**
+ * 将连续的节点 a 到 b (都包含) 一次性从快速列表和索引中摘除,
+ * 摘除后 a 到 b 仍然通过 next 连接, b->next 为 NULL
+ * total 是这些节点的元素数量之和, quicklist->len 由调用方更新
+ *
+ * 每一层只需要修改 a 之前覆盖它的节点:
+ * 如果 b 在第 k 层的覆盖节点也在 a 之前, 那么这一层只是 span 减少 total ,
+ * 否则改为链接到 b 的覆盖节点在第 k 层的后继
+ *
+ * T = O(log N), 与摘除的节点数量无关
+ */
+static void __quicklistUnlinkNodes(quicklist *quicklist, quicklistNode *a, quicklistNode *b,
+                                   unsigned long total) {
+    quicklistNode *update_a[QUICKLIST_INDEX_MAXLEVEL+1], *update_b[QUICKLIST_INDEX_MAXLEVEL+1];
+    unsigned long dist_a[QUICKLIST_INDEX_MAXLEVEL+1], dist_b[QUICKLIST_INDEX_MAXLEVEL+1];
+    unsigned int k;
+
+    if (quicklist->index_level) {
+        if (a->prev) {
+            __quicklistIndexPath(quicklist, a->prev, update_a, dist_a);
+        } else {
+            for (k = 1; k <= quicklist->index_level; k++) {
+                update_a[k] = NULL;
+                dist_a[k] = 0;
+            }
+        }
+        __quicklistIndexPath(quicklist, b, update_b, dist_b);
+
+        for (k = 1; k <= quicklist->index_level; k++) {
+            quicklistLevel *pl = __quicklistLevel(quicklist, update_a[k], k);
+
+            if (update_b[k] == update_a[k]) {
+                pl->span -= total;
+            } else {
+                // update_b[k] 在被摘除的范围内
+                quicklistLevel *ll = &update_b[k]->level[k-1];
+
+                pl->forward = ll->forward;
+                pl->span = dist_a[k] + ll->span - dist_b[k];
+                if (ll->forward) {
+                    ll->forward->level[k-1].backward = update_a[k];
+                } else {
+                    quicklist->index[k-1].backward = update_a[k];
+                }
+            }
+        }
+    }
+
+    // 第 0 层
+    if (a->prev) a->prev->next = b->next;
+    else quicklist->head = b->next;
+    if (b->next) b->next->prev = a->prev;
+    else quicklist->tail = a->prev;
+    a->prev = NULL;
+    b->next = NULL;
+
+    quicklist->count -= total;
+}
+
+/**
+ * 删除从 start 开始的 count 个元素, 被完全覆盖的节点从列表和索引中摘除并返回,
+ * 它们仍然通过 next 连接, 最后一个节点的 next 为 NULL
+ * 只有两端的节点需要删除 ziplist 中的部分元素
+ *
+ * quicklist->len 由调用方在处理摘除的节点时更新, 所以这里不需要遍历它们:
+ * 有索引时最后一个被完全覆盖的节点通过索引查找
+ *
+ * 返回摘除的节点链, 没有删除任何元素时 *deleted 为 0
+ *
+ * T = O(log N + M), M 为两端节点的字节数
+ */
+static quicklistNode *__quicklistDelRange(quicklist *quicklist, const long start,
+                                          const long count, int *deleted) {
+    quicklistEntry entry;
+    quicklistNode *node, *first, *last;
+    unsigned long extent, pos, end, accum;
+
+    *deleted = 0;
+    if (count <= 0) return NULL;
+
+    // 计算实际需要删除的数量
+    extent = count;
+    if (start >= 0 && extent > (quicklist->count - start)) {
+        extent = quicklist->count - start;
+    } else if (start < 0 && extent > (unsigned long)(-start)) {
+        extent = -start;
+    }
+
+    if (!quicklistIndex(quicklist, start, &entry)) return NULL;
+    *deleted = 1;
+
+    node = entry.node;
+    pos = (start >= 0) ? (unsigned long)start : quicklist->count + start;
+
+    // 起始节点只删除一部分, 之后 [pos, pos+extent) 从某个节点的开头开始
+    if (entry.offset > 0) {
+        unsigned long del = node->count - entry.offset;
+
+        if (del > extent) del = extent;
+        __quicklistNodeDelPart(quicklist, node, entry.offset, del);
+        extent -= del;
+        node = node->next;
+    }
+    if (extent == 0) return NULL;
+    first = node;
+
+    // 找到包含最后一个被删除元素的节点, accum 为它之前的元素数量
+    end = pos + extent;
+    if (quicklist->index_level) {
+        node = __quicklistIndexFind(quicklist, end - 1, &accum);
+    } else {
+        accum = pos;
+        while (accum + node->count < end) {
+            accum += node->count;
+            node = node->next;
+        }
+    }
+
+    // 结束节点只删除一部分
+    if (accum + node->count > end) {
+        __quicklistNodeDelPart(quicklist, node, 0, end - accum);
+        last = node->prev;
+        end = accum;
+    } else {
+        last = node;
+    }
+    if (end == pos) return NULL;
+
+    __quicklistUnlinkNodes(quicklist, first, last, end - pos);
+    return first;
+}
+
+/**
+ * 从 start 开始删除 count 个元素, start 可以是负数索引
+ * 删除了元素返回 1, 否则返回 0
+ *
+ * 被完全覆盖的节点作为整体从列表中摘除, 不逐个释放,
+ * 它们通过 next 连接保存在 *chain 中, 节点数量保存在 *chain_len 中,
+ * 调用方负责用 quicklistReleaseDetached 释放 (可以交给后台线程)
+ *
+ * T = O(log N + M + K), K 为摘除的节点数量, 只读取节点头
+ */
+int quicklistDelRangeDetach(quicklist *quicklist, const long start, const long count,
+                            quicklistNode **chain, unsigned long *chain_len) {
+    quicklistNode *node;
+    int deleted;
+
+    *chain = __quicklistDelRange(quicklist, start, count, &deleted);
+    *chain_len = 0;
+    for (node = *chain; node; node = node->next) (*chain_len)++;
+    quicklist->len -= *chain_len;
+
+    // 中间的节点可能进入了两端不压缩的范围
+    if (deleted) __quicklistCompress(quicklist, NULL);
+    return deleted;
+}
+
+/**
+ * 释放 quicklistDelRangeDetach 摘除的节点链
+ * 参数类型是 void * , 以便直接作为后台释放任务
+ *
+ * T = O(N), N 为节点数量
+ */
+void quicklistReleaseDetached(void *chain) {
+    quicklistNode *node = chain, *next;
+
+    while (node) {
+        next = node->next;
+        zfree(node->zl);
+        zfree(node);
+        node = next;
+    }
+}
+
+/**
+ * 从 start 开始删除 count 个元素, start 可以是负数索引
+ * 删除了元素返回 1, 否则返回 0
+ *
+ * 被完全覆盖的节点一次性摘除, 然后在同一次遍历中计数并释放
+ *
+ * T = O(log N + M + K), K 为被释放的节点数量
+ */
+int quicklistDelRange(quicklist *quicklist, const long start, const long count) {
+    quicklistNode *node, *next;
+    int deleted;
+
+    node = __quicklistDelRange(quicklist, start, count, &deleted);
+    while (node) {
+        next = node->next;
+        zfree(node->zl);
+        zfree(node);
+        quicklist->len--;
+        node = next;
+    }
+
+    // 中间的节点可能进入了两端不压缩的范围
+    if (deleted) __quicklistCompress(quicklist, NULL);
+    return deleted;
+}
+
+/**
+ * 删除值与 s 相等的元素, 最多删除 limit 个, limit 为 0 表示不限
+ * direction 为 AL_START_TAIL 时从表尾开始删除
+ * 返回被删除的元素数量
+ *
+ * 每个节点只需要用 ziplistDeleteMatching 处理一次,
+ * 比较直接使用 ziplist 中的原始字节或整数, 不创建任何对象
+ *
+ * T = O(N)
+ */
+unsigned long quicklistDelMatching(quicklist *quicklist, unsigned char *s, unsigned int slen,
+                                   unsigned long limit, int direction) {
+    quicklistNode *node, *next;
+    unsigned long removed = 0;
+    int fromtail = (direction == AL_START_TAIL);
+
+    node = fromtail ? quicklist->tail : quicklist->head;
+    while (node && (limit == 0 || removed < limit)) {
+        unsigned long remaining = limit ? limit - removed : 0;
+        unsigned int deleted;
+
+        next = fromtail ? node->prev : node->next;
+
+        quicklistDecompressNodeForUse(node);
+        node->zl = ziplistDeleteMatching(node->zl, s, slen,
+                                         remaining > COUNT_LIMIT ? 0 : remaining,
+                                         fromtail, &deleted);
+        if (deleted) {
+            __quicklistNodeIncrCount(quicklist, node, -(long)deleted);
+            quicklist->count -= deleted;
+            quicklistNodeUpdateSz(node);
+            removed += deleted;
+        }
+
+        if (node->count == 0) {
+            __quicklistDelNode(quicklist, node);
+        } else {
+            quicklistRecompressOnly(node);
+        }
+        node = next;
+    }
+
+    // 中间的节点可能进入了两端不压缩的范围
+    if (removed) __quicklistCompress(quicklist, NULL);
+    return removed;
+}
+
+/*--------------------------- 迭代和查找 ---------------------------*/
+
+/**
+ * 创建一个从表头 (AL_START_HEAD) 或表尾 (AL_START_TAIL) 开始的迭代器
+ *
+ * T = O(1)
+ */
+quicklistIter *quicklistGetIterator(const quicklist *quicklist, int direction) {
+    quicklistIter *iter = zmalloc(sizeof(*iter));
+
+    iter->quicklist = quicklist;
+    iter->direction = direction;
+    iter->zi = NULL;
+
+    if (direction == AL_START_HEAD) {
+        iter->current = quicklist->head;
+        iter->offset = 0;
+    } else {
+        iter->current = quicklist->tail;
+        iter->offset = quicklist->tail ? (long)quicklist->tail->count - 1 : 0;
+    }
+    return iter;
+}
+
+/**
+ * 创建一个从索引 idx 处开始的迭代器, idx 可以是负数索引
+ * idx 超出范围时, 返回的迭代器不会产生任何元素
+ *
+ * T = O(N)
+ */
+quicklistIter *quicklistGetIteratorAtIdx(const quicklist *quicklist,
+                                         const int direction, const long long idx) {
+    quicklistEntry entry;
+    quicklistIter *iter = quicklistGetIterator(quicklist, direction);
+
+    if (quicklistIndex(quicklist, idx, &entry)) {
+        iter->current = entry.node;
+        iter->offset = entry.offset;
+    } else {
+        iter->current = NULL;
+    }
+    return iter;
+}
+
+/**
+ * 将迭代器的下一个元素保存到 entry
+ * 有元素返回 1, 迭代完毕返回 0
+ *
+ * 迭代过程中只能通过 quicklistDelEntry 删除元素,
+ * 其他修改操作之后迭代器失效
+ *
+ * T = O(1)
+ */
+int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
+    int forward = (iter->direction == AL_START_HEAD);
+
+    entry->quicklist = iter->quicklist;
+    entry->node = NULL;
+
+    while (iter->current) {
+        unsigned char *zl;
+
+        // 开始迭代一个节点时, 临时解压它
+        if (iter->zi == NULL) quicklistDecompressNodeForUse(iter->current);
+        zl = iter->current->zl;
+
+        if (iter->zi == NULL) {
+            iter->zi = ziplistIndex(zl, iter->offset);
+        } else if (forward) {
+            iter->zi = ziplistNext(zl, iter->zi);
+            iter->offset++;
+        } else {
+            iter->zi = ziplistPrev(zl, iter->zi);
+            iter->offset--;
+        }
+
+        if (iter->zi) {
+            entry->node = iter->current;
+            entry->zi = iter->zi;
+            entry->offset = iter->offset;
+            ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+            return 1;
+        }
+
+        // 当前节点迭代完毕, 需要时重新压缩, 然后移动到相邻节点
+        quicklistCompress(iter->quicklist, iter->current);
+        if (forward) {
+            iter->current = iter->current->next;
+            iter->offset = 0;
+        } else {
+            iter->current = iter->current->prev;
+            iter->offset = iter->current ? (long)iter->current->count - 1 : 0;
+        }
+        iter->zi = NULL;
+    }
+    return 0;
+}
+
+/**
+ * 释放迭代器
+ */
+void quicklistReleaseIterator(quicklistIter *iter) {
+    if (iter->current) quicklistCompress(iter->quicklist, iter->current);
+    zfree(iter);
+}
+
+/**
+ * 查找索引 index 处的元素, 保存到 entry, index 可以是负数索引
+ * 找到返回 1, 超出范围返回 0
+ *
+ * 通过节点索引找到元素所在的节点, 索引还没有建立时 (节点很少),
+ * 根据索引的正负从表头或表尾开始, 按节点的元素数量跳过整个节点
+ *
+ * 元素所在的节点被临时解压, 调用方使用完毕后由 quicklistCompress 重新压缩,
+ * 只读访问应使用 quicklistGetIteratorAtIdx, 释放迭代器时会自动处理
+ *
+ * T = O(log N), N 为节点数量
+ */
+int quicklistIndex(const quicklist *quicklist, const long long index, quicklistEntry *entry) {
+    int forward = index < 0 ? 0 : 1;
+    unsigned long long index_abs = forward ? index : (-index) - 1;
+    unsigned long long accum = 0;
+    quicklistNode *n;
+
+    entry->quicklist = quicklist;
+    entry->node = NULL;
+
+    if (index_abs >= quicklist->count) return 0;
+
+    if (quicklist->index_level) {
+        // 负数索引转换成正数索引再查找
+        unsigned long idx = forward ? index_abs : quicklist->count - 1 - index_abs;
+        unsigned long before;
+
+        n = __quicklistIndexFind(quicklist, idx, &before);
+        if (n == NULL) return 0;
+        accum = forward ? before : quicklist->count - before - n->count;
+    } else {
+        n = forward ? quicklist->head : quicklist->tail;
+        while (n) {
+            if (accum + n->count > index_abs) break;
+            accum += n->count;
+            n = forward ? n->next : n->prev;
+        }
+    }
+    if (n == NULL) return 0;
+
+    entry->node = n;
+    if (forward) {
+        entry->offset = index_abs - accum;
+    } else {
+        entry->offset = n->count - 1 - (index_abs - accum);
+    }
+    quicklistDecompressNodeForUse(n);
+    entry->zi = ziplistIndex(n->zl, entry->offset);
+    ziplistGet(entry->zi, &entry->value, &entry->sz, &entry->longval);
+    return 1;
+}
+
+/*--------------------------- 弹出 ---------------------------*/
+
+/**
+ * 从表头或表尾弹出一个元素
+ * 字符串值由 saver 复制后保存到 *data, 整数值保存到 *sval (此时 *data 为 NULL)
+ * 弹出成功返回 1, 列表为空返回 0
+ *
+ * T = O(1)
+ */
+int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
+                       unsigned int *sz, long long *sval,
+                       void *(*saver)(unsigned char *data, unsigned int sz)) {
+    quicklistNode *node;
+    unsigned char *p, *vstr;
+    unsigned int vlen;
+    long long vlong;
+
+    if (data) *data = NULL;
+    if (sz) *sz = 0;
+    if (sval) *sval = 0;
+
+    if (quicklist->count == 0) return 0;
+
+    node = (where == QUICKLIST_HEAD) ? quicklist->head : quicklist->tail;
+    quicklistDecompressNode(node);
+    p = ziplistIndex(node->zl, (where == QUICKLIST_HEAD) ? 0 : -1);
+    if (!ziplistGet(p, &vstr, &vlen, &vlong)) return 0;
+
+    if (vstr) {
+        if (data) *data = saver(vstr, vlen);
+        if (sz) *sz = vlen;
+    } else {
+        if (sval) *sval = vlong;
+    }
+    quicklistDelIndex(quicklist, node, &p);
+    return 1;
+}
+
+/**
+ * quicklistPop 默认使用的 saver, 复制一份字符串值
+ */
+static void *_quicklistSaver(unsigned char *data, unsigned int sz) {
+    unsigned char *vstr;
+
+    if (data) {
+        vstr = zmalloc(sz);
+        memcpy(vstr, data, sz);
+        return vstr;
+    }
+    return NULL;
+}
+
+/**
+ * 从表头或表尾弹出一个元素, 字符串值需要调用方使用 zfree 释放
+ */
+int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
+                 unsigned int *sz, long long *slong) {
+    return quicklistPopCustom(quicklist, where, data, sz, slong, _quicklistSaver);
+}
+
+/*--------------------------- 其他 ---------------------------*/
+
+/**
+ * 返回元素总数
+ *
+ * T = O(1)
+ */
+unsigned long quicklistCount(const quicklist *quicklist) {
+    return quicklist->count;
+}
+
+/**
+ * 比对 ziplist 元素 p1 和长度为 p2_len 的值 p2
+ * 相同返回 1, 否则返回 0
+ */
+int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len) {
+    return ziplistCompare(p1, p2, p2_len);
+}
+
+/**
+ * 取出被压缩节点的 LZF 数据, 保存到 *data, 返回压缩后的字节数
+ * 节点的原始大小为 node->sz
+ *
+ * RDB 持久化时直接写入压缩数据, 避免解压后再压缩一次
+ */
+size_t quicklistGetLzf(const quicklistNode *node, void **data) {
+    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    *data = lzf->compressed;
+    return lzf->sz;
+}
+
+#ifdef QUICKLIST_TEST_MAIN
+
+void _redisAssert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+void ok(void) {
+    printf("OK\n");
+}
+
+/**
+ * 检查节点链接、每个未压缩节点的元素数量和字节数是否与 ziplist 一致,
+ * 以及节点索引的每一层是否与节点一致
+ */
+void checkConsistency(quicklist *ql) {
+    quicklistNode *node, *prev = NULL;
+    unsigned long count = 0;
+    unsigned int len = 0, k;
+
+    for (node = ql->head; node; prev = node, node = node->next) {
+        assert(node->prev == prev);
+        assert(node->count > 0);
+        if (node->encoding == QUICKLIST_NODE_ENCODING_RAW) {
+            assert(node->count == ziplistLen(node->zl));
+            assert(node->sz == ziplistBlobLen(node->zl));
+        }
+        count += node->count;
+        len++;
+    }
+    assert(prev == ql->tail);
+    assert(len == ql->len);
+    assert(count == ql->count);
+
+    // 检查节点索引: 每一层的链接、span 和表头记录的最后一个节点
+    for (node = ql->head; node; node = node->next) {
+        assert(node->levels <= ql->index_level);
+    }
+    for (k = 1; k <= ql->index_level; k++) {
+        quicklistNode *x = NULL, *last = NULL, *n;
+        unsigned int chain = 0, expect = 0;
+
+        do {
+            quicklistLevel *l = x ? &x->level[k-1] : &ql->index[k-1];
+            unsigned long span = 0;
+
+            for (n = x ? x : ql->head; n != l->forward; n = n->next) span += n->count;
+            assert(span == l->span);
+            if (l->forward) {
+                assert(l->forward->levels >= k);
+                assert(l->forward->level[k-1].backward == x);
+                chain++;
+            }
+            last = x;
+            x = l->forward;
+        } while (x);
+
+        assert(ql->index[k-1].backward == last);
+        for (node = ql->head; node; node = node->next) {
+            if (node->levels >= k) expect++;
+        }
+        assert(chain == expect);
+    }
+}
+
+// ziplist.c 的 main 没有用宏保护, 先重命名后单独编译:
+// gcc -g -c -Dmain=ziplist_main ziplist.c
+// gcc -g zmalloc.c util.c sds.c rand.c lzf_c.c lzf_d.c quicklist.c ziplist.o -lm -D QUICKLIST_TEST_MAIN
+int main(void) {
+    quicklist *ql;
+    quicklistIter *iter;
+    quicklistEntry entry;
+    char buf[32];
+    int i;
+
+    // 按元素数量限制节点大小
+    printf("Push with positive fill: "); {
+        ql = quicklistNew(4, 0);
+        for (i = 0; i < 10; i++) {
+            sprintf(buf, "v%d", i);
+            quicklistPushTail(ql, buf, strlen(buf));
+        }
+        assert(ql->count == 10);
+        assert(ql->len == 3);
+        checkConsistency(ql);
+        quicklistRelease(ql);
+        ok();
+    }
+
+    // 正负索引查找
+    printf("Index: "); {
+        ql = quicklistNew(4, 0);
+        for (i = 0; i < 100; i++) {
+            sprintf(buf, "%d", i);
+            quicklistPushTail(ql, buf, strlen(buf));
+        }
+        for (i = 0; i < 100; i++) {
+            assert(quicklistIndex(ql, i, &entry));
+            assert(entry.value == NULL && entry.longval == i);
+            assert(quicklistIndex(ql, i - 100, &entry));
+            assert(entry.longval == i);
+        }
+        assert(!quicklistIndex(ql, 100, &entry));
+        assert(!quicklistIndex(ql, -101, &entry));
+        quicklistRelease(ql);
+        ok();
+    }
+
+    // 在满节点的中间插入, 节点被分裂
+    printf("Insert into full node: "); {
+        ql = quicklistNew(4, 0);
+        for (i = 0; i < 4; i++) {
+            sprintf(buf, "%d", i);
+            quicklistPushTail(ql, buf, strlen(buf));
+        }
+        assert(quicklistIndex(ql, 1, &entry));
+        quicklistInsertAfter(ql, &entry, "x", 1);
+        assert(ql->len == 2);
+        assert(quicklistIndex(ql, 2, &entry));
+        assert(entry.sz == 1 && entry.value[0] == 'x');
+        assert(quicklistIndex(ql, 3, &entry) && entry.longval == 2);
+        checkConsistency(ql);
+        quicklistRelease(ql);
+        ok();
+    }
+
+    // 迭代时删除元素
+    printf("Delete while iterating: "); {
+        ql = quicklistNew(3, 0);
+        for (i = 0; i < 30; i++) {
+            sprintf(buf, "%d", i % 2);
+            quicklistPushTail(ql, buf, strlen(buf));
+        }
+        iter = quicklistGetIterator(ql, AL_START_TAIL);
+        while (quicklistNext(iter, &entry)) {
+            if (quicklistCompare(entry.zi, (unsigned char*)"1", 1))
+                quicklistDelEntry(iter, &entry);
+        }
+        quicklistReleaseIterator(iter);
+        assert(ql->count == 15);
+        iter = quicklistGetIterator(ql, AL_START_HEAD);
+        while (quicklistNext(iter, &entry)) assert(entry.longval == 0);
+        quicklistReleaseIterator(iter);
+        checkConsistency(ql);
+        quicklistRelease(ql);
+        ok();
+    }
+
+    // 范围删除, 覆盖的节点整个释放
+    printf("Delete range: "); {
+        ql = quicklistNew(4, 0);
+        for (i = 0; i < 100; i++) {
+            sprintf(buf, "%d", i);
+            quicklistPushTail(ql, buf, strlen(buf));
+        }
+        assert(quicklistDelRange(ql, 2, 90));
+        assert(ql->count == 10);
+        assert(quicklistIndex(ql, 2, &entry) && entry.longval == 92);
+        assert(quicklistDelRange(ql, -3, 3));
+        assert(quicklistIndex(ql, -1, &entry) && entry.longval == 96);
+        checkConsistency(ql);
+        quicklistRelease(ql);
+        ok();
+    }
+
+    // 弹出
+    printf("Pop: "); {
+        unsigned char *data;
+        unsigned int sz;
+        long long lv;
+
+        ql = quicklistNew(-1, 0);
+        quicklistPushHead(ql, "hello", 5);
+        quicklistPushHead(ql, "55", 2);
+        assert(quicklistPop(ql, QUICKLIST_HEAD, &data, &sz, &lv));
+        assert(data == NULL && lv == 55);
+        assert(quicklistPop(ql, QUICKLIST_TAIL, &data, &sz, &lv));
+        assert(sz == 5 && memcmp(data, "hello", 5) == 0);
+        zfree(data);
+        assert(!quicklistPop(ql, QUICKLIST_TAIL, &data, &sz, &lv));
+        assert(ql->len == 0 && ql->head == NULL && ql->tail == NULL);
+        quicklistRelease(ql);
+        ok();
+    }
+
+    // 压缩中间的节点, 迭代和修改时透明解压
+    printf("Compress interior nodes: "); {
+        quicklistNode *node;
+        int compressed = 0;
+
+        ql = quicklistNew(-1, 1);
+        for (i = 0; i < 5000; i++) {
+            sprintf(buf, "job:%08d", i);
+            quicklistPushTail(ql, buf, strlen(buf));
+        }
+        assert(ql->head->encoding == QUICKLIST_NODE_ENCODING_RAW);
+        assert(ql->tail->encoding == QUICKLIST_NODE_ENCODING_RAW);
+        for (node = ql->head->next; node != ql->tail; node = node->next) {
+            if (node->encoding == QUICKLIST_NODE_ENCODING_LZF) compressed++;
+        }
+        assert(compressed == (int)ql->len - 2);
+
+        iter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD, 2500);
+        assert(quicklistNext(iter, &entry));
+        assert(entry.sz == 12 && memcmp(entry.value, "job:00002500", 12) == 0);
+        quicklistReleaseIterator(iter);
+        assert(quicklistReplaceAtIndex(ql, 2500, "x", 1));
+        assert(quicklistDelRange(ql, 100, 4800));
+        for (node = ql->head; node; node = node->next) assert(!node->recompress);
+
+        i = 0;
+        iter = quicklistGetIterator(ql, AL_START_HEAD);
+        while (quicklistNext(iter, &entry)) i++;
+        quicklistReleaseIterator(iter);
+        assert(i == 200);
+        checkConsistency(ql);
+        quicklistRelease(ql);
+        ok();
+    }
+
+    // 批量添加, 结果与逐个添加相同
+    printf("Push multi: "); {
+        quicklist *ql2;
+        quicklistIter *iter2;
+        quicklistEntry entry2;
+        unsigned char *vals[300];
+        unsigned int lens[300];
+        char bufs[300][16];
+        int where;
+
+        for (where = QUICKLIST_TAIL; where <= QUICKLIST_HEAD; where++) {
+            ql = quicklistNew(16, 1);
+            ql2 = quicklistNew(16, 1);
+            for (i = 0; i < 300; i++) {
+                lens[i] = sprintf(bufs[i], (i % 3) ? "v%d" : "%d", i);
+                vals[i] = (unsigned char*)bufs[i];
+                quicklistPush(ql, vals[i], lens[i], where);
+            }
+            quicklistPushMulti(ql2, vals, lens, 5, where);
+            quicklistPushMulti(ql2, vals+5, lens+5, 295, where);
+            checkConsistency(ql2);
+            assert(ql2->count == 300 && ql2->len == ql->len);
+
+            iter = quicklistGetIterator(ql, AL_START_HEAD);
+            iter2 = quicklistGetIterator(ql2, AL_START_HEAD);
+            while (quicklistNext(iter, &entry)) {
+                assert(quicklistNext(iter2, &entry2));
+                if (entry.value) {
+                    assert(entry2.value && entry.sz == entry2.sz);
+                    assert(memcmp(entry.value, entry2.value, entry.sz) == 0);
+                } else {
+                    assert(!entry2.value && entry.longval == entry2.longval);
+                }
+            }
+            quicklistReleaseIterator(iter);
+            quicklistReleaseIterator(iter2);
+            quicklistRelease(ql);
+            quicklistRelease(ql2);
+        }
+        ok();
+    }
+
+    // 随机修改之后, 通过索引查找的结果与顺序迭代一致
+    printf("Index under random operations: "); {
+        long long j, n;
+
+        ql = quicklistNew(4, 1);
+        for (i = 0; i < 20000; i++) {
+            int op = rand() % 8;
+
+            n = ql->count;
+            sprintf(buf, "%d", rand() % 1000);
+            if (op == 0 || op == 1) {
+                quicklistPush(ql, buf, strlen(buf), op ? QUICKLIST_TAIL : QUICKLIST_HEAD);
+            } else if (op == 2 && n) {
+                unsigned char *data;
+                unsigned int sz;
+                long long lv;
+                assert(quicklistPop(ql, (rand() & 1) ? QUICKLIST_HEAD : QUICKLIST_TAIL,
+                                    &data, &sz, &lv));
+                zfree(data);
+            } else if (op == 3 && n) {
+                assert(quicklistIndex(ql, rand() % n, &entry));
+                if (rand() & 1) {
+                    quicklistInsertAfter(ql, &entry, buf, strlen(buf));
+                } else {
+                    quicklistInsertBefore(ql, &entry, buf, strlen(buf));
+                }
+            } else if (op == 4 && n) {
+                assert(quicklistDelRange(ql, rand() % n, 1 + rand() % 10));
+            } else if (op == 5 && n) {
+                assert(quicklistReplaceAtIndex(ql, rand() % n, buf, strlen(buf)));
+            } else if (op == 6 && n) {
+                iter = quicklistGetIteratorAtIdx(ql, AL_START_HEAD, rand() % n);
+                if (quicklistNext(iter, &entry)) quicklistDelEntry(iter, &entry);
+                quicklistReleaseIterator(iter);
+            } else {
+                quicklistPush(ql, buf, strlen(buf), QUICKLIST_TAIL);
+            }
+            if (i % 500 == 0) checkConsistency(ql);
+        }
+        checkConsistency(ql);
+
+        j = 0;
+        iter = quicklistGetIterator(ql, AL_START_HEAD);
+        while (quicklistNext(iter, &entry)) {
+            quicklistEntry found;
+
+            assert(quicklistIndex(ql, j, &found));
+            assert(found.node == entry.node && found.offset == entry.offset);
+            assert(quicklistIndex(ql, j - (long long)ql->count, &found));
+            assert(found.node == entry.node && found.offset == entry.offset);
+            j++;
+        }
+        quicklistReleaseIterator(iter);
+        assert(j == (long long)ql->count);
+        quicklistRelease(ql);
+        ok();
+    }
+
+    // 范围删除和按值删除的结果与数组模型一致
+    printf("Delete ranges and matching values: "); {
+        int model[3000], n, k, round;
+
+        for (round = 0; round < 200; round++) {
+            long start, count;
+            unsigned long limit, removed;
+            int target, fromtail, m;
+
+            ql = quicklistNew(4, round % 3);
+            n = 1000 + rand() % 2000;
+            for (i = 0; i < n; i++) {
+                model[i] = rand() % 6;
+                sprintf(buf, (model[i] & 1) ? "v%d" : "%d", model[i]);
+                quicklistPush(ql, buf, strlen(buf), QUICKLIST_TAIL);
+            }
+
+            // 范围删除
+            start = rand() % n;
+            count = 1 + rand() % n;
+            if (rand() & 1) start -= n;
+            assert(quicklistDelRange(ql, start, count));
+            if (start < 0) start += n;
+            if (count > n - start) count = n - start;
+            memmove(model + start, model + start + count, sizeof(int) * (n - start - count));
+            n -= count;
+
+            // 按值删除
+            target = rand() % 6;
+            limit = (rand() & 1) ? 0 : 1 + rand() % 200;
+            fromtail = rand() & 1;
+            sprintf(buf, (target & 1) ? "v%d" : "%d", target);
+            removed = quicklistDelMatching(ql, (unsigned char *)buf, strlen(buf), limit,
+                                           fromtail ? AL_START_TAIL : AL_START_HEAD);
+            m = 0;
+            for (k = 0; k < n; k++) if (model[k] == target) m++;
+            if (limit == 0 || limit > (unsigned long)m) limit = m;
+            assert(removed == limit);
+            for (k = 0, m = 0; k < n; k++) {
+                if (model[fromtail ? n-1-k : k] == target && limit) {
+                    model[fromtail ? n-1-k : k] = -1;
+                    limit--;
+                }
+            }
+            for (k = 0, m = 0; k < n; k++) if (model[k] != -1) model[m++] = model[k];
+            n = m;
+
+            checkConsistency(ql);
+            assert(ql->count == (unsigned long)n);
+            k = 0;
+            iter = quicklistGetIterator(ql, AL_START_HEAD);
+            while (quicklistNext(iter, &entry)) {
+                char expect[32];
+
+                sprintf(expect, (model[k] & 1) ? "v%d" : "%d", model[k]);
+                if (entry.value) {
+                    assert(entry.sz == strlen(expect) && memcmp(entry.value, expect, entry.sz) == 0);
+                } else {
+                    assert(entry.longval == model[k]);
+                }
+                k++;
+            }
+            quicklistReleaseIterator(iter);
+            assert(k == n);
+            quicklistRelease(ql);
+        }
+        ok();
+    }
+
+    return 0;
+}
+#endif
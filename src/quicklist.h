@@ -0,0 +1,205 @@
+#ifndef __QUICKLIST_H__
+#define __QUICKLIST_H__
+
+/**
+ * 快速列表节点的索引层, 见 quicklist.c 的 "节点索引"
+ */
+typedef struct quicklistLevel {
+
+    // 本层的后置节点, 为 NULL 时是本层最后一个节点
+    struct quicklistNode *forward;
+
+    // 本层的前置节点, 为 NULL 时是表头
+    // 表头的 backward 记录本层最后一个节点
+    struct quicklistNode *backward;
+
+    // 从本节点 (包含) 到 forward (不包含) 的元素数量,
+    // forward 为 NULL 时到表尾为止
+    unsigned long span;
+
+} quicklistLevel;
+
+/**
+ * 快速列表节点, 每个节点保存一个 ziplist
+ */
+typedef struct quicklistNode {
+
+    // 前置节点
+    struct quicklistNode *prev;
+
+    // 后置节点
+    struct quicklistNode *next;
+
+    // 节点保存的 ziplist, 节点被压缩时指向 quicklistLZF
+    unsigned char *zl;
+
+    // ziplist 未压缩时占用的字节数
+    unsigned int sz;
+
+    // ziplist 包含的元素数量
+    unsigned int count : 16;
+
+    // ziplist 的编码, QUICKLIST_NODE_ENCODING_RAW 或 QUICKLIST_NODE_ENCODING_LZF
+    unsigned int encoding : 2;
+
+    // 节点被临时解压使用, 使用完毕后需要重新压缩
+    unsigned int recompress : 1;
+
+    // 节点的索引层数, 不包括由 prev/next 组成的第 0 层
+    unsigned int levels : 5;
+
+    // 索引层, level[k-1] 是第 k 层
+    quicklistLevel level[];
+
+} quicklistNode;
+
+/**
+ * 被 LZF 压缩的 ziplist
+ */
+typedef struct quicklistLZF {
+
+    // 压缩后的字节数
+    unsigned int sz;
+
+    // 压缩后的数据
+    char compressed[];
+
+} quicklistLZF;
+
+/**
+ * 快速列表
+ */
+typedef struct quicklist {
+
+    // 表头节点
+    quicklistNode *head;
+
+    // 表尾节点
+    quicklistNode *tail;
+
+    // 所有 ziplist 包含的元素总数
+    unsigned long count;
+
+    // 节点数量
+    unsigned int len;
+
+    // 单个节点的填充因子, 见 quicklistSetFill
+    int fill : 16;
+
+    // 两端各有多少个节点不压缩, 为 0 时不压缩任何节点
+    unsigned int compress : 16;
+
+    // 节点索引的表头, index[k-1] 是第 k 层, 第一个有索引层的节点加入时才创建
+    quicklistLevel *index;
+
+    // 节点索引的层数
+    unsigned int index_level;
+
+} quicklist;
+
+/**
+ * 快速列表迭代器
+ */
+typedef struct quicklistIter {
+
+    // 被迭代的快速列表
+    const quicklist *quicklist;
+
+    // 当前节点
+    quicklistNode *current;
+
+    // 上一次返回的元素在 ziplist 中的地址,
+    // 为 NULL 时下一次迭代返回 current 中 offset 处的元素
+    unsigned char *zi;
+
+    // 元素在当前 ziplist 中的索引, 总是非负数
+    long offset;
+
+    // 迭代方向, AL_START_HEAD 或 AL_START_TAIL
+    int direction;
+
+} quicklistIter;
+
+/**
+ * 快速列表中的一个元素
+ */
+typedef struct quicklistEntry {
+
+    // 元素所属的快速列表
+    const quicklist *quicklist;
+
+    // 元素所在的节点
+    quicklistNode *node;
+
+    // 元素在 ziplist 中的地址
+    unsigned char *zi;
+
+    // 字符串值, 元素为整数时为 NULL
+    unsigned char *value;
+
+    // 整数值
+    long long longval;
+
+    // 字符串值的长度
+    unsigned int sz;
+
+    // 元素在节点 ziplist 中的索引, 总是非负数
+    int offset;
+
+} quicklistEntry;
+
+// 添加和弹出的方向
+#define QUICKLIST_HEAD 0
+#define QUICKLIST_TAIL -1
+
+// 填充因子的上下限
+#define QUICKLIST_FILL_MAX (1 << 15)
+#define QUICKLIST_FILL_MIN -5
+
+// 压缩深度的上限
+#define QUICKLIST_COMPRESS_MAX ((1 << 16) - 1)
+
+// 节点索引的最大层数, 每个节点以 1/4 的概率晋升一层
+#define QUICKLIST_INDEX_MAXLEVEL 16
+
+// 节点的编码
+#define QUICKLIST_NODE_ENCODING_RAW 1
+#define QUICKLIST_NODE_ENCODING_LZF 2
+
+quicklist *quicklistCreate(void);
+quicklist *quicklistNew(int fill, int compress);
+void quicklistSetFill(quicklist *quicklist, int fill);
+void quicklistSetCompressDepth(quicklist *quicklist, int depth);
+void quicklistRelease(quicklist *quicklist);
+int quicklistPushHead(quicklist *quicklist, void *value, const size_t sz);
+int quicklistPushTail(quicklist *quicklist, void *value, const size_t sz);
+void quicklistPush(quicklist *quicklist, void *value, const size_t sz, int where);
+void quicklistPushMulti(quicklist *quicklist, unsigned char **values, unsigned int *sz,
+                        unsigned long num, int where);
+void quicklistAppendZiplist(quicklist *quicklist, unsigned char *zl);
+quicklist *quicklistCreateFromZiplist(int fill, int compress, unsigned char *zl);
+void quicklistInsertAfter(quicklist *quicklist, quicklistEntry *entry, void *value, const size_t sz);
+void quicklistInsertBefore(quicklist *quicklist, quicklistEntry *entry, void *value, const size_t sz);
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry);
+int quicklistReplaceAtIndex(quicklist *quicklist, long index, void *data, int sz);
+int quicklistDelRange(quicklist *quicklist, const long start, const long count);
+int quicklistDelRangeDetach(quicklist *quicklist, const long start, const long count,
+                            quicklistNode **chain, unsigned long *chain_len);
+void quicklistReleaseDetached(void *chain);
+unsigned long quicklistDelMatching(quicklist *quicklist, unsigned char *s, unsigned int slen,
+                                   unsigned long limit, int direction);
+quicklistIter *quicklistGetIterator(const quicklist *quicklist, int direction);
+quicklistIter *quicklistGetIteratorAtIdx(const quicklist *quicklist, int direction, const long long idx);
+int quicklistNext(quicklistIter *iter, quicklistEntry *entry);
+void quicklistReleaseIterator(quicklistIter *iter);
+int quicklistIndex(const quicklist *quicklist, const long long index, quicklistEntry *entry);
+int quicklistPopCustom(quicklist *quicklist, int where, unsigned char **data,
+                       unsigned int *sz, long long *sval,
+                       void *(*saver)(unsigned char *data, unsigned int sz));
+int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
+                 unsigned int *sz, long long *slong);
+unsigned long quicklistCount(const quicklist *quicklist);
+int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len);
+size_t quicklistGetLzf(const quicklistNode *node, void **data);
+
+#endif
@@ -0,0 +1,137 @@
+/* 
+ * 线程私有的快速伪随机数生成器
+ *
+ * libc 的 rand() 和 random() 内部要加锁, 并且只有 31 位的输出,
+ * 跳跃表每次插入都要生成随机层数, 字典和集合的随机取样也会大量调用。
+ *
+ * 这里使用 xoshiro256** 算法: 状态为 4 个 64 位整数,
+ * 每次生成只需要几次移位、异或和乘法, 周期为 2^256-1。
+ * 状态用 splitmix64 从一个 64 位种子展开, 保证不会全为 0。
+ *
+ * 状态是线程私有的, 主线程和后台线程各自独立生成, 不需要加锁;
+ * 线程第一次使用时用时间和状态本身的地址自动播种。
+ *
+ * 这个生成器不能用于任何和安全相关的用途。
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * xoshiro256** 算法由 David Blackman 和 Sebastiano Vigna 设计 (2018),
+ * splitmix64 由 Sebastiano Vigna 编写 (2015), 两者的参考实现都以 CC0
+ * 发布到公有领域, 见 http://prng.di.unimi.it/ 。
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "rand.h"
+
+// 当前线程的生成器状态
+static __thread uint64_t rand_state[4];
+
+// 当前线程是否已经播种
+static __thread int rand_seeded = 0;
+
+/*
+ * splitmix64: 用于将一个种子展开为生成器的状态
+ */
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(const uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * 用 seed 为当前线程的生成器播种
+ * 相同的种子会得到相同的随机数序列
+ */
+void redisSrandom64(uint64_t seed) {
+    int j;
+
+    for (j = 0; j < 4; j++)
+        rand_state[j] = splitmix64(&seed);
+    rand_seeded = 1;
+}
+
+/*
+ * 线程第一次使用生成器时自动播种
+ * 时间相同时, 不同线程的状态地址不同, 得到的种子也不同
+ */
+static void randAutoSeed(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    redisSrandom64(((uint64_t)tv.tv_sec << 20) ^ tv.tv_usec ^
+                   ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)rand_state);
+}
+
+/*
+ * 返回一个 64 位的随机数 (xoshiro256**)
+ *
+ * T = O(1)
+ */
+uint64_t redisRandom64(void) {
+    uint64_t *s = rand_state;
+    uint64_t result, t;
+
+    if (!rand_seeded) randAutoSeed();
+
+    result = rotl(s[1] * 5, 7) * 9;
+    t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+/*
+ * 返回 [0, n) 之间的随机数, n 必须大于 0
+ *
+ * 用乘法取高位代替取模, 避免除法;
+ * 偏差为 n/2^64, 对于内存中的任何集合大小都可以忽略
+ *
+ * T = O(1)
+ */
+unsigned long redisRandomBelow(unsigned long n) {
+#if defined(__SIZEOF_INT128__)
+    return (unsigned long)(((unsigned __int128)redisRandom64() * n) >> 64);
+#else
+    return (unsigned long)(redisRandom64() % n);
+#endif
+}
@@ -240,6 +240,36 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     return rdbEncodeInteger(value,enc);
 }
 
+/**
+ * 将已经被 LZF 压缩的数据写入 rdb 文件
+ * data 是压缩后的数据, compress_len 是压缩后长度, original_len 是原长度
+ * 写入成功, 返回写入的字节数
+ * 写入失败, 返回 -1
+ */
+int rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len, size_t original_len) {
+    unsigned char byte;
+    int n, nwritten = 0;
+
+    // 写入压缩方式
+    byte = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_LZF;
+    if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) return -1;
+    nwritten += n;
+
+    // 写入压缩后长度
+    if ((n = rdbSaveLen(rdb,compress_len)) == -1) return -1;
+    nwritten += n;
+
+    // 写入原字符串长度
+    if ((n = rdbSaveLen(rdb,original_len)) == -1) return -1;
+    nwritten += n;
+
+    // 写入压缩后的内容
+    if ((n = rdbWriteRaw(rdb,data,compress_len)) == -1) return -1;
+    nwritten += n;
+
+    return nwritten;
+}
+
 /**
  * 尝试对字符串 s 进行压缩后写入 rdb 文件
  * 写入成功, 返回存入字符串所需字节数
@@ -248,8 +278,7 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
  */
 int rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     size_t comprlen, outlen;
-    unsigned char byte;
-    int n, nwritten = 0;
+    int nwritten;
     void *out;
 
     // 压缩字符串
@@ -262,30 +291,10 @@ int rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
         return 0;
     }
 
-    // 写入压缩方式
-    byte = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_LZF;
-    if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
-    nwritten += n;
-
-    // 写入压缩后长度
-    if ((n = rdbSaveLen(rdb,comprlen)) == -1) goto writeerr;
-    nwritten += n;
-
-    // 写入原字符串长度
-    if ((n = rdbSaveLen(rdb,len)) == -1) goto writeerr;
-    nwritten += n;
-
-    // 写入压缩后的内容
-    if ((n = rdbWriteRaw(rdb,out,comprlen)) == -1) goto writeerr;
-    nwritten += n;
-
+    nwritten = rdbSaveLzfBlob(rdb,out,comprlen,len);
     zfree(out);
 
     return nwritten;
-
-writeerr:
-    zfree(out);
-    return -1;
 }
 
 /**
@@ -459,10 +468,10 @@ robj *rdbGenericLoadStringObject(rio *rdb, int encode) {
 }
 
 robj *rdbLoadStringObject(rio *rdb) {
-    rdbGenericLoadStringObject(rdb,0);
+    return rdbGenericLoadStringObject(rdb,0);
 }
 robj *rdbLoadEncodedStringObject(rio *rdb) {
-    rdbGenericLoadStringObject(rdb,1);
+    return rdbGenericLoadStringObject(rdb,1);
 }
 
 /**
@@ -523,6 +532,22 @@ int rdbLoadDoubleValue(rio *rdb, double *val) {
     }
 }
 
+/**
+ * 将哈希对象 o 按编码对应的类型写入 rdb
+ * 写入成功, 返回写入的字节数
+ * 写入失败, 返回 -1
+ */
+static int rdbSaveHashType(rio *rdb, robj *o) {
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) 
+        return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH_ZIPLIST);
+    else if (o->encoding == REDIS_ENCODING_HT) 
+        return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH);
+    else 
+        redisPanic("Unknown hash encoding");
+
+    return -1;
+}
+
 /**
  * 将对象的类型写入 rdb
  * 写入成功, 返回写入字符所需内存长度
@@ -537,8 +562,8 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     case REDIS_LIST:
         if (o->encoding == REDIS_ENCODING_ZIPLIST) 
             return rdbSaveType(rdb,REDIS_RDB_TYPE_LIST_ZIPLIST);
-        else if (o->encoding == REDIS_ENCODING_LINKEDLIST) 
-            return rdbSaveType(rdb,REDIS_RDB_TYPE_LIST);
+        else if (o->encoding == REDIS_ENCODING_QUICKLIST) 
+            return rdbSaveType(rdb,REDIS_RDB_TYPE_LIST_QUICKLIST);
         else 
             redisPanic("Unknown list encoding");
 
@@ -553,18 +578,17 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     case REDIS_ZSET:
         if (o->encoding == REDIS_ENCODING_ZIPLIST) 
             return rdbSaveType(rdb,REDIS_RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == REDIS_ENCODING_SKIPLIST) 
+        else if (o->encoding == REDIS_ENCODING_SKIPLIST ||
+                 o->encoding == REDIS_ENCODING_BTREE) 
             return rdbSaveType(rdb,REDIS_RDB_TYPE_ZSET);
         else 
             redisPanic("Unknown sorted set encoding");
 
     case REDIS_HASH:
-        if (o->encoding == REDIS_ENCODING_ZIPLIST) 
-            return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH_ZIPLIST);
-        else if (o->encoding == REDIS_ENCODING_HT) 
-            return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH);
-        else 
-            redisPanic("Unknown hash encoding");
+        // 带有域过期时间的哈希, 内层的类型由 rdbSaveObject 写入
+        if (hashTypeFieldExpiresLen(o) > 0)
+            return rdbSaveType(rdb,REDIS_RDB_TYPE_HASH_WITH_FIELD_TTL);
+        return rdbSaveHashType(rdb,o);
     
     default:
         redisPanic("Unknown object type");
@@ -585,6 +609,33 @@ int rdbLoadObjectType(rio *rdb) {
     return type;
 }
 
+/**
+ * 将哈希 o 所有域的过期时间写入 rdb: 域的数量, 之后是 (域, 毫秒过期时间)
+ * 写入成功, 返回写入的字节数
+ * 写入失败, 返回 -1
+ */
+static int rdbSaveHashFieldExpires(rio *rdb, robj *o) {
+    unsigned long len = hashTypeFieldExpiresLen(o), j;
+    int n, nwritten = 0;
+    long long when;
+    sds field;
+
+    if ((n = rdbSaveLen(rdb,len)) == -1) return -1;
+    nwritten += n;
+
+    for (j = 0; j < len; j++) {
+        hashTypeGetFieldExpireAt(o,j,&field,&when);
+
+        if ((n = rdbSaveRawString(rdb,(unsigned char*)field,sdslen(field))) == -1) return -1;
+        nwritten += n;
+
+        if ((n = rdbSaveMillisecondTime(rdb,when)) == -1) return -1;
+        nwritten += n;
+    }
+
+    return nwritten;
+}
+
 /**
  * 将给定对象 o 保存到 rdb 文件
  * 保存成功返回, 保存对象所用的字节数
@@ -608,21 +659,26 @@ int rdbSaveObject(rio *rdb, robj *o) {
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
 
-        } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-            list *list = o->ptr;
-            listIter *li;
-            listNode *ln;
+        } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+            quicklist *ql = o->ptr;
+            quicklistNode *node = ql->head;
 
             // 写入节点数量
-            if ((n = rdbSaveLen(rdb,listLength(list))) == -1) return -1;
+            if ((n = rdbSaveLen(rdb,ql->len)) == -1) return -1;
             nwritten += n;
 
-            // 遍历所有节点, 写入
-            listRewind(list, &li);
-            while ((ln = listNext(&li))) {
-                robj *eleobj = listNodeValue(ln);
-                if ((n = rdbSaveStringObject(rdb,eleobj)) == -1) return -1;
+            // 遍历所有节点, 将节点的 ziplist 作为字符串写入
+            // 被压缩的节点直接写入压缩数据, 载入时作为 LZF 字符串解压
+            while (node) {
+                if (node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+                    void *data;
+                    size_t compress_len = quicklistGetLzf(node, &data);
+                    if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
+                } else {
+                    if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
+                }
                 nwritten += n;
+                node = node->next;
             }
             
         } else {
@@ -670,31 +726,60 @@ int rdbSaveObject(rio *rdb, robj *o) {
             
         } else if (o->encoding == REDIS_ENCODING_SKIPLIST) {
             zset *zs = o->ptr;
-            dictIterator *di = dictGetIterator(zs->dict);
-            dictEntry *de;
+            zskiplistNode *x;
 
-            if ((n = rdbSaveLen(rdb,dictSize(zs->dict)) == -1)) return -1;
+            if ((n = rdbSaveLen(rdb,zs->zsl->length)) == -1) return -1;
             nwritten += n;
             
-            while ((de = dictNext(di)) != NULL) {
-                robj *eleobj = dictGetKey(de);
-                double *score = dictGetVal(de);
+            // 按分值从小到大写入, 载入时不需要重新排序
+            for (x = zs->zsl->header->level[0].forward; x; x = x->level[0].forward) {
 
                 // 写入成员
-                if ((n = rdbSaveStringObject(rdb,eleobj)) == -1) return -1;
+                if ((n = rdbSaveStringObject(rdb,x->obj)) == -1) return -1;
                 nwritten += n;
 
                 // 写入分值
-                if ((n = rdbSaveDoubleValue(rdb,*score)) == -1) return -1;
+                if ((n = rdbSaveDoubleValue(rdb,x->score)) == -1) return -1;
                 nwritten += n;
             }
-            dictReleaseIterator(di);
+
+        } else if (o->encoding == REDIS_ENCODING_BTREE) {
+            zset *zs = o->ptr;
+            zbtreeIter it;
+            zbtreeEntry *e;
+
+            if ((n = rdbSaveLen(rdb,zs->zbt->length)) == -1) return -1;
+            nwritten += n;
+
+            // 按分值顺序写入成员和分值
+            it.node = zs->zbt->head;
+            it.idx = 0;
+            while (it.node) {
+                e = zbtIterEntry(&it);
+
+                // 写入成员
+                if ((n = rdbSaveStringObject(rdb,e->obj)) == -1) return -1;
+                nwritten += n;
+
+                // 写入分值
+                if ((n = rdbSaveDoubleValue(rdb,e->score)) == -1) return -1;
+                nwritten += n;
+
+                zbtIterNext(&it);
+            }
 
         } else {
            redisPanic("Unknown sorted set encoding");
         }
 
     } else if (o->type == REDIS_HASH) {
+        int withttl = hashTypeFieldExpiresLen(o) > 0;
+
+        // 带有域过期时间的哈希, 先写入内层的类型, 哈希之后写入过期时间
+        if (withttl) {
+            if ((n = rdbSaveHashType(rdb,o)) == -1) return -1;
+            nwritten += n;
+        }
 
         if (o->encoding == REDIS_ENCODING_ZIPLIST) {
             size_t l = ziplistBlobLen(o->ptr);
@@ -710,22 +795,27 @@ int rdbSaveObject(rio *rdb, robj *o) {
             if ((n = rdbSaveLen(rdb,dictSize((dict*)o->ptr))) == -1) return -1;
             nwritten += n;
 
-            // 写入节点
+            // 写入节点, 域和值保存在同一个哈希节点中
             while ((de = dictNext(di)) != NULL) {
-                robj *key = dictGetKey(de);
-                robj *val = dictGetVal(de);
+                sds field = dictGetKey(de);
+                sds value = hashEntryValue(field);
                 // 写入键
-                if ((n = rdbSaveStringObject(rdb,key)) == -1) return -1;
+                if ((n = rdbSaveRawString(rdb,(unsigned char*)field,sdslen(field))) == -1) return -1;
                 nwritten += n;
 
                 // 写入值
-                if ((n = rdbSaveStringObject(rdb,val)) == -1) return -1;
+                if ((n = rdbSaveRawString(rdb,(unsigned char*)value,sdslen(value))) == -1) return -1;
                 nwritten += n;
             }
             dictReleaseIterator(di);
         } else {
            redisPanic("Unknown hash encoding");
         }
+
+        if (withttl) {
+            if ((n = rdbSaveHashFieldExpires(rdb,o)) == -1) return -1;
+            nwritten += n;
+        }
     
     } else {
 
@@ -970,6 +1060,16 @@ void rdbRemoveTempFile(pid_t childpid) {
     unlink(tmpfile);
 }
 
+/**
+ * 释放有序集合载入出错时已经载入的 count 个成员, 以及成员数组本身
+ */
+static void rdbFreeZsetEntries(zsetEntry *entries, size_t count) {
+    size_t j;
+
+    for (j = 0; j < count; j++) decrRefCount(entries[j].obj);
+    zfree(entries);
+}
+
 /**
  * 从 rdb 文件中载入指定类型的对象
  * 读取成功返回对象, 否则返回 NULL
@@ -989,7 +1089,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
 
         // 创建对象
         if (len > server.list_max_ziplist_entries)
-            o = createListObject();
+            o = createQuicklistObject();
         else
             o = createZiplistObject();
 
@@ -1002,21 +1102,36 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             if (o->encoding == REDIS_ENCODING_ZIPLIST &&
                 sdsEncodedObject(ele) &&
                 sdslen(ele) > server.list_max_ziplist_value)
-                    listTypeConvert(o,REDIS_ENCODING_LINKEDLIST);
+                    listTypeConvert(o,REDIS_ENCODING_QUICKLIST);
 
             // 添加节点
+            dec = getDecodedObject(ele);
             if (o->encoding == REDIS_ENCODING_ZIPLIST) {
-                dec = getDecodedObject(ele);
-
                 o->ptr = ziplistPush(o->ptr,dec->ptr,sdslen(dec->ptr),ZIPLIST_TAIL);
-
-                decrRefCount(dec);
-                decrRefCount(ele);
-
             } else {
-                ele = tryObjectEncoding(ele);
-                listAddNodeTail(o->ptr,ele);
+                quicklistPushTail(o->ptr,dec->ptr,sdslen(dec->ptr));
             }
+            decrRefCount(dec);
+            decrRefCount(ele);
+        }
+
+    } else if (rdbtype == REDIS_RDB_TYPE_LIST_QUICKLIST) {
+        // 读取快速列表节点数
+        if ((len = rdbLoadLen(rdb,NULL)) == REDIS_RDB_LENERR) return NULL;
+
+        o = createQuicklistObject();
+
+        // 每个节点的 ziplist 以字符串保存, 直接作为新节点追加
+        while (len--) {
+            robj *aux = rdbLoadStringObject(rdb);
+            unsigned char *zl;
+
+            if (aux == NULL) return NULL;
+            zl = zmalloc(sdslen(aux->ptr));
+            memcpy(zl,aux->ptr,sdslen(aux->ptr));
+            decrRefCount(aux);
+
+            quicklistAppendZiplist(o->ptr,zl);
         }
 
     } else if (rdbtype == REDIS_RDB_TYPE_SET) {
@@ -1058,8 +1173,9 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         }
         
     } else if (rdbtype == REDIS_RDB_TYPE_ZSET) {
-        size_t zsetlen;
+        size_t zsetlen, i;
         size_t maxelelen = 0;
+        zsetEntry *entries;
         zset *zs;
 
         // 载入节点数量
@@ -1069,35 +1185,56 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         o = createZsetObject();
         zs = o->ptr;
 
+        // 先载入全部元素, 排序后一次性构建跳跃表
+        entries = zmalloc(sizeof(zsetEntry)*zsetlen);
+
         // 添加节点
-        while (zsetlen--) {
+        for (i = 0; i < zsetlen; i++) {
             robj *ele;
             double score;
-            zskiplistNode *znode;
 
             // 载入元素成员
-            if ((ele = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
+            if ((ele = rdbLoadEncodedStringObject(rdb)) == NULL) {
+                rdbFreeZsetEntries(entries,i);
+                decrRefCount(o);
+                return NULL;
+            }
             ele = tryObjectEncoding(ele);
 
             // 载入元素分值
-            if (rdbLoadDoubleValue(rdb,&score) == -1) return NULL;
+            if (rdbLoadDoubleValue(rdb,&score) == -1) {
+                decrRefCount(ele);
+                rdbFreeZsetEntries(entries,i);
+                decrRefCount(o);
+                return NULL;
+            }
 
             // 记录成员的最大长度
             if (sdsEncodedObject(ele) && sdslen(ele->ptr) > maxelelen)
                 maxelelen = sdslen(ele->ptr);
 
-            // 将元素插入到跳跃表
-            znode = zslInsert(zs->zsl,score,ele);
+            entries[i].obj = ele;
+            entries[i].score = score;
+        }
 
-            // 元素添加到字典
-            dictAdd(zs->dict,ele,&znode->score);
+        // 按顺序保存的 RDB 无需真正排序
+        zsetSortEntries(entries,zsetlen);
 
-            incrRefCount(ele);
+        // 足够大的有序集合直接载入 B+ 树
+        if (server.zset_btree_min_entries &&
+            zsetlen > server.zset_btree_min_entries)
+            zsetConvert(o,REDIS_ENCODING_BTREE);
 
-            if (zsetLength(o) <= server.zset_max_ziplist_entries &&
-                maxelelen <= server.zset_max_ziplist_value)
-                    zsetConvert(o,REDIS_ENCODING_ZIPLIST);
-        }
+        // 载入跳跃表 (或 B+ 树) 和字典
+        zsetBulkLoad(zs,entries,zsetlen);
+        zfree(entries);
+
+        // 所有元素载入之后, 再决定最终的编码
+        if (zsetLength(o) <= server.zset_max_ziplist_entries &&
+            maxelelen <= server.zset_max_ziplist_value)
+                zsetConvert(o,REDIS_ENCODING_ZIPLIST);
+        else
+            zsetTryConvertBtree(o);
 
     } else if (rdbtype == REDIS_RDB_TYPE_HASH) {
         size_t len;
@@ -1148,20 +1285,55 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             robj *field, *value;
             len--;
 
-            field = rdbLoadEncodedStringObject(rdb);
+            field = rdbLoadStringObject(rdb);
             if (field == NULL) return NULL;
-            value = rdbLoadEncodedStringObject(rdb);
+            value = rdbLoadStringObject(rdb);
             if (value == NULL) return NULL;
 
-            field = tryObjectEncoding(field);
-            value = tryObjectEncoding(value);
-
-            ret = dictAdd((dict*)o->ptr,field, value);
+            // 域和值复制到同一个哈希节点中
+            ret = dictAdd((dict*)o->ptr,
+                hashEntryNew(field->ptr,sdslen(field->ptr),value->ptr,sdslen(value->ptr)),
+                NULL);
             redisAssert(ret == REDIS_OK);
+
+            decrRefCount(field);
+            decrRefCount(value);
         }
 
         redisAssert(len == 0);
 
+    } else if (rdbtype == REDIS_RDB_TYPE_HASH_WITH_FIELD_TTL) {
+        int hashtype;
+
+        // 载入内层的哈希
+        if ((hashtype = rdbLoadObjectType(rdb)) == -1) return NULL;
+        if (hashtype != REDIS_RDB_TYPE_HASH &&
+            hashtype != REDIS_RDB_TYPE_HASH_ZIPMAP &&
+            hashtype != REDIS_RDB_TYPE_HASH_ZIPLIST) return NULL;
+        if ((o = rdbLoadObject(hashtype,rdb)) == NULL) return NULL;
+
+        // 载入域的过期时间, 哈希加入数据库时 (dbAdd) 才绑定到键
+        if ((len = rdbLoadLen(rdb,NULL)) == REDIS_RDB_LENERR) {
+            decrRefCount(o);
+            return NULL;
+        }
+        while (len--) {
+            long long when;
+
+            if ((ele = rdbLoadStringObject(rdb)) == NULL) {
+                decrRefCount(o);
+                return NULL;
+            }
+            if ((when = rdbLoadMillisecondTime(rdb)) == -1 ||
+                hashTypeLoadFieldExpire(o,ele,when) == REDIS_ERR)
+            {
+                decrRefCount(ele);
+                decrRefCount(o);
+                return NULL;
+            }
+            decrRefCount(ele);
+        }
+
     } else if (rdbtype == REDIS_RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == REDIS_RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == REDIS_RDB_TYPE_SET_INTSET   ||
@@ -1221,7 +1393,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             o->encoding = REDIS_ENCODING_ZIPLIST;
             // 检查是否需要转换编码
             if (ziplistLen(o->ptr) > server.list_max_ziplist_entries)
-                listTypeConvert(o,REDIS_ENCODING_LINKEDLIST);
+                listTypeConvert(o,REDIS_ENCODING_QUICKLIST);
             break;
 
         // intset 编码的集合
@@ -1248,7 +1420,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             o->encoding = REDIS_ENCODING_ZIPLIST;
             // 检查是否需要转换编码
             if (hashTypeLength(o) > server.hash_max_ziplist_entries)
-                listTypeConvert(o,REDIS_ENCODING_HT);
+                hashTypeConvert(o,REDIS_ENCODING_HT);
             break;
 
         default:
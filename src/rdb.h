@@ -6,7 +6,7 @@
 #include "redis.h"
 
 // RDB 版本号, 当新版本不能兼容旧版本时, 版本增1
-#define REDIS_RDB_VERSION 6
+#define REDIS_RDB_VERSION 8
 
 /**
  * 通过读取第一字节的最高 2 位来判断长度
@@ -51,11 +51,14 @@
 #define REDIS_RDB_TYPE_SET_INTSET 11
 #define REDIS_RDB_TYPE_ZSET_ZIPLIST 12
 #define REDIS_RDB_TYPE_HASH_ZIPLIST 13
+#define REDIS_RDB_TYPE_LIST_QUICKLIST 14
+// 带有域过期时间的哈希: 内层的哈希类型和哈希本身, 之后是域的数量和 (域, 毫秒过期时间)
+#define REDIS_RDB_TYPE_HASH_WITH_FIELD_TTL 15
 
 /**
  * 检查给定类型是否对象
  */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 4) || (t >= 9 && t <= 13))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 4) || (t >= 9 && t <= 15))
 
 /**
  * 数据库特殊操作标识符
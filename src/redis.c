@@ -27,6 +27,37 @@ struct sharedObjectsStruct shared;
 
 struct redisServer server; 
 
+/*-------------------------- 字典类型 --------------------------*/
+
+/*
+ * sds 键的哈希函数
+ */
+unsigned int dictSdsHash(const void *key) {
+    return dictGenHashFunction((unsigned char*)key,sdslen((sds)key));
+}
+
+/*
+ * 比较两个 sds 键
+ */
+int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2) {
+    size_t l1, l2;
+    DICT_NOTUSED(privdata);
+
+    l1 = sdslen((sds)key1);
+    l2 = sdslen((sds)key2);
+    if (l1 != l2) return 0;
+    return memcmp(key1,key2,l1) == 0;
+}
+
+/*
+ * 释放哈希节点, 域和值在同一块内存中, 见 hashEntryNew
+ */
+static void dictHashEntryDestructor(void *privdata, void *key) {
+    DICT_NOTUSED(privdata);
+
+    hashEntryFree(key);
+}
+
 dictType setDictType = {
     NULL,            /* dictEncObjHash hash function */
     NULL,                      /* key dup */
@@ -45,12 +76,14 @@ dictType zsetDictType = {
     NULL                       /* val destructor */
 };
 
+/* Hash type hash table. 字典的键是同时保存域和值的哈希节点 (sds),
+ * 按域查找, 字典的值不使用 */
 dictType hashDictType = {
-    NULL,            /* dictEncObjHash hash function */
+    dictSdsHash,               /* hash function */
     NULL,                      /* key dup */
     NULL,                      /* val dup */
-    NULL,      /* dictEncObjKeyCompare key compare */
-    NULL,                      /* dictRedisObjectDestructor key destructor */
+    dictSdsKeyCompare,         /* key compare */
+    dictHashEntryDestructor,   /* key destructor */
     NULL                       /* val destructor */
 };
 
@@ -109,4 +142,116 @@ void updateDictResizePolicy(void) {
         dictEnableResize();
     else
         dictDisableResize();
-}
\ No newline at end of file
+}
+/*-------------------------- 共享对象 --------------------------*/
+
+/*
+ * 创建一个共享的字符串对象
+ */
+static robj *createSharedString(char *s) {
+    return makeObjectShared(createObject(REDIS_STRING,sdsnew(s)));
+}
+
+/*
+ * 创建服务器的共享对象 (常用回复, 小整数等)
+ *
+ * 所有共享对象都通过 makeObjectShared 标记为 REDIS_SHARED_REFCOUNT,
+ * 这样 incrRefCount / decrRefCount 不会修改它们的引用计数,
+ * 后台线程 (见 lazyfree.c) 释放引用了共享对象的值时也不会和主线程竞争
+ */
+void createSharedObjects(void) {
+    int j;
+
+    // 常用回复
+    shared.crlf = createSharedString("\r\n");
+    shared.ok = createSharedString("+OK\r\n");
+    shared.err = createSharedString("-ERR\r\n");
+    shared.emptybulk = createSharedString("$0\r\n\r\n");
+    shared.czero = createSharedString(":0\r\n");
+    shared.cone = createSharedString(":1\r\n");
+    shared.cnegone = createSharedString(":-1\r\n");
+    shared.nullbulk = createSharedString("$-1\r\n");
+    shared.nullmultibulk = createSharedString("*-1\r\n");
+    shared.emptymultibulk = createSharedString("*0\r\n");
+    shared.pong = createSharedString("+PONG\r\n");
+    shared.queued = createSharedString("+QUEUED\r\n");
+    shared.emptyscan = createSharedString("*2\r\n$1\r\n0\r\n*0\r\n");
+
+    // 常用错误回复
+    shared.wrongtypeerr = createSharedString(
+        "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+    shared.nokeyerr = createSharedString("-ERR no such key\r\n");
+    shared.syntaxerr = createSharedString("-ERR syntax error\r\n");
+    shared.sameobjecterr = createSharedString(
+        "-ERR source and destination objects are the same\r\n");
+    shared.outofrangeerr = createSharedString("-ERR index out of range\r\n");
+    shared.noscripterr = createSharedString(
+        "-NOSCRIPT No matching script. Please use EVAL.\r\n");
+    shared.loadingerr = createSharedString(
+        "-LOADING Redis is loading the dataset in memory\r\n");
+    shared.slowscripterr = createSharedString(
+        "-BUSY Redis is busy running a script. You can only call SCRIPT KILL or SHUTDOWN NOSAVE.\r\n");
+    shared.masterdownerr = createSharedString(
+        "-MASTERDOWN Link with MASTER is down and slave-serve-stale-data is set to 'no'.\r\n");
+    shared.bgsaveerr = createSharedString(
+        "-MISCONF Redis is configured to save RDB snapshots, but is currently not able to persist on disk. Commands that may modify the data set are disabled. Please check Redis logs for details about the error.\r\n");
+    shared.roslaveerr = createSharedString(
+        "-READONLY You can't write against a read only slave.\r\n");
+    shared.noautherr = createSharedString("-NOAUTH Authentication required.\r\n");
+    shared.oomerr = createSharedString(
+        "-OOM command not allowed when used memory > 'maxmemory'.\r\n");
+    shared.execaborterr = createSharedString(
+        "-EXECABORT Transaction discarded because of previous errors.\r\n");
+    shared.noreplicaserr = createSharedString("-NOREPLICAS Not enough good slaves to write.\r\n");
+    shared.busykeyerr = createSharedString("-BUSYKEY Target key name already exists.\r\n");
+
+    shared.space = createSharedString(" ");
+    shared.colon = createSharedString(":");
+    shared.plus = createSharedString("+");
+
+    // SELECT 命令
+    for (j = 0; j < REDIS_SHARED_SELECT_CMDS; j++) {
+        char dictid_str[64];
+        int dictid_len;
+
+        dictid_len = ll2string(dictid_str,sizeof(dictid_str),j);
+        shared.select[j] = makeObjectShared(createObject(REDIS_STRING,
+            sdscatprintf(sdsempty(),
+                "*2\r\n$6\r\nSELECT\r\n$%d\r\n%s\r\n",
+                dictid_len, dictid_str)));
+    }
+
+    // 发布与订阅的回复
+    shared.messagebulk = createSharedString("$7\r\nmessage\r\n");
+    shared.pmessagebulk = createSharedString("$8\r\npmessage\r\n");
+    shared.subscribebulk = createSharedString("$9\r\nsubscribe\r\n");
+    shared.unsubscribebulk = createSharedString("$11\r\nunsubscribe\r\n");
+    shared.psubscribebulk = createSharedString("$10\r\npsubscribe\r\n");
+    shared.punsubscribebulk = createSharedString("$12\r\npunsubscribe\r\n");
+
+    // 传播时使用的命令名
+    shared.del = createSharedString("DEL");
+    shared.rpop = createSharedString("RPOP");
+    shared.lpop = createSharedString("LPOP");
+    shared.lpush = createSharedString("LPUSH");
+    shared.hdel = createSharedString("HDEL");
+
+    // 共享整数, 见 createStringObjectFromLongLong 和 tryObjectEncoding
+    for (j = 0; j < REDIS_SHARED_INTEGERS; j++) {
+        shared.integers[j] = createObject(REDIS_STRING,(void*)(long)j);
+        shared.integers[j]->encoding = REDIS_ENCODING_INT;
+        makeObjectShared(shared.integers[j]);
+    }
+
+    // 多条批量回复和批量回复的长度前缀
+    for (j = 0; j < REDIS_SHARED_BULKHDR_LEN; j++) {
+        shared.mbulkhdr[j] = makeObjectShared(createObject(REDIS_STRING,
+            sdscatprintf(sdsempty(),"*%d\r\n",j)));
+        shared.bulkhdr[j] = makeObjectShared(createObject(REDIS_STRING,
+            sdscatprintf(sdsempty(),"$%d\r\n",j)));
+    }
+
+    // 有序集合字典序范围的边界
+    shared.minstring = createSharedString("minstring");
+    shared.maxstring = createSharedString("maxstring");
+}
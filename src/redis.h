@@ -20,8 +20,10 @@
 #include "adlist.h"
 #include "zmalloc.h"
 #include "ziplist.h"
+#include "quicklist.h"
 #include "intset.h"
 #include "util.h"
+#include "rand.h"
 
 #define REDIS_OK 0
 #define REDIS_ERR -1
@@ -29,6 +31,7 @@
 /* 默认的服务器配置值*/
 
 #define REDIS_SHARED_INTEGERS 10000  /* redis字符串对象的整数编码的共享整数范围(1~10000) */
+#define REDIS_SHARED_REFCOUNT INT_MAX  /* 共享对象的引用计数, 不会被修改, 见 makeObjectShared */
 #define REDIS_SHARED_SELECT_CMDS 10
 
 // 对象类型
@@ -48,15 +51,23 @@
 #define REDIS_ENCODING_INTSET 6
 #define REDIS_ENCODING_SKIPLIST 7
 #define REDIS_ENCODING_EMBSTR 8
+#define REDIS_ENCODING_BTREE 9
+#define REDIS_ENCODING_QUICKLIST 10
 
 /* 客户端标识标志 redisClient->flags */
 #define REDIS_MULTI (1<<3)
+#define REDIS_BLOCKED (1<<4)    /* 客户端正在等待阻塞操作 */
 
 /* 客户端阻塞状态 */
 #define REDIS_BLOCKED_NONE 0
 #define REDIS_BLOCKED_LIST 1
 #define REDIS_BLOCKED_WAIT 2
 
+/* 阻塞超时时间轮, 共 LEVELS 层, 每层 2^BITS 个槽, 见 blocked.c */
+#define REDIS_BLOCK_WHEEL_LEVELS 4
+#define REDIS_BLOCK_WHEEL_BITS 8
+#define REDIS_BLOCK_WHEEL_SLOTS (1<<REDIS_BLOCK_WHEEL_BITS)
+
 /* 双端链表的方向 */
 #define REDIS_HEAD 0
 #define REDIS_TAIL 1
@@ -139,8 +150,8 @@ typedef struct {
     // ziplist 索引, 迭代 ziplist 编码的列表时使用
     unsigned char *zi;
 
-    // 链表节点的指针, 迭代双端链表编码的列表时使用
-    listNode *ln;
+    // 快速列表迭代器, 迭代快速列表编码的列表时使用
+    quicklistIter *iter;
 
 } listTypeIterator;
 
@@ -155,8 +166,8 @@ typedef struct {
     // 压缩列表节点
     unsigned char *zi;
 
-    // 双端链表节点
-    listNode *ln;
+    // 快速列表元素
+    quicklistEntry entry;
     
 } listTypeEntry;
 
@@ -203,6 +214,29 @@ typedef struct {
 #define REDIS_HASH_KEY 1
 #define REDIS_HASH_VALUE 2
 
+/*
+ * HT 编码的哈希, 每个域和它的值保存在同一块内存中:
+ *
+ * | sdshdr | field | \0 | 填充 | sdshdr | value | \0 |
+ *
+ * 字典的键指向 field , 它和 value 都是完整的 sds , 可以直接读取,
+ * 但不能单独扩展或释放, 见 t_hash.c 的 hashEntryNew
+ *
+ * 值的 sdshdr 按 sdshdr 的对齐要求对齐,
+ * hashEntryValueOffset 返回它相对于内存块首地址的偏移量,
+ * 这个偏移量也等于值相对于域的偏移量
+ */
+#define hashEntryValueOffset(flen) \
+    ((sizeof(struct sdshdr)+(flen)+1+__alignof__(struct sdshdr)-1) & \
+     ~(__alignof__(struct sdshdr)-1))
+
+/* 返回哈希节点 entry 的值 */
+#define hashEntryValue(entry) \
+    ((sds)((entry)+hashEntryValueOffset(sdslen(entry))))
+
+// HGETALL 等命令拼接回复时, 每个回复块的大小
+#define REDIS_REPLY_CHUNK_BYTES (16*1024)
+
 // todo 暂时简化
 // #define LRU_CLOCK() ((1000/server.hz <= REDIS_LRU_CLOCK_RESOLUTION) ? server.lruclock : getLRUClock())
 #define LRU_CLOCK() (getLRUClock())
@@ -214,6 +248,22 @@ typedef struct {
     _var.ptr = _ptr; \
 } while(0);
 
+/*
+ * 以地址为键的缓存 (ziplist 的索引和指纹, 域的过期索引), 见 ptrcache.c
+ */
+typedef struct ptrCache {
+
+    // 地址 => 缓存项
+    dict *entries;
+
+    // 缓存项数量的上限, 为 0 时不限制
+    unsigned long max_entries;
+
+    // 释放缓存值的函数
+    void (*freeval)(void *val);
+
+} ptrCache;
+
 typedef struct redisDb {
 
     // 数据库键空间, 保存所有键值对
@@ -239,6 +289,16 @@ typedef struct redisDb {
 
 } redisDb;
 
+// 列表阻塞操作解除阻塞时的移动方式
+typedef struct listPos {
+    // 从列表的哪一端弹出, REDIS_HEAD 或 REDIS_TAIL
+    int wherefrom;
+    // 添加到目标列表的哪一端, 用于 BLMOVE
+    int whereto;
+    // 最多移动的元素数量, 0 表示只移动一个元素并回复单个值
+    long count;
+} listPos;
+
 // 阻塞状态
 typedef struct blockingState {
 
@@ -255,6 +315,8 @@ typedef struct blockingState {
     // 用于 BRPOPLPUSH 命令
     robj *target;           /* The key that should receive the element,
                              * for BRPOPLPUSH. */
+    // 解除阻塞时的弹出和添加方式
+    listPos listpos;
 
     /* REDIS_BLOCK_WAIT */
     // 等待 ACK 的复制节点数量
@@ -262,8 +324,31 @@ typedef struct blockingState {
     // 复制偏移量
     long long reploffset;   /* Replication offset to reach. */
 
+    /* 超时时间轮 */
+    // 同一个槽中的前后客户端
+    struct redisClient *tw_prev, *tw_next;
+    // 所在的槽, 不在时间轮中时为 NULL
+    struct redisClient **tw_slot;
+
 } blockingState;
 
+// 阻塞超时时间轮
+typedef struct blockTimerWheel {
+
+    // 下一个要处理的时间 (毫秒)
+    mstime_t now;
+
+    // 时间轮中的客户端数量
+    unsigned long count;
+
+    // 第 L 层的槽 i 保存超时时间第 L 段 BITS 位为 i 的客户端
+    struct redisClient *slots[REDIS_BLOCK_WHEEL_LEVELS][REDIS_BLOCK_WHEEL_SLOTS];
+
+    // 超出时间轮范围的客户端
+    struct redisClient *overflow;
+
+} blockTimerWheel;
+
 // 记录解除了客户端的阻塞状态的键，以及键所在的数据库。
 typedef struct readyList {
     redisDb *db;
@@ -308,15 +393,45 @@ struct redisServer {
 
     size_t hash_max_ziplist_entries;
     size_t hash_max_ziplist_value;
+    // ziplist 编码的哈希的域数量不少于该值时, 建立域指纹加速查找, 为 0 时不使用
+    size_t hash_ziplist_fingerprint_min_entries;
+    // ziplist 地址 => 域指纹, 见 t_hash.c
+    ptrCache *hash_fingerprint_cache;
+    // 哈希对象的地址 => 域的过期索引, 见 t_hash.c
+    ptrCache *hash_field_expires;
     size_t list_max_ziplist_entries;
     size_t list_max_ziplist_value;
+    // 快速列表节点的填充因子, 正数为单节点的最大元素数量,
+    // -1 到 -5 为单节点的最大字节数 4KB 到 64KB, 见 quicklistSetFill
+    int list_quicklist_fill;
+    // 快速列表两端各有多少个节点不压缩, 其余节点使用 LZF 压缩, 为 0 时不压缩
+    int list_compress_depth;
     size_t set_max_intset_entries;
+    // 集合运算的并行线程数量, 小于 2 时不并行
+    int set_parallel_threads;
+    // 集合运算需要处理的元素数量达到该值时才并行执行
+    size_t set_parallel_min_elements;
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
+    // 有序集合的成员数量超过该值时, 由 SKIPLIST 转为 BTREE 编码
+    // 为 0 时不使用 BTREE 编码
+    size_t zset_btree_min_entries;
+    // ziplist 编码的有序集合的稀疏索引采样间隔, 为 0 时不建立索引
+    unsigned int zset_ziplist_index_stride;
+    // ziplist 地址 => 稀疏索引, 见 t_zset.c
+    ptrCache *zset_index_cache;
+    // 一次删除的元素数量达到该值时, 交给后台线程释放, 为 0 时总是同步释放
+    size_t lazyfree_threshold;
+    // 为真时, 服务器内部删除键 (过期、覆盖等) 也使用惰性释放
+    int lazyfree_lazy_server_del;
     size_t hll_sparse_max_bytes;
 
     // 用于 BLPOP, BRPOP, BRPOPLPUSH 
     list *ready_keys;
+    // 被阻塞的客户端数量
+    unsigned int bpop_blocked_clients;
+    // 阻塞超时时间轮
+    blockTimerWheel bpop_timer_wheel;
 
     int dbnum; // 数据库的个数
 
@@ -409,7 +524,7 @@ struct sharedObjectsStruct {
     *masterdownerr, *roslaveerr, *execaborterr, *noautherr, *noreplicaserr,
     *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
     *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *rpop, *lpop,
-    *lpush, *emptyscan, *minstring, *maxstring,
+    *lpush, *hdel, *emptyscan, *minstring, *maxstring,
     *select[REDIS_SHARED_SELECT_CMDS],
     *integers[REDIS_SHARED_INTEGERS],
     *mbulkhdr[REDIS_SHARED_BULKHDR_LEN], /* "*<value>\r\n" */
@@ -429,7 +544,7 @@ struct sharedObjectsStruct {
 /*--------------------- 压缩列表 -----------------------*/
 
 #define ZSKIPLIST_MAXLEVEL 32
-#define ZSKIPLIST_P 0.25
+#define ZSKIPLIST_P 0.25  /* zslRandomLevel 按 1/4 的概率实现, 修改时需同步 */
 
 // // 跳跃表节点 (level必须放在最后一个)
 // typedef struct zskiplistNode 
@@ -506,6 +621,99 @@ typedef struct zskiplist {
     int level;
 
 } zskiplist;
+/*--------------------- 计数 B+ 树 -----------------------*/
+
+// 叶子节点最多保存的成员数量
+#define ZBTREE_LEAF_ENTRIES 64
+// 内部节点最多拥有的子节点数量
+#define ZBTREE_INNER_CHILDREN 32
+// 树的最大高度, 32^16 远大于成员数量的上限
+#define ZBTREE_MAXDEPTH 16
+
+/*
+ * B+ 树成员, 成员对象和分值紧凑地保存在一起
+ */
+typedef struct zbtreeEntry {
+
+    // 成员对象
+    robj *obj;
+
+    // 分值
+    double score;
+
+} zbtreeEntry;
+
+/*
+ * B+ 树节点
+ *
+ * 叶子节点按序保存成员, 并与左右相邻的叶子节点组成双向链表
+ * 内部节点保存子节点指针, 每个子树的成员数量(用于计算排位),
+ * 以及每个子树的最小成员(借用叶子中的对象, 不持有引用计数)
+ */
+typedef struct zbtreeNode {
+
+    // 是否为叶子节点
+    unsigned short leaf;
+
+    // 叶子节点: 成员数量, 内部节点: 子节点数量
+    unsigned short count;
+
+    union {
+        // 叶子节点
+        struct {
+            struct zbtreeNode *prev, *next;
+            zbtreeEntry entries[ZBTREE_LEAF_ENTRIES];
+        } l;
+
+        // 内部节点
+        struct {
+            unsigned long sizes[ZBTREE_INNER_CHILDREN];
+            zbtreeEntry keys[ZBTREE_INNER_CHILDREN];
+            struct zbtreeNode *children[ZBTREE_INNER_CHILDREN];
+        } i;
+    } u;
+
+} zbtreeNode;
+
+/*
+ * 计数 B+ 树
+ */
+typedef struct zbtree {
+
+    // 根节点, 空树为 NULL
+    zbtreeNode *root;
+
+    // 第一个和最后一个叶子节点
+    zbtreeNode *head, *tail;
+
+    // 成员数量
+    unsigned long length;
+
+    // 树的高度(叶子节点为第 1 层)
+    int height;
+
+} zbtree;
+
+/*
+ * B+ 树迭代器, 指向某个叶子节点中的一个成员
+ * node 为 NULL 表示迭代结束
+ */
+typedef struct zbtreeIter {
+    zbtreeNode *node;
+    int idx;
+} zbtreeIter;
+
+// 迭代器当前指向的成员
+#define zbtIterEntry(it) (&(it)->node->u.l.entries[(it)->idx])
+
+/*
+ * 批量构建有序集合时使用的 (成员, 分值) 对
+ */
+typedef struct zsetEntry {
+    robj *obj;
+    double score;
+} zsetEntry;
+
 /**
  * 有序集合
  * 保存两种结构, 是为在不同场景下的操作, 取最优解
@@ -514,6 +722,8 @@ typedef struct zset {
 
     // 字典, 键为成员, 值为分值
     // 用于支持 O(1) 复杂度的按成员取分值操作
+    // SKIPLIST 编码时值为指向跳跃表节点分值的指针,
+    // BTREE 编码时值直接保存分值 (dictGetDoubleVal)
     dict *dict;
 
     // 跳跃表, 按分值排序成员
@@ -521,6 +731,9 @@ typedef struct zset {
     // 以及范围操作
     zskiplist *zsl;
 
+    // 计数 B+ 树, BTREE 编码时代替跳跃表使用, 此时 zsl 为 NULL
+    zbtree *zbt;
+
 } zset;
 
 #include "rdb.h"
@@ -551,8 +764,16 @@ extern dictType setDictType;
 extern dictType zsetDictType;
 extern dictType hashDictType;
 
+/* 字典类型的函数, 见 redis.c */
+unsigned int dictSdsHash(const void *key);
+int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
+
+/* 共享对象, 见 redis.c */
+void createSharedObjects(void);
+
 /* Redis 对象实现 */
 void decrRefCount(robj *o);
+robj *makeObjectShared(robj *o);
 void decrRefCountVoid(void *o);
 void incrRefCount(robj *o);
 robj *resetRefCount(robj *obj);
@@ -572,7 +793,7 @@ robj *getDecodedObject(robj *o);
 size_t stringObjectLen(robj *o);
 robj *createStringObjectFromLongLong(long long value);
 robj *createStringObjectFromLongDouble(long double value);
-robj *createListObject(void);
+robj *createQuicklistObject(void);
 robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
@@ -598,6 +819,7 @@ int equalStringObjects(robj *a, robj *b);
 zskiplist *zslCreate(void);
 void zslFree(zskiplist *zsl);
 zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj);
+void zslBulkLoad(zskiplist *zsl, zsetEntry *entries, unsigned long n);
 unsigned char *zzlInsert(unsigned char *zl, robj *ele, double score);
 int zslDelete(zskiplist *zsl, double score, robj *obj);
 zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
@@ -608,10 +830,58 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 unsigned int zsetLength(robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
 unsigned long zslGetRank(zskiplist *zsl, double score, robj *o);
+zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank);
+void zsetTryConvertBtree(robj *zobj);
+void zsetSortEntries(zsetEntry *entries, unsigned long n);
+void zsetBulkLoad(zset *zs, zsetEntry *entries, unsigned long n);
+unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
+unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
+unsigned char *zzlFirstInRangeWithRank(unsigned char *zl, zrangespec *range, unsigned long *rank);
+unsigned char *zzlLastInRangeWithRank(unsigned char *zl, zrangespec *range, unsigned long *rank);
+unsigned char *zzlSeekRank(unsigned char *zl, unsigned long rank);
+int zzlLexRangeRanks(unsigned char *zl, zlexrangespec *range, unsigned long *first, unsigned long *last);
+void zzlIndexInvalidate(unsigned char *zl);
+void zzlIndexSetDb(unsigned char *zl, int dbid);
+void zzlIndexResetDb(int dbid);
+
+/* 哈希 API */
+void hzlFingerprintInvalidate(unsigned char *zl);
+void hzlFingerprintResetDb(int dbid);
+sds hashEntryNew(const void *field, size_t flen, const void *value, size_t vlen);
+void hashEntryFree(sds entry);
+unsigned long hashTypeLength(robj *o);
+int hashTypeExists(robj *o, robj *field);
+int hashTypeDelete(robj *o, robj *field);
+void hashTypeClearFieldExpires(robj *o);
+void hashTypeClearDbFieldExpires(redisDb *db);
+void hashTypeSetDb(redisDb *db, robj *key, robj *o);
+unsigned long hashTypeFieldExpiresLen(robj *o);
+void hashTypeGetFieldExpireAt(robj *o, unsigned long index, sds *field, long long *when);
+int hashTypeLoadFieldExpire(robj *o, robj *field, long long when);
+int hashTypeExpireFieldsIfNeeded(redisDb *db, robj *key);
+
+/* B+ 树 API */
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+void zbtInsert(zbtree *zbt, double score, robj *obj);
+int zbtDelete(zbtree *zbt, double score, robj *obj);
+unsigned long zbtGetRank(zbtree *zbt, double score, robj *obj);
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtreeIter *it);
+unsigned long zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it);
+unsigned long zbtLastInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it);
+unsigned long zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it);
+unsigned long zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it);
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict);
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict);
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end, dict *dict);
+int zbtIterNext(zbtreeIter *it);
+int zbtIterPrev(zbtreeIter *it);
 
 
 /* Core function 核心函数 */
 unsigned int getLRUClock(void);
+long long ustime(void);
+long long mstime(void);
 
 
 /* networking.c -- Networking and Client related operations 
@@ -619,15 +889,21 @@ unsigned int getLRUClock(void);
  */
 void addReplyBulk(redisClient *c, robj *obj);
 void addReply(redisClient *c, robj *obj);
+void addReplyString(redisClient *c, char *s, size_t len);
+void addReplySds(redisClient *c, sds s);
 void addReplyError(redisClient *c, char *err);
 void addReplyMultiBulkLen(redisClient *c, long length);
+void *addDeferredMultiBulkLength(redisClient *c);
+void setDeferredMultiBulkLength(redisClient *c, void *node, long length);
 void addReplyBulkCString(redisClient *c, char *s);
 void addReplyBulkCBuffer(redisClient *c, void *p, size_t len);
+void addReplyBulkLongLong(redisClient *c, long long ll);
 void addReplyDouble(redisClient *c, double d);
 void addReplyLongLong(redisClient *c, long long ll);
 
 void rewriteClientCommandArgument(redisClient *c, int i, robj *newval);
 void rewriteClientCommandVector(redisClient *c, int argc, ...);
+void replaceClientCommandVector(redisClient *c, int argc, robj **argv);
 
 /* db.c -- Keyspace access API 
  * 数据库操作函数
@@ -639,6 +915,12 @@ robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply);
 robj *lookupKeyReadOrReply(redisClient *c, robj *key, robj *reply);
 void dbAdd(redisDb *db, robj *key, robj *val);
 int dbDelete(redisDb *db, robj *key);
+int dbSyncDelete(redisDb *db, robj *key);
+void propagateExpire(redisDb *db, robj *key);
+void propagateHashFieldsExpire(redisDb *db, robj *key, robj **fields, int numfields);
+#define REDIS_EMPTYDB_NO_FLAGS 0      /* No flags. */
+#define REDIS_EMPTYDB_ASYNC (1<<0)    /* 由后台线程释放数据库 */
+long long emptyDb(int flags, void(callback)(void*));
 void dbOverwrite(redisDb *db, robj *key, robj *val);
 void setKey(redisDb *db, robj *key, robj *val);
 
@@ -648,12 +930,47 @@ void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
 
 
+/* ptrcache.c -- 以地址为键的缓存 */
+ptrCache *ptrCacheCreate(unsigned long max_entries, void (*freeval)(void *val));
+unsigned long ptrCacheSize(ptrCache *cache);
+void *ptrCacheFind(ptrCache *cache, void *ptr);
+void ptrCacheAdd(ptrCache *cache, void *ptr, void *val, int dbid);
+void ptrCacheDelete(ptrCache *cache, void *ptr);
+void ptrCacheSetDb(ptrCache *cache, void *ptr, int dbid);
+void ptrCacheEmptyDb(ptrCache *cache, int dbid);
+uint64_t ptrCacheChecksum(unsigned char *buf, size_t len, size_t header,
+                          uint32_t *offsets, unsigned int count);
+void ptrCacheSetCurrentDb(int dbid);
+int ptrCacheCurrentDb(void);
+
+/* lazyfree.c -- 惰性释放 */
+int dbAsyncDelete(redisDb *db, robj *key);
+void emptyDbAsync(redisDb *db);
+size_t lazyfreeGetFreeEffort(robj *obj);
+size_t lazyfreeGetPendingObjectsCount(void);
+size_t lazyfreeGetPendingEffort(void);
+size_t lazyfreeGetFreedObjectsCount(void);
+int lazyfreeInBackground(void);
+
+/* bitops.c -- 位操作 */
+size_t redisPopcount(void *s, long count);
+long redisBitpos(void *s, unsigned long count, int bit);
+
 /* Keyspace events notification */
 void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid);
 int keyspaceEventsStringToFlags(char *classes);
 sds keyspaceEventsFlagsToString(int flags);
 
 /* 阻塞客户端的方法 */
+int getTimeoutFromObjectOrReply(redisClient *c, robj *object, mstime_t *timeout, int unit);
 void blockClient(redisClient *c, int btype);
+void unblockClient(redisClient *c);
+void replyToBlockedClientTimedOut(redisClient *c);
+void handleBlockedClientsTimeout(void);
+
+/* 列表阻塞操作 */
+void unblockClientWaitingData(redisClient *c);
+void handleClientsBlockedOnLists(void);
+void signalListAsReady(redisClient *c, robj *key);
 
 #endif
\ No newline at end of file
@@ -189,6 +189,32 @@ sds sdsRemoveFreeSpace(sds s) {
     return sh->buf;
 }
 
+/**
+ * 根据 incr 参数, 增加 sds 的长度, 缩减空余空间,
+ * 并将 \0 放到新字符串的末尾
+ *
+ * 用于调用 sdsMakeRoomFor() 扩展空间并直接写入 buf 之后, 修正 sds 的长度,
+ * incr 为负数时截短字符串
+ *
+ * T = O(1)
+ */
+void sdsIncrLen(sds s, int incr) {
+
+    struct sdshdr *sh = (void*)(s-(sizeof(struct sdshdr)));
+
+    // 确保写入的内容没有超出分配的空间
+    assert(sh->free >= incr);
+
+    // 更新长度和空余空间
+    sh->len += incr;
+    sh->free -= incr;
+
+    assert(sh->free >= 0);
+
+    // 新字符串的末尾
+    s[sh->len] = '\0';
+}
+
 /**
  * 将 sds 扩充至指定长度，未使用的空间以 0 字节填充
  * 
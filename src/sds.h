@@ -34,6 +34,7 @@ sds sdsempty(void);
 sds sdscatlen(sds s,const void *t,size_t len);
 sds sdsnewlen(const void *init, size_t initlen);
 sds sdsnew(const char *init);
+sds sdsdup(const sds s);
 int sdscmp(const sds s1, const sds s2);
 void sdsfree(sds s);
 
@@ -41,11 +42,13 @@ sds sdstrim(sds s,const char *cset);
 sds sdscat(sds s,const char *t);
 void sdsrange(sds s,int start,int end);
 sds sdscatsds(sds s, const sds t);
+sds sdscatprintf(sds s, const char *fmt, ...);
 sds sdsfromlonglong(long long value);
 
 sds sdsgrowzero(sds s,size_t len);
 sds sdsMakeRoomFor(sds s,size_t addlen);
 
 sds sdsRemoveFreeSpace(sds s);
+void sdsIncrLen(sds s, int incr);
 
 #endif
\ No newline at end of file
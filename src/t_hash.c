@@ -14,8 +14,74 @@
  */
 
 #include "redis.h"
+#include "endianconv.h"
 #include <math.h>
 
+/*----------------------------- HT 编码的哈希节点 ------------------------------*/
+
+/*
+ * HT 编码的哈希不再为每个域和值分别创建字符串对象,
+ * 而是把域和值两个 sds 连续地放在同一块内存中, 作为字典的键:
+ *
+ * | sdshdr | field | \0 | 填充 | sdshdr | value | \0 |
+ *
+ * 填充让值的 sdshdr 满足对齐要求, 见 hashEntryValueOffset 。
+ * 每个域只需要一次内存分配 (加上字典节点), 不需要 robj 和引用计数。
+ * 字典按 field 计算哈希值和比较 (hashDictType), 用域的 sds 就可以直接查找,
+ * 值通过 hashEntryValue 取得。
+ */
+
+/**
+ * 创建一个保存域 field 和值 value 的哈希节点, 返回指向域的 sds
+ *
+ * T = O(N)
+ */
+sds hashEntryNew(const void *field, size_t flen, const void *value, size_t vlen) {
+    struct sdshdr *fh, *vh;
+
+    fh = zmalloc(hashEntryValueOffset(flen)+sizeof(struct sdshdr)+vlen+1);
+    fh->len = flen;
+    fh->free = 0;
+    memcpy(fh->buf,field,flen);
+    fh->buf[flen] = '\0';
+
+    vh = (struct sdshdr*)((char*)fh+hashEntryValueOffset(flen));
+    vh->len = vlen;
+    vh->free = 0;
+    memcpy(vh->buf,value,vlen);
+    vh->buf[vlen] = '\0';
+
+    return fh->buf;
+}
+
+/**
+ * 释放哈希节点
+ */
+void hashEntryFree(sds entry) {
+    zfree(entry-sizeof(struct sdshdr));
+}
+
+/**
+ * 将哈希节点 entry 的值设为 value , 返回新的节点
+ * 长度不变时原地修改, 否则创建新的节点并释放旧的节点,
+ * 调用者负责更新字典节点中的键
+ *
+ * T = O(N)
+ */
+static sds hashEntrySetValue(sds entry, const void *value, size_t vlen) {
+    sds old = hashEntryValue(entry), new;
+
+    if (sdslen(old) == vlen) {
+        memcpy(old,value,vlen);
+        return entry;
+    }
+
+    new = hashEntryNew(entry,sdslen(entry),value,vlen);
+    hashEntryFree(entry);
+
+    return new;
+}
+
 /*----------------------------- 迭代器 ------------------------------*/
 
 /**
@@ -133,16 +199,14 @@ void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
 /**
  * 从 ENCODING_HT 编码的哈希中, 取出迭代器指针当前指向节点的域或值
  */
-void hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what, robj **dst) {
+sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what) {
+    sds entry;
 
     redisAssert(hi->encoding == REDIS_ENCODING_HT);
 
-    if (what & REDIS_HASH_KEY) {
-        *dst = dictGetKey(hi->de);
+    entry = dictGetKey(hi->de);
 
-    } else {
-        *dst = dictGetVal(hi->de);
-    }
+    return (what & REDIS_HASH_KEY) ? entry : hashEntryValue(entry);
 }
 
 /**
@@ -171,8 +235,9 @@ robj *hashTypeCurrentObject(hashTypeIterator *hi, int what) {
     } else if (hi->encoding == REDIS_ENCODING_HT) {
 
         // 取出域或值
-        hashTypeCurrentFromHashTable(hi,what,&dst);
-        incrRefCount(dst);
+        sds ele = hashTypeCurrentFromHashTable(hi,what);
+
+        dst = createStringObject(ele,sdslen(ele));
 
     } else {
         redisPanic("Unknown hash encoding");
@@ -203,18 +268,25 @@ void hashTypeConvertZiplist(robj *o, int enc) {
 
         // 迭代压缩列表, 迁移元素
         while(hashTypeNext(hi) != REDIS_ERR) {
-            robj *field, *value;
-
-            // 取出 ziplist 的键
-            field = hashTypeCurrentObject(hi,REDIS_HASH_KEY);
-            field = tryObjectEncoding(field);
-
-            // 取出 ziplist 的值
-            value = hashTypeCurrentObject(hi,REDIS_HASH_VALUE);
-            value = tryObjectEncoding(value);
+            unsigned char *fstr, *vstr;
+            unsigned int flen, vlen;
+            long long fll, vll;
+            char fbuf[32], vbuf[32];
+
+            // 取出 ziplist 的键和值, 整数转换成字符串
+            hashTypeCurrentFromZiplist(hi,REDIS_HASH_KEY,&fstr,&flen,&fll);
+            if (fstr == NULL) {
+                flen = ll2string(fbuf,sizeof(fbuf),fll);
+                fstr = (unsigned char*)fbuf;
+            }
+            hashTypeCurrentFromZiplist(hi,REDIS_HASH_VALUE,&vstr,&vlen,&vll);
+            if (vstr == NULL) {
+                vlen = ll2string(vbuf,sizeof(vbuf),vll);
+                vstr = (unsigned char*)vbuf;
+            }
 
-            // 键值添加到字典
-            ret = dictAdd(dict,field,value);
+            // 键值保存在一个节点中, 添加到字典
+            ret = dictAdd(dict,hashEntryNew(fstr,flen,vstr,vlen),NULL);
             if (ret != DICT_OK) {
                 redisLogHexDump(REDIS_WARNING,"ziplist with dup elements dump",
                     o->ptr,ziplistBlobLen(o->ptr));
@@ -226,6 +298,7 @@ void hashTypeConvertZiplist(robj *o, int enc) {
         hashTypeReleaseIterator(hi);
 
         // 释放压缩列表
+        hzlFingerprintInvalidate(o->ptr);
         zfree(o->ptr);
 
         // 更新编码, 绑定哈希表
@@ -268,7 +341,7 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     for (i = start; i <= end; i++) {
         
         if (sdsEncodedObject(argv[i]) && 
-            sdslen(argv[i]) > server.hash_max_ziplist_value)
+            sdslen(argv[i]->ptr) > server.hash_max_ziplist_value)
         {
             hashTypeConvert(o, REDIS_ENCODING_HT);
             break;
@@ -278,16 +351,681 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
 
 /*----------------------------- 基础函数 ------------------------------*/
 
-/**
- * 当 subject 编码为 REDIS_ENCODING_HT 时
- * 尝试将 o1 和 o2 进行编码压缩, 以节省内存
+/*----------------------------- ziplist 域指纹 ------------------------------*/
+
+/*
+ * ziplist 编码的哈希查找域时, 需要从头开始逐个比较域,
+ * 域数量接近 hash_max_ziplist_entries 时, HGET 的大部分时间花在比较上。
+ *
+ * 对于域数量较多的 ziplist, 可以为每个域记录一个 8 位的指纹 (域哈希值的一个字节)
+ * 和域节点的偏移量。查找时先扫描指纹数组, 只对指纹相同的域调用 ziplistCompare,
+ * 平均只需要比较 1 + N/256 次。
+ *
+ * 指纹数组以 8 字节为单位扫描: 将 8 个指纹与重复 8 次的目标指纹异或,
+ * 再用 SWAR 方法找出值为 0 的字节。
+ *
+ * 和有序集合的 ziplist 索引一样, 指纹不写入 ziplist 本身 (ziplist 和 RDB 格式都不变),
+ * 而是以 ziplist 的地址为键保存在 server.hash_fingerprint_cache 缓存中 (见 ptrcache.c),
+ * 在第一次查找时建立, ziplist 被修改或释放时作废,
+ * 命中时还用字节数和校验值检查指纹是否过期 (和有序集合的索引相同)。
+ * 每个域占用 5 个字节 (1 字节指纹, 4 字节偏移量),
+ * 缓存至多保存 HZL_FINGERPRINT_CACHE_MAX_ENTRIES 个 ziplist 的指纹, 超过时随机淘汰。
+ *
+ * server.hash_ziplist_fingerprint_min_entries 为 0 时不使用指纹。
+ */
+
+// 缓存指纹的 ziplist 数量上限
+#define HZL_FINGERPRINT_CACHE_MAX_ENTRIES 1024
+
+typedef struct hzlFingerprints {
+
+    // 建立指纹时 ziplist 的字节数, 用于校验指纹是否过期
+    size_t bytes;
+
+    // 建立指纹时 ziplist 的校验值, 见 hzlFingerprintChecksum
+    uint64_t checksum;
+
+    // 域的数量
+    unsigned int count;
+
+    // 域节点相对 ziplist 首地址的偏移量
+    uint32_t *offsets;
+
+    // 域的指纹, 长度向上取整到 8 的倍数, 多出的部分不会被当作匹配
+    uint8_t *fps;
+
+} hzlFingerprints;
+
+/*
+ * 计算长度为 len 的域 s 的指纹
+ */
+static inline uint8_t hzlFieldFingerprint(unsigned char *s, unsigned int len) {
+    unsigned int h = dictGenHashFunction(s,len);
+
+    return (uint8_t) (h ^ (h >> 8) ^ (h >> 16) ^ (h >> 24));
+}
+
+/*
+ * 作废 zl 的指纹
+ *
+ * 所有修改或释放 ziplist 编码哈希的操作, 都必须在修改前调用
+ *
+ * T = O(1)
+ */
+void hzlFingerprintInvalidate(unsigned char *zl) {
+    ptrCacheDelete(server.hash_fingerprint_cache,zl);
+}
+
+/*
+ * 删除属于数据库 dbid 的 ziplist 的指纹
+ *
+ * 在把整个数据库交给后台线程释放之前调用
+ *
+ * T = O(N)
+ */
+void hzlFingerprintResetDb(int dbid) {
+    ptrCacheEmptyDb(server.hash_fingerprint_cache,dbid);
+}
+
+/*
+ * 计算 zl 的校验值: ziplist 的表头 (总字节数, 表尾偏移量和节点数量),
+ * 加上抽查的若干个域节点处的字节, 见 ptrCacheChecksum
+ *
+ * ziplist 被重写成同样的字节数时 (比如 HSET 把值换成等长的另一个值),
+ * 只比较字节数无法发现指纹过期, 而抽查处的内容通常会改变
+ *
+ * 调用者需要保证 zl 的字节数和 hfp->bytes 相同, 这样所有偏移量都在 zl 之内
+ *
+ * T = O(1)
+ */
+static uint64_t hzlFingerprintChecksum(unsigned char *zl, hzlFingerprints *hfp) {
+    return ptrCacheChecksum(zl,hfp->bytes,sizeof(uint32_t)*2+sizeof(uint16_t),
+                            hfp->offsets,hfp->count);
+}
+
+/*
+ * 遍历一次 zl, 为它的所有域建立指纹
+ *
+ * T = O(N)
+ */
+static hzlFingerprints *hzlFingerprintBuild(unsigned char *zl) {
+    unsigned int count = ziplistLen(zl)/2;
+    unsigned int padded = (count+7) & ~7U;
+    unsigned int j = 0;
+    unsigned char *fptr, *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[32];
+    hzlFingerprints *hfp;
+
+    // 结构, 偏移量数组和指纹数组一次分配
+    hfp = zmalloc(sizeof(*hfp)+count*sizeof(uint32_t)+padded);
+    hfp->bytes = ziplistBlobLen(zl);
+    hfp->count = count;
+    hfp->offsets = (uint32_t*)(hfp+1);
+    hfp->fps = (uint8_t*)(hfp->offsets+count);
+
+    fptr = ziplistIndex(zl,ZIPLIST_HEAD);
+    while (fptr != NULL) {
+        if (!ziplistGet(fptr,&vstr,&vlen,&vll))
+            redisPanic("Corrupted hash ziplist");
+
+        // 整数编码的域按字符串形式计算指纹, 和查找时的域一致
+        if (vstr == NULL) {
+            vlen = ll2string(buf,sizeof(buf),vll);
+            vstr = (unsigned char*)buf;
+        }
+
+        hfp->offsets[j] = fptr-zl;
+        hfp->fps[j] = hzlFieldFingerprint(vstr,vlen);
+        j++;
+
+        // 跳过值
+        fptr = ziplistNext(zl,fptr);
+        fptr = ziplistNext(zl,fptr);
+    }
+    redisAssert(j == count);
+
+    // 填充部分也可能被当作候选, 扫描时通过检查下标排除
+    memset(hfp->fps+count,0,padded-count);
+    hfp->checksum = hzlFingerprintChecksum(zl,hfp);
+
+    return hfp;
+}
+
+/*
+ * 返回 zl 的指纹, 指纹不存在或已过期时, build 为真则重建, 否则返回 NULL
+ *
+ * 未开启指纹, 或者 zl 的域太少不值得建立指纹时, 返回 NULL
+ */
+static hzlFingerprints *hzlGetFingerprints(unsigned char *zl, int build) {
+    size_t min = server.hash_ziplist_fingerprint_min_entries;
+    hzlFingerprints *hfp;
+
+    if (min == 0 || ziplistLen(zl)/2 < min) return NULL;
+
+    if (server.hash_fingerprint_cache == NULL)
+        server.hash_fingerprint_cache =
+            ptrCacheCreate(HZL_FINGERPRINT_CACHE_MAX_ENTRIES,zfree);
+
+    // 命中并且未过期
+    if ((hfp = ptrCacheFind(server.hash_fingerprint_cache,zl)) != NULL) {
+        if (hfp->bytes == ziplistBlobLen(zl) &&
+            hfp->checksum == hzlFingerprintChecksum(zl,hfp))
+            return hfp;
+        ptrCacheDelete(server.hash_fingerprint_cache,zl);
+    }
+
+    if (!build) return NULL;
+
+    hfp = hzlFingerprintBuild(zl);
+    ptrCacheAdd(server.hash_fingerprint_cache,zl,hfp,ptrCacheCurrentDb());
+
+    return hfp;
+}
+
+/*
+ * 在 ziplist 编码的哈希 zl 中查找域 field, 返回域节点, 没有找到返回 NULL
+ *
+ * 有指纹时只比较指纹相同的域, 否则用 ziplistFind 逐个比较
+ *
+ * 写操作找到域之后马上就会作废指纹, 所以传入 build 为 0 ,
+ * 只使用已经缓存的指纹, 不为它建立新的指纹
+ *
+ * T = O(N)
+ */
+static unsigned char *hzlFindField(unsigned char *zl, unsigned char *field,
+                                   unsigned int len, int build) {
+    hzlFingerprints *hfp;
+    unsigned char *fptr;
+    uint64_t pattern, word, zeros;
+    unsigned int j, k;
+
+    if ((hfp = hzlGetFingerprints(zl,build)) == NULL) {
+        fptr = ziplistIndex(zl,ZIPLIST_HEAD);
+        if (fptr == NULL) return NULL;
+        return ziplistFind(fptr,field,len,1);
+    }
+
+    pattern = hzlFieldFingerprint(field,len) * 0x0101010101010101ULL;
+
+    for (j = 0; j < hfp->count; j += 8) {
+        memcpy(&word,hfp->fps+j,sizeof(word));
+        word ^= pattern;
+
+        // 值为 0 的字节的最高位置 1 (可能误报, 但不会漏报, 误报由比较排除)
+        zeros = (word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL;
+
+        while (zeros) {
+            // 字节在字中的位置与内存顺序一致 (小端), 大端时反过来
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+            k = j + (__builtin_ctzll(zeros) >> 3);
+            zeros &= zeros - 1;
+#else
+            k = j + (__builtin_clzll(zeros) >> 3);
+            zeros &= ~(0x8000000000000000ULL >> (__builtin_clzll(zeros)));
+#endif
+            if (k >= hfp->count) break;
+
+            fptr = zl + hfp->offsets[k];
+            if (ziplistCompare(fptr,field,len)) return fptr;
+        }
+    }
+
+    return NULL;
+}
+
+/*----------------------------- 域的过期时间 ------------------------------*/
+
+/*
+ * 哈希的域可以单独设置过期时间 (HEXPIRE, HPEXPIRE 等)
+ *
+ * 和指纹一样, 过期时间不写入哈希本身 (ziplist 和字典的格式都不变),
+ * 而是以哈希对象的地址为键保存在 server.hash_field_expires 中 (见 ptrcache.c),
+ * 它不是缓存, 没有容量上限。
+ * 带有过期时间的哈希在 RDB 中保存为 REDIS_RDB_TYPE_HASH_WITH_FIELD_TTL ,
+ * 哈希本身之后跟着所有域的过期时间。
+ * 值是这个哈希的过期索引: 一个按过期时间排序的最小堆,
+ * 加上一个 域 => 堆节点 的字典, 用于按域查找、修改和删除过期时间。
+ *
+ * 过期的域在访问时删除:
+ * 1. 查找键时 (expireIfNeeded) 调用 hashTypeExpireFieldsIfNeeded ,
+ *    从堆顶开始删除所有到期的域, 最后一个域也到期时删除整个键
+ * 2. 读取域时 (hashTypeGetObject, hashTypeExists 等) 检查是否过期
+ *
+ * 和键的过期一样, 只有主节点删除到期的域, 并传播 HDEL 命令
+ * (见 propagateHashFieldsExpire), 附属节点只把到期的域当作不存在。
+ *
+ * 读取域时调用者还持有哈希对象, 不能删除键,
+ * 所以这时不会删除哈希的最后一个域, 这个域被当作不存在,
+ * 下一次查找这个键时连同键一起删除。
+ *
+ * 设置域的值 (hashTypeSet) 和删除域 (hashTypeDelete) 都会移除域的过期时间,
+ * 释放哈希对象时移除整个过期索引。
+ */
+
+typedef struct hashFieldTTL {
+
+    // 域, 同时也是 fields 字典的键
+    sds field;
+
+    // 过期时间, 毫秒格式的 UNIX 时间戳
+    long long when;
+
+    // 在堆数组中的下标
+    unsigned long pos;
+
+} hashFieldTTL;
+
+typedef struct hashFieldExpires {
+
+    // 哈希所在的数据库和键名, 主动删除和发送通知时使用
+    redisDb *db;
+    sds key;
+
+    // 域 => hashFieldTTL
+    dict *fields;
+
+    // 按过期时间排序的最小堆
+    hashFieldTTL **heap;
+
+    // 堆的节点数量和数组容量
+    unsigned long len, alloc;
+
+} hashFieldExpires;
+
+static void hfeFieldDestructor(void *privdata, void *val) {
+    hashFieldTTL *t = val;
+
+    DICT_NOTUSED(privdata);
+
+    sdsfree(t->field);
+    zfree(t);
+}
+
+/*
+ * 过期索引的域字典, 键和 hashFieldTTL 共用同一个 sds , 由值的析构函数释放
+ */
+static dictType hfeFieldDictType = {
+    dictSdsHash,               /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    dictSdsKeyCompare,         /* key compare */
+    NULL,                      /* key destructor */
+    hfeFieldDestructor         /* val destructor */
+};
+
+static void hfeFree(void *val) {
+    hashFieldExpires *hfe = val;
+
+    dictRelease(hfe->fields);
+    zfree(hfe->heap);
+    sdsfree(hfe->key);
+    zfree(hfe);
+}
+
+/*
+ * 返回哈希对象 o 的过期索引, 没有带过期时间的域时返回 NULL
+ *
+ * T = O(1)
+ */
+static hashFieldExpires *hfeGet(robj *o) {
+    return ptrCacheFind(server.hash_field_expires,o);
+}
+
+/*
+ * 将节点 t 放到堆的 pos 位置
+ */
+static inline void hfeHeapPlace(hashFieldExpires *hfe, unsigned long pos, hashFieldTTL *t) {
+    hfe->heap[pos] = t;
+    t->pos = pos;
+}
+
+/*
+ * 将 pos 位置的节点向上或向下移动, 直到满足堆的性质
+ *
+ * T = O(log N)
+ */
+static void hfeHeapFix(hashFieldExpires *hfe, unsigned long pos) {
+    hashFieldTTL *t = hfe->heap[pos];
+    unsigned long child;
+
+    // 上移
+    while (pos > 0 && hfe->heap[(pos-1)/2]->when > t->when) {
+        hfeHeapPlace(hfe,pos,hfe->heap[(pos-1)/2]);
+        pos = (pos-1)/2;
+    }
+
+    // 下移
+    while ((child = pos*2+1) < hfe->len) {
+        if (child+1 < hfe->len && hfe->heap[child+1]->when < hfe->heap[child]->when)
+            child++;
+        if (hfe->heap[child]->when >= t->when) break;
+        hfeHeapPlace(hfe,pos,hfe->heap[child]);
+        pos = child;
+    }
+
+    hfeHeapPlace(hfe,pos,t);
+}
+
+/*
+ * 将哈希 o 的域 field 的过期时间设为 when, key 是哈希所在的键
+ *
+ * 载入 RDB 时哈希还没有加入数据库, db 和 key 为 NULL ,
+ * 之后由 dbAdd 调用 hashTypeSetDb 设置
+ *
+ * 调用者保证域存在
+ *
+ * T = O(log N)
+ */
+static void hashTypeSetFieldExpire(redisDb *db, robj *key, robj *o, robj *field, long long when) {
+    hashFieldExpires *hfe;
+    hashFieldTTL *t;
+    dictEntry *de;
+
+    if (server.hash_field_expires == NULL)
+        server.hash_field_expires = ptrCacheCreate(0,hfeFree);
+
+    // 第一个带过期时间的域, 创建过期索引
+    if ((hfe = hfeGet(o)) == NULL) {
+        hfe = zmalloc(sizeof(*hfe));
+        hfe->db = db;
+        hfe->key = key ? sdsdup(key->ptr) : NULL;
+        hfe->fields = dictCreate(&hfeFieldDictType,NULL);
+        hfe->heap = NULL;
+        hfe->len = hfe->alloc = 0;
+        ptrCacheAdd(server.hash_field_expires,o,hfe,db ? db->id : -1);
+    }
+
+    field = getDecodedObject(field);
+
+    // 修改已有的过期时间
+    if ((de = dictFind(hfe->fields,field->ptr)) != NULL) {
+        t = dictGetVal(de);
+        t->when = when;
+        hfeHeapFix(hfe,t->pos);
+
+    // 新增
+    } else {
+        if (hfe->len == hfe->alloc) {
+            hfe->alloc = hfe->alloc ? hfe->alloc*2 : 4;
+            hfe->heap = zrealloc(hfe->heap,sizeof(hashFieldTTL*)*hfe->alloc);
+        }
+
+        t = zmalloc(sizeof(*t));
+        t->field = sdsdup(field->ptr);
+        t->when = when;
+        dictAdd(hfe->fields,t->field,t);
+
+        hfeHeapPlace(hfe,hfe->len++,t);
+        hfeHeapFix(hfe,t->pos);
+    }
+
+    decrRefCount(field);
+}
+
+/*
+ * 返回哈希 o 的域 field 的过期时间, 没有过期时间时返回 -1
+ *
+ * T = O(1)
+ */
+static long long hashTypeGetFieldExpire(robj *o, robj *field) {
+    hashFieldExpires *hfe;
+    dictEntry *de;
+
+    if ((hfe = hfeGet(o)) == NULL) return -1;
+
+    field = getDecodedObject(field);
+    de = dictFind(hfe->fields,field->ptr);
+    decrRefCount(field);
+
+    return de ? ((hashFieldTTL*)dictGetVal(de))->when : -1;
+}
+
+/*
+ * 移除哈希 o 的域 field 的过期时间, 最后一个过期时间被移除时, 删除整个过期索引
+ *
+ * 移除成功返回 1 , 域没有过期时间返回 0
+ *
+ * T = O(log N)
+ */
+static int hashTypeRemoveFieldExpire(robj *o, robj *field) {
+    hashFieldExpires *hfe;
+    hashFieldTTL *t, *last;
+    dictEntry *de;
+
+    if ((hfe = hfeGet(o)) == NULL) return 0;
+
+    field = getDecodedObject(field);
+    de = dictFind(hfe->fields,field->ptr);
+    decrRefCount(field);
+    if (de == NULL) return 0;
+
+    // 用堆的最后一个节点填补空位
+    t = dictGetVal(de);
+    last = hfe->heap[--hfe->len];
+    if (last != t) {
+        hfeHeapPlace(hfe,t->pos,last);
+        hfeHeapFix(hfe,last->pos);
+    }
+    dictDelete(hfe->fields,t->field);
+
+    if (hfe->len == 0) ptrCacheDelete(server.hash_field_expires,o);
+
+    return 1;
+}
+
+/*
+ * 移除哈希 o 所有域的过期时间
+ *
+ * 释放哈希对象之前调用, 交给后台线程释放的对象必须先在主线程调用
+ *
+ * T = O(N)
+ */
+void hashTypeClearFieldExpires(robj *o) {
+    ptrCacheDelete(server.hash_field_expires,o);
+}
+
+/*
+ * 返回哈希 o 中带有过期时间的域的数量
+ *
+ * T = O(1)
+ */
+unsigned long hashTypeFieldExpiresLen(robj *o) {
+    hashFieldExpires *hfe = hfeGet(o);
+
+    return hfe ? hfe->len : 0;
+}
+
+/*
+ * 取出哈希 o 的第 index 个带有过期时间的域和它的过期时间, 顺序是任意的
+ *
+ * 用于把过期时间写入 RDB, 调用者保证 index 小于 hashTypeFieldExpiresLen(o)
+ *
+ * T = O(1)
+ */
+void hashTypeGetFieldExpireAt(robj *o, unsigned long index, sds *field, long long *when) {
+    hashFieldTTL *t = hfeGet(o)->heap[index];
+
+    *field = t->field;
+    *when = t->when;
+}
+
+/*
+ * 载入 RDB 时, 将哈希 o 的域 field 的过期时间设为 when
+ *
+ * 域不存在时返回 REDIS_ERR , 否则返回 REDIS_OK
+ *
+ * T = O(log N)
+ */
+int hashTypeLoadFieldExpire(robj *o, robj *field, long long when) {
+    if (!hashTypeExists(o,field)) return REDIS_ERR;
+
+    hashTypeSetFieldExpire(NULL,NULL,o,field,when);
+
+    return REDIS_OK;
+}
+
+/*
+ * 移除数据库 db 中所有哈希的域过期时间
+ *
+ * 在把整个数据库交给后台线程释放之前调用
+ *
+ * T = O(N), N 为带有过期时间的哈希数量
+ */
+void hashTypeClearDbFieldExpires(redisDb *db) {
+    ptrCacheEmptyDb(server.hash_field_expires,db->id);
+}
+
+/*
+ * 哈希 o 被关联到数据库 db 的键 key 时 (添加、覆盖、RENAME、MOVE、载入) 调用,
+ * 更新指纹和过期索引所属的数据库, 以及过期索引记录的键,
+ * 之后到期的域以新的键名删除和传播
+ *
+ * T = O(1)
+ */
+void hashTypeSetDb(redisDb *db, robj *key, robj *o) {
+    hashFieldExpires *hfe;
+
+    if (o->encoding == REDIS_ENCODING_ZIPLIST)
+        ptrCacheSetDb(server.hash_fingerprint_cache,o->ptr,db->id);
+
+    if ((hfe = hfeGet(o)) == NULL) return;
+
+    ptrCacheSetDb(server.hash_field_expires,o,db->id);
+    hfe->db = db;
+    if (hfe->key == NULL || sdscmp(hfe->key,key->ptr) != 0) {
+        sdsfree(hfe->key);
+        hfe->key = sdsdup(key->ptr);
+    }
+}
+
+/*
+ * 用于过期检查的当前时间, 和 expireIfNeeded 一致
  */
-void hashTypeTryObjectEncoding(robj *subject, robj **o1, robj **o2) {
+static long long hashFieldExpireNow(void) {
+    return server.lua_caller ? server.lua_time_start : mstime();
+}
 
-    if (subject->encoding == REDIS_ENCODING_HT) {
-        *o1 = tryObjectEncoding(*o1);
-        *o2 = tryObjectEncoding(*o2);
+/*
+ * 删除哈希 o 中所有到期的域, 但不删除最后一个域
+ *
+ * 返回删除的域数量, 如果剩下的最后一个域也已经到期, 将 *lastexpired 设为 1
+ *
+ * T = O(M log N), M 为删除的域数量
+ */
+static unsigned long hashTypeDeleteExpiredFields(robj *o, long long now, int *lastexpired)
+{
+    hashFieldExpires *hfe = hfeGet(o);
+    unsigned long deleted = 0, j, alloc = 0;
+    robj **fields = NULL;
+    redisDb *db;
+    robj *keyobj;
+
+    *lastexpired = 0;
+    if (hfe == NULL || hfe->heap[0]->when >= now) return 0;
+
+    // 附属节点不主动删除, 等待主节点传播的 HDEL 命令
+    if (server.loading) return 0;
+    if (server.masterhost != NULL) {
+        *lastexpired = hashTypeLength(o) == 1;
+        return 0;
     }
+
+    db = hfe->db;
+    keyobj = createStringObject(hfe->key,sdslen(hfe->key));
+
+    while ((hfe = hfeGet(o)) != NULL && hfe->heap[0]->when < now) {
+        robj *field;
+
+        if (hashTypeLength(o) == 1) {
+            *lastexpired = 1;
+            break;
+        }
+
+        // hashTypeDelete 会同时移除域的过期时间
+        field = createStringObject(hfe->heap[0]->field,sdslen(hfe->heap[0]->field));
+        if (!hashTypeDelete(o,field))
+            redisPanic("Expired hash field not found");
+
+        // 记录被删除的域, 用于传播 HDEL
+        if (deleted == alloc) {
+            alloc = alloc ? alloc*2 : 8;
+            fields = zrealloc(fields,sizeof(robj*)*alloc);
+        }
+        fields[deleted++] = field;
+    }
+
+    if (deleted) {
+        propagateHashFieldsExpire(db,keyobj,fields,deleted);
+        signalModifiedKey(db,keyobj);
+        notifyKeyspaceEvent(REDIS_NOTIFY_HASH,"hexpired",keyobj,db->id);
+    }
+    for (j = 0; j < deleted; j++) decrRefCount(fields[j]);
+    zfree(fields);
+    decrRefCount(keyobj);
+
+    return deleted;
+}
+
+/*
+ * 检查哈希 o 的域 field 是否已经过期, 如果过期, 将它删除 (最后一个域除外)
+ *
+ * 返回 1 表示域已经过期 (调用者应该当作域不存在), 否则返回 0
+ *
+ * T = O(log N)
+ */
+static int hashTypeFieldExpireIfNeeded(robj *o, robj *field) {
+    long long when, now;
+    int lastexpired;
+
+    if ((when = hashTypeGetFieldExpire(o,field)) == -1) return 0;
+
+    now = hashFieldExpireNow();
+    if (when >= now) return 0;
+
+    // 所有到期的域都在堆顶, 一次删除
+    hashTypeDeleteExpiredFields(o,now,&lastexpired);
+
+    return 1;
+}
+
+/*
+ * 删除数据库 db 中哈希键 key 所有到期的域,
+ * 如果最后一个域也已经到期, 删除整个键
+ *
+ * 在查找键时由 expireIfNeeded 调用, 这时还没有人持有哈希对象,
+ * 可以安全地删除键。
+ *
+ * 返回 1 表示键因此被删除, 否则返回 0
+ *
+ * T = O(M log N), M 为删除的域数量
+ */
+int hashTypeExpireFieldsIfNeeded(redisDb *db, robj *key) {
+    dictEntry *de;
+    robj *o;
+    int lastexpired;
+
+    if (ptrCacheSize(server.hash_field_expires) == 0) return 0;
+
+    de = dictFind(db->dict,key->ptr);
+    if (de == NULL) return 0;
+    o = dictGetVal(de);
+    if (o->type != REDIS_HASH) return 0;
+
+    hashTypeDeleteExpiredFields(o,hashFieldExpireNow(),&lastexpired);
+
+    // 附属节点只把键当作空的哈希, 等待主节点传播的 DEL 命令
+    if (!lastexpired || server.masterhost != NULL) return 0;
+
+    // 最后一个域也已经到期, 删除键 (同时释放过期索引)
+    server.stat_expiredkeys++;
+    propagateExpire(db,key);
+    notifyKeyspaceEvent(REDIS_NOTIFY_HASH,"hexpired",key,db->id);
+    notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",key,db->id);
+    signalModifiedKey(db,key);
+
+    return dbDelete(db,key);
 }
 
 /**
@@ -307,16 +1045,14 @@ int hashTypeGetFromZiplist(robj *o, robj *field,
     field =  getDecodedObject(field);
 
     zl = o->ptr;
-    fptr = ziplistIndex(zl,ZIPLIST_HEAD);
+
+    // 获取域
+    fptr = hzlFindField(zl,field->ptr,sdslen(field->ptr),1);
+
+    // 获取值元素
     if (fptr != NULL) {
-        // 获取域
-        fptr = ziplistFind(fptr, field->ptr,sdslen(field->ptr),1);
-        
-        // 获取值元素
-        if (fptr != NULL) {
-            vptr = ziplistNext(zl,fptr);
-            redisAssert(vptr != NULL);
-        }
+        vptr = ziplistNext(zl,fptr);
+        redisAssert(vptr != NULL);
     }
 
     decrRefCount(field);
@@ -338,19 +1074,21 @@ int hashTypeGetFromZiplist(robj *o, robj *field,
  * 
  * 查找成功, 返回 0, 否则返回 -1
  */
-int hashTypeGetFromHashTable(robj *o, robj *field, robj **value) {
+int hashTypeGetFromHashTable(robj *o, robj *field, sds *value) {
     dictEntry *de;
 
     // 检查编码类型
     redisAssert(o->encoding == REDIS_ENCODING_HT);
 
+    field = getDecodedObject(field);
     de = dictFind(o->ptr,field->ptr);
+    decrRefCount(field);
 
     // 不存在的域
     if (de == NULL) return -1;
 
     // 提取值内容
-    *value = dictGetVal(de);
+    *value = hashEntryValue((sds)dictGetKey(de));
 
     return 0;
 }
@@ -362,6 +1100,9 @@ int hashTypeGetFromHashTable(robj *o, robj *field, robj **value) {
 robj *hashTypeGetObject(robj *o, robj *field) {
     robj *value = NULL;
 
+    // 已经过期的域当作不存在
+    if (hashTypeFieldExpireIfNeeded(o,field)) return NULL;
+
     // ziplist
     if (o->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *vstr = NULL;
@@ -380,11 +1121,10 @@ robj *hashTypeGetObject(robj *o, robj *field) {
 
     // hashtable
     } else if (o->encoding == REDIS_ENCODING_HT) {
-        robj *aux;
+        sds aux;
 
         if (hashTypeGetFromHashTable(o,field,&aux) == 0) {
-            incrRefCount(aux);
-            value = aux;
+            value = createStringObject(aux,sdslen(aux));
         }
 
     // 未知编码
@@ -401,6 +1141,9 @@ robj *hashTypeGetObject(robj *o, robj *field) {
  */
 int hashTypeExists(robj *o, robj *field) {
 
+    // 已经过期的域当作不存在
+    if (hashTypeFieldExpireIfNeeded(o,field)) return 0;
+
     if (o->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
@@ -412,7 +1155,7 @@ int hashTypeExists(robj *o, robj *field) {
         }
 
     } else if (o->encoding == REDIS_ENCODING_HT) {
-        robj *aux;
+        sds aux;
 
         if (hashTypeGetFromHashTable(o,field,&aux) == 0) {
             return 1;
@@ -429,7 +1172,8 @@ int hashTypeExists(robj *o, robj *field) {
  * 将给定的 field-value 添加到哈希结构中
  * 如果 field 已存在, 更新 value
  * 
- * 这个函数负责对 field 和 value 增加引用计数
+ * field 和 value 的内容会被复制, 调用者不需要增加引用计数
+ * 域原有的过期时间会被移除
  * 
  * 返回 0, 表示新增
  * 返回 1, 表示更新
@@ -437,6 +1181,8 @@ int hashTypeExists(robj *o, robj *field) {
 int hashTypeSet(robj *o, robj *field, robj *value) {
     int update = 0;
 
+    hashTypeRemoveFieldExpire(o,field);
+
     if (o->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *zl, *fptr, *vptr;
 
@@ -446,25 +1192,24 @@ int hashTypeSet(robj *o, robj *field, robj *value) {
 
         // 查找目标域
         zl = o->ptr;
-        fptr = ziplistIndex(zl,ZIPLIST_HEAD);
-        
-        if (fptr != NULL) {
-            fptr = ziplistFind(fptr,field->ptr,sdslen(field->ptr),1);
+        fptr = hzlFindField(zl,field->ptr,sdslen(field->ptr),0);
 
-            // 更新
-            if (fptr != NULL) {
-                // 定位到值
-                vptr = ziplistNext(zl,fptr);
-                redisAssert(vptr != NULL);
+        // 修改之后指纹中的偏移量失效
+        hzlFingerprintInvalidate(zl);
 
-                update = 1;
+        // 更新
+        if (fptr != NULL) {
+            // 定位到值
+            vptr = ziplistNext(zl,fptr);
+            redisAssert(vptr != NULL);
 
-                // 删除旧 value
-                zl = ziplistDelete(zl,&vptr);
+            update = 1;
 
-                // 绑定新 value
-                zl = ziplistInsert(zl,vptr,value->ptr,sdslen(value->ptr));
-            }
+            // 删除旧 value
+            zl = ziplistDelete(zl,&vptr);
+
+            // 绑定新 value
+            zl = ziplistInsert(zl,vptr,value->ptr,sdslen(value->ptr));
         }
 
         // 新增
@@ -487,17 +1232,26 @@ int hashTypeSet(robj *o, robj *field, robj *value) {
 
 
     } else if (o->encoding == REDIS_ENCODING_HT) {
+        dictEntry *de;
 
-        // 添加
-        if (dictReplace(o->ptr,field,value)) {
-            incrRefCount(field);
+        // 转成字符串
+        field = getDecodedObject(field);
+        value = getDecodedObject(value);
 
-        // 更新
-        } else {
+        // 更新, 节点地址改变时修改字典节点的键
+        if ((de = dictFind(o->ptr,field->ptr)) != NULL) {
+            de->key = hashEntrySetValue(dictGetKey(de),value->ptr,sdslen(value->ptr));
             update = 1;
+
+        // 添加
+        } else {
+            dictAdd(o->ptr,hashEntryNew(field->ptr,sdslen(field->ptr),
+                                        value->ptr,sdslen(value->ptr)),NULL);
         }
 
-        incrRefCount(value);
+        // 释放临时对象
+        decrRefCount(field);
+        decrRefCount(value);
 
     } else {
         redisPanic("Unknown hash encoding");
@@ -513,34 +1267,38 @@ int hashTypeSet(robj *o, robj *field, robj *value) {
 int hashTypeDelete(robj *o, robj *field) {
     int deleted = 0;
 
+    hashTypeRemoveFieldExpire(o,field);
+
     if (o->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *zl, *fptr;
 
         field = getDecodedObject(field);
 
         zl = o->ptr;
-        fptr = ziplistIndex(zl,ZIPLIST_HEAD);
+
+        // 定位到域
+        fptr = hzlFindField(zl,field->ptr,sdslen(field->ptr),0);
+
         if (fptr != NULL) {
-            // 定位到域
-            fptr = ziplistFind(fptr,field->ptr,sdslen(field->ptr),1);
-
-            if (fptr != NULL) {
-                // 删除域
-                zl = ziplistDelete(zl,&fptr);
-                
-                // 删除值
-                zl = ziplistDelete(zl,&fptr);
-
-                // 更新 ptr
-                o->ptr = zl;
-                deleted = 1;
-            }
+            hzlFingerprintInvalidate(zl);
+
+            // 删除域
+            zl = ziplistDelete(zl,&fptr);
+
+            // 删除值
+            zl = ziplistDelete(zl,&fptr);
+
+            // 更新 ptr
+            o->ptr = zl;
+            deleted = 1;
         }
 
         decrRefCount(field);
 
     } else if (o->encoding == REDIS_ENCODING_HT) {
-        
+
+        field = getDecodedObject(field);
+
         if (dictDelete((dict*)o->ptr, field->ptr) == REDIS_OK) {
             deleted = 1;
 
@@ -548,6 +1306,8 @@ int hashTypeDelete(robj *o, robj *field) {
             if (htNeedsResize(o->ptr)) dictResize(o->ptr);
         }
 
+        decrRefCount(field);
+
     } else {
         redisPanic("Unknown hash encoding");
     }
@@ -611,9 +1371,6 @@ void hsetCommand(redisClient *c) {
     // 尝试是否需要转码
     hashTypeTryConversion(o,c->argv,2,3);
 
-    // 将 field 和 value 转换成字符串结构
-    hashTypeTryObjectEncoding(o,&c->argv[2],&c->argv[3]);
-
     // 添加元素
     update = hashTypeSet(o,c->argv[2],c->argv[3]);
 
@@ -648,9 +1405,6 @@ void hsetnxCommand(redisClient *c) {
     // 添加元素
     } else {
 
-        // 将 field, value 转换成字符串
-        hashTypeTryObjectEncoding(o,&c->argv[2],&c->argv[3]);
-
         // 添加 field-value
         hashTypeSet(o,c->argv[2],c->argv[3]);
 
@@ -688,9 +1442,6 @@ void hmsetCommand(redisClient *c) {
     // 添加元素
     for (i = 2; i < c->argc; i += 2) {
 
-        // 将 field , value转换成字符串
-        hashTypeTryObjectEncoding(o,&c->argv[i],&c->argv[i+1]);
-
         // 添加元素到哈希
         hashTypeSet(o,c->argv[i],c->argv[i+1]);
     }
@@ -746,9 +1497,6 @@ void hincrbyCommand(redisClient *c) {
     value += incr;
     new = createStringObjectFromLongLong(value);
 
-    // 将 field 转换成字符串
-    hashTypeTryObjectEncoding(o,&c->argv[2],NULL);
-
     // 写入新值
     hashTypeSet(o,c->argv[2],new);
 
@@ -797,9 +1545,6 @@ void hincrbyfloatCommand(redisClient *c) {
     value += incr;
     new = createStringObjectFromLongDouble(value);
 
-    // 将 field 改成字符串结构
-    hashTypeTryObjectEncoding(o,&c->argv[2],NULL);
-
     // 写入值对象
     hashTypeSet(o,c->argv[2],new);
     
@@ -828,7 +1573,7 @@ void hincrbyfloatCommand(redisClient *c) {
 static void addHashFieldToReply(redisClient *c, robj *o, robj *field) {
     int ret;
 
-    if (o == NULL) {
+    if (o == NULL || hashTypeFieldExpireIfNeeded(o,field)) {
         addReply(c,shared.nullbulk);
         return;
     }
@@ -854,14 +1599,14 @@ static void addHashFieldToReply(redisClient *c, robj *o, robj *field) {
         }
         
     } else if (o->encoding == REDIS_ENCODING_HT) {
-        robj *value;
+        sds value;
         ret = hashTypeGetFromHashTable(o,field,&value);
 
         if (ret < 0) {
             addReply(c,shared.nullbulk);
 
         } else {
-            addReplyBulk(c,value);
+            addReplyBulkCBuffer(c,value,sdslen(value));
         }
     
     } else {
@@ -947,85 +1692,149 @@ void hdelCommand(redisClient *c) {
 // HLEN key
 void hlenCommand(redisClient *c) {
     robj *o;
+    unsigned long length;
+    int lastexpired;
 
     // 取出哈希对象
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,REDIS_HASH)) return;
 
-    addReplyLongLong(c,hashTypeLength(o));
+    // 不计入已经过期的域
+    hashTypeDeleteExpiredFields(o,hashFieldExpireNow(),&lastexpired);
+    length = hashTypeLength(o);
+    if (lastexpired) length--;
+
+    addReplyLongLong(c,length);
 }
 
 /**
- * 从迭代器当前指向的节点中取出 fiele 或 value
- * 并回复给客户端
+ * 将长度为 len 的字符串 p 以 bulk 格式 ($len\r\np\r\n) 追加到回复缓冲区 buf
+ * 只扩展一次缓冲区
  */
-static void addHashIteratorCursorToReply(redisClient *c, hashTypeIterator *hi, int what) {
-
-    if (hi->encoding == REDIS_ENCODING_ZIPLIST) {
-        unsigned char *vstr = NULL;
-        unsigned int vlen = UINT_MAX;
-        long long vll = LLONG_MAX;
-
-        hashTypeCurrentFromZiplist(hi,what,&vstr,&vlen,&vll);
-
-        if (vstr) {
-            addReplyBulkCBuffer(c,vstr,vlen);
-        } else {
-            addReplyLongLong(c,vll);
-        }
-
+static sds hashCatBulk(sds buf, const char *p, size_t len) {
+    char hdr[32];
+    size_t hlen;
+
+    hdr[0] = '$';
+    hlen = 1 + ll2string(hdr+1, sizeof(hdr)-3, len);
+    hdr[hlen++] = '\r';
+    hdr[hlen++] = '\n';
+
+    buf = sdsMakeRoomFor(buf, hlen+len+2);
+    memcpy(buf+sdslen(buf), hdr, hlen);
+    memcpy(buf+sdslen(buf)+hlen, p, len);
+    memcpy(buf+sdslen(buf)+hlen+len, "\r\n", 2);
+    sdsIncrLen(buf, hlen+len+2);
+
+    return buf;
+}
 
-    } else if (hi->encoding == REDIS_ENCODING_HT) {
-        robj *value;
+/**
+ * 将整数以 bulk 格式追加到回复缓冲区
+ */
+static sds hashCatBulkLongLong(sds buf, long long value) {
+    char s[32];
+    int len = ll2string(s, sizeof(s), value);
 
-        hashTypeCurrentFromHashTable(hi,what,&value);
+    return hashCatBulk(buf, s, len);
+}
 
-        addReplyBulk(c,value);
+/**
+ * 回复缓冲区达到 REDIS_REPLY_CHUNK_BYTES 时交给客户端, 并返回新的缓冲区
+ * 这样大的哈希也不需要在内存中保存整个回复的副本
+ */
+static sds hashFlushReplyChunk(redisClient *c, sds buf) {
+    if (sdslen(buf) < REDIS_REPLY_CHUNK_BYTES) return buf;
 
-    } else {
-        redisPanic("Unknown hash encoding");
-    }
+    addReplySds(c, buf);
+    return sdsMakeRoomFor(sdsempty(), REDIS_REPLY_CHUNK_BYTES);
 }
 
 /**
  * 遍历哈希表, 取出 field 或 value, 并回复客户端
+ *
+ * 回复直接在缓冲区中按协议格式拼接, 不经过哈希迭代器, 也不创建任何对象:
+ * ziplist 编码一次遍历 ziplist , 从节点的原始字节 (或整数) 写入缓冲区,
+ * HT 编码直接从哈希节点中的域和值 sds 写入缓冲区
  */
 void genericHgetallCommand(redisClient *c, int flags) {
     robj *o;
-    hashTypeIterator *hi;
-    int multiplier = 0;
-    int length, count = 0;
+    unsigned long length, count = 0;
+    int multiplier = 0, lastexpired;
+    sds buf;
 
     // 取出哈希对象
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptymultibulk)) == NULL ||
         checkType(c,o,REDIS_HASH)) return;
 
+    // 先删除已经过期的域, 剩下的最后一个域也过期时, 哈希在逻辑上为空
+    hashTypeDeleteExpiredFields(o,hashFieldExpireNow(),&lastexpired);
+    if (lastexpired) {
+        addReply(c,shared.emptymultibulk);
+        return;
+    }
+
     // 计算需要提取的field 和 value 的总数
     if (flags & REDIS_HASH_KEY) multiplier++;
     if (flags & REDIS_HASH_VALUE) multiplier++;
     length = hashTypeLength(o) * multiplier;
 
-    addReplyMultiBulkLen(c,length);
+    // 回复的数组长度
+    buf = sdsMakeRoomFor(sdsempty(), REDIS_REPLY_CHUNK_BYTES);
+    buf = sdscatprintf(buf, "*%lu\r\n", length);
 
-    // 初始化迭代器
-    hi = hashTypeInitIterator(o);
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *zl = o->ptr, *p, *vstr;
+        unsigned int vlen;
+        long long vll;
+        int what = REDIS_HASH_KEY;
+
+        // field 和 value 在 ziplist 中交替保存
+        p = ziplistIndex(zl, 0);
+        while (p != NULL) {
+            if (flags & what) {
+                ziplistGet(p, &vstr, &vlen, &vll);
+                if (vstr) {
+                    buf = hashCatBulk(buf, (char*)vstr, vlen);
+                } else {
+                    buf = hashCatBulkLongLong(buf, vll);
+                }
+                buf = hashFlushReplyChunk(c, buf);
+                count++;
+            }
+            what = (what == REDIS_HASH_KEY) ? REDIS_HASH_VALUE : REDIS_HASH_KEY;
+            p = ziplistNext(zl, p);
+        }
 
-    // 迭代器节点
-    while (hashTypeNext(hi) != REDIS_ERR) {
+    } else if (o->encoding == REDIS_ENCODING_HT) {
+        dictIterator *di = dictGetIterator(o->ptr);
+        dictEntry *de;
 
-        if (flags & REDIS_HASH_KEY) {
-            addHashIteratorCursorToReply(c,hi,REDIS_HASH_KEY);
-            count++;
-        }
+        while ((de = dictNext(di)) != NULL) {
+            sds entry = dictGetKey(de), value = hashEntryValue(entry);
 
-        if (flags & REDIS_HASH_VALUE) {
-            addHashIteratorCursorToReply(c,hi,REDIS_HASH_VALUE);
-            count++;
+            if (flags & REDIS_HASH_KEY) {
+                buf = hashCatBulk(buf, entry, sdslen(entry));
+                count++;
+            }
+            if (flags & REDIS_HASH_VALUE) {
+                buf = hashCatBulk(buf, value, sdslen(value));
+                count++;
+            }
+            buf = hashFlushReplyChunk(c, buf);
         }
+        dictReleaseIterator(di);
+
+    } else {
+        redisPanic("Unknown hash encoding");
     }
 
-    // 释放迭代器
-    hashTypeReleaseIterator(hi);
+    // 剩余的回复
+    if (sdslen(buf)) {
+        addReplySds(c, buf);
+    } else {
+        sdsfree(buf);
+    }
     redisAssert(length == count);
 }
 
@@ -1064,4 +1873,245 @@ void hscanCommand(redisClient *c) {
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptyscan)) == NULL ||
         checkType(c,o,REDIS_HASH)) return;
     scanGenericCommand(c,o,cursor);
-}
\ No newline at end of file
+}
+/*----------------------------- 域的过期命令 ------------------------------*/
+
+/**
+ * 解析 FIELDS numfields field [field ...] 参数, pos 为 FIELDS 的位置
+ * 域的数量必须和剩余参数的数量相同
+ *
+ * 解析成功返回 REDIS_OK , 否则向客户端回复错误并返回 REDIS_ERR
+ */
+static int getHashFieldsArgOrReply(redisClient *c, int pos, long *numfields) {
+    if (pos+1 >= c->argc || strcasecmp(c->argv[pos]->ptr,"fields")) {
+        addReplyError(c,"mandatory argument FIELDS is missing or not at the right position");
+        return REDIS_ERR;
+    }
+
+    if (getLongFromObjectOrReply(c,c->argv[pos+1],numfields,NULL) != REDIS_OK)
+        return REDIS_ERR;
+
+    if (*numfields <= 0 || *numfields != c->argc-pos-2) {
+        addReplyError(c,"the numfields parameter must match the number of arguments");
+        return REDIS_ERR;
+    }
+
+    return REDIS_OK;
+}
+
+/**
+ * 向客户端回复 numfields 个 -2 , 表示键不存在
+ */
+static void addReplyNoSuchFields(redisClient *c, long numfields) {
+    addReplyMultiBulkLen(c,numfields);
+    while (numfields--) addReplyLongLong(c,-2);
+}
+
+/**
+ * 设置域的过期时间
+ * basetime 在 *AT 命令下给 0, 其他情况给 UNIX 时间戳, 总是毫秒
+ * unit 为时间单位 SECONDS or MILLISECONDS
+ *
+ * 对每个域回复:
+ * -2 域不存在, 1 设置成功, 2 过期时间已经过去, 域被删除
+ */
+void hexpireGenericCommand(redisClient *c, long long basetime, int unit) {
+    robj *key = c->argv[1], *o, **hdelargv = NULL;
+    long long when;
+    long numfields;
+    int j, set = 0, deleted = 0, keyremoved = 0;
+
+    // 取出时间
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&when,NULL) != REDIS_OK)
+        return;
+
+    // 程序以毫秒形式存储时间戳, 如果设置为秒, 将其转为毫秒
+    if (when < 0 || (unit == UNIT_SECONDS && when > LLONG_MAX/1000)) {
+        addReplyError(c,"invalid expire time");
+        return;
+    }
+    if (unit == UNIT_SECONDS) when *= 1000;
+
+    if (when > LLONG_MAX-basetime) {
+        addReplyError(c,"invalid expire time");
+        return;
+    }
+    when += basetime;
+
+    if (getHashFieldsArgOrReply(c,3,&numfields) != REDIS_OK) return;
+
+    // 取出哈希对象
+    if ((o = lookupKeyWrite(c->db,key)) == NULL) {
+        addReplyNoSuchFields(c,numfields);
+        return;
+    }
+    if (checkType(c,o,REDIS_HASH)) return;
+
+    addReplyMultiBulkLen(c,numfields);
+    for (j = 5; j < c->argc; j++) {
+        robj *field = c->argv[j];
+
+        // 域不存在, 或者已经过期
+        if (keyremoved || !hashTypeExists(o,field)) {
+            addReplyLongLong(c,-2);
+
+        // 时间已过期, 服务器为主节点, 并且未加载数据, 删除域
+        } else if (when <= mstime() && !server.loading && !server.masterhost) {
+            if (!hashTypeDelete(o,field))
+                redisPanic("Expired hash field not found");
+
+            // 记录被删除的域, 命令以 HDEL 的形式传播
+            if (hdelargv == NULL) {
+                hdelargv = zmalloc(sizeof(robj*)*(numfields+2));
+                hdelargv[0] = shared.hdel;
+                hdelargv[1] = key;
+                incrRefCount(shared.hdel);
+                incrRefCount(key);
+            }
+            hdelargv[2+deleted] = field;
+            incrRefCount(field);
+            deleted++;
+            addReplyLongLong(c,2);
+
+            // 哈希对象为空, 删除 key
+            if (hashTypeLength(o) == 0) {
+                dbDelete(c->db,key);
+                keyremoved = 1;
+            }
+
+        // 存储过期时间
+        } else {
+            hashTypeSetFieldExpire(c->db,key,o,field,when);
+            set++;
+            addReplyLongLong(c,1);
+        }
+    }
+
+    // 发送通知
+    if (set || deleted) {
+        signalModifiedKey(c->db,key);
+
+        if (set) notifyKeyspaceEvent(REDIS_NOTIFY_HASH,"hexpire",key,c->db->id);
+        if (deleted) notifyKeyspaceEvent(REDIS_NOTIFY_HASH,"hdel",key,c->db->id);
+        if (keyremoved) notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",key,c->db->id);
+
+        server.dirty += set+deleted;
+    }
+
+    // 和 EXPIRE 一样, 到期删除的域以 HDEL key field [field ...] 的形式传播,
+    // 否则附属节点和 AOF 会收到一个已经过去的过期时间
+    if (hdelargv) replaceClientCommandVector(c,deleted+2,hdelargv);
+}
+
+// HEXPIRE key seconds FIELDS numfields field [field ...]
+void hexpireCommand(redisClient *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_SECONDS);
+}
+
+// HEXPIREAT key timestamp FIELDS numfields field [field ...]
+void hexpireatCommand(redisClient *c) {
+    hexpireGenericCommand(c,0,UNIT_SECONDS);
+}
+
+// HPEXPIRE key milliseconds FIELDS numfields field [field ...]
+void hpexpireCommand(redisClient *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_MILLISECONDS);
+}
+
+// HPEXPIREAT key milliseconds-timestamp FIELDS numfields field [field ...]
+void hpexpireatCommand(redisClient *c) {
+    hexpireGenericCommand(c,0,UNIT_MILLISECONDS);
+}
+
+/**
+ * 返回域的剩余生存时间
+ * output_ms 为 1 时, 返回毫秒
+ * output_ms 为 0 时, 返回秒
+ *
+ * 对每个域回复: -2 域不存在, -1 域没有过期时间, 否则为剩余生存时间
+ */
+void httlGenericCommand(redisClient *c, int output_ms) {
+    robj *o;
+    long numfields;
+    int j;
+
+    if (getHashFieldsArgOrReply(c,2,&numfields) != REDIS_OK) return;
+
+    // 取出哈希对象
+    if ((o = lookupKeyRead(c->db,c->argv[1])) == NULL) {
+        addReplyNoSuchFields(c,numfields);
+        return;
+    }
+    if (checkType(c,o,REDIS_HASH)) return;
+
+    addReplyMultiBulkLen(c,numfields);
+    for (j = 4; j < c->argc; j++) {
+        long long expire, ttl;
+
+        // 域不存在
+        if (!hashTypeExists(o,c->argv[j])) {
+            addReplyLongLong(c,-2);
+            continue;
+        }
+
+        // 持久域
+        if ((expire = hashTypeGetFieldExpire(o,c->argv[j])) == -1) {
+            addReplyLongLong(c,-1);
+            continue;
+        }
+
+        // 计算剩余时间
+        ttl = expire - mstime();
+        if (ttl < 0) ttl = 0;
+        addReplyLongLong(c,output_ms ? ttl : ((ttl+500)/1000));
+    }
+}
+
+// HTTL key FIELDS numfields field [field ...]
+void httlCommand(redisClient *c) {
+    httlGenericCommand(c,0);
+}
+
+// HPTTL key FIELDS numfields field [field ...]
+void hpttlCommand(redisClient *c) {
+    httlGenericCommand(c,1);
+}
+
+/**
+ * HPERSIST key FIELDS numfields field [field ...]
+ * 移除域的过期时间
+ *
+ * 对每个域回复: -2 域不存在, -1 域没有过期时间, 1 移除成功
+ */
+void hpersistCommand(redisClient *c) {
+    robj *o;
+    long numfields;
+    int j, removed = 0;
+
+    if (getHashFieldsArgOrReply(c,2,&numfields) != REDIS_OK) return;
+
+    // 取出哈希对象
+    if ((o = lookupKeyWrite(c->db,c->argv[1])) == NULL) {
+        addReplyNoSuchFields(c,numfields);
+        return;
+    }
+    if (checkType(c,o,REDIS_HASH)) return;
+
+    addReplyMultiBulkLen(c,numfields);
+    for (j = 4; j < c->argc; j++) {
+        if (!hashTypeExists(o,c->argv[j])) {
+            addReplyLongLong(c,-2);
+        } else if (hashTypeRemoveFieldExpire(o,c->argv[j])) {
+            removed++;
+            addReplyLongLong(c,1);
+        } else {
+            addReplyLongLong(c,-1);
+        }
+    }
+
+    if (removed) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(REDIS_NOTIFY_HASH,"hpersist",c->argv[1],c->db->id);
+        server.dirty += removed;
+    }
+}
@@ -4,14 +4,18 @@
  * 列表值可以是以下两种数据结构
  *  - 压缩列表, 提取调用方传入 robj 格式中的值(字符串、数字), 
  *             以字符串、数字的内容存入压缩列表的节点
- *  - 双端链表, 直接将调用方传入的 robj 存入链表节点
+ *  - 快速列表, 由多个容量有限的压缩列表组成的双端链表,
+ *             元素同样以字符串、数字的内容保存
  * 
- * 将 subject->ptr 看成 ziplist 或 linkedlist 的首地址
+ * 将 subject->ptr 看成 ziplist 或 quicklist 的首地址
  * 当 subject->ptr 是 ziplist 时, ziplist->node 是字符串或数字
- * 当 subject->ptr 是 linkedlist 时, linkedlist->node 是 robj 结构的值
+ * 当 subject->ptr 是 quicklist 时, 每个 quicklistNode 保存一个 ziplist
+ *
+ * 列表的元素数量或元素长度超过 ziplist 的限制时, 转换成快速列表
  */
 
 #include "redis.h"
+#include "bio.h"
 
 /*-----------------------内部函数 ------------------------*/
 /*----------------------- 迭代器 ------------------------*/
@@ -33,9 +37,11 @@ listTypeIterator *listTypeInitIterator(robj *subject, long index, unsigned char
     if (li->encoding == REDIS_ENCODING_ZIPLIST) {
         li->zi = ziplistIndex(subject->ptr, index);
 
-    // 双端链表
-    } else if(li->encoding == REDIS_ENCODING_LINKEDLIST) {
-        li->ln = listIndex(subject->ptr, index);
+    // 快速列表
+    } else if(li->encoding == REDIS_ENCODING_QUICKLIST) {
+        // REDIS_TAIL 表示向表尾方向迭代, 也即是从表头开始
+        int iter_direction = (direction == REDIS_HEAD) ? AL_START_TAIL : AL_START_HEAD;
+        li->iter = quicklistGetIteratorAtIdx(subject->ptr, iter_direction, index);
 
     // 位置编码
     } else {
@@ -49,6 +55,8 @@ listTypeIterator *listTypeInitIterator(robj *subject, long index, unsigned char
  * 释放迭代器
  */
 void listTypeReleaseIterator(listTypeIterator *li) {
+    if (li->encoding == REDIS_ENCODING_QUICKLIST)
+        quicklistReleaseIterator(li->iter);
     zfree(li);
 }
 
@@ -77,21 +85,9 @@ int listTypeNext(listTypeIterator *li, listTypeEntry *entry) {
             return 1;
         }
 
-    // 双端链表
-    } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
-
-        // 当前节点
-        entry->ln = li->ln;
-
-        // 移动指针到下一个节点
-        if (entry->ln != NULL) {
-            if (li->direction == REDIS_TAIL) {
-                li->ln = li->ln->next;
-            } else {
-                li->ln = li->ln->prev;
-            }
-            return 1;
-        }
+    // 快速列表
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        return quicklistNext(li->iter, &entry->entry);
     
     // 未知编码
     } else {
@@ -128,11 +124,14 @@ robj *listTypeGet(listTypeEntry *entry) {
             }
         }
 
-    // 双端链表
-    } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
-        redisAssert(entry->ln != NULL);
-        value = listNodeValue(entry->ln);
-        incrRefCount(value);
+    // 快速列表
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        redisAssert(entry->entry.node != NULL);
+        if (entry->entry.value) {
+            value = createStringObject((char*)entry->entry.value, entry->entry.sz);
+        } else {
+            value = createStringObjectFromLongLong(entry->entry.longval);
+        }
 
     } else {
         redisPanic("Unknown list encoding");
@@ -143,36 +142,23 @@ robj *listTypeGet(listTypeEntry *entry) {
 
 /*----------------------- 编码转换 ------------------------*/
 /**
- * 将列表的编码从 压缩列表 转换成 双端链表
+ * 将列表的编码从 压缩列表 转换成 快速列表
  */
 void listTypeConvert(robj *subject, int enc) {
 
-    listTypeIterator *li;
-    listTypeEntry entry;
-
     redisAssertWithInfo(NULL, subject, subject->type == REDIS_LIST);
+    redisAssertWithInfo(NULL, subject, subject->encoding == REDIS_ENCODING_ZIPLIST);
 
-    // 转换成双端链表
-    if (enc == REDIS_ENCODING_LINKEDLIST) {
-
-        // 创建一个空链表
-        list *l = listCreate();
+    // 转换成快速列表
+    if (enc == REDIS_ENCODING_QUICKLIST) {
 
-        listSetFreeMethod(l, decrRefCountVoid);
-
-        // 遍历压缩列表, 迁移节点到双端链表
-        li = listTypeInitIterator(subject, 0, REDIS_TAIL);
-        while (listTypeNext(li,&entry)) listAddNodeTail(l, listTypeGet(&entry));
-        listTypeReleaseIterator(li);
+        // 按顺序迁移压缩列表的元素, 原压缩列表会被释放
+        subject->ptr = quicklistCreateFromZiplist(server.list_quicklist_fill,
+                                                  server.list_compress_depth,
+                                                  subject->ptr);
 
         // 更新编码
-        subject->encoding = REDIS_ENCODING_LINKEDLIST;
-
-        // 释放原值
-        zfree(subject->ptr);
-
-        // 更新值指针
-        subject->ptr = l;
+        subject->encoding = REDIS_ENCODING_QUICKLIST;
 
     } else {
         redisPanic("Unsupported list conversion");
@@ -189,9 +175,9 @@ void listTypeTryConversion(robj *subject, robj *value) {
     if (subject->encoding != REDIS_ENCODING_ZIPLIST) return;
 
     if (sdsEncodedObject(value) && 
-        sdslen(value) > server.list_max_ziplist_value) {
-            // 将编码转换成双端链表
-            listTypeConvert(subject, REDIS_ENCODING_LINKEDLIST);
+        sdslen(value->ptr) > server.list_max_ziplist_value) {
+            // 将编码转换成快速列表
+            listTypeConvert(subject, REDIS_ENCODING_QUICKLIST);
     }
 }
 
@@ -210,7 +196,7 @@ void listTypePush(robj *subject, robj *value, int where) {
     // 压缩列表节点超过最大限制, 导致转换编码
     if (subject->encoding == REDIS_ENCODING_ZIPLIST &&
         ziplistLen(subject->ptr) >= server.list_max_ziplist_entries) {
-            listTypeConvert(subject, REDIS_ENCODING_LINKEDLIST);
+            listTypeConvert(subject, REDIS_ENCODING_QUICKLIST);
     }
 
     // 压缩列表编码
@@ -218,23 +204,82 @@ void listTypePush(robj *subject, robj *value, int where) {
         int pos = (where == REDIS_HEAD) ? ZIPLIST_HEAD : ZIPLIST_TAIL;
         // 将整型值转为字符串, 方便计算长度
         value = getDecodedObject(value);
-        ziplistPush(subject->ptr, value->ptr, sdslen(value->ptr), pos);
+        subject->ptr = ziplistPush(subject->ptr, value->ptr, sdslen(value->ptr), pos);
         decrRefCount(value);
     
-    // 双端链表编码
-    } else if (subject->encoding == REDIS_ENCODING_LINKEDLIST) {
+    // 快速列表编码
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        int pos = (where == REDIS_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        value = getDecodedObject(value);
+        quicklistPush(subject->ptr, value->ptr, sdslen(value->ptr), pos);
+        decrRefCount(value);
 
-        if (where == REDIS_HEAD) {
-            listAddNodeHead(subject->ptr, value);
-        } else {
-            listAddNodeTail(subject->ptr, value);
-        }
-        incrRefCount(value);
+    // 未知编码
+    } else {
+        redisPanic("Unknown list encoding");
+    }
+}
+
+/**
+ * 将 num 个对象 values 依次添加到列表, 结果与逐个调用 listTypePush 相同
+ * where 控制添加方向
+ * - REDIS_HEAD 表头添加
+ * - REDIS_TAIL 表尾添加
+ *
+ * 编码转换在添加之前一次性决定,
+ * 之后压缩列表只重分配一次内存, 快速列表每个节点只重分配一次内存
+ */
+void listTypePushMulti(robj *subject, robj **values, int num, int where) {
+    unsigned char **vstr;
+    unsigned int *vlen;
+    robj **decoded;
+    int j;
+
+    if (num <= 0) return;
+
+    // 任意一个值超过长度限制, 或者添加后节点数超过限制, 都会导致转换编码
+    for (j = 0; j < num; j++) listTypeTryConversion(subject, values[j]);
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST &&
+        ziplistLen(subject->ptr) + num > server.list_max_ziplist_entries) {
+            listTypeConvert(subject, REDIS_ENCODING_QUICKLIST);
+    }
+
+    // 收集所有值的字符串形式
+    vstr = zmalloc(sizeof(unsigned char*) * num);
+    vlen = zmalloc(sizeof(unsigned int) * num);
+    decoded = zmalloc(sizeof(robj*) * num);
+    for (j = 0; j < num; j++) {
+        decoded[j] = getDecodedObject(values[j]);
+        vstr[j] = (unsigned char*)decoded[j]->ptr;
+        vlen[j] = sdslen(decoded[j]->ptr);
+    }
+
+    // 压缩列表编码
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        int pos = (where == REDIS_HEAD) ? ZIPLIST_HEAD : ZIPLIST_TAIL;
+        subject->ptr = ziplistPushMulti(subject->ptr, vstr, vlen, num, pos);
+
+    // 快速列表编码
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        int pos = (where == REDIS_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        quicklistPushMulti(subject->ptr, vstr, vlen, num, pos);
 
     // 未知编码
     } else {
         redisPanic("Unknown list encoding");
     }
+
+    for (j = 0; j < num; j++) decrRefCount(decoded[j]);
+    zfree(decoded);
+    zfree(vlen);
+    zfree(vstr);
+}
+
+/**
+ * 快速列表弹出元素时, 将字符串值保存为字符串对象
+ */
+static void *listPopSaver(unsigned char *data, unsigned int sz) {
+    return createStringObject((char*)data, sz);
 }
 
 /**
@@ -246,7 +291,7 @@ void listTypePush(robj *subject, robj *value, int where) {
  */
 robj *listTypePop(robj *subject, int where) {
 
-    robj *value;
+    robj *value = NULL;
 
     // 压缩列表弹出元素
     if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
@@ -268,22 +313,15 @@ robj *listTypePop(robj *subject, int where) {
             subject->ptr = ziplistDelete(subject->ptr, &p);
         }
 
-    // 双端链表弹出元素
-    } else if (subject->encoding == REDIS_ENCODING_LINKEDLIST) {
-        list *list = subject->ptr;
-        listNode *ln;
-
-        if (where == REDIS_HEAD) {
-            ln = listFirst(list);
-        } else {
-            ln = listLast(list);
-        }
+    // 快速列表弹出元素
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        long long vlong;
+        int pos = (where == REDIS_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
 
-        if (ln != NULL) {
-            value = listNodeValue(ln);
-            // ?? 为什么 ziplist 里面没有增加引用计数
-            incrRefCount(value);
-            listDelNode(list, ln);
+        // 字符串值由 listPopSaver 创建成对象, 整数值保存在 vlong
+        if (quicklistPopCustom(subject->ptr, pos, (unsigned char **)&value,
+                               NULL, &vlong, listPopSaver)) {
+            if (value == NULL) value = createStringObjectFromLongLong(vlong);
         }
 
     } else {
@@ -302,9 +340,9 @@ unsigned long listTypeLength(robj *subject) {
     if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
         return ziplistLen(subject->ptr);
 
-    // 双端链表
-    } else if (subject->encoding == REDIS_ENCODING_LINKEDLIST) {
-        return listLength((list*)subject->ptr);
+    // 快速列表
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        return quicklistCount(subject->ptr);
 
     // 未知编码
     } else {
@@ -346,15 +384,16 @@ void listTypeInsert(listTypeEntry *entry, robj *value, int where) {
         }
         decrRefCount(value);
 
-    // 双端链表
-    } else if (entry->li->encoding == REDIS_ENCODING_LINKEDLIST) {
+    // 快速列表
+    } else if (entry->li->encoding == REDIS_ENCODING_QUICKLIST) {
 
+        value = getDecodedObject(value);
         if (where == REDIS_TAIL) {
-            listInsertNode(subject->ptr, entry->ln, value, AL_START_TAIL);
+            quicklistInsertAfter(subject->ptr, &entry->entry, value->ptr, sdslen(value->ptr));
         } else {
-            listInsertNode(subject->ptr, entry->ln, value, AL_START_HEAD);
+            quicklistInsertBefore(subject->ptr, &entry->entry, value->ptr, sdslen(value->ptr));
         }
-        incrRefCount(value);
+        decrRefCount(value);
 
     // 未知编码
     } else {
@@ -375,9 +414,10 @@ int listTypeEqual(listTypeEntry *entry, robj *o) {
         redisAssertWithInfo(NULL,o,sdsEncodedObject(o));
         return ziplistCompare(entry->zi, o->ptr, sdslen(o->ptr));
 
-    // 双端链表
-    } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
-        return equalStringObjects(o, listNodeValue(entry->ln));
+    // 快速列表
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        redisAssertWithInfo(NULL,o,sdsEncodedObject(o));
+        return quicklistCompare(entry->entry.zi, o->ptr, sdslen(o->ptr));
 
     // 未知编码
     } else {
@@ -405,22 +445,9 @@ void listTypeDelete(listTypeEntry *entry) {
             li->zi = ziplistPrev(li->subject->ptr, p);
         }
 
-    // 双端链表
-    } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
-
-        // 记录移动的节点
-        listNode *next;
-
-        if (li->direction == REDIS_TAIL) {
-            next = li->ln->next;
-        } else {
-            next = li->ln->prev;
-        }
-
-        listDelNode(li->subject->ptr, entry->ln);
-
-        // 更新节点指针指向
-        li->ln = next;
+    // 快速列表, 删除后由 quicklistDelEntry 更新迭代器的位置
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistDelEntry(li->iter, &entry->entry);
     // 未知编码
     } else {
         redisPanic("Unknown list encoding");
@@ -435,7 +462,7 @@ void listTypeDelete(listTypeEntry *entry) {
  * 添加失败, 回复客户端错误, 终止程序
  */
 void pushGenericCommand(redisClient *c, int where) {
-    int j, waiting = 0, pushed = 0;
+    int waiting = 0, pushed = 0;
 
     // 获取 key 的值
     robj *lobj = lookupKeyWrite(c->db, c->argv[1]);
@@ -452,23 +479,17 @@ void pushGenericCommand(redisClient *c, int where) {
     // 将列表状态设置为就绪
     if (may_have_waiting_clients) signalListAsReady(c, c->argv[1]);
 
-    // 向列表对象中添加节点值
-    for (j=2; j<c->argc; j++) {
-
-        // 压缩节点值剩余空间
-        c->argv[j] = tryObjectEncoding(c->argv[j]);
-
-        // 如果列表键不存在, 创建一个
-        if (!lobj) {
-            lobj = createZiplistObject();
-            dbAdd(c->db, c->argv[1], lobj);
-        }
-
-        // 添加节点
-        listTypePush(lobj, c->argv[j], where);
-        pushed++;
+    // 如果列表键不存在, 创建一个
+    if (!lobj) {
+        lobj = createZiplistObject();
+        dbAdd(c->db, c->argv[1], lobj);
     }
 
+    // 一次性添加所有节点值
+    // 值只会被复制到 ziplist 中, 不需要 tryObjectEncoding
+    listTypePushMulti(lobj, c->argv+2, c->argc-2, where);
+    pushed = c->argc-2;
+
     // 返回节点数量
     addReplyLongLong(c, waiting + (lobj ? listTypeLength(lobj) : 0));
 
@@ -533,7 +554,7 @@ void pushxGenericCommand(redisClient *c, robj *refval, robj *val, int where) {
             // 检查节点数量是否达到转码标准
             if (subject->encoding == REDIS_ENCODING_ZIPLIST && 
                 ziplistLen(subject->ptr) > server.list_max_ziplist_entries) {
-                    listTypeConvert(subject, REDIS_ENCODING_LINKEDLIST);
+                    listTypeConvert(subject, REDIS_ENCODING_QUICKLIST);
             }
 
             // 发送键被修改的信号
@@ -618,7 +639,7 @@ void lindexCommand(redisClient *c) {
     robj *value = NULL;
 
     // 获取 index 值
-    if ((getLongFromObjectOrReply(c, c->argv[3], &index, NULL)) != REDIS_OK)
+    if ((getLongFromObjectOrReply(c, c->argv[2], &index, NULL)) != REDIS_OK)
         return;
 
     if (o->encoding == REDIS_ENCODING_ZIPLIST) {
@@ -642,15 +663,23 @@ void lindexCommand(redisClient *c) {
         } else {
             addReply(c, shared.nullbulk);
         }
-    } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-        listNode *ln = listIndex(o->ptr, index);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistIter *iter;
+        quicklistEntry entry;
 
-        if (ln != NULL) {
+        // 通过迭代器读取, 释放迭代器时会重新压缩被临时解压的节点
+        iter = quicklistGetIteratorAtIdx(o->ptr, AL_START_TAIL, index);
+        if (quicklistNext(iter, &entry)) {
 
-            addReplyBulk(c,listNodeValue(ln));
+            if (entry.value) {
+                addReplyBulkCBuffer(c, entry.value, entry.sz);
+            } else {
+                addReplyLongLong(c, entry.longval);
+            }
         } else {
             addReply(c, shared.nullbulk);
         }
+        quicklistReleaseIterator(iter);
 
     } else {
         redisPanic("Unknown list encoding");
@@ -699,21 +728,18 @@ void lsetCommand(redisClient *c) {
             server.dirty++;
         }
 
-    // 双端链表
-    } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+    // 快速列表
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        int replaced;
 
-        // 获取 index 指向的值
-        listNode *ln = listIndex(o->ptr, index);
+        // 用新值替换 index 处的元素
+        value = getDecodedObject(value);
+        replaced = quicklistReplaceAtIndex(o->ptr, index, value->ptr, sdslen(value->ptr));
+        decrRefCount(value);
 
-        if (ln == NULL) {
+        if (!replaced) {
             addReply(c, shared.outofrangeerr);
         } else {
-            // 删除旧节点
-            decrRefCount((robj*)listNodeValue(ln));
-            // 指向新节点
-            listNodeValue(ln) = value;
-            incrRefCount(value);
-
             addReply(c, shared.ok);
             signalModifiedKey(c->db, c->argv[1]);
             notifyKeyspaceEvent(REDIS_NOTIFY_LIST, "lset", c->argv[1], c->db->id);
@@ -726,45 +752,133 @@ void lsetCommand(redisClient *c) {
 
 }
 
+/**
+ * 从列表的表头或表尾弹出最多 count 个节点, 以多条批量回复返回给客户端
+ *
+ * 先按弹出顺序回复节点值, 再一次性删除这些节点:
+ * 压缩列表只移动和重分配一次内存, 快速列表中被完全覆盖的节点直接释放
+ *
+ * 返回实际弹出的节点数量
+ */
+static long listPopRangeAndReply(redisClient *c, robj *o, long count, int where) {
+    long llen = listTypeLength(o), j;
+
+    if (count > llen) count = llen;
+    addReplyMultiBulkLen(c, count);
+
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr, (where == REDIS_HEAD) ? 0 : -1);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+
+        for (j = 0; j < count; j++) {
+            ziplistGet(p, &vstr, &vlen, &vlong);
+            if (vstr) {
+                addReplyBulkCBuffer(c, vstr, vlen);
+            } else {
+                addReplyLongLong(c, vlong);
+            }
+            p = (where == REDIS_HEAD) ? ziplistNext(o->ptr, p) : ziplistPrev(o->ptr, p);
+        }
+        o->ptr = ziplistDeleteRange(o->ptr, (where == REDIS_HEAD) ? 0 : -count, count);
+
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        int direction = (where == REDIS_HEAD) ? AL_START_HEAD : AL_START_TAIL;
+        quicklistIter *iter = quicklistGetIterator(o->ptr, direction);
+        quicklistEntry entry;
+
+        for (j = 0; j < count && quicklistNext(iter, &entry); j++) {
+            if (entry.value) {
+                addReplyBulkCBuffer(c, entry.value, entry.sz);
+            } else {
+                addReplyLongLong(c, entry.longval);
+            }
+        }
+        quicklistReleaseIterator(iter);
+        quicklistDelRange(o->ptr, (where == REDIS_HEAD) ? 0 : -count, count);
+
+    } else {
+        redisPanic("Unknown list encoding");
+    }
+
+    return count;
+}
+
+/**
+ * LPOP / RPOP 的通用函数
+ * 不带 count 参数时弹出一个节点, 回复节点值
+ * 带 count 参数时弹出最多 count 个节点, 回复节点值的数组, 键不存在时回复空数组
+ */
 void popGenericCommand(redisClient *c, int where) {
+    long count = 0;
+    robj *o;
+
+    if (c->argc > 3) {
+        addReply(c, shared.syntaxerr);
+        return;
+    }
+
+    // 获取 count 参数
+    if (c->argc == 3) {
+        if (getLongFromObjectOrReply(c, c->argv[2], &count, NULL) != REDIS_OK)
+            return;
+        if (count < 0) {
+            addReplyError(c, "value is out of range, must be positive");
+            return;
+        }
+    }
 
     // 获取列表值
-    robj *o = lookupKeyWriteOrReply(c, c->argv[1], shared.nullbulk);
-    
+    o = lookupKeyWriteOrReply(c, c->argv[1],
+                              (c->argc == 3) ? shared.nullmultibulk : shared.nullbulk);
+
     if (o == NULL || checkType(c, o, REDIS_LIST)) return;
 
-    robj *value = listTypePop(o, where);
+    if (c->argc == 3 && count == 0) {
+        addReply(c, shared.emptymultibulk);
+        return;
+    }
 
-    if (value == NULL) {
-        addReply(c, shared.nullbulk);
+    if (c->argc == 3) {
+        // 批量弹出
+        count = listPopRangeAndReply(c, o, count, where);
     } else {
-        char *event = (where == REDIS_HEAD) ? "lpop" : "rpop";
+        robj *value = listTypePop(o, where);
+
+        if (value == NULL) {
+            addReply(c, shared.nullbulk);
+            return;
+        }
 
         // 回复客户端删除的值
-        addReply(c,value);
+        addReplyBulk(c,value);
         decrRefCount(value);
+        count = 1;
+    }
 
-        // 发送事件通知
-        notifyKeyspaceEvent(REDIS_NOTIFY_LIST, event, c->argv[1], c->db->id);
-
-        // 列表对象空了, 从 db 中删除这个列表键
-        if (listTypeLength(o) == 0) {
-            notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", c->argv[1], c->db->id);
-            dbDelete(c->db, c->argv[1]);
-        }
+    char *event = (where == REDIS_HEAD) ? "lpop" : "rpop";
 
-        signalModifiedKey(c->db, c->argv[1]);
+    // 发送事件通知
+    notifyKeyspaceEvent(REDIS_NOTIFY_LIST, event, c->argv[1], c->db->id);
 
-        server.dirty++;
+    // 列表对象空了, 从 db 中删除这个列表键
+    if (listTypeLength(o) == 0) {
+        notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", c->argv[1], c->db->id);
+        dbDelete(c->db, c->argv[1]);
     }
+
+    signalModifiedKey(c->db, c->argv[1]);
+
+    server.dirty += count;
 }
 
-// LPOP KEY_NAME
+// LPOP KEY_NAME [COUNT]
 void lpopCommand(redisClient *c) {
     popGenericCommand(c, REDIS_HEAD);   
 }
 
-// RPOP KEY_NAME
+// RPOP KEY_NAME [COUNT]
 void rpopCommand(redisClient *c) {
     popGenericCommand(c, REDIS_TAIL);   
 }
@@ -821,20 +935,24 @@ void lrangeCommand(redisClient *c) {
             }
             p = ziplistNext(o->ptr, p);
         }
-    } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-        listNode *ln;
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistIter *iter;
+        quicklistEntry entry;
 
         // 起始节点
-        if (start > llen/2) start -= llen;
-        ln = listIndex(o->ptr, start);
+        iter = quicklistGetIteratorAtIdx(o->ptr, AL_START_HEAD, start);
 
         // 收集范围内的节点, 回复给客户端
-        while(rangelen--) {
-            addReplyBulk(c, ln->value);
-            ln = ln->next;
+        while(rangelen-- && quicklistNext(iter, &entry)) {
+            if (entry.value) {
+                addReplyBulkCBuffer(c, entry.value, entry.sz);
+            } else {
+                addReplyLongLong(c, entry.longval);
+            }
         }
+        quicklistReleaseIterator(iter);
     } else {
-        redisPanic("List encoding is not LINKEDLIST nor ZIPLIST!");
+        redisPanic("List encoding is not QUICKLIST nor ZIPLIST!");
     }
 }
 
@@ -842,9 +960,7 @@ void lrangeCommand(redisClient *c) {
 void ltrimCommand(redisClient *c) {
 
     robj *o;
-    long start, end, llen, j, ltrim, rtrim;
-    list *list;
-    listNode *ln;
+    long start, end, llen, ltrim, rtrim;
 
     // 获取索引值
     if (getLongFromObjectOrReply(c, c->argv[2], &start, NULL) != REDIS_OK ||
@@ -880,17 +996,24 @@ void ltrimCommand(redisClient *c) {
 
         o->ptr = ziplistDeleteRange(o->ptr, -rtrim, rtrim);
 
-    } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-        list = o->ptr;
-        // 删除左端节点
-        for(j = 0; j < ltrim; j++) {
-            ln = listFirst(list);
-            listDelNode(list, ln);
-        }
-        // 删除右端节点
-        for(j = 0; j < rtrim; j++) {
-            ln = listLast(list);
-            listDelNode(list, ln);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklist *ql = o->ptr;
+        quicklistNode *lchain, *rchain;
+        unsigned long lnodes, rnodes;
+
+        // 按节点的平均元素数量估计要释放的节点数量,
+        // 较多时把节点一次性摘除后交给后台线程释放, 否则直接删除。
+        // 后台线程启动之前 zmalloc 的计数不是线程安全的, 也直接删除
+        if (server.lazyfree_threshold && bioLazyFreeEnabled() &&
+            (ltrim+rtrim) / (ql->count / ql->len) >= server.lazyfree_threshold)
+        {
+            quicklistDelRangeDetach(ql, 0, ltrim, &lchain, &lnodes);
+            quicklistDelRangeDetach(ql, -rtrim, rtrim, &rchain, &rnodes);
+            if (lchain) bioCreateLazyFreeJob(quicklistReleaseDetached, lchain);
+            if (rchain) bioCreateLazyFreeJob(quicklistReleaseDetached, rchain);
+        } else {
+            quicklistDelRange(ql, 0, ltrim);
+            quicklistDelRange(ql, -rtrim, rtrim);
         }
 
     } else {
@@ -919,8 +1042,7 @@ void ltrimCommand(redisClient *c) {
 void lremCommand(redisClient *c) {
     robj *subject, *obj;
     long toremove, removed = 0;
-    listTypeIterator *li;
-    listTypeEntry entry;
+    int fromtail = 0;
 
     // 压缩要查找的节点
     obj = c->argv[3] = tryObjectEncoding(c->argv[3]);
@@ -935,33 +1057,34 @@ void lremCommand(redisClient *c) {
              return;
     }
 
-    if (subject->encoding == REDIS_ENCODING_ZIPLIST)
-        obj = getDecodedObject(obj);
+    // 两种编码都以字符串比对元素
+    obj = getDecodedObject(obj);
 
-    // 计算删除节点的数量和删除的迭代器(指向第一个节点)
+    // toremove 为负数时从表尾开始删除
     if (toremove < 0) {
         toremove = -toremove;
-        li = listTypeInitIterator(subject, -1, REDIS_HEAD);
-    } else {
-        li = listTypeInitIterator(subject, 0, REDIS_TAIL);
+        fromtail = 1;
     }
 
-    // 遍历删除节点
-    while(listTypeNext(li, &entry)) {
-        // 匹配成功, 删除节点
-        if (listTypeEqual(&entry, obj)) {
-            listTypeDelete(&entry);
-            server.dirty++;
-            removed++;
+    // 直接与 ziplist 中的原始字节或整数比对, 每个 ziplist 只重写一次
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned int deleted;
 
-            // 删除够数量了
-            if (toremove && toremove == removed) break;
-        }
+        subject->ptr = ziplistDeleteMatching(subject->ptr, obj->ptr, sdslen(obj->ptr),
+                                             toremove > UINT_MAX ? 0 : toremove,
+                                             fromtail, &deleted);
+        removed = deleted;
+
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        removed = quicklistDelMatching(subject->ptr, obj->ptr, sdslen(obj->ptr), toremove,
+                                       fromtail ? AL_START_TAIL : AL_START_HEAD);
+
+    } else {
+        redisPanic("Unknown list encoding");
     }
-    listTypeReleaseIterator(li);
+    server.dirty += removed;
 
-    if (subject->encoding == REDIS_ENCODING_ZIPLIST)
-        decrRefCount(obj);
+    decrRefCount(obj);
 
     // 删除空列表
     if (listTypeLength(subject) == 0) dbDelete(c->db, c->argv[1]);
@@ -972,10 +1095,128 @@ void lremCommand(redisClient *c) {
 }
 
 /**
- * 将 value 添加到 dstkey 的列表中
- * 如果 dstkey 不存在, 那么创建一个空列表并添加
+ * 从对象中取出列表的方向, LEFT 为 REDIS_HEAD , RIGHT 为 REDIS_TAIL
+ * 取出成功返回 REDIS_OK , 否则回复语法错误并返回 REDIS_ERR
  */
-void rpoplpushHandlePush(redisClient *c, robj *dstkey, robj *dstobj, robj *value) {
+static int getListPositionFromObjectOrReply(redisClient *c, robj *arg, int *position) {
+    if (!strcasecmp(arg->ptr, "right")) {
+        *position = REDIS_TAIL;
+    } else if (!strcasecmp(arg->ptr, "left")) {
+        *position = REDIS_HEAD;
+    } else {
+        addReply(c, shared.syntaxerr);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 解析从 argv[pos] 开始的可选参数 COUNT count
+ * 没有 COUNT 时 *count 为 0 , 表示只移动一个元素
+ * 解析成功返回 REDIS_OK , 否则回复错误并返回 REDIS_ERR
+ */
+static int getListMoveCountOrReply(redisClient *c, int pos, long *count) {
+    *count = 0;
+    if (c->argc == pos) return REDIS_OK;
+
+    if (c->argc != pos+2 || strcasecmp(c->argv[pos]->ptr, "count")) {
+        addReply(c, shared.syntaxerr);
+        return REDIS_ERR;
+    }
+    if (getLongFromObjectOrReply(c, c->argv[pos+1], count, NULL) != REDIS_OK)
+        return REDIS_ERR;
+    if (*count <= 0) {
+        addReplyError(c, "count should be greater than 0");
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/**
+ * 从列表的 where 端弹出最多 count 个元素, 按弹出的顺序保存到 values 中
+ * 返回弹出的元素数量
+ *
+ * 所有元素只做一次范围删除, 而不是逐个弹出
+ */
+static long listTypePopMulti(robj *subject, robj **values, long count, int where) {
+    long llen = listTypeLength(subject), j;
+
+    if (count > llen) count = llen;
+
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(subject->ptr, (where == REDIS_HEAD) ? 0 : -1);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+
+        for (j = 0; j < count; j++) {
+            ziplistGet(p, &vstr, &vlen, &vlong);
+            if (vstr) {
+                values[j] = createStringObject((char*)vstr, vlen);
+            } else {
+                values[j] = createStringObjectFromLongLong(vlong);
+            }
+            p = (where == REDIS_HEAD) ? ziplistNext(subject->ptr, p) : ziplistPrev(subject->ptr, p);
+        }
+        subject->ptr = ziplistDeleteRange(subject->ptr, (where == REDIS_HEAD) ? 0 : -count, count);
+
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        int direction = (where == REDIS_HEAD) ? AL_START_HEAD : AL_START_TAIL;
+        quicklistIter *iter = quicklistGetIterator(subject->ptr, direction);
+        quicklistEntry entry;
+
+        for (j = 0; j < count && quicklistNext(iter, &entry); j++) {
+            if (entry.value) {
+                values[j] = createStringObject((char*)entry.value, entry.sz);
+            } else {
+                values[j] = createStringObjectFromLongLong(entry.longval);
+            }
+        }
+        quicklistReleaseIterator(iter);
+        quicklistDelRange(subject->ptr, (where == REDIS_HEAD) ? 0 : -count, count);
+
+    } else {
+        redisPanic("Unknown list encoding");
+    }
+
+    return count;
+}
+
+/**
+ * 源列表和目标列表是同一个列表时的 LMOVE / BLMOVE
+ *
+ * 逐个移动 moved 次的结果是将列表旋转 moved 次, moved 可以大于列表长度,
+ * 第 j 次移动的值是 values[j % num]
+ *
+ * values 至少要能保存 min(moved, 列表长度) 个值, 返回保存的值的数量 num
+ */
+static long listTypeRotateMulti(robj *subject, robj **values, long moved,
+                                int wherefrom, int whereto) {
+    long num, j;
+    robj **order;
+
+    // 两端相同时每次移动都将同一个元素放回原处, 列表不变
+    if (wherefrom == whereto) {
+        num = listTypePopMulti(subject, values, 1, wherefrom);
+        listTypePush(subject, values[0], whereto);
+        return num;
+    }
+
+    // 弹出会被移动的元素, 然后按旋转 moved 次之后的顺序放回另一端
+    num = listTypePopMulti(subject, values, moved, wherefrom);
+    order = zmalloc(sizeof(robj*) * num);
+    for (j = 0; j < num; j++) order[j] = values[(moved + j) % num];
+    listTypePushMulti(subject, order, num, whereto);
+    zfree(order);
+
+    return num;
+}
+
+/**
+ * 将 num 个值 values 依次添加到 dstkey 的列表的 where 端
+ * 如果 dstkey 不存在, 那么创建一个空列表并添加, 并通知等待这个键的客户端
+ */
+void lmoveHandlePush(redisClient *c, robj *dstkey, robj *dstobj, robj **values, int num, int where) {
 
     // 创建一个空列表
     if (!dstobj) {
@@ -986,69 +1227,125 @@ void rpoplpushHandlePush(redisClient *c, robj *dstkey, robj *dstobj, robj *value
 
     signalModifiedKey(c->db, dstkey);
 
-    // 添加节点
-    listTypePush(dstobj, value, REDIS_HEAD);
+    // 添加节点, 编码转换只检查一次
+    listTypePushMulti(dstobj, values, num, where);
 
-    notifyKeyspaceEvent(REDIS_NOTIFY_LIST, "lpush", dstkey, c->db->id);
+    notifyKeyspaceEvent(REDIS_NOTIFY_LIST,
+        (where == REDIS_HEAD) ? "lpush" : "rpush", dstkey, c->db->id);
+}
 
-    addReplyBulk(c, value);
+/**
+ * 回复被移动的值: 没有 COUNT 选项时回复单个值, 否则回复数组
+ * 共移动了 moved 次, 第 j 次移动的值是 values[j % num] , 见 listTypeRotateMulti
+ */
+static void addReplyMovedValues(redisClient *c, robj **values, long num,
+                                long moved, long count) {
+    long j;
+
+    if (count == 0) {
+        addReplyBulk(c, values[0]);
+    } else {
+        addReplyMultiBulkLen(c, moved);
+        for (j = 0; j < moved; j++) addReplyBulk(c, values[j % num]);
+    }
 }
 
-// RPOPLPUSH source destination
-void rpoplpushCommand(redisClient *c) {
-    robj *value, *sobj;
+/**
+ * LMOVE / RPOPLPUSH 的通用函数
+ * 从 argv[1] 的 wherefrom 端弹出最多 count 个元素 (count 为 0 时弹出一个),
+ * 按弹出的顺序添加到 argv[2] 的 whereto 端, 结果与逐个移动相同
+ *
+ * 两个列表各自只做一次范围删除和一次批量添加,
+ * 源列表和目标列表相同时旋转列表, 见 listTypeRotateMulti
+ */
+static void lmoveGenericCommand(redisClient *c, int wherefrom, int whereto, long count) {
+    robj *sobj, *dobj, *touchedkey, **values;
+    long moved, num, j;
 
     // 获取源列表
-    if ((sobj = lookupKeyWriteOrReply(c, c->argv[1], shared.nullbulk)) == NULL || 
+    if ((sobj = lookupKeyWriteOrReply(c, c->argv[1],
+            count ? shared.nullmultibulk : shared.nullbulk)) == NULL ||
         checkType(c, sobj, REDIS_LIST)) return;
 
     // 源列表为空, 无元素可 pop, 返回
     if (listTypeLength(sobj) == 0) {
-        addReply(c, shared.nullbulk);
+        addReply(c, count ? shared.nullmultibulk : shared.nullbulk);
+        return;
+    }
 
-    // 源列表非空
-    } else {
+    // 获取目标列表(要添加节点的列表), 目标列表必须为列表类型
+    dobj = lookupKeyWrite(c->db, c->argv[2]);
+    if (dobj && checkType(c, dobj, REDIS_LIST)) return;
 
-        // 获取目标列表(要添加节点的列表)
-        robj *dobj = lookupKeyWrite(c->db, c->argv[2]);
-        robj *touchedkey = c->argv[1];
+    touchedkey = c->argv[1];
+    incrRefCount(touchedkey);
 
-        // 目标列表是否为列表类型
-        if (dobj && checkType(c, dobj, REDIS_LIST)) return;
+    moved = (count == 0) ? 1 : count;
+    num = moved;
+    if (num > listTypeLength(sobj)) num = listTypeLength(sobj);
+    values = zmalloc(sizeof(robj*) * num);
 
-        // rpop 源列表, 获取最后一个节点
-        value = listTypePop(sobj, REDIS_TAIL);
-        incrRefCount(value);
+    if (sobj == dobj) {
+        // 源列表和目标列表相同, 旋转列表
+        num = listTypeRotateMulti(sobj, values, moved, wherefrom, whereto);
+        notifyKeyspaceEvent(REDIS_NOTIFY_LIST,
+            (whereto == REDIS_HEAD) ? "lpush" : "rpush", touchedkey, c->db->id);
+    } else {
+        // 从源列表弹出, 将节点添加到目标列表
+        num = listTypePopMulti(sobj, values, num, wherefrom);
+        moved = num;
+        lmoveHandlePush(c, c->argv[2], dobj, values, num, whereto);
+    }
+    addReplyMovedValues(c, values, num, moved, count);
 
-        // 将节点添加到目标列表
-        rpoplpushHandlePush(c, c->argv[2], dobj, value);
-        decrRefCount(value);
+    notifyKeyspaceEvent(REDIS_NOTIFY_LIST,
+        (wherefrom == REDIS_HEAD) ? "lpop" : "rpop", touchedkey, c->db->id);
 
-        notifyKeyspaceEvent(REDIS_NOTIFY_LIST, "rpop", touchedkey, c->db->id);
+    // 如果源列表空了, 删除其列表键
+    if (listTypeLength(sobj) == 0) {
+        dbDelete(c->db, touchedkey);
+        notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", touchedkey, c->db->id);
+    }
 
-        // 如果源列表空了, 删除其列表键
-        if (listTypeLength(sobj) == 0) {
-            dbDelete(c->db, touchedkey);
-            notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del",touchedkey, c->db->id);
-        }
+    signalModifiedKey(c->db, touchedkey);
+    decrRefCount(touchedkey);
 
-        signalModifiedKey(c->db, touchedkey);
+    for (j = 0; j < num; j++) decrRefCount(values[j]);
+    zfree(values);
 
-        decrRefCount(touchedkey);
+    server.dirty += moved;
+}
 
-        server.dirty++;
-    }
+// RPOPLPUSH source destination
+void rpoplpushCommand(redisClient *c) {
+    lmoveGenericCommand(c, REDIS_TAIL, REDIS_HEAD, 0);
+}
+
+// LMOVE source destination LEFT|RIGHT LEFT|RIGHT [COUNT count]
+void lmoveCommand(redisClient *c) {
+    int wherefrom, whereto;
+    long count;
+
+    if (getListPositionFromObjectOrReply(c, c->argv[3], &wherefrom) != REDIS_OK ||
+        getListPositionFromObjectOrReply(c, c->argv[4], &whereto) != REDIS_OK ||
+        getListMoveCountOrReply(c, 5, &count) != REDIS_OK)
+        return;
 
+    lmoveGenericCommand(c, wherefrom, whereto, count);
 }
 
 /**
  * 对给定客户端进行阻塞
  * keys     任意多个 key
  * numkeys  keys 的数量
- * timeout  阻塞的最长时间, 0 是无限阻塞
+ * timeout  阻塞时限 (毫秒格式的 UNIX 时间), 0 是无限阻塞
  * target   在解除阻塞时, 将结果保存在这个指针中, 而不是返回给客户端
+ * listpos  解除阻塞时从列表的哪一端弹出, 以及添加到 target 的哪一端
+ *
+ * 每个键的等待队列按阻塞的先后顺序排列, 客户端在 c->bpop.keys 中
+ * 记录自己在各个队列中的节点, 解除阻塞时不需要查找就能删除
  */
-void blockForKeys(redisClient *c, robj **keys, int numkeys, mstime_t timeout, robj *target) {
+void blockForKeys(redisClient *c, robj **keys, int numkeys, mstime_t timeout, robj *target, listPos *listpos) {
     dictEntry *de;
     list *l;
     int j;
@@ -1060,14 +1357,13 @@ void blockForKeys(redisClient *c, robj **keys, int numkeys, mstime_t timeout, ro
     c->bpop.target = target;
     if (target != NULL) incrRefCount(target);
 
+    c->bpop.listpos = *listpos;
+
     // 关联阻塞客户端和键的信息
     for (j = 0; j < numkeys; j++) {
 
-        // 记下造成客户端阻塞的键
-        // 以下语句在键不存在于集合时, 将它添加到集合
-        if (dictAdd(c->bpop.keys, keys[j], NULL) != DICT_OK) continue;
-
-        incrRefCount(keys[j]);
+        // 同一个键只等待一次
+        if (dictFind(c->bpop.keys, keys[j]) != NULL) continue;
 
         // 值是一个链表, 链表中包含所有被阻塞的客户端
         // 以下程序将阻塞键和被阻塞客户端关联起来
@@ -1085,11 +1381,49 @@ void blockForKeys(redisClient *c, robj **keys, int numkeys, mstime_t timeout, ro
         }
         // 将客户端添加到被阻塞客户端的链表中
         listAddNodeTail(l, c);
+
+        // 记下造成客户端阻塞的键, 以及客户端在等待队列中的节点
+        dictAdd(c->bpop.keys, keys[j], listLast(l));
+        incrRefCount(keys[j]);
     }
 
     blockClient(c, REDIS_BLOCKED_LIST);
 }
 
+/**
+ * 将客户端从所有等待队列中删除, 由 unblockClient 调用
+ *
+ * T = O(N), N 为客户端等待的键数量, 与其他等待者的数量无关
+ */
+void unblockClientWaitingData(redisClient *c) {
+    dictEntry *de;
+    dictIterator *di;
+    list *l;
+
+    redisAssertWithInfo(c, NULL, dictSize(c->bpop.keys) != 0);
+
+    di = dictGetIterator(c->bpop.keys);
+    while ((de = dictNext(di)) != NULL) {
+        robj *key = dictGetKey(de);
+
+        // 直接删除客户端在等待队列中的节点
+        l = dictFetchValue(c->db->blocking_keys, key);
+        listDelNode(l, dictGetVal(de));
+
+        // 没有客户端等待这个键了, 删除等待队列
+        if (listLength(l) == 0)
+            dictDelete(c->db->blocking_keys, key);
+    }
+    dictReleaseIterator(di);
+
+    // 清空 bpop.keys , 键的引用计数由字典的析构函数减少
+    dictEmpty(c->bpop.keys, NULL);
+    if (c->bpop.target) {
+        decrRefCount(c->bpop.target);
+        c->bpop.target = NULL;
+    }
+}
+
 /**
  * 如果客户端正因为等待 key 被 push 而阻塞
  * 那么将 key 放到 server.ready_keys 列表里面
@@ -1120,6 +1454,140 @@ void signalListAsReady(redisClient *c, robj *key) {
 
 }
 
+/**
+ * 将从 key 中弹出的 num 个值 values 交给被阻塞的客户端 receiver
+ *
+ * dstkey 为 NULL 时执行的是 BLPOP/BRPOP , 直接回复键和值,
+ * 否则执行的是 BLMOVE/BRPOPLPUSH , 将值添加到 dstkey 中并回复被移动的值
+ *
+ * dstkey 和 key 相同时调用方已经用 listTypeRotateMulti 旋转了列表,
+ * 共移动了 moved 次, 其他情况下 moved 等于 num
+ *
+ * dstkey 的类型错误时返回 REDIS_ERR , 调用方需要将 values 放回原来的列表
+ */
+static int serveClientBlockedOnList(redisClient *receiver, robj *key, robj *dstkey,
+                                    redisDb *db, robj **values, long num, long moved,
+                                    listPos *listpos) {
+    robj *dstobj;
+
+    if (dstkey == NULL) {
+        // 回复弹出元素的列表和值
+        addReplyMultiBulkLen(receiver, 2);
+        addReplyBulk(receiver, key);
+        addReplyBulk(receiver, values[0]);
+    } else if (equalStringObjects(key, dstkey)) {
+        // 列表已经被旋转
+        notifyKeyspaceEvent(REDIS_NOTIFY_LIST,
+            (listpos->whereto == REDIS_HEAD) ? "lpush" : "rpush", key, db->id);
+        addReplyMovedValues(receiver, values, num, moved, listpos->count);
+    } else {
+        dstobj = lookupKeyWrite(receiver->db, dstkey);
+        if (dstobj && checkType(receiver, dstobj, REDIS_LIST)) return REDIS_ERR;
+
+        lmoveHandlePush(receiver, dstkey, dstobj, values, num, listpos->whereto);
+        addReplyMovedValues(receiver, values, num, moved, listpos->count);
+    }
+
+    notifyKeyspaceEvent(REDIS_NOTIFY_LIST,
+        (listpos->wherefrom == REDIS_HEAD) ? "lpop" : "rpop", key, db->id);
+    server.dirty += moved;
+
+    return REDIS_OK;
+}
+
+/**
+ * 服务 server.ready_keys 中记录的所有键的等待者
+ *
+ * 在每次事件循环中调用一次, 同一轮中对同一个键的多次 push
+ * 只会在 ready_keys 中出现一次, 然后在这里成批地交给等待者:
+ * 每个键按阻塞的先后顺序取出队首的等待者, 直到列表为空或没有等待者
+ *
+ * 服务过程中的 push (例如 BRPOPLPUSH 的目标键) 会产生新的 ready_keys ,
+ * 所以循环直到 ready_keys 为空
+ *
+ * T = O(N), N 为被服务的客户端数量
+ */
+void handleClientsBlockedOnLists(void) {
+    while (listLength(server.ready_keys) != 0) {
+        list *l;
+
+        // 换上一个新的 ready_keys , 服务过程中产生的键留到下一轮处理
+        l = server.ready_keys;
+        server.ready_keys = listCreate();
+
+        while (listLength(l) != 0) {
+            listNode *ln = listFirst(l);
+            readyList *rl = ln->value;
+            robj *o;
+
+            // 键可以再次被加入 ready_keys 了
+            dictDelete(rl->db->ready_keys, rl->key);
+
+            o = lookupKeyWrite(rl->db, rl->key);
+            if (o != NULL && o->type == REDIS_LIST) {
+                dictEntry *de;
+
+                de = dictFind(rl->db->blocking_keys, rl->key);
+                if (de) {
+                    list *clients = dictGetVal(de);
+                    int numclients = listLength(clients);
+
+                    // 最后一个等待者解除阻塞时 clients 会被释放,
+                    // 所以按开始时的数量计数, 而不是检查 clients 的长度
+                    while (numclients-- && listTypeLength(o) != 0) {
+                        redisClient *receiver = listNodeValue(listFirst(clients));
+                        robj *dstkey = receiver->bpop.target;
+                        listPos listpos = receiver->bpop.listpos;
+                        long moved = listpos.count ? listpos.count : 1;
+                        long num = moved, j;
+                        robj **values;
+
+                        // 从列表弹出等待者需要的元素,
+                        // 源列表和目标列表相同时旋转列表
+                        if (num > listTypeLength(o)) num = listTypeLength(o);
+                        values = zmalloc(sizeof(robj*) * num);
+                        if (dstkey && equalStringObjects(dstkey, rl->key)) {
+                            num = listTypeRotateMulti(o, values, moved,
+                                                      listpos.wherefrom, listpos.whereto);
+                        } else {
+                            num = listTypePopMulti(o, values, num, listpos.wherefrom);
+                            moved = num;
+                        }
+
+                        // unblockClient 会释放 target
+                        if (dstkey) incrRefCount(dstkey);
+                        unblockClient(receiver);
+
+                        if (serveClientBlockedOnList(receiver, rl->key, dstkey, rl->db,
+                                                     values, num, moved, &listpos) == REDIS_ERR)
+                        {
+                            // 无法服务这个客户端, 按相反的顺序将值放回原来的位置
+                            for (j = num-1; j >= 0; j--)
+                                listTypePush(o, values[j], listpos.wherefrom);
+                        }
+
+                        if (dstkey) decrRefCount(dstkey);
+                        for (j = 0; j < num; j++) decrRefCount(values[j]);
+                        zfree(values);
+                    }
+                }
+
+                // 列表被取空了, 删除列表键
+                if (listTypeLength(o) == 0) {
+                    dbDelete(rl->db, rl->key);
+                    notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC, "del", rl->key, rl->db->id);
+                }
+                signalModifiedKey(rl->db, rl->key);
+            }
+
+            decrRefCount(rl->key);
+            zfree(rl);
+            listDelNode(l, ln);
+        }
+        listRelease(l);
+    }
+}
+
 // BLPOP key [key ...] timeout
 // 执行一次 pop 一个, 从左到右的 key 执行弹出
 // 如果所有 key 都是空的, block 等待有值了再 pop
@@ -1129,7 +1597,7 @@ void blockingPopGenericCommand(redisClient *c, int where) {
     int j;
 
     // 取出 timeout
-    if (getLongLongFromObjectOrReply(c, c->argv[c->argc-1], &timeout, UNIT_SECONDS) != REDIS_OK) 
+    if (getTimeoutFromObjectOrReply(c, c->argv[c->argc-1], &timeout, UNIT_SECONDS) != REDIS_OK)
         return;
 
     // 遍历列表键
@@ -1192,7 +1660,8 @@ void blockingPopGenericCommand(redisClient *c, int where) {
     }
 
     // 所有输入列表键都不存在, 只能阻塞了
-    blockForKeys(c, c->argv+1, c->argc-2, timeout, NULL);
+    listPos listpos = {where, REDIS_HEAD, 0};
+    blockForKeys(c, c->argv+1, c->argc-2, timeout, NULL, &listpos);
 }
 
 void blpopCommand(redisClient *c) {
@@ -1203,27 +1672,24 @@ void brpopCommand(redisClient *c) {
     blockingPopGenericCommand(c, REDIS_TAIL);
 }
 
-// BRPOPLPUSH source destination timeout
-void brpoplpushCommand(redisClient *c) {
-    mstime_t timeout;
-
-    // 取 timeout 参数
-    if (getLongLongFromObjectOrReply(c, c->argv[1], &timeout, UNIT_SECONDS) != REDIS_OK)
-        return;
-
-    // 取出列表键
+/**
+ * BLMOVE / BRPOPLPUSH 的通用函数
+ * 源列表非空时直接执行 LMOVE , 否则阻塞等待源列表出现元素
+ */
+static void blmoveGenericCommand(redisClient *c, int wherefrom, int whereto,
+                                 mstime_t timeout, long count) {
     robj *key = lookupKeyWrite(c->db, c->argv[1]);
 
     // 列表键不存在, 阻塞等待
     if (key == NULL) {
         if (c->flags & REDIS_MULTI) {
-            addReply(c, shared.nullbulk);
+            addReply(c, count ? shared.nullmultibulk : shared.nullbulk);
         } else {
-            blockForKeys(c, c->argv+1, 1, timeout, c->argv[2]);
+            listPos listpos = {wherefrom, whereto, count};
+            blockForKeys(c, c->argv+1, 1, timeout, c->argv[2], &listpos);
         }
 
-
-    // 列表键非空, 执行 RPOP
+    // 列表键非空, 直接移动
     } else {
         // 非列表类型的值, 返回
         if (key->type != REDIS_LIST) {
@@ -1232,7 +1698,175 @@ void brpoplpushCommand(redisClient *c) {
         } else {
             redisAssertWithInfo(c, key, listTypeLength(key) > 0);
 
-            rpoplpushCommand(c);
+            lmoveGenericCommand(c, wherefrom, whereto, count);
         }
     }
-}
\ No newline at end of file
+}
+
+// BRPOPLPUSH source destination timeout
+void brpoplpushCommand(redisClient *c) {
+    mstime_t timeout;
+
+    // 取 timeout 参数
+    if (getTimeoutFromObjectOrReply(c, c->argv[3], &timeout, UNIT_SECONDS) != REDIS_OK)
+        return;
+
+    blmoveGenericCommand(c, REDIS_TAIL, REDIS_HEAD, timeout, 0);
+}
+
+// BLMOVE source destination LEFT|RIGHT LEFT|RIGHT timeout [COUNT count]
+void blmoveCommand(redisClient *c) {
+    mstime_t timeout;
+    int wherefrom, whereto;
+    long count;
+
+    if (getListPositionFromObjectOrReply(c, c->argv[3], &wherefrom) != REDIS_OK ||
+        getListPositionFromObjectOrReply(c, c->argv[4], &whereto) != REDIS_OK ||
+        getTimeoutFromObjectOrReply(c, c->argv[5], &timeout, UNIT_SECONDS) != REDIS_OK ||
+        getListMoveCountOrReply(c, 6, &count) != REDIS_OK)
+        return;
+
+    blmoveGenericCommand(c, wherefrom, whereto, timeout, count);
+}
+
+#ifdef LIST_TEST_MAIN
+/*
+ * 源列表和目标列表相同时的 LMOVE COUNT 测试:
+ * listTypeRotateMulti 的结果和回复必须与逐个移动 count 次相同
+ *
+ * ziplist.c, object.c 和 adlist.c 的 main 没有用宏保护, 先重命名后单独编译:
+ * gcc -g -c -Dmain=ziplist_main ziplist.c
+ * gcc -g -c -Dmain=object_main object.c
+ * gcc -g -c -Dmain=adlist_main adlist.c
+ * gcc -g -DLIST_TEST_MAIN t_list.c networking.c redis.c quicklist.c sds.c zmalloc.c \
+ *     util.c dict.c intset.c lzf_c.c lzf_d.c rand.c ziplist.o object.o adlist.o -lm
+ */
+#define LIST_TEST_LEN 4
+
+/*
+ * 以下是 t_list.c 和 object.c 引用的服务器函数,
+ * 测试不会调用它们 (bioCreateLazyFreeJob 除外, 释放对象时直接执行), 只为了链接
+ */
+void _redisAssert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+unsigned int dictGenHashFunction(const void *key, int len) {
+    REDIS_NOTUSED(key); REDIS_NOTUSED(len); return 0;
+}
+void dictEnableResize(void) {}
+void dictDisableResize(void) {}
+void bioCreateLazyFreeJob(void (*free_fn)(void *), void *arg) { free_fn(arg); }
+int bioLazyFreeEnabled(void) { return 0; }
+robj *lookupKeyWrite(redisDb *db, robj *key) {
+    REDIS_NOTUSED(db); REDIS_NOTUSED(key); return NULL;
+}
+robj *lookupKeyReadOrReply(redisClient *c, robj *key, robj *reply) {
+    REDIS_NOTUSED(c); REDIS_NOTUSED(key); REDIS_NOTUSED(reply); return NULL;
+}
+robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply) {
+    REDIS_NOTUSED(c); REDIS_NOTUSED(key); REDIS_NOTUSED(reply); return NULL;
+}
+void dbAdd(redisDb *db, robj *key, robj *val) {
+    REDIS_NOTUSED(db); REDIS_NOTUSED(key); REDIS_NOTUSED(val);
+}
+int dbDelete(redisDb *db, robj *key) {
+    REDIS_NOTUSED(db); REDIS_NOTUSED(key); return 0;
+}
+void signalModifiedKey(redisDb *db, robj *key) {
+    REDIS_NOTUSED(db); REDIS_NOTUSED(key);
+}
+void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
+    REDIS_NOTUSED(type); REDIS_NOTUSED(event); REDIS_NOTUSED(key); REDIS_NOTUSED(dbid);
+}
+int getTimeoutFromObjectOrReply(redisClient *c, robj *object, mstime_t *timeout, int unit) {
+    REDIS_NOTUSED(c); REDIS_NOTUSED(object); REDIS_NOTUSED(timeout); REDIS_NOTUSED(unit);
+    return REDIS_ERR;
+}
+void blockClient(redisClient *c, int btype) { REDIS_NOTUSED(c); REDIS_NOTUSED(btype); }
+void unblockClient(redisClient *c) { REDIS_NOTUSED(c); }
+void hashEntryFree(sds entry) { REDIS_NOTUSED(entry); }
+void hashTypeClearFieldExpires(robj *o) { REDIS_NOTUSED(o); }
+void hzlFingerprintInvalidate(unsigned char *zl) { REDIS_NOTUSED(zl); }
+void zzlIndexInvalidate(unsigned char *zl) { REDIS_NOTUSED(zl); }
+zskiplist *zslCreate(void) { return NULL; }
+void zslFree(zskiplist *zsl) { REDIS_NOTUSED(zsl); }
+void zbtFree(zbtree *zbt) { REDIS_NOTUSED(zbt); }
+
+/* 按 LMOVE 的定义逐个移动 moved 次, 第 j 次移动的值保存在 values[j] */
+static void listTestMoveOneByOne(robj *subject, robj **values, long moved,
+                                 int wherefrom, int whereto) {
+    long j;
+
+    for (j = 0; j < moved; j++) {
+        listTypePopMulti(subject, values+j, 1, wherefrom);
+        listTypePush(subject, values[j], whereto);
+    }
+}
+
+/* 创建保存 a, b, c, d 的列表, encoding 为列表的编码 */
+static robj *listTestCreate(int encoding) {
+    robj *o = encoding == REDIS_ENCODING_QUICKLIST ?
+              createQuicklistObject() : createZiplistObject();
+    char *elements[LIST_TEST_LEN] = {"a", "b", "c", "d"};
+    int j;
+
+    for (j = 0; j < LIST_TEST_LEN; j++)
+        listTypePush(o, createStringObject(elements[j], 1), REDIS_TAIL);
+    return o;
+}
+
+/* 比较两个列表的元素, 比较会清空两个列表 */
+static int listTestEqual(robj *a, robj *b) {
+    robj *va[LIST_TEST_LEN], *vb[LIST_TEST_LEN];
+    long na, nb, j;
+
+    na = listTypePopMulti(a, va, LIST_TEST_LEN, REDIS_HEAD);
+    nb = listTypePopMulti(b, vb, LIST_TEST_LEN, REDIS_HEAD);
+    if (na != nb) return 0;
+    for (j = 0; j < na; j++)
+        if (!equalStringObjects(va[j], vb[j])) return 0;
+    return 1;
+}
+
+int main(void) {
+    int encodings[2] = {REDIS_ENCODING_ZIPLIST, REDIS_ENCODING_QUICKLIST};
+    int ends[2] = {REDIS_HEAD, REDIS_TAIL};
+    int e, from, to, failed = 0;
+    long moved, num, j;
+
+    server.list_max_ziplist_entries = 128;
+    server.list_max_ziplist_value = 64;
+
+    for (e = 0; e < 2; e++) {
+        for (from = 0; from < 2; from++) {
+            for (to = 0; to < 2; to++) {
+                for (moved = 1; moved <= LIST_TEST_LEN*2+1; moved++) {
+                    robj *rotated = listTestCreate(encodings[e]);
+                    robj *expected = listTestCreate(encodings[e]);
+                    robj *values[LIST_TEST_LEN], *onebyone[LIST_TEST_LEN*2+1];
+                    int ok = 1;
+
+                    num = listTypeRotateMulti(rotated, values, moved, ends[from], ends[to]);
+                    listTestMoveOneByOne(expected, onebyone, moved, ends[from], ends[to]);
+
+                    for (j = 0; j < moved; j++)
+                        if (!equalStringObjects(values[j % num], onebyone[j])) ok = 0;
+                    if (!listTestEqual(rotated, expected)) ok = 0;
+
+                    if (!ok) {
+                        printf("FAILED: encoding %d, %s -> %s, count %ld\n",
+                            encodings[e],
+                            ends[from] == REDIS_HEAD ? "LEFT" : "RIGHT",
+                            ends[to] == REDIS_HEAD ? "LEFT" : "RIGHT", moved);
+                        failed++;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("LMOVE same key rotation: %s\n", failed ? "FAILED" : "OK");
+    return failed ? 1 : 0;
+}
+#endif
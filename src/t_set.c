@@ -22,6 +22,7 @@
  */
 
 #include "redis.h"
+#include "bio.h"
 
 void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *dstkey, int op);
 
@@ -300,7 +301,7 @@ int setTypeRandomElement(robj *setobj, robj **objele, int64_t *llele) {
         *objele = dictGetKey(de);
 
     } else if (setobj->encoding == REDIS_ENCODING_INTSET) {
-        llele = intsetRandom(setobj->ptr);
+        *llele = intsetRandom(setobj->ptr);
 
     } else {
 
@@ -513,14 +514,173 @@ void scardCommand(redisClient *c) {
     addReplyLongLong(c,setTypeSize(set));
 }
 
-// SPOP key
+/*
+ * 随机取样时用于去重的开放寻址哈希表
+ *
+ * 表中保存非 0 的 64 位值 (intset 的索引加一, 或者字典键的地址),
+ * 0 表示空槽。表的大小为不小于 2*count 的 2 的幂,
+ * 整个表只需要一次内存分配。
+ */
+static uint64_t *setSampleTableCreate(unsigned long count, unsigned long *mask) {
+    unsigned long size = 16;
+
+    while (size < count*2) size <<= 1;
+    *mask = size-1;
+
+    return zcalloc(sizeof(uint64_t)*size);
+}
+
+/*
+ * 将 v 加入取样表, 添加成功返回 1, v 已经存在返回 0
+ *
+ * T = O(1)
+ */
+static int setSampleTableAdd(uint64_t *table, unsigned long mask, uint64_t v) {
+    unsigned long i = (unsigned long)((v * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+
+    while (table[i]) {
+        if (table[i] == v) return 0;
+        i = (i+1) & mask;
+    }
+    table[i] = v;
+
+    return 1;
+}
+
+/*
+ * 在 count 大于集合大小的 1/SPOP_SELECT_STRATEGY_MUL 时,
+ * SPOP 对字典编码的集合进行一次选择抽样遍历, 而不是逐个随机弹出
+ */
+#define SPOP_SELECT_STRATEGY_MUL 3
+
+// 实现 SPOP key count
+void spopWithCountCommand(redisClient *c) {
+    long l;
+    unsigned long count, size, j;
+    robj *set, *ele, **argv;
+    int64_t llele;
+    int encoding;
+
+    // 取出 count 值
+    if (getLongFromObjectOrReply(c,c->argv[2],&l,NULL) != REDIS_OK)
+        return;
+    if (l < 0) {
+        addReply(c,shared.outofrangeerr);
+        return;
+    }
+    count = (unsigned long) l;
+
+    // 取出集合对象
+    if ((set = lookupKeyWriteOrReply(c,c->argv[1],shared.emptymultibulk)) == NULL ||
+        checkType(c,set,REDIS_SET)) return;
+
+    // count = 0, 直接返回
+    if (count == 0) {
+        addReply(c,shared.emptymultibulk);
+        return;
+    }
+
+    size = setTypeSize(set);
+
+    notifyKeyspaceEvent(REDIS_NOTIFY_SET,"spop",c->argv[1],c->db->id);
+
+    // case 1: count 不小于集合数量, 弹出整个集合, 作为 DEL 传播
+    if (count >= size) {
+        sunionDiffGenericCommand(c,c->argv+1,1,NULL,REDIS_OP_UNION);
+
+        dbDelete(c->db,c->argv[1]);
+        notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,"del",c->argv[1],c->db->id);
+
+        rewriteClientCommandVector(c,2,shared.del,c->argv[1]);
+        signalModifiedKey(c->db,c->argv[1]);
+        server.dirty += size;
+        return;
+    }
+
+    // 被弹出的元素作为一个 SREM key member [member ...] 传播
+    argv = zmalloc(sizeof(robj*)*(count+2));
+    argv[0] = createStringObject("SREM",4);
+    argv[1] = c->argv[1];
+    incrRefCount(argv[1]);
+
+    addReplyMultiBulkLen(c,count);
+
+    // case 2: 字典编码并且弹出的元素较多,
+    // 用选择抽样 (Knuth 的 Algorithm S) 遍历一次字典:
+    // 剩下 remaining 个元素还需要选出 needed 个时, 以 needed/remaining 的概率选中当前元素
+    if (set->encoding == REDIS_ENCODING_HT &&
+        count*SPOP_SELECT_STRATEGY_MUL > size)
+    {
+        dictIterator *di = dictGetSafeIterator(set->ptr);
+        dictEntry *de;
+        unsigned long remaining = size;
+
+        j = 0;
+        while (j < count && (de = dictNext(di)) != NULL) {
+            if (redisRandomBelow(remaining) < count-j) {
+                ele = dictGetKey(de);
+                incrRefCount(ele);
+                // 安全迭代器允许删除当前节点
+                dictDelete(set->ptr,ele);
+
+                addReplyBulk(c,ele);
+                argv[2+j++] = ele;
+            }
+            remaining--;
+        }
+        dictReleaseIterator(di);
+
+        if (htNeedsResize(set->ptr)) dictResize(set->ptr);
+
+    // case 3: 逐个随机弹出
+    } else {
+        for (j = 0; j < count; j++) {
+            encoding = setTypeRandomElement(set,&ele,&llele);
+
+            if (encoding == REDIS_ENCODING_INTSET) {
+                ele = createStringObjectFromLongLong(llele);
+                set->ptr = intsetRemove(set->ptr,llele,NULL);
+            } else {
+                incrRefCount(ele);
+                setTypeRemove(set,ele);
+            }
+
+            addReplyBulk(c,ele);
+            argv[2+j] = ele;
+        }
+    }
+
+    redisAssert(j == count);
+
+    // argv 的所有权转交给客户端
+    replaceClientCommandVector(c,count+2,argv);
+
+    // 发送通知
+    signalModifiedKey(c->db,c->argv[1]);
+
+    // 更新键改次数
+    server.dirty += count;
+}
+
+// SPOP key [count]
 void spopCommand(redisClient *c) {
     robj *set, *ele, *aux;
     int64_t llele;
     int encoding;
 
+    // 带有 count 参数, 调用 count 专用方法
+    if (c->argc == 3) {
+        spopWithCountCommand(c);
+        return;
+
+    // 参数错误, 报错返回
+    } else if (c->argc > 3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
     // 取出集合对象, 不存在直接返回
-    if ((set = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
+    if ((set = lookupKeyWriteOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,set,REDIS_SET)) return;
 
     // 随机获取一个元素
@@ -566,7 +726,6 @@ void srandmemberWithCountCommand(redisClient *c) {
     int encoding, uniq = 1;
     robj *ele, *set;
     int64_t llele;
-    dict *d;
 
     // 取出 count 值
     if (getLongFromObjectOrReply(c,c->argv[2],&l,NULL) != REDIS_OK)
@@ -582,7 +741,7 @@ void srandmemberWithCountCommand(redisClient *c) {
     }
 
     // 取出集合对象
-    if ((set = lookupKeyWriteOrReply(c,c->argv[1],shared.emptymultibulk)) == NULL ||
+    if ((set = lookupKeyReadOrReply(c,c->argv[1],shared.emptymultibulk)) == NULL ||
         checkType(c,set,REDIS_SET)) return;
 
     // 集合长度
@@ -603,7 +762,7 @@ void srandmemberWithCountCommand(redisClient *c) {
 
             encoding = setTypeRandomElement(set,&ele,&llele);
             if (encoding == REDIS_ENCODING_INTSET) {
-                addReplyLongLong(c,llele);
+                addReplyBulkLongLong(c,llele);
             } else {
                 addReplyBulk(c,ele);
             }
@@ -618,78 +777,64 @@ void srandmemberWithCountCommand(redisClient *c) {
         return;
     }
 
-    // case 3 和 case 4 需要字典结构
-    d = dictCreate(&setDictType,NULL);
+    addReplyMultiBulkLen(c,count);
 
-    // case 3: count大于集合的三分之一, 随机取太慢, 采用随机删除 2/3 的方法
+    // case 3: count大于集合的三分之一, 随机取太慢,
+    // 用选择抽样 (Knuth 的 Algorithm S) 遍历一次集合:
+    // 剩下 remaining 个元素还需要选出 count 个时, 以 count/remaining 的概率选中当前元素
+    // 不需要任何额外的内存
     if (count * SRANDMEMBER_SUB_STRATEGY_MUL > size) {
         setTypeIterator *si;
+        unsigned long remaining = size;
 
-        // 将所有元素迭代到字典中
         si = setTypeInitIterator(set);
-
-        while((encoding = setTypeNext(si,&ele,&llele)) != -1) {
-            int retval = DICT_ERR;
-
-            if (encoding == REDIS_ENCODING_INTSET) {
-                retval = dictAdd(d,createStringObjectFromLongLong(llele),NULL);
-            } else {
-                retval = dictAdd(d,dupStringObject(ele),NULL);
+        while (count && (encoding = setTypeNext(si,&ele,&llele)) != -1) {
+            if (redisRandomBelow(remaining) < count) {
+                if (encoding == REDIS_ENCODING_INTSET) {
+                    addReplyBulkLongLong(c,llele);
+                } else {
+                    addReplyBulk(c,ele);
+                }
+                count--;
             }
-            redisAssert(retval == DICT_OK);
+            remaining--;
         }
-
         setTypeReleaseIterator(si);
-        redisAssert(dictSize(d) == size);
-
-        // 随机删除元素
-        while (size > count) {
-            dictEntry *de;
-
-            de = dictGetRandomKey(d);
-            dictDelete(d,dictGetKey(de));
 
-            size--;
-        }
-
-
-    // case 4: 随机取 count 个元素
+    // case 4: 随机取 count 个元素, 用取样表去重
     } else {
-        unsigned long added = 0;
-
-        while (added < count) {
-
-            // 随机元素
-            encoding = setTypeRandomElement(set,&ele,&llele);
-
-            // 元素装入 robj 中
-            if (encoding == REDIS_ENCODING_INTSET) {
-                ele = createStringObjectFromLongLong(llele);
-            } else {
-                ele = dupStringObject(ele);
+        unsigned long mask;
+        uint64_t *table = setSampleTableCreate(count,&mask);
+
+        if (set->encoding == REDIS_ENCODING_INTSET) {
+            unsigned long j, t;
+
+            // Floyd 算法: 每一轮从 [0, j] 中选出一个索引,
+            // 已经被选过时改选 j, 共 count 轮, 不会产生重复
+            for (j = size-count; j < size; j++) {
+                t = redisRandomBelow(j+1);
+                if (!setSampleTableAdd(table,mask,t+1)) {
+                    t = j;
+                    setSampleTableAdd(table,mask,t+1);
+                }
+                intsetGet(set->ptr,t,&llele);
+                addReplyBulkLongLong(c,llele);
             }
 
-            // 添加到字典
-            if (dictAdd(d,ele,NULL) == REDIS_OK) {
-                added++;
-            } else {
-                decrRefCount(ele);
+        } else {
+            // count 不超过集合的 1/3, 平均每个元素只需要不到 1.5 次取样
+            while (count) {
+                dictEntry *de = dictGetRandomKey(set->ptr);
+
+                ele = dictGetKey(de);
+                if (setSampleTableAdd(table,mask,(uintptr_t)ele)) {
+                    addReplyBulk(c,ele);
+                    count--;
+                }
             }
         }
-    }
 
-    // 返回 case 3 或 case 4 的元素
-    if (size > count) {
-        dictIterator *di;
-        dictEntry *de;
-
-        di = dictGetIterator(d);
-        while ((de = dictNext(di)) != NULL) {
-            addReplyBulk(c,dictGetKey(de));
-        }
-
-        dictReleaseIterator(di);
-        dictRelease(d);
+        zfree(table);
     }
 }
 
@@ -719,7 +864,7 @@ void srandmemberCommand(redisClient *c) {
 
     // 回复客户端
     if (encoding == REDIS_ENCODING_INTSET) {
-        addReplyLongLong(c,llele);
+        addReplyBulkLongLong(c,llele);
     } else {
         addReplyBulk(c,ele);
     }
@@ -729,17 +874,689 @@ void srandmemberCommand(redisClient *c) {
  * 计算 s1 集合元素数量与 s2 集合元素数量之间的差值
  */
 int qsortCompareSetsByCardinality(const void *s1, const void *s2) {
-    return setTypeSize((robj**)s1)-setTypeSize((robj**)s2);
+    unsigned long l1 = setTypeSize(*(robj**)s1), l2 = setTypeSize(*(robj**)s2);
+
+    return (l1 > l2) - (l1 < l2);
 }
 
 /**
  * 计算 s2 集合元素数量与 s1 集合元素数量之间的差值
  */
 int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
-    robj *o1 = (robj**)s1;
-    robj *o2 = (robj**)s2;
+    robj *o1 = *(robj**)s1;
+    robj *o2 = *(robj**)s2;
+    unsigned long l1 = o1 ? setTypeSize(o1) : 0, l2 = o2 ? setTypeSize(o2) : 0;
+
+    return (l2 > l1) - (l2 < l1);
+}
+
+/*----------------------------- 集合运算的执行计划 ------------------------------*/
+
+/*
+ * 集合运算的执行策略
+ *
+ * HASH   : 迭代一个集合, 在其他集合中逐个查找元素, 适用于任何编码
+ * MERGE  : 所有输入都是 intset, 利用 intset 有序的特点归并, 不需要查找
+ * BITMAP : 所有输入都是值域较窄的 intset, 在以最小值为起点的位图上做位运算
+ *
+ * MERGE 和 BITMAP 的结果是有序的整数数组,
+ * 保存时可以直接按最终编码一次建立目标集合
+ */
+#define SET_OP_STRATEGY_HASH 0
+#define SET_OP_STRATEGY_MERGE 1
+#define SET_OP_STRATEGY_BITMAP 2
+
+// 位图策略允许的最大值域 (位数), 对应 128KB 的位图
+#define SET_OP_BITMAP_MAX_BITS (1<<20)
+
+/*
+ * 根据输入集合的编码、大小和值域选择执行策略
+ *
+ * 选中 BITMAP 时, 所有输入的最小值和最大值保存在 *min 和 *max 中
+ *
+ * T = O(N), N 为集合的数量
+ */
+static int setOpPlan(robj **sets, int setnum, int64_t *min, int64_t *max) {
+    unsigned long total = 0;
+    uint64_t span;
+    int64_t first, last;
+    uint32_t len;
+    int j;
+
+    *min = INT64_MAX;
+    *max = INT64_MIN;
+
+    for (j = 0; j < setnum; j++) {
+        if (!sets[j]) continue;
+
+        // 只要有一个字典编码的输入, 就只能逐个查找
+        if (sets[j]->encoding != REDIS_ENCODING_INTSET)
+            return SET_OP_STRATEGY_HASH;
+
+        if ((len = intsetLen(sets[j]->ptr)) == 0) continue;
+        total += len;
+
+        // intset 有序, 首尾元素就是最小值和最大值
+        intsetGet(sets[j]->ptr,0,&first);
+        intsetGet(sets[j]->ptr,len-1,&last);
+        if (first < *min) *min = first;
+        if (last > *max) *max = last;
+    }
+
+    if (total == 0) return SET_OP_STRATEGY_MERGE;
+
+    // 平均每个 64 位的字至少对应一个元素时,
+    // 位运算的代价不超过归并所需的比较
+    span = (uint64_t)*max - (uint64_t)*min + 1;
+    if (span != 0 && span <= SET_OP_BITMAP_MAX_BITS && span/64 <= total)
+        return SET_OP_STRATEGY_BITMAP;
+
+    return SET_OP_STRATEGY_MERGE;
+}
+
+/*
+ * MERGE 策略: 对全部为 intset 的输入进行归并, 返回有序的结果数组
+ *
+ * sets 中可以有 NULL (不存在的键), 对 INTER 来说调用者需要预先处理
+ * INTER 和 DIFF 以 sets[0] 为基准, INTER 时 sets[0] 应该是最小的集合
+ *
+ * 结果数量保存在 *len 中, 数组由调用者释放
+ *
+ * T = O(N*M), N 为全部元素的数量, M 为集合的数量
+ */
+static int64_t *setOpMerge(robj **sets, int setnum, int op, uint32_t *len) {
+    uint32_t *pos = zcalloc(sizeof(uint32_t)*setnum);
+    unsigned long cap = 0;
+    uint32_t n = 0;
+    int64_t *result, v = 0, w;
+    int j;
+
+    // 结果数量的上限
+    if (op == REDIS_OP_UNION) {
+        for (j = 0; j < setnum; j++)
+            if (sets[j]) cap += intsetLen(sets[j]->ptr);
+    } else {
+        cap = sets[0] ? intsetLen(sets[0]->ptr) : 0;
+    }
+    result = zmalloc(sizeof(int64_t)*(cap ? cap : 1));
+
+    if (op == REDIS_OP_UNION) {
+        // k 路归并, 每轮取出所有游标中的最小值
+        while (1) {
+            int found = 0;
+
+            for (j = 0; j < setnum; j++) {
+                if (!sets[j] || !intsetGet(sets[j]->ptr,pos[j],&w)) continue;
+                if (!found || w < v) v = w;
+                found = 1;
+            }
+            if (!found) break;
+
+            result[n++] = v;
+
+            // 所有等于 v 的游标一起前进
+            for (j = 0; j < setnum; j++) {
+                if (sets[j] && intsetGet(sets[j]->ptr,pos[j],&w) && w == v)
+                    pos[j]++;
+            }
+        }
+
+    } else if (sets[0]) {
+        uint32_t i, base = intsetLen(sets[0]->ptr);
+
+        // 迭代基准集合, 其他集合的游标跟随前进到不小于当前元素的位置
+        for (i = 0; i < base; i++) {
+            int matched = 0;
+
+            intsetGet(sets[0]->ptr,i,&v);
+            for (j = 1; j < setnum; j++) {
+                if (!sets[j] || sets[j] == sets[0]) {
+                    // 与基准集合相同: INTER 总是命中, DIFF 总是排除
+                    if (sets[j]) matched++;
+                    continue;
+                }
+                while (intsetGet(sets[j]->ptr,pos[j],&w) && w < v) pos[j]++;
+                if (intsetGet(sets[j]->ptr,pos[j],&w) && w == v) matched++;
+                else if (op == REDIS_OP_INTER) break;
+            }
+
+            if ((op == REDIS_OP_INTER && j == setnum) ||
+                (op == REDIS_OP_DIFF && matched == 0))
+                result[n++] = v;
+        }
+    }
+
+    zfree(pos);
+    *len = n;
+    return result;
+}
+
+/*
+ * 将 intset 中位于 [min, min+64*words) 之内的元素在位图 bm 上置位
+ */
+static void setOpBitmapFill(uint64_t *bm, intset *is, int64_t min) {
+    uint32_t i, len = intsetLen(is);
+    uint64_t off;
+    int64_t v;
+
+    for (i = 0; i < len; i++) {
+        intsetGet(is,i,&v);
+        off = (uint64_t)v - (uint64_t)min;
+        bm[off>>6] |= 1ULL << (off&63);
+    }
+}
+
+/*
+ * BITMAP 策略: 在覆盖 [min, max] 的位图上计算, 返回有序的结果数组
+ *
+ * 对 sets 的要求和 setOpMerge 相同
+ *
+ * T = O(N + M*W), N 为全部元素的数量, M 为集合的数量, W 为位图的字数
+ */
+static int64_t *setOpBitmap(robj **sets, int setnum, int op,
+                            int64_t min, int64_t max, uint32_t *len)
+{
+    unsigned long words = (unsigned long)(((uint64_t)max-(uint64_t)min)/64+1), k;
+    uint64_t *bm = zcalloc(sizeof(uint64_t)*words), *tmp = NULL;
+    unsigned long cap = 0;
+    uint32_t n = 0;
+    int64_t *result;
+    int j;
+
+    if (op == REDIS_OP_UNION) {
+        for (j = 0; j < setnum; j++) {
+            if (!sets[j]) continue;
+            setOpBitmapFill(bm,sets[j]->ptr,min);
+            cap += intsetLen(sets[j]->ptr);
+        }
+
+    } else if (sets[0]) {
+        setOpBitmapFill(bm,sets[0]->ptr,min);
+        cap = intsetLen(sets[0]->ptr);
+
+        tmp = zmalloc(sizeof(uint64_t)*words);
+        for (j = 1; j < setnum; j++) {
+            if (!sets[j]) continue;
+
+            memset(tmp,0,sizeof(uint64_t)*words);
+            setOpBitmapFill(tmp,sets[j]->ptr,min);
+
+            // INTER 保留两者都有的位, DIFF 清除其他集合中的位
+            if (op == REDIS_OP_INTER) {
+                for (k = 0; k < words; k++) bm[k] &= tmp[k];
+            } else {
+                for (k = 0; k < words; k++) bm[k] &= ~tmp[k];
+            }
+        }
+        zfree(tmp);
+    }
+
+    // 按位从低到高取出结果, 结果自然有序
+    result = zmalloc(sizeof(int64_t)*(cap ? cap : 1));
+    for (k = 0; k < words; k++) {
+        uint64_t word = bm[k];
+
+        while (word) {
+            int bit = __builtin_ctzll(word);
 
-    return (o2 ? setTypeSize(o2) : 0) - (o1 ? setTypeSize(o1) : 0);
+            result[n++] = (int64_t)((uint64_t)min + (k<<6) + bit);
+            word &= word-1;
+        }
+    }
+
+    zfree(bm);
+    *len = n;
+    return result;
+}
+
+/*
+ * 用有序整数数组创建最终编码的目标集合:
+ * 数量不超过 set_max_intset_entries 时一次建立 intset,
+ * 否则预先扩展字典再逐个添加
+ *
+ * T = O(N)
+ */
+static robj *setOpCreateFromSorted(int64_t *values, uint32_t len) {
+    robj *set;
+    uint32_t i;
+
+    if (len <= server.set_max_intset_entries) {
+        set = createObject(REDIS_SET,intsetNewFromSorted(values,len));
+        set->encoding = REDIS_ENCODING_INTSET;
+    } else {
+        set = createSetObject();
+        dictExpand(set->ptr,len);
+        for (i = 0; i < len; i++)
+            dictAdd(set->ptr,createStringObjectFromLongLong(values[i]),NULL);
+    }
+
+    return set;
+}
+
+/*
+ * 回复有序整数数组中的所有元素
+ */
+static void setOpReplySorted(redisClient *c, int64_t *values, uint32_t len) {
+    uint32_t i;
+
+    addReplyMultiBulkLen(c,len);
+    for (i = 0; i < len; i++)
+        addReplyBulkLongLong(c,values[i]);
+}
+
+/*
+ * 执行整数策略 (MERGE 或 BITMAP)
+ */
+static int64_t *setOpExecuteSorted(robj **sets, int setnum, int op, int strategy,
+                                   int64_t min, int64_t max, uint32_t *len)
+{
+    if (strategy == SET_OP_STRATEGY_BITMAP)
+        return setOpBitmap(sets,setnum,op,min,max,len);
+    else
+        return setOpMerge(sets,setnum,op,len);
+}
+
+/*----------------------------- 并行集合运算 ------------------------------*/
+
+/*
+ * 输入集合非常大时, 可以把运算分片交给 bio 的并行线程执行 (默认关闭)
+ *
+ * INTER 和 DIFF 按 sets[0] 的哈希表桶 (或 intset 的索引) 分片;
+ * UNION 按元素哈希值的低位分片, 相同的元素一定落在同一片中,
+ * 所以每一片可以独立去重。
+ *
+ * 工作线程对输入只读: 不触发渐进式 rehash, 不修改任何对象的引用计数。
+ * 字典类型的回调中只有 hashFunction 会在工作线程中调用,
+ * keyCompare, keyDup, valDup 和析构函数都不会调用 (比较元素用 setParKeyEqual)。
+ * 集合字典的元素只有 sds 编码和 REDIS_ENCODING_INT 编码两种,
+ * 哈希函数对它们只读取字节 (整数转换到栈上的缓冲区), 不修改引用计数,
+ * 所以可以和主线程同时执行。查找 sets[j] 时使用它自己的
+ * d->type->hashFunction , UNION 分片使用 setDictType 的哈希函数,
+ * 这样桶号的低位才和分片号一致。
+ */
+
+// 元素的字节表示, 整数元素转换为字符串
+typedef struct setParKey {
+    const char *p;
+    size_t len;
+    char buf[32];
+} setParKey;
+
+// 一个结果元素, obj 为 NULL 时表示整数 ll
+typedef struct setParItem {
+    robj *obj;
+    int64_t ll;
+} setParItem;
+
+// 一个分片的结果
+typedef struct setParPart {
+    setParItem *items;
+    unsigned long len, cap;
+} setParPart;
+
+// 一次并行运算的状态
+typedef struct setParJob {
+    robj **sets;
+    int setnum;
+    int op;
+    setParPart parts[REDIS_BIO_MAX_PARALLEL];
+} setParJob;
+
+static void setParKeyFromInt(setParKey *k, int64_t v) {
+    k->len = ll2string(k->buf,sizeof(k->buf),v);
+    k->p = k->buf;
+}
+
+static void setParKeyFromObject(setParKey *k, robj *o) {
+    if (sdsEncodedObject(o)) {
+        k->p = o->ptr;
+        k->len = sdslen(o->ptr);
+    } else {
+        setParKeyFromInt(k,(long)o->ptr);
+    }
+}
+
+/*
+ * 用字典类型 type 的哈希函数计算元素的哈希值, obj 为 NULL 时元素是整数 ll
+ *
+ * 整数元素用栈上的 REDIS_ENCODING_INT 临时对象表示, 不需要分配内存
+ */
+static unsigned int setParHash(dictType *type, robj *obj, int64_t ll) {
+    robj tmp;
+
+    if (obj == NULL) {
+        tmp.type = REDIS_STRING;
+        tmp.encoding = REDIS_ENCODING_INT;
+        tmp.refcount = REDIS_SHARED_REFCOUNT;
+        tmp.ptr = (void*)(long)ll;
+        obj = &tmp;
+    }
+
+    return type->hashFunction(obj);
+}
+
+static int setParKeyEqual(setParKey *a, setParKey *b) {
+    return a->len == b->len && memcmp(a->p,b->p,a->len) == 0;
+}
+
+/*
+ * 只读地检查 k 是否为集合 set 的成员, obj 和 ll 是 k 对应的元素, 见 setParHash
+ *
+ * *hashtype 和 *h 缓存上一次计算哈希值使用的字典类型和结果,
+ * 同一个元素在多个类型相同的字典中查找时只计算一次哈希值
+ */
+static int setParIsMember(robj *set, setParKey *k, robj *obj, int64_t ll,
+                          dictType **hashtype, unsigned int *h)
+{
+
+    if (set->encoding == REDIS_ENCODING_INTSET) {
+        long long ll;
+
+        if (!string2ll(k->p,k->len,&ll)) return 0;
+        return intsetFind(set->ptr,ll);
+
+    } else {
+        dict *d = set->ptr;
+        dictEntry *he;
+        setParKey ek;
+
+        if (d->ht[0].size == 0) return 0;
+
+        if (*hashtype != d->type) {
+            *h = setParHash(d->type,obj,ll);
+            *hashtype = d->type;
+        }
+
+        he = d->ht[0].table[*h & d->ht[0].sizemask];
+        while (he) {
+            setParKeyFromObject(&ek,dictGetKey(he));
+            if (setParKeyEqual(k,&ek)) return 1;
+            he = he->next;
+        }
+        return 0;
+    }
+}
+
+static void setParAppend(setParPart *part, robj *obj, int64_t ll) {
+    if (part->len == part->cap) {
+        part->cap = part->cap ? part->cap*2 : 256;
+        part->items = zrealloc(part->items,sizeof(setParItem)*part->cap);
+    }
+    part->items[part->len].obj = obj;
+    part->items[part->len].ll = ll;
+    part->len++;
+}
+
+/*
+ * 检查 sets[0] 的元素 k (对应的元素为 obj 或整数 ll) 是否属于 INTER 或 DIFF 的结果
+ */
+static int setParKeep(setParJob *job, setParKey *k, robj *obj, int64_t ll) {
+    dictType *hashtype = NULL;
+    unsigned int h = 0;
+    int j;
+
+    for (j = 1; j < job->setnum; j++) {
+        robj *set = job->sets[j];
+
+        if (job->op == REDIS_OP_INTER) {
+            if (set != job->sets[0] &&
+                !setParIsMember(set,k,obj,ll,&hashtype,&h)) return 0;
+        } else {
+            if (!set) continue;
+            if (set == job->sets[0] ||
+                setParIsMember(set,k,obj,ll,&hashtype,&h)) return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * UNION 分片的去重表: 开放寻址, 保存结果元素的下标加一, 0 表示空槽
+ */
+typedef struct setParTable {
+    uint32_t *slots;
+    unsigned int *hashes;
+    unsigned long size;
+} setParTable;
+
+static void setParItemKey(setParItem *item, setParKey *k) {
+    if (item->obj) setParKeyFromObject(k,item->obj);
+    else setParKeyFromInt(k,item->ll);
+}
+
+/*
+ * 如果 k 还没有出现在分片中, 那么将它加入分片
+ */
+static void setParUnionAdd(setParPart *part, setParTable *t, setParKey *k,
+                           unsigned int h, robj *obj, int64_t ll)
+{
+    unsigned long i;
+    setParKey ek;
+
+    // 装载因子超过 1/2 时扩展
+    if ((part->len+1)*2 > t->size) {
+        unsigned long j, size = t->size ? t->size*2 : 1024;
+        uint32_t *slots = zcalloc(sizeof(uint32_t)*size);
+        unsigned int *hashes = zmalloc(sizeof(unsigned int)*size);
+
+        for (j = 0; j < t->size; j++) {
+            if (!t->slots[j]) continue;
+            i = t->hashes[j] & (size-1);
+            while (slots[i]) i = (i+1) & (size-1);
+            slots[i] = t->slots[j];
+            hashes[i] = t->hashes[j];
+        }
+        zfree(t->slots);
+        zfree(t->hashes);
+        t->slots = slots;
+        t->hashes = hashes;
+        t->size = size;
+    }
+
+    i = h & (t->size-1);
+    while (t->slots[i]) {
+        if (t->hashes[i] == h) {
+            setParItemKey(&part->items[t->slots[i]-1],&ek);
+            if (setParKeyEqual(k,&ek)) return;
+        }
+        i = (i+1) & (t->size-1);
+    }
+
+    setParAppend(part,obj,ll);
+    t->slots[i] = part->len;
+    t->hashes[i] = h;
+}
+
+/*
+ * 计算一个分片, 由 bioRunParallel 在主线程或工作线程中调用
+ */
+static void setParWorker(void *privdata, int partid, int nparts) {
+    setParJob *job = privdata;
+    setParPart *part = &job->parts[partid];
+    setParKey k;
+    int64_t ll;
+    int j;
+
+    if (job->op != REDIS_OP_UNION) {
+        robj *base = job->sets[0];
+
+        // 按桶或索引范围对 sets[0] 分片
+        if (base->encoding == REDIS_ENCODING_INTSET) {
+            uint32_t len = intsetLen(base->ptr), i;
+            uint32_t lo = (uint64_t)len*partid/nparts, hi = (uint64_t)len*(partid+1)/nparts;
+
+            for (i = lo; i < hi; i++) {
+                intsetGet(base->ptr,i,&ll);
+                setParKeyFromInt(&k,ll);
+                if (setParKeep(job,&k,NULL,ll)) setParAppend(part,NULL,ll);
+            }
+        } else {
+            dictht *ht = &((dict*)base->ptr)->ht[0];
+            unsigned long lo = ht->size*partid/nparts, hi = ht->size*(partid+1)/nparts, b;
+            dictEntry *he;
+
+            for (b = lo; b < hi; b++) {
+                for (he = ht->table[b]; he; he = he->next) {
+                    setParKeyFromObject(&k,dictGetKey(he));
+                    if (setParKeep(job,&k,dictGetKey(he),0))
+                        setParAppend(part,dictGetKey(he),0);
+                }
+            }
+        }
+
+    } else {
+        setParTable t = {NULL,NULL,0};
+        unsigned int mask = nparts-1, h;
+
+        // nparts 为 2 的幂, 只收集哈希值低位等于 partid 的元素
+        for (j = 0; j < job->setnum; j++) {
+            robj *set = job->sets[j];
+
+            if (!set) continue;
+
+            if (set->encoding == REDIS_ENCODING_INTSET) {
+                uint32_t len = intsetLen(set->ptr), i;
+
+                for (i = 0; i < len; i++) {
+                    intsetGet(set->ptr,i,&ll);
+                    setParKeyFromInt(&k,ll);
+                    h = setParHash(&setDictType,NULL,ll);
+                    if ((h & mask) == (unsigned)partid)
+                        setParUnionAdd(part,&t,&k,h,NULL,ll);
+                }
+            } else {
+                dict *d = set->ptr;
+                dictht *ht = &d->ht[0];
+                unsigned long b, step = 1;
+                dictEntry *he;
+
+                // 桶的数量不少于分片数量, 并且字典和分片使用同一个哈希函数时,
+                // 桶号的低位就是哈希值的低位, 只需要访问属于本分片的桶
+                b = 0;
+                if (ht->size >= (unsigned long)nparts &&
+                    d->type->hashFunction == setDictType.hashFunction) {
+                    b = partid;
+                    step = nparts;
+                }
+
+                for (; b < ht->size; b += step) {
+                    for (he = ht->table[b]; he; he = he->next) {
+                        setParKeyFromObject(&k,dictGetKey(he));
+                        h = setParHash(&setDictType,dictGetKey(he),0);
+                        if ((h & mask) == (unsigned)partid)
+                            setParUnionAdd(part,&t,&k,h,dictGetKey(he),0);
+                    }
+                }
+            }
+        }
+
+        zfree(t.slots);
+        zfree(t.hashes);
+    }
+}
+
+/*
+ * 检查运算是否应该并行执行
+ */
+static int setParallelEligible(robj **sets, int setnum, int op) {
+    unsigned long work = 0;
+    int j;
+
+    if (server.set_parallel_threads < 2) return 0;
+
+    // 整数元素需要能用 REDIS_ENCODING_INT 的临时对象表示, 见 setParHash
+    if (sizeof(long) < sizeof(int64_t)) return 0;
+
+    // UNION 分片和 intset 元素的哈希值都由 setDictType 的哈希函数计算
+    if (setDictType.hashFunction == NULL) return 0;
+
+    for (j = 0; j < setnum; j++) {
+        if (!sets[j]) continue;
+
+        // 工作线程只读 0 号哈希表, 正在 rehash 的字典不能分片
+        if (sets[j]->encoding == REDIS_ENCODING_HT &&
+            dictIsRehashing((dict*)sets[j]->ptr)) return 0;
+
+        // 查找成员时使用集合自己的哈希函数, 见 setParIsMember
+        if (sets[j]->encoding == REDIS_ENCODING_HT &&
+            ((dict*)sets[j]->ptr)->type->hashFunction == NULL) return 0;
+
+        if (op == REDIS_OP_UNION || j == 0) work += setTypeSize(sets[j]);
+    }
+
+    if (op != REDIS_OP_UNION && !sets[0]) return 0;
+
+    return work >= server.set_parallel_min_elements;
+}
+
+/*
+ * 并行执行集合运算
+ *
+ * store 为假时直接回复客户端并返回 NULL, 否则返回新建的目标集合
+ *
+ * 结果元素引用的是输入集合中的对象, 回复和建立目标集合都在主线程中进行
+ */
+static robj *setParallelRun(redisClient *c, robj **sets, int setnum, int op, int store) {
+    setParJob job;
+    unsigned long total = 0, i;
+    int nparts = 1, j;
+    robj *dstset = NULL;
+
+    // 分片数量取不超过线程数的 2 的幂
+    while (nparts*2 <= server.set_parallel_threads &&
+           nparts*2 <= REDIS_BIO_MAX_PARALLEL) nparts *= 2;
+
+    memset(&job,0,sizeof(job));
+    job.sets = sets;
+    job.setnum = setnum;
+    job.op = op;
+
+    bioRunParallel(nparts,setParWorker,&job);
+
+    for (j = 0; j < nparts; j++) total += job.parts[j].len;
+
+    if (!store) {
+        addReplyMultiBulkLen(c,total);
+    } else if (total > server.set_max_intset_entries) {
+        dstset = createSetObject();
+        dictExpand(dstset->ptr,total);
+    } else {
+        dstset = createIntsetObject();
+    }
+
+    // 按分片顺序合并结果
+    for (j = 0; j < nparts; j++) {
+        setParPart *part = &job.parts[j];
+
+        for (i = 0; i < part->len; i++) {
+            setParItem *item = &part->items[i];
+
+            if (!store) {
+                if (item->obj) addReplyBulk(c,item->obj);
+                else addReplyBulkLongLong(c,item->ll);
+                continue;
+            }
+
+            if (dstset->encoding == REDIS_ENCODING_HT) {
+                // 结果元素互不重复, 直接添加到字典
+                robj *ele = item->obj;
+
+                if (ele) incrRefCount(ele);
+                else ele = createStringObjectFromLongLong(item->ll);
+                dictAdd(dstset->ptr,ele,NULL);
+            } else if (item->obj) {
+                setTypeAdd(dstset,item->obj);
+            } else {
+                robj *ele = createStringObjectFromLongLong(item->ll);
+                setTypeAdd(dstset,ele);
+                decrRefCount(ele);
+            }
+        }
+        zfree(part->items);
+    }
+
+    return dstset;
 }
 
 /**
@@ -755,7 +1572,8 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
     int64_t intobj;
     void *replylen = NULL;
     unsigned long j, cardinality = 0;
-    int encoding;
+    int encoding, strategy;
+    int64_t min, max;
 
     // 获取集合, 并填入数组
     for (j = 0; j < setnum; j++) {
@@ -794,12 +1612,43 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
     // 数据从小到大排序, 将最小的集合放在首地址
     qsort(sets,setnum,sizeof(robj*),qsortCompareSetsByCardinality);
 
+    // 所有集合都是 intset 时, 按序归并或者使用位图
+    strategy = setOpPlan(sets,setnum,&min,&max);
+    if (strategy != SET_OP_STRATEGY_HASH) {
+        uint32_t len;
+        int64_t *values = setOpExecuteSorted(sets,setnum,REDIS_OP_INTER,
+                                             strategy,min,max,&len);
+
+        if (!dstkey) {
+            setOpReplySorted(c,values,len);
+            zfree(values);
+            zfree(sets);
+            return;
+        }
+
+        dstset = setOpCreateFromSorted(values,len);
+        zfree(values);
+        goto store;
+    }
+
+    // 超大的集合, 分片并行计算
+    if (setParallelEligible(sets,setnum,REDIS_OP_INTER)) {
+        dstset = setParallelRun(c,sets,setnum,REDIS_OP_INTER,dstkey != NULL);
+        if (!dstkey) {
+            zfree(sets);
+            return;
+        }
+        goto store;
+    }
+
     // 设置了 dst, 创建一个 dst, 交集元素写入
+    // 交集元素都来自最小的集合, 所以直接使用它的编码
     // 未设置, 申请一个回复客户端的 buf
     if (!dstkey) {
         replylen = addDeferredMultiBulkLength(c);
     } else {
-        dstset = createIntsetObject();
+        dstset = sets[0]->encoding == REDIS_ENCODING_INTSET ?
+                 createIntsetObject() : createSetObject();
     }
 
     // 提取交集元素
@@ -854,7 +1703,7 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
                 if (encoding == REDIS_ENCODING_HT) {
                     addReplyBulk(c,eleobj);
                 } else {
-                    addReplyLongLong(c,intobj);
+                    addReplyBulkLongLong(c,intobj);
                 }
                 cardinality++;
             // SINTERSTORE命令, 添加交集元素到 dst 集合
@@ -871,6 +1720,7 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
     }
     setTypeReleaseIterator(si);
 
+store:
     // SINTERSTORE 命令，将结果集关联到数据库
     if (dstkey) {
 
@@ -926,7 +1776,8 @@ void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *
     setTypeIterator *si;
     robj *ele, *dstset = NULL;
     int j, cardinality = 0;
-    int diff_algo = 1;
+    int diff_algo = 1, strategy;
+    int64_t min, max;
 
     // 取出所有集合对象, 并添加到集合数组
     for (j = 0; j < setnum; j++) {
@@ -951,6 +1802,35 @@ void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *
         sets[j] = setobj;
     }
 
+    // 所有集合都是 intset 时, 按序归并或者使用位图,
+    // 结果直接回复, 或者按最终编码一次建立目标集合
+    strategy = setOpPlan(sets,setnum,&min,&max);
+    if (strategy != SET_OP_STRATEGY_HASH) {
+        uint32_t len;
+        int64_t *values = setOpExecuteSorted(sets,setnum,op,strategy,min,max,&len);
+
+        if (!dstkey) {
+            setOpReplySorted(c,values,len);
+            zfree(values);
+            zfree(sets);
+            return;
+        }
+
+        dstset = setOpCreateFromSorted(values,len);
+        zfree(values);
+        goto store;
+    }
+
+    // 超大的集合, 分片并行计算
+    if (setParallelEligible(sets,setnum,op)) {
+        dstset = setParallelRun(c,sets,setnum,op,dstkey != NULL);
+        if (!dstkey) {
+            zfree(sets);
+            return;
+        }
+        goto store;
+    }
+
     /**
      *  DIFF 算法决策
      * 
@@ -988,13 +1868,54 @@ void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *
         }
     }
 
+    // SDIFF 使用算法 1 时, 结果元素不会重复, 不需要目标集合, 直接回复
+    if (!dstkey && op == REDIS_OP_DIFF && sets[0] && diff_algo == 1) {
+        void *replylen = addDeferredMultiBulkLength(c);
+
+        si = setTypeInitIterator(sets[0]);
+        while ((ele = setTypeNextObject(si)) != NULL) {
+            for (j = 1; j < setnum; j++) {
+                if (!sets[j]) continue;
+                if (sets[j] == sets[0]) break;
+                if (setTypeIsMember(sets[j],ele)) break;
+            }
+
+            if (j == setnum) {
+                addReplyBulk(c,ele);
+                cardinality++;
+            }
+            decrRefCount(ele);
+        }
+        setTypeReleaseIterator(si);
+
+        setDeferredMultiBulkLength(c,replylen,cardinality);
+        zfree(sets);
+        return;
+    }
+
     // 创建一个空的目标集合
-    dstset = createIntsetObject();
+    // 输入中有字典编码的集合, 并集的结果也是字典编码, 按最大的输入预先扩展;
+    // 差集的结果是 sets[0] 的子集, 使用 sets[0] 的编码
+    if (op == REDIS_OP_UNION) {
+        unsigned long largest = 0;
+
+        for (j = 0; j < setnum; j++)
+            if (sets[j] && setTypeSize(sets[j]) > largest)
+                largest = setTypeSize(sets[j]);
+
+        dstset = createSetObject();
+        dictExpand(dstset->ptr,largest);
+    } else if (sets[0] && sets[0]->encoding == REDIS_ENCODING_HT) {
+        dstset = createSetObject();
+    } else {
+        dstset = createIntsetObject();
+    }
 
     // 并集计算
     if (op == REDIS_OP_UNION) {
 
         for (j = 0; j < setnum; j++) {
+            if (!sets[j]) continue;
 
             si = setTypeInitIterator(sets[j]);
             while ((ele = setTypeNextObject(si)) != NULL) {
@@ -1062,6 +1983,7 @@ void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *
     }
 
     
+store:
     // 执行 SDIFF 或 SUNION命令
     // 打印目标集合的所有元素
 
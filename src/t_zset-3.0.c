@@ -7,15 +7,15 @@
  * 返回值介于 1 和 ZSKIPLIST_MAXLEVEL 之间 (包含ZSKIPLIST_MAXLEVEL)
  * 根据随机算法所使用的幂次定律，越大的值生成的几率越小
  *
- * T = O(N)
+ * T = O(1)
  */
 int zslRandomLevel(void)
 {
-    int level = 1;
-    // 随机值小于 1/4 的int值, level增加
-    while((rand() & 0xFFFF) < (ZSKIPLIST_P * 0xFFFF)){
-        level += 1;
-    }
+    /* ZSKIPLIST_P 为 1/4, 每次以 1/4 的概率晋升一层,
+     * 等价于随机数的二进制末尾每有 2 个 0 就增加一层,
+     * 所以只需要一次随机数和一次 ctz 指令, 不需要循环。
+     * 最高位置 1 保证参数非 0 */
+    int level = 1 + __builtin_ctzll(redisRandom64() | (1ULL<<63)) / 2;
 
     return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
 }
@@ -1,5 +1,7 @@
 #include "redis.h"
+#include "bio.h"
 #include <math.h>
+#include <stddef.h>
 
 /*
  * 创建一个层数为 level 的跳跃表节点，
@@ -102,14 +104,14 @@ void zslFree(zskiplist *zsl) {
  * 返回值介乎 1 和 ZSKIPLIST_MAXLEVEL 之间（包含 ZSKIPLIST_MAXLEVEL），
  * 根据随机算法所使用的幂次定律，越大的值生成的几率越小。
  *
- * T = O(N)
+ * T = O(1)
  */
 int zslRandomLevel(void) {
-    int level = 1;
-
-    // while ((random()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
-    while ((rand()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
-        level += 1;
+    /* ZSKIPLIST_P 为 1/4, 每次以 1/4 的概率晋升一层,
+     * 等价于随机数的二进制末尾每有 2 个 0 就增加一层,
+     * 所以只需要一次随机数和一次 ctz 指令, 不需要循环。
+     * 最高位置 1 保证参数非 0 */
+    int level = 1 + __builtin_ctzll(redisRandom64() | (1ULL<<63)) / 2;
 
     return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
 }
@@ -233,6 +235,58 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj) {
     return x;
 }
 
+/*
+ * 将 n 个已按 (分值, 成员) 从小到大排列的元素一次性载入空跳跃表 zsl
+ *
+ * 逐个 zslInsert 时每次都要从表头开始查找插入位置,
+ * 而输入有序时新节点总是追加在表尾:
+ * 只要记下每一层当前的最后一个节点以及它的排位,
+ * 就可以在一次遍历中连接好所有层的前进指针, 并算出跨度。
+ *
+ * 和 zslInsert 一样, 跳跃表接管 entries 中成员对象的引用。
+ *
+ * T = O(N)
+ */
+void zslBulkLoad(zskiplist *zsl, zsetEntry *entries, unsigned long n) {
+    zskiplistNode *last[ZSKIPLIST_MAXLEVEL], *x, *prev = NULL;
+    unsigned long rank[ZSKIPLIST_MAXLEVEL], k;
+    int i, level;
+
+    redisAssert(zsl->length == 0);
+
+    // 一开始每一层的最后一个节点都是表头
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        last[i] = zsl->header;
+        rank[i] = 0;
+    }
+
+    for (k = 0; k < n; k++) {
+        level = zslRandomLevel();
+        if (level > zsl->level) zsl->level = level;
+
+        // 新节点追加到它所在的每一层的末尾
+        x = zslCreateNode(level,entries[k].score,entries[k].obj);
+        for (i = 0; i < level; i++) {
+            last[i]->level[i].forward = x;
+            last[i]->level[i].span = (k+1) - rank[i];
+            last[i] = x;
+            rank[i] = k+1;
+        }
+
+        x->backward = prev;
+        prev = x;
+    }
+
+    // 每一层的最后一个节点没有后继, 跨度为它之后的节点数量
+    for (i = 0; i < zsl->level; i++) {
+        last[i]->level[i].forward = NULL;
+        last[i]->level[i].span = n - rank[i];
+    }
+
+    zsl->tail = prev;
+    zsl->length = n;
+}
+
 /* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank 
  * 
  * 内部删除函数，
@@ -448,6 +502,125 @@ zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range) {
     return x;
 }
 
+/*
+ * 将排位在 (rank[0], end] 之间的节点整段从跳跃表中摘除。
+ *
+ * update 和 rank 记录范围之前的最后一个节点在各层的位置及其排位,
+ * 和 zslDeleteNode 所用的 update 数组相同。
+ *
+ * 函数只修改范围两端的指针和跨度, 不会逐个访问被摘除的节点。
+ * 被摘除的节点仍然通过 level[0].forward 相连, 最后一个节点的 forward 为 NULL。
+ *
+ * 返回被摘除的第一个节点, 范围为空时返回 NULL。
+ *
+ * T = O(log N)
+ */
+static zskiplistNode *zslDetachRange(zskiplist *zsl, zskiplistNode **update,
+                                     unsigned long *rank, unsigned long end)
+{
+    zskiplistNode *last[ZSKIPLIST_MAXLEVEL], *first, *x;
+    unsigned long lrank[ZSKIPLIST_MAXLEVEL], traversed, count;
+    int i;
+
+    if (end > zsl->length) end = zsl->length;
+    if (end <= rank[0]) return NULL;
+    count = end - rank[0];
+
+    // 从 update 开始继续向前, 找到排位不超过 end 的最后一个节点在各层的位置
+    x = update[zsl->level-1];
+    traversed = rank[zsl->level-1];
+    for (i = zsl->level-1; i >= 0; i--) {
+        // 下层的 update 节点不会在上层的之前
+        if (rank[i] > traversed) {
+            x = update[i];
+            traversed = rank[i];
+        }
+        while (x->level[i].forward && (traversed + x->level[i].span) <= end) {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        last[i] = x;
+        lrank[i] = traversed;
+    }
+
+    first = update[0]->level[0].forward;
+
+    // 在每一层上跳过整个范围
+    for (i = 0; i < zsl->level; i++) {
+        if (last[i] == update[i]) {
+            // 这一层上没有范围内的节点
+            update[i]->level[i].span -= count;
+        } else {
+            update[i]->level[i].span =
+                lrank[i] + last[i]->level[i].span - rank[i] - count;
+            update[i]->level[i].forward = last[i]->level[i].forward;
+        }
+    }
+
+    // 更新范围之后节点的后退指针, 以及表尾
+    x = last[0];
+    if (x->level[0].forward) {
+        x->level[0].forward->backward = first->backward;
+    } else {
+        zsl->tail = first->backward;
+    }
+    x->level[0].forward = NULL;
+
+    while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
+        zsl->level--;
+
+    zsl->length -= count;
+
+    return first;
+}
+
+/*
+ * 释放一条由 zslDetachRange 摘下的节点链表
+ *
+ * 可以在后台线程中执行, 链表中的对象只被这些节点引用
+ */
+static void zslFreeDetached(void *chain) {
+    zskiplistNode *x = chain, *next;
+
+    while (x) {
+        next = x->level[0].forward;
+        if (x->obj) decrRefCount(x->obj);
+        zfree(x);
+        x = next;
+    }
+}
+
+/*
+ * 将摘下的 count 个节点的成员从字典 dict 中删除, 然后释放节点
+ *
+ * 节点数量达到 server.lazyfree_threshold 时, 节点和对象的释放交给后台线程,
+ * 否则直接在主线程释放。
+ *
+ * T = O(N)
+ */
+static void zslReleaseDetached(zskiplistNode *chain, unsigned long count, dict *dict) {
+    zskiplistNode *x;
+    int lazy = server.lazyfree_threshold && count >= server.lazyfree_threshold &&
+               bioLazyFreeEnabled();
+
+    // 字典只能在主线程中修改
+    for (x = chain; x; x = x->level[0].forward) {
+        dictDelete(dict,x->obj);
+
+        // 对象还被其他地方引用 (比如共享整数),
+        // 引用计数只能在主线程中修改
+        if (lazy && x->obj->refcount > 1) {
+            decrRefCount(x->obj);
+            x->obj = NULL;
+        }
+    }
+
+    if (lazy)
+        bioCreateLazyFreeJob(zslFreeDetached,chain);
+    else
+        zslFreeDetached(chain);
+}
+
 /* Delete all the elements with score between min and max from the skiplist.
  *
  * 删除所有分值在给定范围之内的节点。
@@ -466,45 +639,57 @@ zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range) {
  * T = O(N)
  */
 unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long removed = 0;
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *chain;
+    unsigned long rank[ZSKIPLIST_MAXLEVEL], traversed = 0, end;
     int i;
 
-    // 记录所有和被删除节点（们）有关的节点
+    // 记录所有和被删除节点（们）有关的节点，以及它们的排位
     // T_wrost = O(N) , T_avg = O(log N)
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
         while (x->level[i].forward && (range->minex ?
             x->level[i].forward->score <= range->min :
             x->level[i].forward->score < range->min))
-                x = x->level[i].forward;
+        {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
         update[i] = x;
+        rank[i] = traversed;
     }
 
     /* Current node is the last with score < or <= min. */
-    // 定位到给定范围开始的第一个节点
-    x = x->level[0].forward;
+    // 继续向前，找到范围内最后一个节点的排位
+    // T_wrost = O(N) , T_avg = O(log N)
+    x = update[zsl->level-1];
+    traversed = rank[zsl->level-1];
+    for (i = zsl->level-1; i >= 0; i--) {
+        // 下层的 update 节点不会在上层的之前
+        if (rank[i] > traversed) {
+            x = update[i];
+            traversed = rank[i];
+        }
+        while (x->level[i].forward && (range->maxex ?
+            x->level[i].forward->score < range->max :
+            x->level[i].forward->score <= range->max))
+        {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
+    }
+    end = traversed;
 
     /* Delete nodes while in range. */
-    // 删除范围中的所有节点
-    // T = O(N)
-    while (x &&
-           (range->maxex ? x->score < range->max : x->score <= range->max))
-    {
-        // 记录下个节点的指针
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->obj);
-        zslFreeNode(x);
-        removed++;
-        x = next;
-    }
-    return removed;
+    // 整段摘除范围内的节点，再批量删除和释放
+    if ((chain = zslDetachRange(zsl,update,rank,end)) == NULL) return 0;
+    zslReleaseDetached(chain,end-rank[0],dict);
+
+    return end-rank[0];
 }
 
 unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long removed = 0;
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *chain;
+    unsigned long rank[ZSKIPLIST_MAXLEVEL], traversed = 0, end;
     int i;
 
 
@@ -512,33 +697,40 @@ unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *di
     for (i = zsl->level-1; i >= 0; i--) {
         while (x->level[i].forward &&
             !zslLexValueGteMin(x->level[i].forward->obj,range))
-                x = x->level[i].forward;
+        {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
         update[i] = x;
+        rank[i] = traversed;
     }
 
     /* Current node is the last with score < or <= min. */
-    x = x->level[0].forward;
+    // 继续向前，找到范围内最后一个节点的排位
+    x = update[zsl->level-1];
+    traversed = rank[zsl->level-1];
+    for (i = zsl->level-1; i >= 0; i--) {
+        // 下层的 update 节点不会在上层的之前
+        if (rank[i] > traversed) {
+            x = update[i];
+            traversed = rank[i];
+        }
+        while (x->level[i].forward &&
+            zslLexValueLteMax(x->level[i].forward->obj,range))
+        {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
+        }
+    }
+    end = traversed;
 
     /* Delete nodes while in range. */
-    while (x && zslLexValueLteMax(x->obj,range)) {
-        zskiplistNode *next = x->level[0].forward;
-
-        // 从跳跃表中删除当前节点
-        zslDeleteNode(zsl,x,update);
-        // 从字典中删除当前节点
-        dictDelete(dict,x->obj);
-        // 释放当前跳跃表节点的结构
-        zslFreeNode(x);
-
-        // 增加删除计数器
-        removed++;
-
-        // 继续处理下个节点
-        x = next;
-    }
+    // 整段摘除范围内的节点，再批量删除和释放
+    if ((chain = zslDetachRange(zsl,update,rank,end)) == NULL) return 0;
+    zslReleaseDetached(chain,end-rank[0],dict);
 
     // 返回被删除节点的数量
-    return removed;
+    return end-rank[0];
 }
 
 /* Delete all the elements with rank between start and end from the skiplist.
@@ -554,11 +746,11 @@ unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *di
  * T = O(N)
  */
 unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned int end, dict *dict) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long traversed = 0, removed = 0;
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *chain;
+    unsigned long rank[ZSKIPLIST_MAXLEVEL], traversed = 0, removed;
     int i;
 
-    // 沿着前进指针移动到指定排位的起始位置，并记录所有沿途指针
+    // 沿着前进指针移动到指定排位的起始位置，并记录所有沿途指针及其排位
     // T_wrost = O(N) , T_avg = O(log N)
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
@@ -567,34 +759,15 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
             x = x->level[i].forward;
         }
         update[i] = x;
+        rank[i] = traversed;
     }
 
-    // 移动到排位的起始的第一个节点
-    traversed++;
-    x = x->level[0].forward;
-    // 删除所有在给定排位范围内的节点
-    // T = O(N)
-    while (x && traversed <= end) {
-
-        // 记录下一节点的指针
-        zskiplistNode *next = x->level[0].forward;
+    if (end > zsl->length) end = zsl->length;
 
-        // 从跳跃表中删除节点
-        zslDeleteNode(zsl,x,update);
-        // 从字典中删除节点
-        dictDelete(dict,x->obj);
-        // 释放节点结构
-        zslFreeNode(x);
-
-        // 为删除计数器增一
-        removed++;
-
-        // 为排位计数器增一
-        traversed++;
-
-        // 处理下个节点
-        x = next;
-    }
+    // 整段摘除给定排位范围内的节点，再批量删除和释放
+    if ((chain = zslDetachRange(zsl,update,rank,end)) == NULL) return 0;
+    removed = end - rank[0];
+    zslReleaseDetached(chain,removed,dict);
 
     // 返回被删除节点的数量
     return removed;
@@ -936,118 +1109,1009 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
     return x;
 }
 
-/*-------------------------- ziplist 编码的有序集合 API -----------------------------*/
+/*-------------------------- 计数 B+ 树 API -----------------------------*/
 
-/**
- * 取出并返回 sptr 指向的有序集合的元素的分值
+/*
+ * BTREE 编码是大型有序集合在跳跃表之外的另一种实现。
+ *
+ * 跳跃表为每个成员单独分配一个节点, 节点中除了成员和分值,
+ * 还有后退指针以及平均 1.33 层的 (前进指针, 跨度),
+ * 算上分配器的开销, 每个成员大约要 50 字节以上。
+ *
+ * B+ 树把 (成员, 分值) 按序紧凑地保存在叶子节点的数组中,
+ * 每个成员只占 16 字节, 按 3/4 的填充率计算也只有 22 字节左右。
+ * 内部节点记录了每个子树的成员数量, 所以按排位查找、计算排位
+ * 都是 O(log N), 在叶子中顺序访问成员对 CPU 缓存也更友好。
+ *
+ * 字典仍然负责 O(1) 的按成员取分值, 但值直接保存分值本身:
+ * B+ 树中的成员会在节点之间移动, 不能像跳跃表那样保存指向分值的指针。
  */
-double zzlGetScore(unsigned char *sptr) {
-    unsigned char *vstr;
-    unsigned int vlen;
-    long long vlong;
-    char buf[128];
-    double score;
 
-    redisAssert(sptr != NULL);
+// 叶子节点和内部节点实际分配的大小
+#define ZBTREE_LEAF_BYTES (offsetof(zbtreeNode,u)+sizeof(((zbtreeNode*)0)->u.l))
+#define ZBTREE_INNER_BYTES (offsetof(zbtreeNode,u)+sizeof(((zbtreeNode*)0)->u.i))
 
-    // 提取 sptr 的值
-    redisAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+/*
+ * 创建一个空的 B+ 树节点
+ *
+ * T = O(1)
+ */
+static zbtreeNode *zbtCreateNode(int leaf) {
+    zbtreeNode *x = zmalloc(leaf ? ZBTREE_LEAF_BYTES : ZBTREE_INNER_BYTES);
 
-    // 提取整数
-    if (vstr) {
-        // 将字符串值转换成数值
-        memcpy(buf,vstr,vlen);
-        buf[vlen] = '\0';
-        score = strtod(buf,NULL);
+    x->leaf = leaf;
+    x->count = 0;
+    if (leaf) x->u.l.prev = x->u.l.next = NULL;
+
+    return x;
+}
+
+/*
+ * 创建并返回一个新的 B+ 树
+ *
+ * T = O(1)
+ */
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+
+    zbt->root = zbt->head = zbt->tail = NULL;
+    zbt->length = 0;
+    zbt->height = 0;
+
+    return zbt;
+}
+
+/*
+ * 释放节点及其子树, 叶子中的成员对象引用计数减一
+ *
+ * T = O(N)
+ */
+static void zbtFreeNode(zbtreeNode *x) {
+    int j;
 
+    if (x->leaf) {
+        for (j = 0; j < x->count; j++)
+            decrRefCount(x->u.l.entries[j].obj);
     } else {
-        score = vlong;
+        for (j = 0; j < x->count; j++)
+            zbtFreeNode(x->u.i.children[j]);
     }
 
-    return score;
+    zfree(x);
 }
 
-/**
- * 取出并以 robj 格式返回 sptr 指向的有序集合的元素的分值
+/*
+ * 释放 B+ 树, 以及树中的所有成员
+ *
+ * T = O(N)
  */
-robj *ziplistGetObject(unsigned char *sptr) {
-    unsigned char *vstr;
-    unsigned int vlen;
-    long long vlong;
+void zbtFree(zbtree *zbt) {
+    if (zbt->root) zbtFreeNode(zbt->root);
+    zfree(zbt);
+}
 
-    redisAssert(sptr != NULL);
+/*
+ * 比较 (score, obj) 和成员 e 的先后顺序, 先比分值, 再比成员
+ */
+static int zbtCompare(double score, robj *obj, zbtreeEntry *e) {
+    if (score < e->score) return -1;
+    if (score > e->score) return 1;
+    return compareStringObjects(obj,e->obj);
+}
 
-    // 提取值
-    redisAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+/*
+ * 返回叶子节点中第一个不小于 (score, obj) 的成员的下标,
+ * 所有成员都比它小时返回 count
+ *
+ * T = O(log M), M 为叶子节点的容量
+ */
+static int zbtLeafSearch(zbtreeNode *x, double score, robj *obj) {
+    int lo = 0, hi = x->count, mid;
 
-    if (vstr) {
-        return createStringObject(vstr,vlen);
-    } else {
-        return createStringObjectFromLongLong(vlong);
+    while (lo < hi) {
+        mid = (lo+hi)/2;
+        if (zbtCompare(score,obj,&x->u.l.entries[mid]) > 0)
+            lo = mid+1;
+        else
+            hi = mid;
     }
+
+    return lo;
 }
 
-/**
- * 将 eptr 中的元素值和 cstr 进行比对
- * 相等返回 0
- * eptr 的字符串比 cstr 大时, 返回正整数
- * eptr 的字符串比 cstr 小时, 返回负整数
+/*
+ * 返回内部节点中最后一个最小成员不大于 (score, obj) 的子节点的下标,
+ * 所有子树都比它大时返回 0
+ *
+ * T = O(log M)
  */
-int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int clen) {
-    unsigned char *vstr;
-    unsigned int vlen;
-    long long vlong;
-    unsigned char vbuf[32];
-    int cmp, minlen;
-
-    // 提取 eptr 的值
-    redisAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+static int zbtInnerSearch(zbtreeNode *x, double score, robj *obj) {
+    int lo = 1, hi = x->count, mid;
 
-    // 如果值是整数, 转成字符串
-    if (vstr == NULL) {
-        vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
-        vstr = vbuf;
+    while (lo < hi) {
+        mid = (lo+hi)/2;
+        if (zbtCompare(score,obj,&x->u.i.keys[mid]) >= 0)
+            lo = mid+1;
+        else
+            hi = mid;
     }
 
-    // 比对
-    minlen = (vlen < clen) ? vlen : clen;
-    cmp = memcmp(vstr,cstr,minlen);
-    if (cmp == 0) return vlen - clen;
-    return cmp;
+    return lo-1;
 }
 
 /*
- * 返回跳跃表包含的元素数量
+ * 节点中的最小成员
  */
-unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+static zbtreeEntry zbtMinEntry(zbtreeNode *x) {
+    return x->leaf ? x->u.l.entries[0] : x->u.i.keys[0];
 }
 
-/**
- * 分别获取 eptr 和 sptr 的下一个成员和分值
- * 
- * 如果后面没有元素了, 两个指针都返回 NULL
+/*
+ * 节点子树中的成员数量
+ *
+ * T = O(M)
  */
-void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
-    unsigned char *_eptr, *_sptr;
+static unsigned long zbtNodeSize(zbtreeNode *x) {
+    unsigned long size = 0;
+    int j;
 
-    redisAssert(*eptr != NULL && *sptr != NULL);
+    if (x->leaf) return x->count;
 
-    // 指向下一个成员
-    _eptr = ziplistNext(zl,*sptr);
-    if (_eptr != NULL) {
-        // 指向下一个分值
-        _sptr = ziplistNext(zl,_eptr);
-        redisAssert(_sptr != NULL);
-    } else {
-        _sptr = NULL;
-    }
+    for (j = 0; j < x->count; j++) size += x->u.i.sizes[j];
 
-    *eptr = _eptr;
-    *sptr = _sptr;
+    return size;
 }
 
-/**
+/*
+ * 第 depth 层的节点 x 的最小成员发生了变化,
+ * 沿着路径向上更新父节点中记录的最小成员,
+ * 直到 x 不再是父节点的第一个子节点为止
+ *
+ * path[d] 为第 d 层经过的内部节点, pidx[d] 为在该节点中选择的子节点下标
+ *
+ * T = O(log N)
+ */
+static void zbtUpdateMin(zbtreeNode **path, int *pidx, int depth, zbtreeNode *x) {
+    while (depth-- > 0) {
+        path[depth]->u.i.keys[pidx[depth]] = zbtMinEntry(x);
+        if (pidx[depth] != 0) break;
+        x = path[depth];
+    }
+}
+
+/*
+ * 在内部节点 x 的下标 i 处插入子节点 child, 其子树的成员数量为 size
+ *
+ * T = O(M)
+ */
+static void zbtInnerInsertAt(zbtreeNode *x, int i, zbtreeNode *child, unsigned long size) {
+    int n = x->count - i;
+
+    memmove(x->u.i.sizes+i+1,x->u.i.sizes+i,n*sizeof(unsigned long));
+    memmove(x->u.i.keys+i+1,x->u.i.keys+i,n*sizeof(zbtreeEntry));
+    memmove(x->u.i.children+i+1,x->u.i.children+i,n*sizeof(zbtreeNode*));
+
+    x->u.i.sizes[i] = size;
+    x->u.i.keys[i] = zbtMinEntry(child);
+    x->u.i.children[i] = child;
+    x->count++;
+}
+
+/*
+ * 移除内部节点 x 中下标为 i 的子节点
+ *
+ * T = O(M)
+ */
+static void zbtInnerRemoveAt(zbtreeNode *x, int i) {
+    int n = x->count - i - 1;
+
+    memmove(x->u.i.sizes+i,x->u.i.sizes+i+1,n*sizeof(unsigned long));
+    memmove(x->u.i.keys+i,x->u.i.keys+i+1,n*sizeof(zbtreeEntry));
+    memmove(x->u.i.children+i,x->u.i.children+i+1,n*sizeof(zbtreeNode*));
+    x->count--;
+}
+
+/*
+ * 将节点 x 从下标 at 处分裂, at 之后的成员(子节点)移动到新节点中,
+ * 返回新节点。叶子节点会被链接到叶子链表中。
+ *
+ * at 等于 count 时新节点为空, 用于在末尾追加时保持左侧节点是满的,
+ * 这样顺序插入(例如从有序的数据转换编码)得到的树几乎是满填充的。
+ *
+ * T = O(M)
+ */
+static zbtreeNode *zbtSplitNode(zbtree *zbt, zbtreeNode *x, int at) {
+    zbtreeNode *y = zbtCreateNode(x->leaf);
+    int n = x->count - at;
+
+    if (x->leaf) {
+        memcpy(y->u.l.entries,x->u.l.entries+at,n*sizeof(zbtreeEntry));
+
+        // 链接叶子节点
+        y->u.l.prev = x;
+        y->u.l.next = x->u.l.next;
+        if (y->u.l.next)
+            y->u.l.next->u.l.prev = y;
+        else
+            zbt->tail = y;
+        x->u.l.next = y;
+
+    } else {
+        memcpy(y->u.i.sizes,x->u.i.sizes+at,n*sizeof(unsigned long));
+        memcpy(y->u.i.keys,x->u.i.keys+at,n*sizeof(zbtreeEntry));
+        memcpy(y->u.i.children,x->u.i.children+at,n*sizeof(zbtreeNode*));
+    }
+
+    y->count = n;
+    x->count = at;
+
+    return y;
+}
+
+/*
+ * 第 depth 层的节点 left 分裂出了右侧的新节点 right,
+ * 将 right 插入到 left 的父节点中, 父节点已满时继续向上分裂,
+ * 根节点分裂时树长高一层。
+ *
+ * T = O(M log N)
+ */
+static void zbtInsertSibling(zbtree *zbt, zbtreeNode **path, int *pidx, int depth, zbtreeNode *left, zbtreeNode *right) {
+    zbtreeNode *parent, *sibling;
+    unsigned long rsize;
+    int i;
+
+    while (depth > 0) {
+        parent = path[depth-1];
+        i = pidx[depth-1];
+        rsize = zbtNodeSize(right);
+
+        // right 中的成员原来都计算在 left 中
+        parent->u.i.sizes[i] -= rsize;
+
+        // 父节点还有空位
+        if (parent->count < ZBTREE_INNER_CHILDREN) {
+            zbtInnerInsertAt(parent,i+1,right,rsize);
+            return;
+        }
+
+        // 父节点已满, 分裂父节点后再插入
+        sibling = zbtSplitNode(zbt,parent,
+            (i+1 == parent->count) ? parent->count : parent->count/2);
+        if (i+1 >= parent->count)
+            zbtInnerInsertAt(sibling,i+1-parent->count,right,rsize);
+        else
+            zbtInnerInsertAt(parent,i+1,right,rsize);
+
+        // 继续处理上一层
+        left = parent;
+        right = sibling;
+        depth--;
+    }
+
+    // 根节点分裂, 创建新的根节点
+    parent = zbtCreateNode(0);
+    zbtInnerInsertAt(parent,0,left,zbtNodeSize(left));
+    zbtInnerInsertAt(parent,1,right,zbtNodeSize(right));
+    zbt->root = parent;
+    zbt->height++;
+}
+
+/*
+ * 创建一个成员为 obj, 分值为 score 的成员, 并将它插入到 B+ 树中。
+ * 调用者需要保证成员不在树中, 树会持有 obj 的一个引用。
+ *
+ * T = O(M log N)
+ */
+void zbtInsert(zbtree *zbt, double score, robj *obj) {
+    zbtreeNode *path[ZBTREE_MAXDEPTH], *x, *y = NULL, *target;
+    int pidx[ZBTREE_MAXDEPTH], depth = 0, pos, i;
+    zbtreeEntry *e;
+
+    // 空树, 创建根节点
+    if (zbt->root == NULL) {
+        zbt->root = zbt->head = zbt->tail = zbtCreateNode(1);
+        zbt->height = 1;
+    }
+
+    // 自顶向下查找插入位置, 记录路径, 并为沿途的子树计数增一
+    x = zbt->root;
+    while (!x->leaf) {
+        redisAssert(depth < ZBTREE_MAXDEPTH);
+        i = zbtInnerSearch(x,score,obj);
+        x->u.i.sizes[i]++;
+        path[depth] = x;
+        pidx[depth] = i;
+        depth++;
+        x = x->u.i.children[i];
+    }
+    pos = zbtLeafSearch(x,score,obj);
+    target = x;
+
+    // 叶子节点已满, 分裂叶子节点
+    if (x->count == ZBTREE_LEAF_ENTRIES) {
+        // 在整棵树的末尾追加时, 保持左侧叶子是满的
+        y = zbtSplitNode(zbt,x,
+            (pos == x->count && x->u.l.next == NULL) ? x->count : x->count/2);
+        if (pos >= x->count) {
+            target = y;
+            pos -= x->count;
+        }
+    }
+
+    // 插入成员
+    e = target->u.l.entries;
+    memmove(e+pos+1,e+pos,(target->count-pos)*sizeof(zbtreeEntry));
+    e[pos].obj = obj;
+    e[pos].score = score;
+    target->count++;
+    zbt->length++;
+
+    // 叶子的最小成员变了, 更新父节点
+    if (target == x && pos == 0) zbtUpdateMin(path,pidx,depth,x);
+
+    // 将分裂出的叶子节点插入父节点
+    if (y) zbtInsertSibling(zbt,path,pidx,depth,x,y);
+}
+
+/*
+ * 释放一个已经为空的节点, 叶子节点需要先从叶子链表中解除链接
+ *
+ * T = O(1)
+ */
+static void zbtFreeEmptyNode(zbtree *zbt, zbtreeNode *x) {
+    if (x->leaf) {
+        if (x->u.l.prev)
+            x->u.l.prev->u.l.next = x->u.l.next;
+        else
+            zbt->head = x->u.l.next;
+
+        if (x->u.l.next)
+            x->u.l.next->u.l.prev = x->u.l.prev;
+        else
+            zbt->tail = x->u.l.prev;
+    }
+
+    zfree(x);
+}
+
+/*
+ * 将相邻的节点 right 合并到 left 中, 并释放 right
+ *
+ * T = O(M)
+ */
+static void zbtMergeNodes(zbtree *zbt, zbtreeNode *left, zbtreeNode *right) {
+    int n = right->count;
+
+    if (left->leaf) {
+        memcpy(left->u.l.entries+left->count,right->u.l.entries,n*sizeof(zbtreeEntry));
+    } else {
+        memcpy(left->u.i.sizes+left->count,right->u.i.sizes,n*sizeof(unsigned long));
+        memcpy(left->u.i.keys+left->count,right->u.i.keys,n*sizeof(zbtreeEntry));
+        memcpy(left->u.i.children+left->count,right->u.i.children,n*sizeof(zbtreeNode*));
+    }
+    left->count += n;
+    right->count = 0;
+
+    zbtFreeEmptyNode(zbt,right);
+}
+
+/*
+ * 第 depth 层的节点 x 中移除了成员(子节点)之后, 调整树的结构:
+ *
+ * 1) 节点为空时, 将它从父节点中移除
+ * 2) 节点不足 1/4 满时, 尝试和相邻的兄弟节点合并
+ * 3) 根节点只有一个子节点时, 树降低一层
+ *
+ * T = O(M log N)
+ */
+static void zbtRebalance(zbtree *zbt, zbtreeNode **path, int *pidx, int depth, zbtreeNode *x) {
+    zbtreeNode *parent, *left, *right;
+    int idx, l, cap;
+
+    while (depth > 0) {
+        parent = path[depth-1];
+        idx = pidx[depth-1];
+        cap = x->leaf ? ZBTREE_LEAF_ENTRIES : ZBTREE_INNER_CHILDREN;
+
+        if (x->count == 0) {
+            // 节点已空, 从父节点中移除
+            zbtFreeEmptyNode(zbt,x);
+            zbtInnerRemoveAt(parent,idx);
+            if (idx == 0 && parent->count) zbtUpdateMin(path,pidx,depth-1,parent);
+
+        } else if (x->count < cap/4) {
+            // 节点过于稀疏, 和左侧或右侧的兄弟节点合并
+            if (parent->count > 1) {
+                l = (idx+1 < parent->count) ? idx : idx-1;
+                left = parent->u.i.children[l];
+                right = parent->u.i.children[l+1];
+
+                // 合并后仍然要留有余量, 避免插入时马上又分裂
+                if (left->count + right->count > cap*3/4) break;
+
+                zbtMergeNodes(zbt,left,right);
+                parent->u.i.sizes[l] += parent->u.i.sizes[l+1];
+                zbtInnerRemoveAt(parent,l+1);
+            }
+
+        } else {
+            break;
+        }
+
+        // 父节点的子节点数量可能也变少了, 继续向上检查
+        x = parent;
+        depth--;
+    }
+
+    // 收缩根节点
+    x = zbt->root;
+    if (x->count == 0) {
+        zbtFreeEmptyNode(zbt,x);
+        zbt->root = NULL;
+        zbt->height = 0;
+    } else {
+        while (!x->leaf && x->count == 1) {
+            zbt->root = x->u.i.children[0];
+            zfree(x);
+            x = zbt->root;
+            zbt->height--;
+        }
+    }
+}
+
+/*
+ * 删除叶子节点 x 中从下标 pos 开始的 n 个成员, 并调整树的结构。
+ * dict 不为 NULL 时, 同时从字典中删除这些成员。
+ *
+ * T = O(n + M log N)
+ */
+static void zbtLeafRemove(zbtree *zbt, zbtreeNode **path, int *pidx, int depth,
+                          zbtreeNode *x, int pos, int n, dict *dict)
+{
+    zbtreeEntry *e = x->u.l.entries;
+    int j;
+
+    // 释放成员
+    for (j = pos; j < pos+n; j++) {
+        if (dict) dictDelete(dict,e[j].obj);
+        decrRefCount(e[j].obj);
+    }
+    memmove(e+pos,e+pos+n,(x->count-pos-n)*sizeof(zbtreeEntry));
+    x->count -= n;
+    zbt->length -= n;
+
+    // 更新沿途子树的成员数量
+    for (j = 0; j < depth; j++) path[j]->u.i.sizes[pidx[j]] -= n;
+
+    // 最小成员被删除了
+    if (pos == 0 && x->count) zbtUpdateMin(path,pidx,depth,x);
+
+    zbtRebalance(zbt,path,pidx,depth,x);
+}
+
+/*
+ * 从 B+ 树中删除分值为 score, 成员为 obj 的成员
+ *
+ * 删除成功返回 1, 成员不存在返回 0
+ *
+ * T = O(M log N)
+ */
+int zbtDelete(zbtree *zbt, double score, robj *obj) {
+    zbtreeNode *path[ZBTREE_MAXDEPTH], *x;
+    int pidx[ZBTREE_MAXDEPTH], depth = 0, pos;
+
+    if ((x = zbt->root) == NULL) return 0;
+
+    // 查找成员所在的叶子节点, 并记录路径
+    while (!x->leaf) {
+        path[depth] = x;
+        pidx[depth] = zbtInnerSearch(x,score,obj);
+        x = x->u.i.children[pidx[depth]];
+        depth++;
+    }
+
+    // 分值和成员都要相同
+    pos = zbtLeafSearch(x,score,obj);
+    if (pos == x->count || zbtCompare(score,obj,&x->u.l.entries[pos]) != 0)
+        return 0;
+
+    zbtLeafRemove(zbt,path,pidx,depth,x,pos,1,NULL);
+
+    return 1;
+}
+
+/*
+ * 查找包含给定分值和成员对象的成员在 B+ 树中的排位。
+ *
+ * 排位以 1 为起始值, 成员不存在时返回 0
+ *
+ * T = O(M log N)
+ */
+unsigned long zbtGetRank(zbtree *zbt, double score, robj *obj) {
+    zbtreeNode *x = zbt->root;
+    unsigned long rank = 0;
+    int i, j, pos;
+
+    if (x == NULL) return 0;
+
+    // 累加经过的子树左侧的成员数量
+    while (!x->leaf) {
+        i = zbtInnerSearch(x,score,obj);
+        for (j = 0; j < i; j++) rank += x->u.i.sizes[j];
+        x = x->u.i.children[i];
+    }
+
+    pos = zbtLeafSearch(x,score,obj);
+    if (pos < x->count && zbtCompare(score,obj,&x->u.l.entries[pos]) == 0)
+        return rank+pos+1;
+
+    return 0;
+}
+
+/*
+ * 查找排位为 rank (以 1 为起始值) 的成员所在的叶子节点,
+ * 成员在叶子中的下标保存在 *pos 中。
+ *
+ * path 不为 NULL 时记录沿途的路径, 路径长度保存在 *depth 中。
+ * 调用者需要保证 1 <= rank <= length
+ *
+ * T = O(M log N)
+ */
+static zbtreeNode *zbtSeekRank(zbtree *zbt, unsigned long rank,
+                               zbtreeNode **path, int *pidx, int *depth, int *pos)
+{
+    zbtreeNode *x = zbt->root;
+    int d = 0, i;
+
+    while (!x->leaf) {
+        for (i = 0; i < x->count-1 && rank > x->u.i.sizes[i]; i++)
+            rank -= x->u.i.sizes[i];
+
+        if (path) {
+            path[d] = x;
+            pidx[d] = i;
+        }
+        d++;
+        x = x->u.i.children[i];
+    }
+
+    if (depth) *depth = d;
+    *pos = rank-1;
+
+    return x;
+}
+
+/*
+ * 根据排位查找成员, 排位的起始值为 1
+ *
+ * 找到时将迭代器指向该成员并返回 1, 否则返回 0
+ *
+ * T = O(M log N)
+ */
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtreeIter *it) {
+
+    if (rank < 1 || rank > zbt->length) {
+        it->node = NULL;
+        return 0;
+    }
+
+    it->node = zbtSeekRank(zbt,rank,NULL,NULL,NULL,&it->idx);
+
+    return 1;
+}
+
+/*
+ * 将迭代器移动到下一个成员, 没有下一个成员时返回 0
+ *
+ * T = O(1)
+ */
+int zbtIterNext(zbtreeIter *it) {
+    if (++it->idx >= it->node->count) {
+        it->node = it->node->u.l.next;
+        it->idx = 0;
+    }
+
+    return it->node != NULL;
+}
+
+/*
+ * 将迭代器移动到上一个成员, 没有上一个成员时返回 0
+ *
+ * T = O(1)
+ */
+int zbtIterPrev(zbtreeIter *it) {
+    if (it->idx-- == 0) {
+        it->node = it->node->u.l.prev;
+        if (it->node) it->idx = it->node->count-1;
+    }
+
+    return it->node != NULL;
+}
+
+/*
+ * 范围查找所用的判断函数, 对有序的成员来说必须是单调的:
+ * 前面一段成员返回 1, 之后的成员都返回 0
+ */
+typedef int (*zbtPredicate)(zbtreeEntry *e, void *spec);
+
+// 分值小于范围的 min 项
+static int zbtScoreLtMin(zbtreeEntry *e, void *spec) {
+    return !zslValueGteMin(e->score,spec);
+}
+
+// 分值小于等于范围的 max 项
+static int zbtScoreLteMax(zbtreeEntry *e, void *spec) {
+    return zslValueLteMax(e->score,spec);
+}
+
+// 成员小于字典序范围的 min 项
+static int zbtLexLtMin(zbtreeEntry *e, void *spec) {
+    return !zslLexValueGteMin(e->obj,spec);
+}
+
+// 成员小于等于字典序范围的 max 项
+static int zbtLexLteMax(zbtreeEntry *e, void *spec) {
+    return zslLexValueLteMax(e->obj,spec);
+}
+
+/*
+ * 查找最后一个满足 pred 的成员, 将迭代器指向它, 并返回它的排位。
+ * 没有成员满足 pred 时返回 0
+ *
+ * 内部节点记录了每个子树的最小成员, 所以每一层只需要二分查找
+ * 最后一个最小成员满足 pred 的子树。
+ *
+ * T = O(M log N)
+ */
+static unsigned long zbtSeekLast(zbtree *zbt, zbtPredicate pred, void *spec, zbtreeIter *it) {
+    zbtreeNode *x = zbt->root;
+    unsigned long rank = 0;
+    int lo, hi, mid, j;
+
+    it->node = NULL;
+    if (x == NULL) return 0;
+
+    while (!x->leaf) {
+        lo = 0; hi = x->count;
+        while (lo < hi) {
+            mid = (lo+hi)/2;
+            if (pred(&x->u.i.keys[mid],spec))
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+
+        // 所有成员都不满足
+        if (lo == 0) return 0;
+
+        for (j = 0; j < lo-1; j++) rank += x->u.i.sizes[j];
+        x = x->u.i.children[lo-1];
+    }
+
+    lo = 0; hi = x->count;
+    while (lo < hi) {
+        mid = (lo+hi)/2;
+        if (pred(&x->u.l.entries[mid],spec))
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    if (lo == 0) return 0;
+
+    it->node = x;
+    it->idx = lo-1;
+
+    return rank+lo;
+}
+
+/*
+ * 将迭代器指向第一个分值在 range 范围内的成员, 并返回它的排位。
+ * 范围内没有成员时返回 0
+ *
+ * T = O(M log N)
+ */
+unsigned long zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it) {
+    unsigned long rank;
+
+    it->node = NULL;
+
+    // 排除总为空的范围
+    if (range->min > range->max ||
+            (range->min == range->max && (range->minex || range->maxex)))
+        return 0;
+
+    // 最后一个小于 min 项的成员的下一个成员
+    rank = zbtSeekLast(zbt,zbtScoreLtMin,range,it);
+    if (rank == 0) {
+        it->node = zbt->head;
+        it->idx = 0;
+    } else {
+        zbtIterNext(it);
+    }
+
+    // 检查是否满足 max 项
+    if (it->node == NULL || !zslValueLteMax(zbtIterEntry(it)->score,range)) {
+        it->node = NULL;
+        return 0;
+    }
+
+    return rank+1;
+}
+
+/*
+ * 将迭代器指向最后一个分值在 range 范围内的成员, 并返回它的排位。
+ * 范围内没有成员时返回 0
+ *
+ * T = O(M log N)
+ */
+unsigned long zbtLastInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it) {
+    unsigned long rank;
+
+    it->node = NULL;
+
+    // 排除总为空的范围
+    if (range->min > range->max ||
+            (range->min == range->max && (range->minex || range->maxex)))
+        return 0;
+
+    // 最后一个小于等于 max 项的成员
+    rank = zbtSeekLast(zbt,zbtScoreLteMax,range,it);
+    if (rank == 0) return 0;
+
+    // 检查是否满足 min 项
+    if (!zslValueGteMin(zbtIterEntry(it)->score,range)) {
+        it->node = NULL;
+        return 0;
+    }
+
+    return rank;
+}
+
+/*
+ * 字典序范围 range 是否总为空
+ */
+static int zbtLexRangeIsEmpty(zlexrangespec *range) {
+    int cmp = compareStringObjectsForLexRange(range->min,range->max);
+
+    return cmp > 0 || (cmp == 0 && (range->minex || range->maxex));
+}
+
+/*
+ * 将迭代器指向第一个在字典序范围 range 内的成员, 并返回它的排位。
+ * 范围内没有成员时返回 0
+ *
+ * T = O(M log N)
+ */
+unsigned long zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it) {
+    unsigned long rank;
+
+    it->node = NULL;
+    if (zbtLexRangeIsEmpty(range)) return 0;
+
+    // 最后一个小于 min 项的成员的下一个成员
+    rank = zbtSeekLast(zbt,zbtLexLtMin,range,it);
+    if (rank == 0) {
+        it->node = zbt->head;
+        it->idx = 0;
+    } else {
+        zbtIterNext(it);
+    }
+
+    // 检查是否满足 max 项
+    if (it->node == NULL || !zslLexValueLteMax(zbtIterEntry(it)->obj,range)) {
+        it->node = NULL;
+        return 0;
+    }
+
+    return rank+1;
+}
+
+/*
+ * 将迭代器指向最后一个在字典序范围 range 内的成员, 并返回它的排位。
+ * 范围内没有成员时返回 0
+ *
+ * T = O(M log N)
+ */
+unsigned long zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it) {
+    unsigned long rank;
+
+    it->node = NULL;
+    if (zbtLexRangeIsEmpty(range)) return 0;
+
+    // 最后一个小于等于 max 项的成员
+    rank = zbtSeekLast(zbt,zbtLexLteMax,range,it);
+    if (rank == 0) return 0;
+
+    // 检查是否满足 min 项
+    if (!zslLexValueGteMin(zbtIterEntry(it)->obj,range)) {
+        it->node = NULL;
+        return 0;
+    }
+
+    return rank;
+}
+
+/*
+ * 删除排位在 start 和 end 之间的成员 (包含 start 和 end, 以 1 为起始值),
+ * 同时从字典中删除它们。
+ *
+ * 成员是按叶子整块删除的, 每个叶子只需要一次路径查找。
+ *
+ * 返回被删除成员的数量
+ *
+ * T = O(K + (K/M) log N), K 为被删除成员的数量
+ */
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end, dict *dict) {
+    zbtreeNode *path[ZBTREE_MAXDEPTH], *x;
+    int pidx[ZBTREE_MAXDEPTH], depth, pos;
+    unsigned long removed = 0, todo, n;
+
+    if (end > zbt->length) end = zbt->length;
+    if (start < 1 || start > end) return 0;
+
+    todo = end-start+1;
+    while (todo) {
+        // 后面的成员会前移, 所以每次都从 start 开始删除
+        x = zbtSeekRank(zbt,start,path,pidx,&depth,&pos);
+
+        n = x->count - pos;
+        if (n > todo) n = todo;
+
+        zbtLeafRemove(zbt,path,pidx,depth,x,pos,n,dict);
+
+        removed += n;
+        todo -= n;
+    }
+
+    return removed;
+}
+
+/*
+ * 删除所有分值在给定范围之内的成员, 同时从字典中删除它们。
+ *
+ * 返回被删除成员的数量
+ *
+ * T = O(K + (K/M) log N)
+ */
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict) {
+    zbtreeIter it;
+    unsigned long start, end;
+
+    if ((start = zbtFirstInRange(zbt,range,&it)) == 0) return 0;
+    end = zbtLastInRange(zbt,range,&it);
+
+    return zbtDeleteRangeByRank(zbt,start,end,dict);
+}
+
+/*
+ * 删除所有在字典序范围之内的成员, 同时从字典中删除它们。
+ *
+ * 返回被删除成员的数量
+ *
+ * T = O(K + (K/M) log N)
+ */
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict) {
+    zbtreeIter it;
+    unsigned long start, end;
+
+    if ((start = zbtFirstInLexRange(zbt,range,&it)) == 0) return 0;
+    end = zbtLastInLexRange(zbt,range,&it);
+
+    return zbtDeleteRangeByRank(zbt,start,end,dict);
+}
+
+/*-------------------------- ziplist 编码的有序集合 API -----------------------------*/
+
+/**
+ * 取出并返回 sptr 指向的有序集合的元素的分值
+ */
+double zzlGetScore(unsigned char *sptr) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    char buf[128];
+    double score;
+
+    redisAssert(sptr != NULL);
+
+    // 提取 sptr 的值
+    redisAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+
+    // 提取整数
+    if (vstr) {
+        // 将字符串值转换成数值
+        memcpy(buf,vstr,vlen);
+        buf[vlen] = '\0';
+        score = strtod(buf,NULL);
+
+    } else {
+        score = vlong;
+    }
+
+    return score;
+}
+
+/**
+ * 取出并以 robj 格式返回 sptr 指向的有序集合的元素的分值
+ */
+robj *ziplistGetObject(unsigned char *sptr) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+
+    redisAssert(sptr != NULL);
+
+    // 提取值
+    redisAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+
+    if (vstr) {
+        return createStringObject(vstr,vlen);
+    } else {
+        return createStringObjectFromLongLong(vlong);
+    }
+}
+
+/**
+ * 将 eptr 中的元素值和 cstr 进行比对
+ * 相等返回 0
+ * eptr 的字符串比 cstr 大时, 返回正整数
+ * eptr 的字符串比 cstr 小时, 返回负整数
+ */
+int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int clen) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    unsigned char vbuf[32];
+    int cmp, minlen;
+
+    // 提取 eptr 的值
+    redisAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+
+    // 如果值是整数, 转成字符串
+    if (vstr == NULL) {
+        vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
+        vstr = vbuf;
+    }
+
+    // 比对
+    minlen = (vlen < clen) ? vlen : clen;
+    cmp = memcmp(vstr,cstr,minlen);
+    if (cmp == 0) return vlen - clen;
+    return cmp;
+}
+
+/*
+ * 返回跳跃表包含的元素数量
+ */
+unsigned int zzlLength(unsigned char *zl) {
+    return ziplistLen(zl)/2;
+}
+
+/**
+ * 分别获取 eptr 和 sptr 的下一个成员和分值
+ * 
+ * 如果后面没有元素了, 两个指针都返回 NULL
+ */
+void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
+    unsigned char *_eptr, *_sptr;
+
+    redisAssert(*eptr != NULL && *sptr != NULL);
+
+    // 指向下一个成员
+    _eptr = ziplistNext(zl,*sptr);
+    if (_eptr != NULL) {
+        // 指向下一个分值
+        _sptr = ziplistNext(zl,_eptr);
+        redisAssert(_sptr != NULL);
+    } else {
+        _sptr = NULL;
+    }
+
+    *eptr = _eptr;
+    *sptr = _sptr;
+}
+
+/**
  * 分别获取 eptr 和 sptr 的前一个成员和分值
  * 
  * 如果前面没有元素了, 两个之后都返回 NULL
@@ -1064,51 +2128,262 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
         _eptr = ziplistPrev(zl,_sptr);
         redisAssert(_eptr != NULL);
 
-    } else {
-        _eptr = NULL;
-    }
+    } else {
+        _eptr = NULL;
+    }
+
+    *eptr = _eptr;
+    *sptr = _sptr;
+}
+
+/**
+ * 只要有一个节点在 range 指定的范围内
+ * 函数返回 1, 否则返回 0
+ */
+int zzlIsInRange(unsigned char *zl, zrangespec *range) {
+    double score;
+    unsigned char *p;
+
+    // range 范围检查
+    if (range->min > range->max || 
+        (range->min == range->max && (range->maxex || range->minex)))
+        return 0;
+
+    // 超范围, 最大值小于 range 最小值
+    p = ziplistIndex(zl,-1);
+    if (p == NULL) return 0;
+    score = zzlGetScore(p);
+    if (!zslValueGteMin(score,range)) 
+        return 0;
+
+    // 超范围, 最小值大于 range 最大值
+    p = ziplistIndex(zl,1);
+    redisAssert(p != NULL);
+    score = zzlGetScore(p);
+    if (!zslValueLteMax(score,range)) 
+        return 0;
+
+    return 1;
+}
+
+/*
+ * ziplist 稀疏分值索引
+ *
+ * ziplist 编码的有序集合只能从两端线性遍历,
+ * 按排名定位和按分值查找范围起点都是 O(N) 的。
+ *
+ * 对于成员数量较多的 ziplist, 可以为它建立一个稀疏索引:
+ * 每隔 stride 个元素记录一次该元素成员节点的偏移量和分值。
+ * 按分值查找时先对采样点二分查找, 再从最近的采样点开始遍历至多 stride 个元素;
+ * 按排名定位时直接跳到 rank/stride 号采样点, 再向后走 rank%stride 个元素。
+ *
+ * 索引不写入 ziplist 本身 (ziplist 和 RDB 格式都不变),
+ * 而是以 ziplist 的地址为键保存在 server.zset_index_cache 缓存中 (见 ptrcache.c),
+ * 在第一次读取时建立, ziplist 被修改或释放时作废。
+ * 缓存至多保存 ZZL_INDEX_CACHE_MAX_ENTRIES 个索引, 超过时随机淘汰。
+ *
+ * server.zset_ziplist_index_stride 为 0 时不使用索引。
+ */
+
+// 成员数量至少是 stride 的多少倍时才建立索引
+#define ZZL_INDEX_MIN_SAMPLES 4
+
+// 缓存的索引数量上限
+#define ZZL_INDEX_CACHE_MAX_ENTRIES 1024
+
+typedef struct zzlIndex {
+
+    // 建立索引时 ziplist 的字节数, 用于校验索引是否过期
+    size_t bytes;
+
+    // 建立索引时 ziplist 的校验值, 见 zzlIndexChecksum
+    uint64_t checksum;
+
+    // 采样间隔
+    unsigned int stride;
+
+    // 采样点数量
+    unsigned int count;
+
+    // 采样点的分值
+    double *scores;
+
+    // 采样点成员节点相对 ziplist 首地址的偏移量
+    uint32_t *offsets;
+
+} zzlIndex;
+
+/*
+ * 作废 zl 的索引
+ * 
+ * 所有修改或释放 ziplist 编码有序集合的操作, 都必须在修改前调用
+ *
+ * T = O(1)
+ */
+void zzlIndexInvalidate(unsigned char *zl) {
+    ptrCacheDelete(server.zset_index_cache,zl);
+}
+
+/*
+ * ziplist 编码的有序集合被加入数据库 dbid 时, 更新它的索引所属的数据库
+ *
+ * T = O(1)
+ */
+void zzlIndexSetDb(unsigned char *zl, int dbid) {
+    ptrCacheSetDb(server.zset_index_cache,zl,dbid);
+}
+
+/*
+ * 删除属于数据库 dbid 的 ziplist 的索引
+ *
+ * 在把整个数据库交给后台线程释放之前调用
+ *
+ * T = O(N)
+ */
+void zzlIndexResetDb(int dbid) {
+    ptrCacheEmptyDb(server.zset_index_cache,dbid);
+}
+
+/*
+ * 计算 zl 的校验值: ziplist 的表头 (总字节数, 表尾偏移量和节点数量),
+ * 加上抽查的若干个采样点处的字节, 见 ptrCacheChecksum
+ *
+ * 调用者需要保证 zl 的字节数和 idx->bytes 相同, 这样所有偏移量都在 zl 之内
+ *
+ * T = O(1)
+ */
+static uint64_t zzlIndexChecksum(unsigned char *zl, zzlIndex *idx) {
+    return ptrCacheChecksum(zl,idx->bytes,sizeof(uint32_t)*2+sizeof(uint16_t),
+                            idx->offsets,idx->count);
+}
+
+/*
+ * 遍历一次 zl, 为它建立采样间隔为 stride 的索引
+ *
+ * T = O(N)
+ */
+static zzlIndex *zzlIndexBuild(unsigned char *zl, unsigned int stride) {
+    unsigned int length = zzlLength(zl);
+    unsigned int count = (length+stride-1)/stride;
+    unsigned int i = 0, j = 0;
+    unsigned char *eptr, *sptr;
+    zzlIndex *idx;
+
+    // 索引结构和两个采样数组一次分配, 分值数组在前以保证对齐
+    idx = zmalloc(sizeof(*idx)+count*(sizeof(double)+sizeof(uint32_t)));
+    idx->bytes = ziplistBlobLen(zl);
+    idx->stride = stride;
+    idx->count = count;
+    idx->scores = (double*)(idx+1);
+    idx->offsets = (uint32_t*)(idx->scores+count);
+
+    eptr = ziplistIndex(zl,0);
+    sptr = ziplistNext(zl,eptr);
+    while (eptr != NULL) {
+        if (i++ % stride == 0) {
+            idx->offsets[j] = eptr-zl;
+            idx->scores[j] = zzlGetScore(sptr);
+            j++;
+        }
+        zzlNext(zl,&eptr,&sptr);
+    }
+    redisAssert(j == count);
+    idx->checksum = zzlIndexChecksum(zl,idx);
+
+    return idx;
+}
+
+/*
+ * 返回 zl 的索引, 索引不存在或已过期时重建
+ *
+ * 未开启索引, 或者 zl 太短不值得建立索引时, 返回 NULL
+ */
+static zzlIndex *zzlGetIndex(unsigned char *zl) {
+    unsigned int stride = server.zset_ziplist_index_stride;
+    zzlIndex *idx;
+
+    if (stride == 0 || zzlLength(zl) < stride*ZZL_INDEX_MIN_SAMPLES)
+        return NULL;
 
-    *eptr = _eptr;
-    *sptr = _sptr;
+    if (server.zset_index_cache == NULL)
+        server.zset_index_cache = ptrCacheCreate(ZZL_INDEX_CACHE_MAX_ENTRIES,zfree);
+
+    // 命中并且未过期
+    if ((idx = ptrCacheFind(server.zset_index_cache,zl)) != NULL &&
+        idx->bytes == ziplistBlobLen(zl) && idx->stride == stride &&
+        idx->checksum == zzlIndexChecksum(zl,idx))
+        return idx;
+
+    // 未命中或已过期, 重建后替换旧的索引
+    idx = zzlIndexBuild(zl,stride);
+    ptrCacheAdd(server.zset_index_cache,zl,idx,ptrCacheCurrentDb());
+
+    return idx;
 }
 
-/**
- * 只要有一个节点在 range 指定的范围内
- * 函数返回 1, 否则返回 0
+/*
+ * 二分查找第一个使 pred 为真的采样点,
+ * pred 在有序的分值上必须是单调的 (先假后真)
+ *
+ * 都为假时返回 idx->count
+ *
+ * T = O(log N)
  */
-int zzlIsInRange(unsigned char *zl, zrangespec *range) {
-    double score;
-    unsigned char *p;
+static unsigned int zzlIndexSearch(zzlIndex *idx, int (*pred)(double,zrangespec*), zrangespec *range) {
+    unsigned int lo = 0, hi = idx->count, mid;
 
-    // range 范围检查
-    if (range->min > range->max || 
-        (range->min == range->max && (range->maxex || range->minex)))
-        return 0;
+    while (lo < hi) {
+        mid = lo+(hi-lo)/2;
+        if (pred(idx->scores[mid],range))
+            hi = mid;
+        else
+            lo = mid+1;
+    }
+    return lo;
+}
 
-    // 超范围, 最大值小于 range 最小值
-    p = ziplistIndex(zl,-1);
-    if (p == NULL) return 0;
-    score = zzlGetScore(p);
-    if (!zslValueGteMin(score,range)) 
-        return 0;
+static int zzlScoreGtMax(double score, zrangespec *range) {
+    return !zslValueLteMax(score,range);
+}
 
-    // 超范围, 最小值大于 range 最大值
-    p = ziplistIndex(zl,1);
-    redisAssert(p != NULL);
-    score = zzlGetScore(p);
-    if (!zslValueLteMax(score,range)) 
-        return 0;
+/*
+ * 返回排名为 rank (从 0 开始) 的元素的成员节点
+ * rank 超出范围时返回 NULL
+ *
+ * 有索引时从最近的采样点向后走, 否则从较近的一端开始遍历
+ *
+ * T = O(stride) 或 O(N)
+ */
+unsigned char *zzlSeekRank(unsigned char *zl, unsigned long rank) {
+    unsigned long length = zzlLength(zl), n;
+    unsigned char *eptr;
+    zzlIndex *idx;
+
+    if (rank >= length) return NULL;
+
+    if ((idx = zzlGetIndex(zl)) != NULL) {
+        eptr = zl+idx->offsets[rank/idx->stride];
+        for (n = rank%idx->stride; n > 0; n--)
+            eptr = ziplistNext(zl,ziplistNext(zl,eptr));
+        return eptr;
+    }
 
-    return 1;
+    if (rank < length/2)
+        return ziplistIndex(zl,2*rank);
+    else
+        return ziplistIndex(zl,-2*(long)(length-rank));
 }
 
 /**
  * 返回值在给定范围的第一个节点
- * 找到返回 成员节点的指针
+ * 找到返回 成员节点的指针, 如果 rank 不为空, 将节点的排名 (从 0 开始) 写入 rank
  * 未找到返回 NULL
  */
-unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
+unsigned char *zzlFirstInRangeWithRank(unsigned char *zl, zrangespec *range, unsigned long *rank) {
     unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned long r = 0;
+    unsigned int j;
+    zzlIndex *idx;
     double score;
 
     redisAssert(eptr != NULL);
@@ -1116,6 +2391,15 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
     // 是否存在 range 范围的节点
     if (!zzlIsInRange(zl,range)) return NULL;
 
+    // 从第一个大于等于 range 最小值的采样点的前一个采样点开始遍历
+    if ((idx = zzlGetIndex(zl)) != NULL) {
+        j = zzlIndexSearch(idx,zslValueGteMin,range);
+        if (j > 0) {
+            eptr = zl+idx->offsets[j-1];
+            r = (unsigned long)(j-1)*idx->stride;
+        }
+    }
+
     // 遍历节点
     while (eptr != NULL) {
 
@@ -1129,30 +2413,61 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         // 大于range的节点
         if (zslValueGteMin(score,range)) {
             // 小于 range的最大值
-            if (zslValueLteMax(score,range))
+            if (zslValueLteMax(score,range)) {
+                if (rank != NULL) *rank = r;
                 return eptr;
+            }
             return NULL;
         }
 
         // 下一个节点
         eptr = ziplistNext(zl,sptr);
+        r++;
     }
 
     return NULL;
 }
 
+unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
+    return zzlFirstInRangeWithRank(zl,range,NULL);
+}
+
 /**
  * 返回值在给定范围的最后一个节点
- * 找到返回成员节点的指针
+ * 找到返回成员节点的指针, 如果 rank 不为空, 将节点的排名 (从 0 开始) 写入 rank
  * 未找到返回 NULL
  */
-unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+unsigned char *zzlLastInRangeWithRank(unsigned char *zl, zrangespec *range, unsigned long *rank) {
+    unsigned char *eptr = ziplistIndex(zl,-2), *sptr, *next, *nsptr;
+    unsigned long r = zzlLength(zl)-1;
+    unsigned int j;
+    zzlIndex *idx;
     double score;
 
     // 判断 range 范围内是否有节点
     if (!zzlIsInRange(zl,range)) return NULL;
 
+    // 有索引时, 从最后一个小于等于 range 最大值的采样点开始向后遍历
+    if ((idx = zzlGetIndex(zl)) != NULL) {
+        j = zzlIndexSearch(idx,zzlScoreGtMax,range);
+        if (j == 0) return NULL;
+
+        eptr = zl+idx->offsets[j-1];
+        r = (unsigned long)(j-1)*idx->stride;
+        sptr = ziplistNext(zl,eptr);
+        while ((next = ziplistNext(zl,sptr)) != NULL) {
+            nsptr = ziplistNext(zl,next);
+            if (!zslValueLteMax(zzlGetScore(nsptr),range)) break;
+            eptr = next;
+            sptr = nsptr;
+            r++;
+        }
+
+        if (!zslValueGteMin(zzlGetScore(sptr),range)) return NULL;
+        if (rank != NULL) *rank = r;
+        return eptr;
+    }
+
     // 遍历节点
     while (eptr != NULL) {
 
@@ -1166,36 +2481,78 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
         // 比对分值, 是否在 range 范围内
         if (zslValueLteMax(score,range)) {
 
-            if (zslValueGteMin(score,range))
+            if (zslValueGteMin(score,range)) {
+                if (rank != NULL) *rank = r;
                 return eptr;
+            }
             return NULL;
         }
 
         // 下一个成员节点
         sptr = ziplistPrev(zl,eptr);
         if (sptr != NULL) {
-            redisAssert(ziplistPrev(eptr = ziplistPrev(zl,sptr)) != NULL);
+            eptr = ziplistPrev(zl,sptr);
+            redisAssert(eptr != NULL);
         } else {
             eptr = NULL;
         }
+        r--;
     }
 
     return NULL;
 }
 
+unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
+    return zzlLastInRangeWithRank(zl,range,NULL);
+}
+
+/*
+ * 比较 ziplist 节点 p 的值和字典序范围的边界 bound
+ * p 小于、等于、大于 bound 时分别返回负数、0、正数
+ *
+ * 整数节点在栈上转换成字符串, 不创建对象
+ */
+static int zzlCompareLexBound(unsigned char *p, robj *bound) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    char vbuf[32], bbuf[32], *bstr;
+    size_t blen, minlen;
+    int cmp;
+
+    // 正负无穷
+    if (bound == shared.minstring) return 1;
+    if (bound == shared.maxstring) return -1;
+
+    redisAssert(ziplistGet(p,&vstr,&vlen,&vlong));
+    if (vstr == NULL) {
+        vlen = ll2string(vbuf,sizeof(vbuf),vlong);
+        vstr = (unsigned char*)vbuf;
+    }
+
+    if (sdsEncodedObject(bound)) {
+        bstr = bound->ptr;
+        blen = sdslen(bstr);
+    } else {
+        blen = ll2string(bbuf,sizeof(bbuf),(long)bound->ptr);
+        bstr = bbuf;
+    }
+
+    minlen = (vlen < blen) ? vlen : blen;
+    cmp = memcmp(vstr,bstr,minlen);
+    if (cmp == 0) return (vlen < blen) ? -1 : (vlen > blen);
+    return cmp;
+}
+
 /**
  * 节点字符串是否大于 spec.min 的字符串
  * 大于, 返回 1
  * 小于, 返回 0
  */
 static int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    // 获取 p 节点
-    robj *value = ziplistGetObject(p);
+    int cmp = zzlCompareLexBound(p,spec->min);
 
-    // 比对
-    int res = zslLexValueGteMin(value,spec);
-    decrRefCount(value);
-    return res;
+    return spec->minex ? (cmp > 0) : (cmp >= 0);
 }
 
 /**
@@ -1204,10 +2561,9 @@ static int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
  * 大于, 返回 0
  */
 static int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    robj *value = ziplistGetObject(p);
-    int res = zslLexValueLteMax(value,spec);
-    decrRefCount(value);
-    return res;
+    int cmp = zzlCompareLexBound(p,spec->max);
+
+    return spec->maxex ? (cmp < 0) : (cmp <= 0);
 }
 
 /**
@@ -1298,6 +2654,41 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
     return NULL;
 }
 
+/*
+ * 计算 ziplist 中成员在 range 范围内的第一个和最后一个元素的排位 (从 0 开始)
+ * 分别写入 first 和 last
+ *
+ * 范围内有元素时返回 1, 否则返回 0
+ *
+ * T = O(N)
+ */
+int zzlLexRangeRanks(unsigned char *zl, zlexrangespec *range, unsigned long *first, unsigned long *last) {
+    unsigned char *eptr, *sptr;
+    unsigned long rank = 0;
+
+    if (!zzlIsInLexRange(zl,range)) return 0;
+
+    // 跳过小于 range 最小值的元素
+    eptr = ziplistIndex(zl,0);
+    while (eptr != NULL && !zzlLexValueGteMin(eptr,range)) {
+        sptr = ziplistNext(zl,eptr);
+        eptr = ziplistNext(zl,sptr);
+        rank++;
+    }
+    if (eptr == NULL || !zzlLexValueLteMax(eptr,range)) return 0;
+    *first = rank;
+
+    // 一直走到最后一个小于等于 range 最大值的元素
+    while (eptr != NULL && zzlLexValueLteMax(eptr,range)) {
+        sptr = ziplistNext(zl,eptr);
+        eptr = ziplistNext(zl,sptr);
+        rank++;
+    }
+    *last = rank-1;
+
+    return 1;
+}
+
 /**
  * 从 ziplist 编码的有序集合中查找 ele 成员, 并将其分值保存到 score
  * 查找成功, 返回 ele 的指针
@@ -1338,6 +2729,7 @@ unsigned char *zzlFind(unsigned char *zl, robj *ele, double *score) {
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
+    zzlIndexInvalidate(zl);
     zl = ziplistDelete(zl,&p);
     zl = ziplistDelete(zl,&p);
     return zl;
@@ -1357,6 +2749,8 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, robj *ele, do
     redisAssertWithInfo(NULL,ele,sdsEncodedObject(ele));
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
 
+    zzlIndexInvalidate(zl);
+
     // 末端添加
     if (eptr == NULL) {
         zl = ziplistPush(zl,ele->ptr,sdslen(ele->ptr),ZIPLIST_TAIL);
@@ -1438,6 +2832,7 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
+    zzlIndexInvalidate(zl);
     while ((sptr = ziplistNext(zl,eptr)) != NULL) {
 
         // 提取分值
@@ -1475,6 +2870,8 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
+    zzlIndexInvalidate(zl);
+
     // 迭代删除 range 范围内的节点
     while ((sptr = ziplistNext(zl,eptr)) != NULL) {
 
@@ -1506,6 +2903,7 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
 
     // rank 第一位索引是 1, ziplist 第一位索引是 0, 所以 start-1 才是ziplist的索引位
     // 索引,元素数量分别 *2, 是因为 ziplist 的 ele,score 存在两个节点中
+    zzlIndexInvalidate(zl);
     zl = ziplistDeleteRange(zl,2*(start-1),num*2);
 
     return zl;
@@ -1525,6 +2923,9 @@ unsigned int zsetLength(robj *zobj) {
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
         length = ((zset*)zobj->ptr)->zsl->length;
 
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        length = ((zset*)zobj->ptr)->zbt->length;
+
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -1532,16 +2933,88 @@ unsigned int zsetLength(robj *zobj) {
     return length;
 }
 
+/*
+ * 按 (分值, 成员) 比较两个 zsetEntry, 用于 qsort
+ */
+static int zsetEntryCompare(const void *a, const void *b) {
+    const zsetEntry *x = a, *y = b;
+
+    if (x->score < y->score) return -1;
+    if (x->score > y->score) return 1;
+    return compareStringObjects(x->obj,y->obj);
+}
+
+/*
+ * 将 entries 按 (分值, 成员) 从小到大排序
+ * 输入已经有序时 (比如按顺序保存的 RDB) 只需要一次遍历
+ *
+ * T = O(N) 或 O(N log N)
+ */
+void zsetSortEntries(zsetEntry *entries, unsigned long n) {
+    unsigned long i;
+
+    for (i = 1; i < n; i++) {
+        if (zsetEntryCompare(&entries[i-1],&entries[i]) > 0) break;
+    }
+
+    if (i < n) qsort(entries,n,sizeof(zsetEntry),zsetEntryCompare);
+}
+
+/*
+ * 将已排序的 entries 一次性载入空的 SKIPLIST 或 BTREE 编码有序集合
+ *
+ * 排序结构接管 entries 中成员对象的引用;
+ * 成员不在字典中时加入字典, 并为字典增加一次引用计数,
+ * 已经在字典中时 (调用者事先用字典去重) 只设置字典的值。
+ *
+ * T = O(N), BTREE 编码为 O(N log N)
+ */
+void zsetBulkLoad(zset *zs, zsetEntry *entries, unsigned long n) {
+    zskiplistNode *x;
+    dictEntry *de;
+    unsigned long k;
+
+    // 一次分配好字典的空间, 避免载入过程中反复扩容
+    if (dictSize(zs->dict) < n) dictExpand(zs->dict,n);
+
+    if (zs->zsl) {
+        zslBulkLoad(zs->zsl,entries,n);
+
+        // 字典的值指向跳跃表节点的分值
+        for (x = zs->zsl->header->level[0].forward; x; x = x->level[0].forward) {
+            if ((de = dictAddRaw(zs->dict,x->obj)) != NULL)
+                incrRefCount(x->obj);
+            else
+                de = dictFind(zs->dict,x->obj);
+            dictSetVal(zs->dict,de,&x->score);
+        }
+
+    } else {
+        // 有序输入总是追加到 B+ 树末尾的叶子节点
+        for (k = 0; k < n; k++) {
+            zbtInsert(zs->zbt,entries[k].score,entries[k].obj);
+
+            if ((de = dictAddRaw(zs->dict,entries[k].obj)) != NULL)
+                incrRefCount(entries[k].obj);
+            else
+                de = dictFind(zs->dict,entries[k].obj);
+            dictSetDoubleVal(de,entries[k].score);
+        }
+    }
+}
+
 /**
  * 内部编码转换
  */
 void zsetConvert(robj *zobj, int encoding) {
     zset *zs;
     zskiplistNode *node, *next;
+    zsetEntry *entries;
+    unsigned long n;
     robj *ele;
     double score;
 
-    // ZIPLIST 转 SKIPLIST
+    // ZIPLIST 转 SKIPLIST 或 BTREE
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
@@ -1549,13 +3022,19 @@ void zsetConvert(robj *zobj, int encoding) {
         unsigned int vlen;
         long long vlong;
         
-        if (encoding != REDIS_ENCODING_SKIPLIST)
+        if (encoding != REDIS_ENCODING_SKIPLIST &&
+            encoding != REDIS_ENCODING_BTREE)
             redisPanic("Unknown target encoding");
 
-        // 创建空 skiplist
+        // 创建空的 skiplist 或 btree
         zs = zmalloc(sizeof(*zs));
         zs->dict = dictCreate(&zsetDictType,NULL);
-        zs->zsl = zslCreate();
+        zs->zsl = NULL;
+        zs->zbt = NULL;
+        if (encoding == REDIS_ENCODING_SKIPLIST)
+            zs->zsl = zslCreate();
+        else
+            zs->zbt = zbtCreate();
 
         // 第一个节点的成员和分值
         eptr = ziplistIndex(zobj->ptr,0);
@@ -1563,6 +3042,10 @@ void zsetConvert(robj *zobj, int encoding) {
         sptr = ziplistNext(zobj->ptr,eptr);
         redisAssertWithInfo(NULL,zobj,sptr != NULL);
 
+        // ziplist 本身是有序的, 取出所有元素后一次性载入
+        n = 0;
+        entries = zmalloc(sizeof(zsetEntry)*zzlLength(zl));
+
         // 拷贝节点
         while (eptr != NULL) {
             // 提取分值
@@ -1576,34 +3059,59 @@ void zsetConvert(robj *zobj, int encoding) {
                 ele = createStringObjectFromLongLong(vlong);
             }
 
-            // 添加到 skiplist
-            node = zslInsert(zs->zsl,score,ele);
-            redisAssertWithInfo(NULL,zobj,dictAdd(zs->dict,ele,&node->score) == DICT_OK);
-            incrRefCount(ele);
+            entries[n].obj = ele;
+            entries[n].score = score;
+            n++;
 
             // 下一个节点
             zzlNext(zl,&eptr,&sptr);
         }
 
+        // 添加到 skiplist 或 btree, 以及字典
+        zsetBulkLoad(zs,entries,n);
+        zfree(entries);
+
         // 更新编码
-        zobj->encoding = REDIS_ENCODING_SKIPLIST;
+        zobj->encoding = encoding;
 
         // 释放 ziplist 结构
+        zzlIndexInvalidate(zobj->ptr);
         zfree(zobj->ptr);
 
-        // 绑定 skiplist 结构
+        // 绑定新结构
         zobj->ptr = zs;
 
-    // SKIPLIST 转 ZIPLIST
+    // SKIPLIST 转 ZIPLIST 或 BTREE
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
 
-        // 创建 ziplist
-        unsigned char *zl = ziplistNew();
+        zs = zobj->ptr;
+
+        // SKIPLIST 转 BTREE, 字典保留, 只替换排序结构
+        if (encoding == REDIS_ENCODING_BTREE) {
+            zs->zbt = zbtCreate();
+
+            // 跳跃表是有序的, 逐个追加到 B+ 树的末尾
+            for (node = zs->zsl->header->level[0].forward; node;
+                 node = node->level[0].forward)
+            {
+                zbtInsert(zs->zbt,node->score,node->obj);
+                incrRefCount(node->obj);
+
+                // 字典的值改为直接保存分值
+                dictSetDoubleVal(dictFind(zs->dict,node->obj),node->score);
+            }
+
+            zslFree(zs->zsl);
+            zs->zsl = NULL;
+            zobj->encoding = REDIS_ENCODING_BTREE;
+            return;
+        }
 
         if (encoding != REDIS_ENCODING_ZIPLIST)
             redisPanic("Unknown target encoding");
 
-        zs = zobj->ptr;
+        // 创建 ziplist
+        unsigned char *zl = ziplistNew();
 
         // 释放字典
         dictRelease(zs->dict);
@@ -1639,11 +3147,72 @@ void zsetConvert(robj *zobj, int encoding) {
         // 绑定 ziplist
         zobj->ptr = zl;
 
+    // BTREE 转 SKIPLIST 或 ZIPLIST
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zbtreeIter it;
+        zbtreeEntry *e;
+
+        zs = zobj->ptr;
+        it.node = zs->zbt->head;
+        it.idx = 0;
+
+        if (encoding == REDIS_ENCODING_SKIPLIST) {
+            zs->zsl = zslCreate();
+
+            // 字典的值改为指向跳跃表节点中的分值
+            while (it.node) {
+                e = zbtIterEntry(&it);
+                node = zslInsert(zs->zsl,e->score,e->obj);
+                incrRefCount(e->obj);
+                dictGetVal(dictFind(zs->dict,e->obj)) = &node->score;
+                zbtIterNext(&it);
+            }
+
+            zbtFree(zs->zbt);
+            zs->zbt = NULL;
+            zobj->encoding = REDIS_ENCODING_SKIPLIST;
+
+        } else if (encoding == REDIS_ENCODING_ZIPLIST) {
+            unsigned char *zl = ziplistNew();
+
+            // 按顺序追加到 ziplist 末尾
+            while (it.node) {
+                e = zbtIterEntry(&it);
+                ele = getDecodedObject(e->obj);
+                zl = zzlInsertAt(zl,NULL,ele,e->score);
+                decrRefCount(ele);
+                zbtIterNext(&it);
+            }
+
+            dictRelease(zs->dict);
+            zbtFree(zs->zbt);
+            zfree(zs);
+
+            zobj->encoding = REDIS_ENCODING_ZIPLIST;
+            zobj->ptr = zl;
+
+        } else {
+            redisPanic("Unknown target encoding");
+        }
+
     } else {
         redisPanic("Unknown sorted set encoding");
     }
 }
 
+/**
+ * 如果开启了 BTREE 编码, 并且 SKIPLIST 编码的有序集合的成员数量
+ * 超过了 zset_btree_min_entries, 那么将它转换为 BTREE 编码
+ */
+void zsetTryConvertBtree(robj *zobj) {
+    if (zobj->encoding == REDIS_ENCODING_SKIPLIST &&
+        server.zset_btree_min_entries &&
+        zsetLength(zobj) > server.zset_btree_min_entries)
+    {
+        zsetConvert(zobj,REDIS_ENCODING_BTREE);
+    }
+}
+
 /*-------------------------- sorted set 命令 -----------------------------*/
 
 // ZADD 和 ZINCRBY 的通用函数
@@ -1803,11 +3372,64 @@ void zaddGenericCommand(redisClient *c, int incr) {
                 added++;
             }
 
+        // btree
+        } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+            zset *zs = zobj->ptr;
+            dictEntry *de;
+            ele = c->argv[3+j*2] = tryObjectEncoding(c->argv[3+j*2]);
+
+            // 查找元素
+            de = dictFind(zs->dict,ele);
+            if (de != NULL) {
+                // 元素已存在
+                curobj = dictGetKey(de);
+                curscore = dictGetDoubleVal(de);
+
+                // 计算 incr 后的分值, ZINCRBY时执行
+                if (incr) {
+                    score += curscore;
+                    if (isnan(score)) {
+                        addReplyError(c,nanerr);
+                        goto cleanup;
+                    }
+                }
+
+                // 更新元素, 先从 btree 删除旧元素, 再添加新元素
+                if (score != curscore) {
+                    if (!zbtDelete(zs->zbt,curscore,curobj))
+                        redisPanic("Sorted set member missing from btree");
+                    zbtInsert(zs->zbt,score,curobj);
+                    incrRefCount(curobj);
+
+                    // 更新字典中的分值
+                    dictSetDoubleVal(de,score);
+
+                    server.dirty++;
+                    updated++;
+                }
+
+            } else {
+                // 元素不存在, 添加到 btree 和字典
+                zbtInsert(zs->zbt,score,ele);
+                incrRefCount(ele);
+
+                de = dictAddRaw(zs->dict,ele);
+                redisAssertWithInfo(c,NULL,de != NULL);
+                dictSetDoubleVal(de,score);
+                incrRefCount(ele);
+
+                server.dirty++;
+                added++;
+            }
+
         } else {
             redisPanic("Unknown sorted set encoding");
         }
     }
 
+    // 成员数量较多时转换为 BTREE 编码
+    zsetTryConvertBtree(zobj);
+
     // 回复客户端
     if (incr) {
         addReplyDouble(c,score);
@@ -1898,6 +3520,35 @@ void zremCommand(redisClient *c) {
             }
         }
 
+    // btree
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de;
+
+        for (j = 2; j < c->argc; j++) {
+
+            de = dictFind(zs->dict,c->argv[j]);
+
+            if (de != NULL) {
+
+                deleted++;
+
+                // 删除 btree 和 dict 中的成员
+                if (!zbtDelete(zs->zbt,dictGetDoubleVal(de),c->argv[j]))
+                    redisPanic("Sorted set member missing from btree");
+                dictDelete(zs->dict,c->argv[j]);
+
+                // 检查是否需要缩小字典
+                if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+
+                // 删空了
+                if (dictSize(zs->dict) == 0) {
+                    dbDelete(c->db,key);
+                    break;
+                }
+            }
+        }
+
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -1985,23 +3636,46 @@ void zremrangeGenericCommand(redisClient *c, int rangetype) {
         }
 
         // 删空了
-        if (zzlLength(zobj->ptr) == 0) {
+        if (zzlLength(zobj->ptr) == 0) {
+            dbDelete(c->db,key);
+            keyremoved = 1;
+        }
+
+    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        zset *zs = zobj->ptr;
+
+        switch(rangetype){
+        case ZRANGE_RANK: 
+            deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict); 
+            break;
+        case ZRANGE_SCORE: 
+            deleted = zslDeleteRangeByScore(zs->zsl,&range,zs->dict); 
+            break;
+        case ZRANGE_LEX: 
+            deleted = zslDeleteRangeByLex(zs->zsl,&lexrange,zs->dict); 
+            break;
+        }
+
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+
+        // 删空了
+        if (dictSize(zs->dict) == 0) {
             dbDelete(c->db,key);
             keyremoved = 1;
         }
 
-    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
 
         switch(rangetype){
         case ZRANGE_RANK: 
-            deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict); 
+            deleted = zbtDeleteRangeByRank(zs->zbt,start+1,end+1,zs->dict); 
             break;
         case ZRANGE_SCORE: 
-            deleted = zslDeleteRangeByScore(zs->zsl,&range,zs->dict); 
+            deleted = zbtDeleteRangeByScore(zs->zbt,&range,zs->dict); 
             break;
         case ZRANGE_LEX: 
-            deleted = zslDeleteRangeByLex(zs->zsl,&lexrange,zs->dict); 
+            deleted = zbtDeleteRangeByLex(zs->zbt,&lexrange,zs->dict); 
             break;
         }
 
@@ -2108,6 +3782,13 @@ typedef struct {
                 // 当前跳跃表节点
                 zskiplistNode *node;
             } sl;
+            // btree 迭代器
+            struct {
+                // 被迭代的 zset
+                zset *zs;
+                // 当前 btree 成员
+                zbtreeIter it;
+            } bt;
         } zset;
     } iter;
 } zsetopsrc;
@@ -2183,6 +3864,11 @@ void zuiInitIterator(zsetopsrc *op) {
             it->sl.zs = op->subject->ptr;
             it->sl.node = it->sl.zs->zsl->header->level[0].forward;
 
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            it->bt.zs = op->subject->ptr;
+            it->bt.it.node = it->bt.zs->zbt->head;
+            it->bt.it.idx = 0;
+
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -2225,6 +3911,9 @@ void zuiClearIterator(zsetopsrc *op) {
         } else if (op->encoding == REDIS_ENCODING_SKIPLIST) {
             REDIS_NOTUSED(it);
 
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            REDIS_NOTUSED(it);
+
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -2239,15 +3928,13 @@ void zuiClearIterator(zsetopsrc *op) {
  */
 int zuiLength(zsetopsrc *op) {
     if (op->subject == NULL)
-        return;
+        return 0;
 
     // 集合
     if (op->type == REDIS_SET) {
 
-        iterset *it = &op->iter.set;
-
         if (op->encoding == REDIS_ENCODING_INTSET) {
-            return intsetLen(it->is.is);
+            return intsetLen(op->subject->ptr);
 
         } else if (op->encoding == REDIS_ENCODING_HT) {
             dict *ht = op->subject->ptr;
@@ -2260,14 +3947,16 @@ int zuiLength(zsetopsrc *op) {
     // 有序集合
     } else if (op->type == REDIS_ZSET) {
 
-        iterzset *it = &op->iter.zset;
-
         if (op->encoding == REDIS_ENCODING_ZIPLIST) {
-            return zzlLength(it->zl.zl);
+            return zzlLength(op->subject->ptr);
 
         } else if (op->encoding == REDIS_ENCODING_SKIPLIST) {
             zset *zs = op->subject->ptr;
-            return zs->zsl->level;
+            return zs->zsl->length;
+
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            zset *zs = op->subject->ptr;
+            return zs->zbt->length;
 
         } else {
             redisPanic("Unknown sorted set encoding");
@@ -2350,6 +4039,18 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             it->sl.node = it->sl.node->level[0].forward;
 
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            zbtreeEntry *e;
+
+            if (it->bt.it.node == NULL)
+                return 0;
+
+            e = zbtIterEntry(&it->bt.it);
+            val->ele = e->obj;
+            val->score = e->score;
+
+            zbtIterNext(&it->bt.it);
+
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -2357,6 +4058,8 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
     } else {
         redisPanic("Unsupported type");
     }
+
+    return 1;
 }
 
 /**
@@ -2493,13 +4196,24 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             zset *zs = op->subject->ptr;
             dictEntry *de;
             
-            if (dictFind(zs->dict,val->ele) != NULL) {
+            if ((de = dictFind(zs->dict,val->ele)) != NULL) {
                 *score = *(double*)dictGetVal(de);
                 return 1;
             } else {
                 return 0;
             }
 
+        } else if (op->encoding == REDIS_ENCODING_BTREE) {
+            zset *zs = op->subject->ptr;
+            dictEntry *de;
+
+            if ((de = dictFind(zs->dict,val->ele)) != NULL) {
+                *score = dictGetDoubleVal(de);
+                return 1;
+            } else {
+                return 0;
+            }
+
         } else {
             redisPanic("Unknown sorted set encoding");
         }
@@ -2543,6 +4257,356 @@ inline static void zunionInterAggregate(double *target, double val, int aggregat
 }
 
 
+/*
+ * 将 (obj, score) 追加到动态数组 entries 的末尾, 空间不足时容量翻倍
+ *
+ * 返回扩容后的数组
+ */
+static zsetEntry *zsetEntriesAppend(zsetEntry *entries, unsigned long *len, unsigned long *cap, robj *obj, double score) {
+    if (*len == *cap) {
+        *cap = *cap ? *cap*2 : 16;
+        entries = zrealloc(entries,sizeof(zsetEntry)*(*cap));
+    }
+    entries[*len].obj = obj;
+    entries[*len].score = score;
+    (*len)++;
+
+    return entries;
+}
+
+/*
+ * ZUNIONSTORE 和 ZINTERSTORE 有三种计算方式, 按输入的编码和基数选择:
+ *
+ * 1) 归并: 所有输入都是 intset 编码的集合时, 成员本身就是有序的整数,
+ *    对 k 个输入做一次 k 路归并即可, 不需要任何查找;
+ *
+ * 2) 探测: 遍历最小的输入, 用 zuiFind 在其余输入中查找每个成员,
+ *    只用于 ZINTERSTORE, 在最小的输入远小于其余输入时代价最低;
+ *
+ * 3) 哈希聚合: 将所有输入的成员依次放入一个开放寻址的临时哈希表中聚合分值,
+ *    表项直接引用输入集合内部的字符串或整数, 聚合过程中不为成员创建对象,
+ *    只有进入结果集的成员才会创建 (或者复用) 成员对象。
+ *
+ * 三种方式的结果都先保存到 zsetEntry 数组中, 最后排序并一次性载入目标有序集合。
+ */
+
+/*
+ * 哈希聚合使用的临时哈希表的表项
+ */
+typedef struct zuiAggEntry {
+
+    // 输入集合中已有的成员对象, 可以直接复用, 没有时为 NULL
+    robj *ele;
+
+    // 字符串成员, 指向输入集合内部的内存, 整数成员时为 NULL
+    unsigned char *str;
+    unsigned int len;
+
+    // 整数成员
+    long long ll;
+
+    // 哈希值
+    unsigned int hash;
+
+    // 包含该成员的输入数量, 为 0 表示空槽
+    int count;
+
+    // 聚合后的分值
+    double score;
+
+} zuiAggEntry;
+
+/*
+ * 开放寻址 (线性探测) 的临时哈希表
+ */
+typedef struct zuiAggTable {
+
+    // 槽数组, 大小为 2 的幂
+    zuiAggEntry *table;
+
+    // 槽数量
+    unsigned long size;
+
+    // 已使用的槽数量
+    unsigned long used;
+
+} zuiAggTable;
+
+/*
+ * 从 val 中取出聚合用的键
+ *
+ * 可以表示为整数的成员统一用整数表示,
+ * 这样 ziplist 里的整数和字典里的字符串 "10" 会被当作同一个成员
+ */
+static void zuiAggKeyFromValue(zsetopval *val, zuiAggEntry *key) {
+    key->ele = val->ele;
+    key->count = 0;
+    key->score = 0;
+
+    if (zuiLongLongFromValue(val)) {
+        key->str = NULL;
+        key->len = 0;
+        key->ll = val->ell;
+        key->hash = dictGenHashFunction(&key->ll,sizeof(key->ll));
+    } else {
+        if (val->ele != NULL) {
+            key->str = val->ele->ptr;
+            key->len = sdslen(val->ele->ptr);
+        } else {
+            key->str = val->estr;
+            key->len = val->elen;
+        }
+        key->hash = dictGenHashFunction(key->str,key->len);
+    }
+}
+
+static int zuiAggKeyEqual(zuiAggEntry *a, zuiAggEntry *b) {
+    if (a->hash != b->hash) return 0;
+    if (a->str == NULL || b->str == NULL)
+        return a->str == b->str && a->ll == b->ll;
+    return a->len == b->len && memcmp(a->str,b->str,a->len) == 0;
+}
+
+/*
+ * 创建一个至少能容纳 expected 个成员 (装载因子不超过 1/2) 的临时哈希表
+ */
+static void zuiAggInit(zuiAggTable *t, unsigned long expected) {
+    t->size = 16;
+    while (t->size < expected*2) t->size *= 2;
+    t->table = zcalloc(sizeof(zuiAggEntry)*t->size);
+    t->used = 0;
+}
+
+/*
+ * 槽数量翻倍, 按保存的哈希值重新放置所有表项
+ */
+static void zuiAggResize(zuiAggTable *t) {
+    zuiAggEntry *old = t->table;
+    unsigned long oldsize = t->size, i, idx;
+
+    t->size *= 2;
+    t->table = zcalloc(sizeof(zuiAggEntry)*t->size);
+    for (i = 0; i < oldsize; i++) {
+        if (old[i].count == 0) continue;
+        idx = old[i].hash & (t->size-1);
+        while (t->table[idx].count != 0) idx = (idx+1) & (t->size-1);
+        t->table[idx] = old[i];
+    }
+    zfree(old);
+}
+
+/*
+ * 在临时哈希表中查找 key
+ *
+ * 找到时返回表项;
+ * 未找到并且 create 为真时, 将 key 放入一个空槽并返回它, 此时表项的 count 为 0,
+ * 由调用者设置; 否则返回 NULL
+ */
+static zuiAggEntry *zuiAggLookup(zuiAggTable *t, zuiAggEntry *key, int create) {
+    unsigned long idx;
+
+    if (create && (t->used+1)*2 > t->size) zuiAggResize(t);
+
+    idx = key->hash & (t->size-1);
+    while (t->table[idx].count != 0) {
+        if (zuiAggKeyEqual(&t->table[idx],key)) return &t->table[idx];
+        idx = (idx+1) & (t->size-1);
+    }
+
+    if (!create) return NULL;
+
+    t->table[idx] = *key;
+    t->used++;
+    return &t->table[idx];
+}
+
+/*
+ * 哈希聚合
+ *
+ * ZUNIONSTORE 将所有输入的成员放入哈希表并聚合分值;
+ * ZINTERSTORE 先放入最小的输入, 之后每个输入只更新
+ * 在之前所有输入中都出现过的成员
+ *
+ * 返回结果数组, 长度写入 len
+ *
+ * T = O(N), N 为所有输入的基数之和
+ */
+static zsetEntry *zuiHashAggregate(zsetopsrc *src, long setnum, int op, int aggregate,
+                                   unsigned long *len, unsigned int *maxelelen)
+{
+    zuiAggTable t;
+    zuiAggEntry key, *e;
+    zsetopval zval;
+    zsetEntry *entries = NULL;
+    unsigned long i, cap = 0, expected = 0;
+    robj *tmp;
+    double score;
+    long j;
+
+    *len = 0;
+
+    // ZINTERSTORE 的结果不会多于最小的输入, ZUNIONSTORE 至少和最大的输入一样多
+    expected = zuiLength(&src[op == REDIS_OP_INTER ? 0 : setnum-1]);
+    zuiAggInit(&t,expected);
+
+    memset(&zval,0,sizeof(zval));
+    for (j = 0; j < setnum; j++) {
+        if (zuiLength(&src[j]) == 0) continue;
+
+        zuiInitIterator(&src[j]);
+        while (zuiNext(&src[j],&zval)) {
+            zuiAggKeyFromValue(&zval,&key);
+
+            score = src[j].weight * zval.score;
+            if (isnan(score)) score = 0;
+
+            if (op == REDIS_OP_UNION || j == 0) {
+                e = zuiAggLookup(&t,&key,1);
+                if (e->count == 0)
+                    e->score = score;
+                else
+                    zunionInterAggregate(&e->score,score,aggregate);
+
+            } else {
+                // 只有在前 j 个输入中都出现过的成员才可能在交集中
+                e = zuiAggLookup(&t,&key,0);
+                if (e == NULL || e->count != j) continue;
+                zunionInterAggregate(&e->score,score,aggregate);
+            }
+
+            // 记录可以复用的成员对象
+            if (e->ele == NULL) e->ele = key.ele;
+            e->count++;
+        }
+        zuiClearIterator(&src[j]);
+    }
+
+    // 取出结果, 只为结果集中的成员创建对象
+    for (i = 0; i < t.size; i++) {
+        e = &t.table[i];
+        if (e->count == 0) continue;
+        if (op == REDIS_OP_INTER && e->count != setnum) continue;
+
+        if (e->ele != NULL) {
+            tmp = e->ele;
+            incrRefCount(tmp);
+        } else if (e->str != NULL) {
+            tmp = createStringObject((char*)e->str,e->len);
+        } else {
+            tmp = createStringObjectFromLongLong(e->ll);
+        }
+
+        if (e->str != NULL && e->len > *maxelelen) *maxelelen = e->len;
+
+        entries = zsetEntriesAppend(entries,len,&cap,tmp,e->score);
+    }
+
+    zfree(t.table);
+    return entries;
+}
+
+/*
+ * 所有输入是否都是 intset 编码的集合 (或者不存在)
+ */
+static int zuiAllIntsets(zsetopsrc *src, long setnum) {
+    long j;
+
+    for (j = 0; j < setnum; j++) {
+        if (src[j].subject == NULL) continue;
+        if (src[j].type != REDIS_SET ||
+            src[j].encoding != REDIS_ENCODING_INTSET) return 0;
+    }
+    return 1;
+}
+
+/*
+ * 对 intset 编码的输入做 k 路归并
+ *
+ * 每一轮取出所有输入当前位置的最小值, 并推进所有等于该值的输入;
+ * ZINTERSTORE 中任意一个输入遍历完之后就可以结束
+ *
+ * T = O(N*K), K 为输入数量
+ */
+static zsetEntry *zuiMergeIntsets(zsetopsrc *src, long setnum, int op, int aggregate,
+                                  unsigned long *len)
+{
+    uint32_t *pos = zcalloc(sizeof(uint32_t)*setnum);
+    zsetEntry *entries = NULL;
+    unsigned long cap = 0;
+    int64_t min, v;
+    double score, value;
+    int found, count;
+    long j;
+
+    *len = 0;
+
+    while (1) {
+
+        // 所有输入当前位置的最小值
+        found = 0;
+        for (j = 0; j < setnum; j++) {
+            if (src[j].subject == NULL ||
+                !intsetGet(src[j].subject->ptr,pos[j],&v))
+            {
+                if (op == REDIS_OP_INTER) goto done;
+                continue;
+            }
+            if (!found || v < min) min = v;
+            found = 1;
+        }
+        if (!found) break;
+
+        // 聚合所有包含最小值的输入, 并推进它们的位置
+        count = 0;
+        score = 0;
+        for (j = 0; j < setnum; j++) {
+            if (src[j].subject == NULL ||
+                !intsetGet(src[j].subject->ptr,pos[j],&v) || v != min)
+                continue;
+
+            value = src[j].weight;
+            if (isnan(value)) value = 0;
+            if (count++ == 0)
+                score = value;
+            else
+                zunionInterAggregate(&score,value,aggregate);
+            pos[j]++;
+        }
+
+        if (op == REDIS_OP_UNION || count == setnum) {
+            entries = zsetEntriesAppend(entries,len,&cap,
+                createStringObjectFromLongLong(min),score);
+        }
+    }
+
+done:
+    zfree(pos);
+    return entries;
+}
+
+/*
+ * ZINTERSTORE 中探测是否比哈希聚合代价更低
+ *
+ * 探测: 最小输入的每个成员在其余输入中各查找一次,
+ *      ziplist 编码的输入每次查找都是线性的;
+ * 哈希聚合: 每个输入的每个成员各查找一次
+ */
+static int zuiProbeIsCheaper(zsetopsrc *src, long setnum) {
+    unsigned long probe = 0, scan = zuiLength(&src[0]);
+    unsigned long first = zuiLength(&src[0]), l;
+    long j;
+
+    for (j = 1; j < setnum; j++) {
+        l = zuiLength(&src[j]);
+        scan += l;
+        if (src[j].type == REDIS_ZSET && src[j].encoding == REDIS_ENCODING_ZIPLIST)
+            probe += first * l;
+        else
+            probe += first;
+    }
+    return probe <= scan;
+}
+
 void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     int i,j;
     long setnum;
@@ -2553,7 +4617,8 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     unsigned int maxelelen = 0;
     robj *dstobj;
     zset *dstzset;
-    zskiplistNode *znode;
+    zsetEntry *entries = NULL;
+    unsigned long nentries = 0, capacity = 0;
     int touched = 0;
 
     // 提取 numkeys 参数
@@ -2651,8 +4716,15 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     dstzset = dstobj->ptr;
     memset(&zval,0,sizeof(zval));
 
-    // ZINTERSTORE 命令
-    if (op == REDIS_OP_INTER) {
+    if (op != REDIS_OP_INTER && op != REDIS_OP_UNION)
+        redisPanic("Unknown operator");
+
+    // 全部是 intset: 归并
+    if (zuiAllIntsets(src,setnum)) {
+        entries = zuiMergeIntsets(src,setnum,op,aggregate,&nentries);
+
+    // ZINTERSTORE 并且最小的输入足够小: 探测
+    } else if (op == REDIS_OP_INTER && zuiProbeIsCheaper(src,setnum)) {
 
         if (zuiLength(&src[0]) > 0) {
 
@@ -2688,10 +4760,8 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
                     // 取出成员
                     tmp = zuiObjectFromValue(&zval);
 
-                    // 添加节点
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    incrRefCount(tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
+                    // 暂存节点, 最后排序后一次性载入
+                    entries = zsetEntriesAppend(entries,&nentries,&capacity,tmp,score);
                     incrRefCount(tmp);
 
                     // 最长字符串
@@ -2704,60 +4774,19 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
             zuiClearIterator(&src[0]);
         }
 
-    // ZUNIONSTORE 命令
-    } else if (op == REDIS_OP_UNION) {
-
-        // 遍历集合
-        for (i = 0; i < setnum; i++) {
-
-            // 跳过空集合
-            if (zuiLength(&src[i]) == 0) continue;
-
-            // 遍历节点
-            zuiInitIterator(&src[i]);
-            while (zuiNext(&src[i],&zval)) {
-                double score, value;
-
-                // 跳过已处理元素
-                if (dictFind(dstzset->dict,zuiObjectFromValue(&zval)) != NULL)
-                    continue;
-
-                score = zval.score * src[i].weight;
-                if (isnan(score)) score = 0;
-
-                // 相同节点, 进行聚合计算
-                for (j = (i+1); j < setnum; j++) {
-                    if (src[j].subject == src[i].subject) {
-                        value = zval.score * src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-
-                    } else if (zuiFind(&src[j],&zval,&value)) {
-                        value *= src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    }
-                }
-
-                // 存储节点
-                tmp = zuiObjectFromValue(&zval);
-
-                znode = zslInsert(dstzset->zsl,score,tmp);
-                incrRefCount(zval.ele);
-                dictAdd(dstzset->dict,tmp,&znode->score);
-                incrRefCount(zval.ele);
-
-                // 更新最大字符串长度
-                if (sdsEncodedObject(tmp)) {
-                    if (sdslen(tmp->ptr) > maxelelen)
-                        maxelelen = sdslen(tmp->ptr);
-                }
-            }
-            zuiClearIterator(&src[i]);
-        }
-
+    // 其他情况: 哈希聚合
     } else {
-        redisPanic("Unknown operator");
+        entries = zuiHashAggregate(src,setnum,op,aggregate,&nentries,&maxelelen);
     }
 
+    // 结果集排序后一次性载入, 足够大时直接使用 BTREE 编码
+    zsetSortEntries(entries,nentries);
+    if (server.zset_btree_min_entries &&
+        nentries > server.zset_btree_min_entries)
+        zsetConvert(dstobj,REDIS_ENCODING_BTREE);
+    zsetBulkLoad(dstzset,entries,nentries);
+    zfree(entries);
+
     // 删除已存在的 dstkey
     if (dbDelete(c->db,dstkey)) {
         signalModifiedKey(c->db,dstkey);
@@ -2766,12 +4795,14 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     }
 
     // 关联结果集
-    if (dstzset->zsl->length) {
+    if (zsetLength(dstobj)) {
 
         // 是否转码
-        if (dstzset->zsl->length <= server.zset_max_ziplist_entries &&
+        if (zsetLength(dstobj) <= server.zset_max_ziplist_entries &&
             maxelelen <= server.zset_max_ziplist_value)
                 zsetConvert(dstobj,REDIS_ENCODING_ZIPLIST);
+        else
+            zsetTryConvertBtree(dstobj);
 
         // 关联数据库
         dbAdd(c->db,dstkey,dstobj);
@@ -2802,47 +4833,18 @@ void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
 
 /*-------------------------- uninstore interstore 命令 -----------------------------*/
 
-void zrangeGenericCommand(redisClient *c, int reverse) {
-    robj *key = c->argv[1];
-    robj *zobj;
-    int withscores = 0;
-    long start, end;
-    int llen, rangelen;
-
-    // 取范围
-    if ((getLongFromObjectOrReply(c,c->argv[2],&start,NULL) != REDIS_OK) ||
-        (getLongFromObjectOrReply(c,c->argv[3],&end,NULL) != REDIS_OK))
-        return;
-
-    // 是否带分值
-    if (c->argc == 5 && !strcasecmp(c->argv[4]->ptr,"withscores")) {
-        withscores = 1;
-    } else if (c->argc >= 5) {
-        addReply(c,shared.syntaxerr);
-        return;
-    }
-
-    // 取出有序集合对象
-    if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk) == NULL ||
-        checkType(c,zobj,REDIS_ZSET))) return;
-
-    // 清洗索引,计算索引长度
-    llen = zsetLength(zobj);
-    if (start < 0) start += llen;
-    if (end < 0) end += llen;
-    if (start < 0) start = 0;
-
-    if (start > end || start >= llen) {
-        addReply(c,shared.outofrangeerr);
-        return;
-    }
-    
-    if (end >= llen) end = llen-1;
-    rangelen = (end-start)+1;
-
-    
-    // 取出范围内的节点, 发送给客户端
-    addReplyMultiBulkLen(c, withscores ? (rangelen*2) : rangelen);
+/*
+ * 从排位为 start (从 0 开始) 的成员开始,
+ * 向后 (reverse 为真时向前) 回复 count 个成员, withscores 为真时同时回复分值
+ *
+ * 调用者需要先写出回复的长度, 并确保 count 个成员都存在。
+ * 成员直接从 ziplist 或排序结构写入回复, 不创建临时对象。
+ *
+ * T = O(log(N)+M), M 为 count
+ */
+static void zsetReplyRankRange(redisClient *c, robj *zobj, unsigned long start,
+                               unsigned long count, int reverse, int withscores)
+{
     // ziplist
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *zl = zobj->ptr;
@@ -2850,26 +4852,24 @@ void zrangeGenericCommand(redisClient *c, int reverse) {
         unsigned char *vstr;
         unsigned int vlen;
         long long vlong;
+        char buf[32];
 
         // 起始节点的成员和分值
-        if (reverse)
-            eptr = ziplistIndex(zl,-2-(start*2));
-        else 
-            eptr = ziplistIndex(zl,start*2);
-        
+        eptr = zzlSeekRank(zl,start);
         redisAssertWithInfo(c,zobj,eptr != NULL);
         sptr = ziplistNext(zl,eptr);
 
         // 遍历取节点
-        while (rangelen--) {
+        while (count--) {
             redisAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
             redisAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
 
-            // 回复客户端
+            // 回复客户端, 整数成员在栈上转换成字符串
             if (vstr) {
                 addReplyBulkCBuffer(c,vstr,vlen);
             } else {
-                addReplyLongLong(c,vlong);
+                vlen = ll2string(buf,sizeof(buf),vlong);
+                addReplyBulkCBuffer(c,buf,vlen);
             }
 
             if (withscores)
@@ -2882,38 +4882,59 @@ void zrangeGenericCommand(redisClient *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
         }
 
-
     // skiplist
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
         zskiplistNode *ln;
-        robj *ele;
 
-        // 起始节点
-        if (reverse) {
-            ln = zsl->tail;
-            if (start > 0)
-                ln = zslGetElementByRank(zsl,llen-start);
-        } else {
+        // 起始节点, 两端的节点不需要查找
+        if (start == 0)
             ln = zsl->header->level[0].forward;
-            if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
-        }
+        else if (start == zsl->length-1)
+            ln = zsl->tail;
+        else
+            ln = zslGetElementByRank(zsl,start+1);
 
         // 遍历节点
-        while (rangelen--) {
+        while (count--) {
             redisAssertWithInfo(c,zobj,ln != NULL);
 
             // 回复客户端
-            ele = ln->obj;
-            addReplyBulk(c,ele);
+            addReplyBulk(c,ln->obj);
+
+            if (withscores)
+                addReplyDouble(c,ln->score);
+
+            // 下一个节点
+            ln = reverse ? ln->backward : ln->level[0].forward;
+        }
+
+    // btree
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        zbtreeEntry *e;
+
+        // 起始成员, 按排位直接定位
+        zbtGetElementByRank(zs->zbt,start+1,&it);
+
+        // 遍历成员
+        while (count--) {
+            redisAssertWithInfo(c,zobj,it.node != NULL);
+
+            // 回复客户端
+            e = zbtIterEntry(&it);
+            addReplyBulk(c,e->obj);
 
             if (withscores)
-                addReplyLongLong(c,ln->score);
+                addReplyDouble(c,e->score);
 
-            // 下一个节点
-            ln = reverse ? ln->backward : ln->level[0].forward;
+            // 下一个成员
+            if (reverse)
+                zbtIterPrev(&it);
+            else
+                zbtIterNext(&it);
         }
 
     } else {
@@ -2921,6 +4942,71 @@ void zrangeGenericCommand(redisClient *c, int reverse) {
     }
 }
 
+/*
+ * 范围内成员的排位为 [first, last] 时, 根据 LIMIT 的 offset 和 limit
+ * 计算需要回复的成员数量, 并将第一个要回复的成员的排位写入 start
+ *
+ * offset 为负数时不回复任何成员, limit 为负数时不限制数量
+ */
+static unsigned long zsetLimitRange(unsigned long first, unsigned long last,
+                                    long offset, long limit, int reverse,
+                                    unsigned long *start)
+{
+    unsigned long count = last - first + 1;
+
+    if (offset < 0 || (unsigned long)offset >= count) return 0;
+
+    count -= offset;
+    if (limit >= 0 && (unsigned long)limit < count) count = limit;
+
+    *start = reverse ? last - offset : first + offset;
+    return count;
+}
+
+void zrangeGenericCommand(redisClient *c, int reverse) {
+    robj *key = c->argv[1];
+    robj *zobj;
+    int withscores = 0;
+    long start, end;
+    int llen, rangelen;
+
+    // 取范围
+    if ((getLongFromObjectOrReply(c,c->argv[2],&start,NULL) != REDIS_OK) ||
+        (getLongFromObjectOrReply(c,c->argv[3],&end,NULL) != REDIS_OK))
+        return;
+
+    // 是否带分值
+    if (c->argc == 5 && !strcasecmp(c->argv[4]->ptr,"withscores")) {
+        withscores = 1;
+    } else if (c->argc >= 5) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    // 取出有序集合对象
+    if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
+        checkType(c,zobj,REDIS_ZSET)) return;
+
+    // 清洗索引,计算索引长度
+    llen = zsetLength(zobj);
+    if (start < 0) start += llen;
+    if (end < 0) end += llen;
+    if (start < 0) start = 0;
+
+    if (start > end || start >= llen) {
+        addReply(c,shared.outofrangeerr);
+        return;
+    }
+    
+    if (end >= llen) end = llen-1;
+    rangelen = (end-start)+1;
+
+    // 取出范围内的节点, 发送给客户端
+    addReplyMultiBulkLen(c, withscores ? (rangelen*2) : rangelen);
+    zsetReplyRankRange(c,zobj,reverse ? llen-1-start : start,rangelen,
+        reverse,withscores);
+}
+
 void zrangeCommand(redisClient *c) {
     zrangeGenericCommand(c,0);
 }
@@ -2935,8 +5021,7 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse) {
     robj *zobj;
     long offset = 0, limit = -1;
     int withscores  = 0;
-    unsigned long rangelen = 0;
-    void *replylen = NULL;
+    unsigned long rangelen, first, last, start;
     int minidx, maxidx;
 
     // 确定 min 和 max 的位置, 因为 ZRANGEBYSCORE 和 ZREVRANGEBYSCORE
@@ -2979,133 +5064,55 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptymultibulk)) == NULL ||
         checkType(c,zobj,REDIS_ZSET)) return;
 
-    // 提取范围内节点, 回复客户端
-    // ziplist
+    // 先通过排位算出范围内成员的数量 (排位从 0 开始),
+    // 这样可以直接写出回复的长度, 并按排位直接跳过 offset 个成员
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *zl = zobj->ptr;
-        unsigned char *eptr, *sptr;
-        unsigned char *vstr;
-        unsigned int vlen;
-        long long vlong;
-        double score;
 
-        // 起始节点
-        if (reverse)
-            eptr = zzlLastInRange(zl,&range);
-        else
-            eptr = zzlFirstInRange(zl,&range);
-
-        if (eptr == NULL) {
+        if (zzlFirstInRangeWithRank(zl,&range,&first) == NULL) {
             addReply(c,shared.emptymultibulk);
             return;
         }
-        redisAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
-
-        replylen = addDeferredMultiBulkLength(c);
-
-        // 跳过 offset 节点
-        while (eptr && offset--) {
-            if (reverse)
-                zzlPrev(zl,&eptr,&sptr);
-            else
-                zzlNext(zl,&eptr,&sptr);
-        }
-
-        // 提取节点
-        while (eptr && limit--) {
-
-            score = zzlGetScore(sptr);
-
-            // 范围检查
-            if (reverse) {
-                if (!zslValueGteMin(score,&range)) break;
-            } else {
-                if (!zslValueLteMax(score,&range)) break;
-            }
-
-            // 回复客户端
-            redisAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
-            rangelen++;
-
-            if (vstr) {
-                addReplyBulkCBuffer(c,vstr,vlen);
-            } else {
-                addReplyLongLong(c,vlong);
-            }
-
-            if (withscores)
-                addReplyDouble(c,score);
-            
-            // 处理下一个节点
-            if (reverse)
-                zzlPrev(zl,&eptr,&sptr);
-            else
-                zzlNext(zl,&eptr,&sptr);
+        zzlLastInRangeWithRank(zl,&range,&last);
 
-        }
-
-    // skiplist
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
         zskiplistNode *ln;
 
-        // 起始节点
-        if (reverse) {
-            ln = zslLastInRange(zsl,&range);
-        } else {
-            ln = zslFirstInRange(zsl,&range);
-        }
-
-        if (ln == NULL) {
+        if ((ln = zslFirstInRange(zsl,&range)) == NULL) {
             addReply(c,shared.emptymultibulk);
             return;
         }
+        first = zslGetRank(zsl,ln->score,ln->obj)-1;
+        ln = zslLastInRange(zsl,&range);
+        last = zslGetRank(zsl,ln->score,ln->obj)-1;
 
-        replylen = addDeferredMultiBulkLength(c);
-
-        // 跳过 offset 节点
-        while (ln && offset--) {
-            if (reverse)
-                ln = ln->backward;
-            else
-                ln = ln->level[0].forward;
-        }
-
-        // 提取节点
-        while (ln && limit--) {
-
-            // 范围检查
-            if (reverse) {
-                if (!zslValueGteMin(ln->score,&range)) break;
-            } else {
-                if (!zslValueLteMax(ln->score,&range)) break;
-            }
-
-            rangelen++;
-
-            // 回复客户端
-            addReplyBulk(c,ln->obj);
-
-            if (withscores)
-                addReplyDouble(c,ln->score);
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
 
-            // 处理下一个节点
-            if (reverse)
-                ln = ln->backward;
-            else
-                ln = ln->level[0].forward;
+        if ((first = zbtFirstInRange(zs->zbt,&range,&it)) == 0) {
+            addReply(c,shared.emptymultibulk);
+            return;
         }
+        first--;
+        last = zbtLastInRange(zs->zbt,&range,&it)-1;
 
     } else {
         redisPanic("Unknown sorted set encoding");
     }
 
-    if (withscores)
-        rangelen *= 2;
+    // 应用 LIMIT
+    rangelen = zsetLimitRange(first,last,offset,limit,reverse,&start);
+    if (rangelen == 0) {
+        addReply(c,shared.emptymultibulk);
+        return;
+    }
 
-    setDeferredMultiBulkLength(c, replylen, rangelen);
+    // 回复客户端
+    addReplyMultiBulkLen(c, withscores ? (rangelen*2) : rangelen);
+    zsetReplyRankRange(c,zobj,start,rangelen,reverse,withscores);
 }
 
 // ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
@@ -3138,38 +5145,17 @@ void zcountCommand(redisClient *c) {
     // 计算范围内节点数量
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
         unsigned char *zl = zobj->ptr;
-        unsigned char *eptr, *sptr;
-        double score;
-
-        // 起始节点
-        eptr = zzlFirstInRange(zl,&range);
+        unsigned long first, last;
 
-        if (eptr == NULL) {
+        // 起始节点和结束节点的排位相减,
+        // 有稀疏索引时两次查找都只需遍历常数个节点
+        if (zzlFirstInRangeWithRank(zl,&range,&first) == NULL) {
             addReply(c,shared.czero);
             return;
         }
-
-        sptr = ziplistNext(zl,eptr);
-        score = zzlGetScore(sptr);
-        redisAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
-
-        // 遍历到结束节点
-        while (eptr) {
-            score = zzlGetScore(sptr);
-            // 超出范围
-            if (!zslValueLteMax(score,&range)) {
-                break;
-            
-            // 未超出范围
-            } else {
-                // 统计节点数量
-                count++;
-
-                // 指向下一个节点
-                zzlNext(zl,&eptr,&sptr);
-            }
-        }
-        
+        if (zzlLastInRangeWithRank(zl,&range,&last) == NULL)
+            redisPanic("Range has a first element but no last element");
+        count = last - first + 1;
 
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
@@ -3200,6 +5186,17 @@ void zcountCommand(redisClient *c) {
             }
         }
 
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        unsigned long first, last;
+
+        // 起始成员和结束成员的排位相减
+        if ((first = zbtFirstInRange(zs->zbt,&range,&it)) != 0) {
+            last = zbtLastInRange(zs->zbt,&range,&it);
+            count = last - first + 1;
+        }
+
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -3287,6 +5284,17 @@ void zlexcountCommand(redisClient *c) {
             }
         }
 
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        unsigned long first, last;
+
+        // 起始成员和结束成员的排位相减
+        if ((first = zbtFirstInLexRange(zs->zbt,&range,&it)) != 0) {
+            last = zbtLastInLexRange(zs->zbt,&range,&it);
+            count = last - first + 1;
+        }
+
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -3302,8 +5310,7 @@ void genericZrangebylexCommand(redisClient *c, int reverse) {
     robj *key = c->argv[1];
     robj *zobj;
     long offset = 0, limit = -1;
-    unsigned long rangelen = 0;
-    void *replylen = NULL;
+    unsigned long rangelen, first, last, start;
     int minidx, maxidx;
 
     // min 和 max 的位置
@@ -3345,120 +5352,58 @@ void genericZrangebylexCommand(redisClient *c, int reverse) {
         return;
     }
 
-    // 取出范围内的节点, 返回给客户端
+    // 先通过排位算出范围内成员的数量 (排位从 0 开始),
+    // 这样可以直接写出回复的长度, 并按排位直接跳过 offset 个成员
     if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
-        unsigned char *zl = zobj->ptr;
-        unsigned char *eptr, *sptr;
-        unsigned char *vstr;
-        unsigned int vlen;
-        long long vlong;
 
-        // 起始节点
-        if (reverse) {
-            eptr = zzlLastInLexRange(zl,&range);
-        } else {
-            eptr = zzlFirstInLexRange(zl,&range);
-        }
-        if (eptr == NULL) {
+        if (!zzlLexRangeRanks(zobj->ptr,&range,&first,&last)) {
             addReply(c,shared.emptymultibulk);
             zslFreeLexRange(&range);
             return;
         }
-        redisAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
-        
-        replylen = addDeferredMultiBulkLength(c);
-
-        // 跳过 offset
-        while (eptr && offset--) {
-            if (reverse) {
-                zzlPrev(zl,&eptr,&sptr);
-            } else {
-                zzlNext(zl,&eptr,&sptr);
-            }
-        }
-
-        // 提取节点, 并回复客户端
-        while (eptr && limit--) {
-            // 超出范围, 退出
-            if (reverse) {
-                if (!zzlLexValueGteMin(eptr,&range)) break;
-            } else {
-                if (!zzlLexValueLteMax(eptr,&range)) break;
-            }
-
-            // 回复客户端
-            redisAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
-            rangelen++;
-            if (vstr) {
-                addReplyBulkCBuffer(c,vstr,vlen);
-            } else {
-                addReplyLongLong(c,vlong);
-            }
-
-            // 下一个节点
-            if (reverse) {
-                zzlPrev(zl,&eptr,&sptr);
-            } else {
-                zzlNext(zl,&eptr,&sptr);
-            }
-        }
 
     } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
         zskiplistNode *zn;
 
-        // 起始节点
-        if (reverse) {
-            zn = zslLastInLexRange(zsl,&range);
-        } else {
-            zn = zslFirstInLexRange(zsl,&range);
-        }
-        if (zn == NULL) {
+        if ((zn = zslFirstInLexRange(zsl,&range)) == NULL) {
             addReply(c,shared.emptymultibulk);
             zslFreeLexRange(&range);
             return;
         }
+        first = zslGetRank(zsl,zn->score,zn->obj)-1;
+        zn = zslLastInLexRange(zsl,&range);
+        last = zslGetRank(zsl,zn->score,zn->obj)-1;
 
-        replylen = addDeferredMultiBulkLength(c);
-
-        // 跳过节点
-        while (zn && offset--) {
-            if (reverse) {
-                zn = zn->backward;
-            } else {
-                zn = zn->level[0].forward;
-            }
-        }
-
-        // 范围内节点, 回复客户端
-        while (zn && limit--) {
-            // 节点超范围, 退出
-            if (reverse) {
-                if (!zslLexValueGteMin(zn->obj,&range)) break;
-            } else {
-                if (!zslLexValueLteMax(zn->obj,&range)) break;
-            }
-
-            rangelen++;
-            // 成员发送给客户端
-            addReplyBulk(c,zn->obj);
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
 
-            // 下一个节点
-            if (reverse) {
-                zn = zn->backward;
-            } else {
-                zn = zn->level[0].forward;
-            }
+        if ((first = zbtFirstInLexRange(zs->zbt,&range,&it)) == 0) {
+            addReply(c,shared.emptymultibulk);
+            zslFreeLexRange(&range);
+            return;
         }
+        first--;
+        last = zbtLastInLexRange(zs->zbt,&range,&it)-1;
 
     } else {
         redisPanic("Unknown sorted set encoding");
     }
 
     zslFreeLexRange(&range);
-    setDeferredMultiBulkLength(c, replylen, rangelen);
+
+    // 应用 LIMIT
+    rangelen = zsetLimitRange(first,last,offset,limit,reverse,&start);
+    if (rangelen == 0) {
+        addReply(c,shared.emptymultibulk);
+        return;
+    }
+
+    // 回复客户端
+    addReplyMultiBulkLen(c,rangelen);
+    zsetReplyRankRange(c,zobj,start,rangelen,reverse,0);
 }
 
 // ZRANGEBYLEX key min max [LIMIT offset count]
@@ -3519,6 +5464,20 @@ void zscoreCommand(redisClient *c) {
             addReply(c,shared.nullbulk);
         }
 
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de;
+
+        c->argv[2] = tryObjectEncoding(c->argv[2]);
+
+        // BTREE 编码的字典直接保存分值
+        de = dictFind(zs->dict,c->argv[2]);
+        if (de != NULL) {
+            addReplyDouble(c,dictGetDoubleVal(de));
+        } else {
+            addReply(c,shared.nullbulk);
+        }
+
     } else {
         redisPanic("Unknown sorted set encoding");
     }
@@ -3599,6 +5558,31 @@ void zrankGenericCommand(redisClient *c, int reverse) {
             addReply(c,shared.nullbulk);
         }
 
+    } else if (zobj->encoding == REDIS_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        dictEntry *de;
+
+        // 获取成员
+        ele = c->argv[2] = tryObjectEncoding(c->argv[2]);
+        de = dictFind(zs->dict,ele);
+
+        if (de != NULL) {
+
+            // 通过内部节点记录的子树成员数量计算排位
+            rank = zbtGetRank(zs->zbt,dictGetDoubleVal(de),ele);
+            redisAssertWithInfo(c,ele,rank);
+
+            // 回复客户端
+            if (reverse) {
+                addReplyLongLong(c,llen-rank);
+            } else {
+                addReplyLongLong(c,rank-1);
+            }
+
+        } else {
+            addReply(c,shared.nullbulk);
+        }
+
     } else {
         redisPanic("Unknwon sorted set encoding");
     }
@@ -777,6 +777,128 @@ static unsigned char *__ziplistInsert(unsigned char *zl, unsigned char *p, unsig
     return zl;
 }
 
+/**
+ * 根据指针 p 所指定的位置, 一次性添加 num 个字符串 s[i] (长度为 slen[i])
+ * reverse 为 0 时新节点按 s[0], s[1], ... 的顺序排列, 为 1 时按相反的顺序排列
+ *
+ * 效果等同于多次调用 __ziplistInsert, 但是只重分配一次内存,
+ * 只移动一次 p 之后的节点, 也只检查一次连锁更新
+ *
+ * 返回添加完节点的压缩列表
+ *
+ * T = O(N+M), M 为新节点的总长度
+ */
+static unsigned char *__ziplistInsertMulti(unsigned char *zl, unsigned char *p,
+                                           unsigned char **s, unsigned int *slen,
+                                           unsigned int num, int reverse) {
+
+    size_t curlen = intrev32ifbe(ZIPLIST_BYTES(zl)), reqlen = 0, prevlen = 0;
+    size_t offset, firstprevlen, lastlen = 0;
+    unsigned char encoding = 0;
+    int nextdiff = 0;
+    unsigned int i, j, len;
+    long long value = 123456789;
+
+    zlentry tail;
+
+    if (num == 0) return zl;
+
+    // 获取前置节点长度, 与 __ziplistInsert 相同
+    if (p[0] != ZIP_END) {
+        prevlen = zipEntry(p).prevrawlen;
+    } else {
+        unsigned char *ptail = ZIPLIST_ENTRY_TAIL(zl);
+        if (ptail[0] != ZIP_END) {
+            prevlen = zipRawEntryLength(ptail);
+        }
+    }
+    firstprevlen = prevlen;
+
+    // 第一遍: 按新节点的排列顺序计算每个节点的长度
+    // 每个新节点都是下一个新节点的前置节点
+    for (i = 0; i < num; i++) {
+        j = reverse ? num-1-i : i;
+
+        if (zipTryEncoding(s[j],slen[j],&value,&encoding)) {
+            len = zipIntSize(encoding);
+        } else {
+            encoding = 0;
+            len = slen[j];
+        }
+        len += zipPrevEncodeLength(NULL, prevlen);
+        len += zipEncodeLength(NULL, encoding, slen[j]);
+
+        reqlen += len;
+        prevlen = lastlen = len;
+    }
+
+    // p 指向的节点的前置节点变为最后一个新节点
+    nextdiff = (p[0] != ZIP_END) ? zipPrevLenByteDiff(p,lastlen) : 0;
+
+    // 只扩容一次
+    offset = p - zl;
+    zl = ziplistResize(zl, curlen+reqlen+nextdiff);
+    p = zl + offset;
+
+    if (p[0] != ZIP_END) {
+        // 移动 p 之后的节点, 腾出新节点的空间
+        memmove(p+reqlen,p-nextdiff,curlen-offset-1+nextdiff);
+
+        // 将最后一个新节点的长度编码到其后置节点
+        zipPrevEncodeLength(p+reqlen, lastlen);
+
+        // 更新到达列表尾节点偏移量
+        ZIPLIST_TAIL_OFFSET(zl) =
+            intrev32ifbe(intrev32ifbe(ZIPLIST_TAIL_OFFSET(zl))+reqlen);
+
+        tail = zipEntry(p+reqlen);
+        if (p[reqlen+tail.headersize+tail.len] != ZIP_END) {
+            ZIPLIST_TAIL_OFFSET(zl) =
+                intrev32ifbe(intrev32ifbe(ZIPLIST_TAIL_OFFSET(zl))+nextdiff);
+        }
+
+    } else {
+        // 最后一个新节点是尾节点
+        ZIPLIST_TAIL_OFFSET(zl) = intrev32ifbe(p+reqlen-lastlen-zl);
+    }
+
+    // 检查 "连锁更新"
+    if (nextdiff != 0) {
+        offset = p - zl;
+        zl = __ziplistCascadeUpdate(zl, p+reqlen);
+        p = zl + offset;
+    }
+
+    // 第二遍: 依次写入新节点
+    prevlen = firstprevlen;
+    for (i = 0; i < num; i++) {
+        unsigned char *start = p;
+        j = reverse ? num-1-i : i;
+
+        if (!zipTryEncoding(s[j],slen[j],&value,&encoding)) encoding = 0;
+
+        p += zipPrevEncodeLength(p,prevlen);
+        p += zipEncodeLength(p, encoding, slen[j]);
+        if (ZIP_IS_STR(encoding)) {
+            memcpy(p, s[j], slen[j]);
+            p += slen[j];
+        } else {
+            zipSaveInteger(p, value, encoding);
+            p += zipIntSize(encoding);
+        }
+        prevlen = p - start;
+    }
+
+    // 更新列表的节点计数器, 超出 UINT16_MAX 时需要遍历才能得到节点数
+    if (intrev16ifbe(ZIPLIST_LENGTH(zl)) < UINT16_MAX) {
+        len = intrev16ifbe(ZIPLIST_LENGTH(zl)) + num;
+        if (len > UINT16_MAX) len = UINT16_MAX;
+        ZIPLIST_LENGTH(zl) = intrev16ifbe(len);
+    }
+
+    return zl;
+}
+
 /**
  * 从位置 p 开始, 连续删除 num 个节点
  * 返回删除后的压缩列表
@@ -842,7 +964,7 @@ static unsigned char *__ziplistDelete(unsigned char *zl, unsigned char *p, unsig
 
         // 释放删除的节点的内容空间
         offset = first.p - zl;
-        ziplistResize(zl, intrev32ifbe(ZIPLIST_BYTES(zl))-totlen+nextdiff);
+        zl = ziplistResize(zl, intrev32ifbe(ZIPLIST_BYTES(zl))-totlen+nextdiff);
         ZIPLIST_INCR_LENGTH(zl, -deleted);
         p = zl + offset;
 
@@ -903,6 +1025,27 @@ unsigned char *ziplistPush(unsigned char *zl,unsigned char *s,unsigned int slen,
     return __ziplistInsert(zl,p,s,slen);
 }
 
+/**
+ * 将 num 个字符串 s[i] (长度为 slen[i]) 依次添加到压缩列表中
+ *
+ * 结果与按顺序对每个值调用 ziplistPush 相同:
+ * ZIPLIST_HEAD 时 s[num-1] 成为表头节点, ZIPLIST_TAIL 时 s[num-1] 成为表尾节点
+ * 但是整个过程只重分配一次内存
+ *
+ * 返回值为添加新值后的压缩列表
+ *
+ * T = O(N+M)
+ */
+unsigned char *ziplistPushMulti(unsigned char *zl, unsigned char **s, unsigned int *slen,
+                                unsigned int num, int where) {
+
+    unsigned char *p;
+    p = (where == ZIPLIST_HEAD) ? ZIPLIST_ENTRY_HEAD(zl) : ZIPLIST_ENTRY_END(zl);
+
+    // 表头添加时, 最后一个值位于最前面
+    return __ziplistInsertMulti(zl,p,s,slen,num,where == ZIPLIST_HEAD);
+}
+
 /**
  * 返回给定索引对应的指针
  * 正索引, 从表头向表尾遍历, >=0 为正索引
@@ -1192,6 +1335,108 @@ unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int v
     return NULL;
 }
 
+/**
+ * 删除压缩列表中所有值与 s 相等的节点, 最多删除 limit 个, limit 为 0 表示不限
+ * fromtail 为真时, 优先删除靠近表尾的节点
+ * 被删除的节点数量保存在 *deleted 中
+ *
+ * 和逐个调用 ziplistDelete 不同, 这里只做两次遍历:
+ * 第一次统计匹配节点数量, 第二次把保留的节点复制到新的压缩列表,
+ * 并重新编码每个保留节点的 prevlen , 避免多次 memmove 和连锁更新
+ *
+ * 没有匹配的节点时, 原样返回 zl
+ *
+ * T = O(N)
+ */
+unsigned char *ziplistDeleteMatching(unsigned char *zl, unsigned char *s, unsigned int slen,
+                                     unsigned int limit, int fromtail, unsigned int *deleted) {
+
+    unsigned char *p, *q, *w, *nzl, *lastp = NULL;
+    unsigned int matches = 0, first, last, idx, ndel, nlen, rawlen, prevlen = 0;
+    size_t curlen = intrev32ifbe(ZIPLIST_BYTES(zl)), newlen;
+    unsigned char vencoding = 0;
+    long long vll = 0;
+    zlentry entry;
+
+    *deleted = 0;
+
+    // 只对 s 做一次整数编码尝试
+    if (!zipTryEncoding(s,slen,&vll,&vencoding)) vencoding = 0;
+
+// 判断节点 entry 的值是否和 s 相等
+#define ZIP_ENTRY_MATCH(entry) \
+    (ZIP_IS_STR((entry).encoding) ? \
+        ((entry).len == slen && \
+         memcmp((entry).p+(entry).headersize,s,slen) == 0) : \
+        (vencoding != 0 && \
+         zipLoadInteger((entry).p+(entry).headersize,(entry).encoding) == vll))
+
+    // 第一次遍历: 统计匹配节点数量
+    p = ZIPLIST_ENTRY_HEAD(zl);
+    while (p[0] != ZIP_END) {
+        entry = zipEntry(p);
+        if (ZIP_ENTRY_MATCH(entry)) matches++;
+        p += entry.headersize + entry.len;
+    }
+    if (matches == 0) return zl;
+
+    // 在匹配节点的序号中, 被删除的是 [first, last)
+    first = 0;
+    last = matches;
+    if (limit != 0 && limit < matches) {
+        if (fromtail) first = matches - limit;
+        else last = limit;
+    }
+    ndel = last - first;
+
+    // 每个保留节点的 prevlen 最多从 1 字节变为 5 字节,
+    // 而这只会发生在被删除节点之后, 所以新列表最多增长 4*ndel 字节
+    nzl = zmalloc(curlen + 4*ndel);
+    w = ZIPLIST_ENTRY_HEAD(nzl);
+
+    // 第二次遍历: 复制保留的节点
+    idx = 0;
+    nlen = 0;
+    p = ZIPLIST_ENTRY_HEAD(zl);
+    while (p[0] != ZIP_END) {
+        entry = zipEntry(p);
+        rawlen = entry.headersize + entry.len;
+        q = p + rawlen;
+
+        if (ZIP_ENTRY_MATCH(entry)) {
+            idx++;
+            if (idx > first && idx <= last) {
+                p = q;
+                continue;
+            }
+        }
+
+        // 重新编码 prevlen , 然后复制节点的其余部分
+        lastp = w;
+        w += zipPrevEncodeLength(w,prevlen);
+        memcpy(w,p+entry.prevrawlensize,rawlen-entry.prevrawlensize);
+        w += rawlen - entry.prevrawlensize;
+        prevlen = w - lastp;
+        nlen++;
+
+        p = q;
+    }
+#undef ZIP_ENTRY_MATCH
+
+    // 设置表头和表尾
+    w[0] = ZIP_END;
+    newlen = (w+1) - nzl;
+    ZIPLIST_TAIL_OFFSET(nzl) =
+        intrev32ifbe(lastp ? lastp-nzl : ZIPLIST_HEADER_SIZE);
+    ZIPLIST_LENGTH(nzl) = intrev16ifbe(nlen < UINT16_MAX ? nlen : UINT16_MAX);
+
+    zfree(zl);
+    nzl = ziplistResize(nzl,newlen);
+
+    *deleted = ndel;
+    return nzl;
+}
+
 /**
  * 返回压缩列表的节点数量
  *
@@ -1415,16 +1660,6 @@ void ziplistRepr(unsigned char *zl) {
 // gcc -g zmalloc.c sds.c util.c ziplist.c
 int main(void) {
 
-    printf("sizeof(1)=%d\n",sizeof(1));
-    printf("sizeof(32760)=%d\n",sizeof(32760));
-    printf("sizeof(2147483640)=%d\n",sizeof(2147483640));
-    printf("int size: %lu byte\n",sizeof(int));
-    printf("short size: %lu byte\n",sizeof(short int));
-    printf("long size: %lu byte\n",sizeof(long int));
-    printf("long long size: %lu byte\n",sizeof(long long int));
-    // printf("sizeof(1)=%d\n",sizeof(1));
-    exit(0);
-
     unsigned char *zl, *p;
     unsigned char *entry;
     unsigned int elen;
@@ -1763,6 +1998,122 @@ int main(void) {
         printf("SUCCESS\n\n");
     }
 
+    printf("Push multiple values and compare with single pushes:\n");
+    {
+        unsigned char *zl2;
+        unsigned char *vals[64];
+        unsigned int lens[64];
+        char bufs[64][512];
+        int i, j, n, where;
+
+        for (i = 0; i < 2000; i++) {
+            where = (i & 1) ? ZIPLIST_TAIL : ZIPLIST_HEAD;
+            zl = ziplistNew();
+            n = rand() % 8;
+            for (j = 0; j < n; j++) {
+                lens[0] = randstring(bufs[0],1,300);
+                zl = ziplistPush(zl,(unsigned char*)bufs[0],lens[0],ZIPLIST_TAIL);
+            }
+            zl2 = zmalloc(ziplistBlobLen(zl));
+            memcpy(zl2,zl,ziplistBlobLen(zl));
+
+            // 混合整数、短字符串和超过 254 字节的字符串
+            n = 1 + rand() % 64;
+            for (j = 0; j < n; j++) {
+                if (rand() % 3 == 0) {
+                    lens[j] = sprintf(bufs[j],"%lld",(long long)rand()-RAND_MAX/2);
+                } else {
+                    lens[j] = randstring(bufs[j],0,(rand() & 1) ? 300 : 20);
+                }
+                vals[j] = (unsigned char*)bufs[j];
+                zl = ziplistPush(zl,vals[j],lens[j],where);
+            }
+            zl2 = ziplistPushMulti(zl2,vals,lens,n,where);
+
+            assert(ziplistBlobLen(zl) == ziplistBlobLen(zl2));
+            assert(memcmp(zl,zl2,ziplistBlobLen(zl)) == 0);
+            zfree(zl);
+            zfree(zl2);
+        }
+        printf("SUCCESS\n\n");
+    }
+
+    printf("Delete matching values and compare with single deletes:\n");
+    {
+        unsigned char *zl2, *p2, *s1, *s2;
+        unsigned int l1, l2, limit, deleted, expect;
+        long long v1, v2;
+        char bufs[4][512], *target;
+        int i, j, n, fromtail;
+
+        // 两个整数值、一个短字符串和一个超过 254 字节的字符串
+        sprintf(bufs[0],"%d",12);
+        sprintf(bufs[1],"%d",-70000);
+        sprintf(bufs[2],"%s","short");
+        memset(bufs[3],'x',300);
+        bufs[3][300] = '\0';
+
+        for (i = 0; i < 2000; i++) {
+            zl = ziplistNew();
+            zl2 = ziplistNew();
+            n = rand() % 64;
+            for (j = 0; j < n; j++) {
+                target = bufs[rand() % 4];
+                zl = ziplistPush(zl,(unsigned char*)target,strlen(target),ZIPLIST_TAIL);
+                zl2 = ziplistPush(zl2,(unsigned char*)target,strlen(target),ZIPLIST_TAIL);
+            }
+
+            target = bufs[rand() % 4];
+            limit = (rand() & 1) ? 0 : rand() % 16;
+            fromtail = rand() & 1;
+
+            // 逐个删除得到期望的结果
+            expect = 0;
+            p = fromtail ? ziplistIndex(zl2,-1) : ziplistIndex(zl2,0);
+            while (p != NULL && (limit == 0 || expect < limit)) {
+                if (ziplistCompare(p,(unsigned char*)target,strlen(target))) {
+                    zl2 = ziplistDelete(zl2,&p);
+                    expect++;
+                    if (fromtail) p = (p[0] == ZIP_END) ? ziplistIndex(zl2,-1) : ziplistPrev(zl2,p);
+                    else if (p[0] == ZIP_END) p = NULL;
+                } else {
+                    p = fromtail ? ziplistPrev(zl2,p) : ziplistNext(zl2,p);
+                }
+            }
+
+            zl = ziplistDeleteMatching(zl,(unsigned char*)target,strlen(target),
+                                       limit,fromtail,&deleted);
+            assert(deleted == expect);
+            assert(ziplistLen(zl) == ziplistLen(zl2));
+
+            // 从表头比对每个节点
+            p = ziplistIndex(zl,0);
+            p2 = ziplistIndex(zl2,0);
+            while (p2 != NULL) {
+                assert(p != NULL);
+                assert(ziplistGet(p,&s1,&l1,&v1) && ziplistGet(p2,&s2,&l2,&v2));
+                if (s1) assert(s2 && l1 == l2 && memcmp(s1,s2,l1) == 0);
+                else assert(!s2 && v1 == v2);
+                p = ziplistNext(zl,p);
+                p2 = ziplistNext(zl2,p2);
+            }
+            assert(p == NULL);
+
+            // 从表尾反向遍历, 检查重新编码的 prevlen
+            j = 0;
+            p = ziplistIndex(zl,-1);
+            while (p != NULL) {
+                j++;
+                p = ziplistPrev(zl,p);
+            }
+            assert(j == (int)ziplistLen(zl));
+
+            zfree(zl);
+            zfree(zl2);
+        }
+        printf("SUCCESS\n\n");
+    }
+
     // printf("Compare strings with ziplist entries:\n");
     // {
     //     zl = createList();
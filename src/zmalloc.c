@@ -160,3 +160,11 @@ void zfree(void *ptr){
     free(realptr);
 }
 
+/**
+ * 以线程安全的方式统计内存用量
+ * 必须在其他线程开始申请或释放内存之前调用, 开启后不能关闭
+ */
+void zmalloc_enable_thread_safeness(void){
+    zmalloc_thread_safe = 1;
+}
+
@@ -10,5 +10,6 @@ void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr,size_t size);
 void zfree(void *ptr);
+void zmalloc_enable_thread_safeness(void);
 
 #endif
\ No newline at end of file